@@ -16,15 +16,27 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cstring>
 #include <limits>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define LIBERTIFF_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
 #ifndef LIBERTIFF_NS
 #define LIBERTIFF_NS libertiff
 #endif
@@ -33,8 +45,10 @@
  *
  * Handles both ClassicTIFF and BigTIFF, little-endian or big-endian ordered.
  *
- * The library does not (yet?) offer codec facilities. It is mostly aimed at
- * browsing through the linked chain of Image File Directory (IFD) and their tags.
+ * The library is mostly aimed at browsing through the linked chain of Image
+ * File Directory (IFD) and their tags. It only embeds PackBits and LZW
+ * decompressors (and optionally Deflate), but others can be plugged in
+ * through the CodecRegistry class.
  *
  * "Offline" tag values are not loaded at IFD opening time, but only upon
  * request, which helps handling files with tags with an arbitrarily large
@@ -50,6 +64,17 @@
  * Optional features:
  * - define LIBERTIFF_C_FILE_READER before including libertiff.hpp, so that
  *   the libertiff::CFileReader class is available
+ * - define LIBERTIFF_POSIX_FILE_READER before including libertiff.hpp, so that
+ *   the libertiff::PosixFileReader class is available
+ * - define LIBERTIFF_MMAP_FILE_READER before including libertiff.hpp, so that
+ *   the libertiff::MMapFileReader class is available
+ * - define LIBERTIFF_CACHING_FILE_READER before including libertiff.hpp, so
+ *   that the libertiff::CachingFileReader class is available
+ * - define LIBERTIFF_METADATA_CACHE before including libertiff.hpp, so that
+ *   the libertiff::MetadataCache class is available
+ * - define LIBERTIFF_DEFLATE_DECODER before including libertiff.hpp, so that
+ *   the libertiff::DeflateCodec class is available and registered in
+ *   libertiff::CodecRegistry::global()
  */
 namespace LIBERTIFF_NS
 {
@@ -176,1561 +201,6750 @@ template <> inline double byteSwap(double v)
     std::memcpy(&v, &u, sizeof(u));
     return v;
 }
-}  // namespace LIBERTIFF_NS
 
-namespace LIBERTIFF_NS
+namespace detail
 {
-#if defined(__clang__)
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wweak-vtables"
-#endif
+/** Function byte-swapping in place count values of a given size */
+typedef void (*ByteSwapArrayFunc)(void *values, size_t count);
 
-/** Interface to read from a file. */
-class FileReader
+/** Scalar byte-swap kernel, for values of the size of T */
+template <class T> inline void byteSwapArrayScalar(void *values, size_t count)
 {
-  public:
-    virtual ~FileReader() = default;
+    uint8_t *ptr = static_cast<uint8_t *>(values);
+    for (size_t i = 0; i < count; ++i, ptr += sizeof(T))
+    {
+        T v;
+        std::memcpy(&v, ptr, sizeof(T));
+        v = byteSwap(v);
+        std::memcpy(ptr, &v, sizeof(T));
+    }
+}
 
-    /** Return file size in bytes */
-    virtual uint64_t size() const = 0;
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+/** Return a pshufb mask reversing the bytes of each value of the size of T,
+ * repeated over two 128-bit lanes */
+template <class T> inline const uint8_t *byteSwapShuffleMask()
+{
+    struct Mask
+    {
+        uint8_t bytes[32];
 
-    /** Read 'count' bytes from offset 'offset' into 'buffer' and
-     * return the number of bytes actually read.
-     */
-    virtual size_t read(uint64_t offset, size_t count, void *buffer) const = 0;
-};
+        Mask()
+        {
+            constexpr size_t N = sizeof(T);
+            for (size_t i = 0; i < 32; ++i)
+                bytes[i] = static_cast<uint8_t>(((i % 16) / N) * N + N - 1 -
+                                                i % N);
+        }
+    };
 
-#if defined(__clang__)
-#pragma clang diagnostic pop
-#endif
-}  // namespace LIBERTIFF_NS
+    static const Mask mask;
+    return mask.bytes;
+}
 
-namespace LIBERTIFF_NS
-{
-/** Read context: associates a file, and the byte ordering of the TIFF file */
-class ReadContext
+/** SSSE3 byte-swap kernel, for values of the size of T */
+template <class T>
+__attribute__((target("ssse3"))) inline void
+byteSwapArraySSSE3(void *values, size_t count)
 {
-  public:
-    /** Constructor */
-    ReadContext(const std::shared_ptr<const FileReader> &file,
-                bool mustByteSwap)
-        : m_file(file), m_mustByteSwap(mustByteSwap)
+    const __m128i mask = _mm_loadu_si128(
+        reinterpret_cast<const __m128i *>(byteSwapShuffleMask<T>()));
+    constexpr size_t VALUES_PER_VECTOR = 16 / sizeof(T);
+    uint8_t *ptr = static_cast<uint8_t *>(values);
+    size_t i = 0;
+    for (; i + VALUES_PER_VECTOR <= count; i += VALUES_PER_VECTOR, ptr += 16)
     {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(ptr));
+        v = _mm_shuffle_epi8(v, mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(ptr), v);
     }
+    byteSwapArrayScalar<T>(ptr, count - i);
+}
 
-    /** Return if values of more than 1-byte must be byte swapped.
-     * To be only taken into account when reading pixels. Tag values are
-     * automatically byte-swapped */
-    inline bool mustByteSwap() const
+/** AVX2 byte-swap kernel, for values of the size of T */
+template <class T>
+__attribute__((target("avx2"))) inline void
+byteSwapArrayAVX2(void *values, size_t count)
+{
+    const __m256i mask = _mm256_loadu_si256(
+        reinterpret_cast<const __m256i *>(byteSwapShuffleMask<T>()));
+    constexpr size_t VALUES_PER_VECTOR = 32 / sizeof(T);
+    uint8_t *ptr = static_cast<uint8_t *>(values);
+    size_t i = 0;
+    for (; i + VALUES_PER_VECTOR <= count; i += VALUES_PER_VECTOR, ptr += 32)
     {
-        return m_mustByteSwap;
+        __m256i v =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(ptr));
+        v = _mm256_shuffle_epi8(v, mask);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(ptr), v);
     }
+    byteSwapArraySSSE3<T>(ptr, count - i);
+}
+#elif defined(LIBERTIFF_HAVE_NEON)
+/** Reverse the bytes of each value of the size of T in a NEON vector */
+template <class T> inline uint8x16_t byteSwapNEON(uint8x16_t v);
 
-    /** Return file size */
-    inline uint64_t size() const
+template <> inline uint8x16_t byteSwapNEON<uint16_t>(uint8x16_t v)
+{
+    return vrev16q_u8(v);
+}
+
+template <> inline uint8x16_t byteSwapNEON<uint32_t>(uint8x16_t v)
+{
+    return vrev32q_u8(v);
+}
+
+template <> inline uint8x16_t byteSwapNEON<uint64_t>(uint8x16_t v)
+{
+    return vrev64q_u8(v);
+}
+
+/** NEON byte-swap kernel, for values of the size of T */
+template <class T> inline void byteSwapArrayNEON(void *values, size_t count)
+{
+    constexpr size_t VALUES_PER_VECTOR = 16 / sizeof(T);
+    uint8_t *ptr = static_cast<uint8_t *>(values);
+    size_t i = 0;
+    for (; i + VALUES_PER_VECTOR <= count; i += VALUES_PER_VECTOR, ptr += 16)
     {
-        return m_file->size();
+        vst1q_u8(ptr, byteSwapNEON<T>(vld1q_u8(ptr)));
     }
+    byteSwapArrayScalar<T>(ptr, count - i);
+}
+#endif
 
-    /** Read count raw bytes at offset into buffer */
-    void read(uint64_t offset, size_t count, void *buffer, bool &ok) const
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+/** SIMD instruction sets supported by the CPU */
+struct CPUFeatures
+{
+    bool ssse3;
+    bool avx2;
+};
+
+/** Return the SIMD instruction sets supported by the CPU, detected once at
+ * first use */
+inline const CPUFeatures &cpuFeatures()
+{
+    static const CPUFeatures features = []()
     {
-        if (m_file->read(offset, count, buffer) != count)
-            ok = false;
-    }
+        __builtin_cpu_init();
+        return CPUFeatures{__builtin_cpu_supports("ssse3") != 0,
+                           __builtin_cpu_supports("avx2") != 0};
+    }();
+    return features;
+}
+#endif
 
-    /** Read single value at offset */
-    template <class T> T read(uint64_t offset, bool &ok) const
+/** Set of byte-swap kernels for 16, 32 and 64-bit values */
+struct ByteSwapArrayKernels
+{
+    ByteSwapArrayFunc swap16;
+    ByteSwapArrayFunc swap32;
+    ByteSwapArrayFunc swap64;
+};
+
+/** Return the fastest byte-swap kernels supported by the CPU */
+inline ByteSwapArrayKernels selectByteSwapArrayKernels()
+{
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    if (cpuFeatures().avx2)
     {
-#if __cplusplus >= 201703L
-        static_assert(
-            std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t> ||
-            std::is_same_v<T, uint16_t> || std::is_same_v<T, int16_t> ||
-            std::is_same_v<T, uint32_t> || std::is_same_v<T, int32_t> ||
-            std::is_same_v<T, uint64_t> || std::is_same_v<T, int64_t> ||
-            std::is_same_v<T, float> || std::is_same_v<T, double>);
+        return {byteSwapArrayAVX2<uint16_t>, byteSwapArrayAVX2<uint32_t>,
+                byteSwapArrayAVX2<uint64_t>};
+    }
+    if (cpuFeatures().ssse3)
+    {
+        return {byteSwapArraySSSE3<uint16_t>, byteSwapArraySSSE3<uint32_t>,
+                byteSwapArraySSSE3<uint64_t>};
+    }
+#elif defined(LIBERTIFF_HAVE_NEON)
+    return {byteSwapArrayNEON<uint16_t>, byteSwapArrayNEON<uint32_t>,
+            byteSwapArrayNEON<uint64_t>};
 #endif
+    return {byteSwapArrayScalar<uint16_t>, byteSwapArrayScalar<uint32_t>,
+            byteSwapArrayScalar<uint64_t>};
+}
 
-        T res = 0;
-        if (m_file->read(offset, sizeof(res), &res) != sizeof(res))
-        {
-            ok = false;
-            return 0;
-        }
-        if LIBERTIFF_CONSTEXPR (sizeof(T) > 1)
+/** Return the byte-swap kernels, selected once at first use */
+inline const ByteSwapArrayKernels &byteSwapArrayKernels()
+{
+    static const ByteSwapArrayKernels kernels = selectByteSwapArrayKernels();
+    return kernels;
+}
+}  // namespace detail
+
+/** Byte-swap in place an array of count values.
+ *
+ * T must be a 1, 2, 4 or 8-byte arithmetic type. Uses SIMD kernels when
+ * available (SSSE3 or AVX2 on x86_64, detected at runtime, and NEON on ARM).
+ */
+template <class T> inline void byteSwapArray(T *values, size_t count)
+{
+    LIBERTIFF_STATIC_ASSERT(std::is_arithmetic<T>::value);
+    LIBERTIFF_STATIC_ASSERT(sizeof(T) == 1 || sizeof(T) == 2 ||
+                            sizeof(T) == 4 || sizeof(T) == 8);
+    if LIBERTIFF_CONSTEXPR (sizeof(T) == 2)
+        detail::byteSwapArrayKernels().swap16(values, count);
+    else if LIBERTIFF_CONSTEXPR (sizeof(T) == 4)
+        detail::byteSwapArrayKernels().swap32(values, count);
+    else if LIBERTIFF_CONSTEXPR (sizeof(T) == 8)
+        detail::byteSwapArrayKernels().swap64(values, count);
+}
+
+namespace detail
+{
+/** Scalar kernel unpacking count samples of bitsPerSample bits (1 to 32),
+ * packed most significant bit first, into values of the type T */
+template <class T>
+inline void unpackSamplesScalar(const uint8_t *src, size_t count,
+                                uint32_t bitsPerSample, T *dst)
+{
+    const uint64_t mask = (uint64_t(1) << bitsPerSample) - 1;
+    uint64_t acc = 0;
+    uint32_t accBits = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        while (accBits < bitsPerSample)
         {
-            if (m_mustByteSwap)
-                res = byteSwap(res);
+            acc = (acc << 8) | *src++;
+            accBits += 8;
         }
-        return res;
+        accBits -= bitsPerSample;
+        dst[i] = static_cast<T>((acc >> accBits) & mask);
     }
+}
 
-    /** Read a unsigned rational (type == Type::Rational) */
-    template <class T = uint32_t>
-    double readRational(uint64_t offset, bool &ok) const
+/** Scalar kernel unpacking count 12-bit samples, two per 3 bytes */
+template <class T>
+inline void unpack12BitSamplesScalar(const uint8_t *src, size_t count, T *dst)
+{
+    size_t i = 0;
+    for (; i + 2 <= count; i += 2, src += 3)
     {
-        const auto numerator = read<T>(offset, ok);
-        const auto denominator = read<T>(offset + sizeof(T), ok);
-        if (denominator == 0)
-        {
-            ok = false;
-            return std::numeric_limits<double>::quiet_NaN();
-        }
-        return double(numerator) / denominator;
+        dst[i] = static_cast<T>((src[0] << 4) | (src[1] >> 4));
+        dst[i + 1] = static_cast<T>(((src[1] & 0x0F) << 8) | src[2]);
     }
+    if (i < count)
+        dst[i] = static_cast<T>((src[0] << 4) | (src[1] >> 4));
+}
 
-    /** Read a signed rational (type == Type::SRational) */
-    double readSignedRational(uint64_t offset, bool &ok) const
+/** Scalar kernel unpacking count 24-bit samples */
+template <class T>
+inline void unpack24BitSamplesScalar(const uint8_t *src, size_t count, T *dst)
+{
+    for (size_t i = 0; i < count; ++i, src += 3)
     {
-        return readRational<int32_t>(offset, ok);
+        dst[i] = static_cast<T>((static_cast<uint32_t>(src[0]) << 16) |
+                                (static_cast<uint32_t>(src[1]) << 8) |
+                                src[2]);
     }
+}
 
-    /** Read length bytes at offset (typically for ASCII tag) as a string */
-    std::string readString(std::string &res, uint64_t offset, size_t length,
-                           bool &ok) const
+/** Scalar kernel packing count samples into bitsPerSample bits (1 to 32),
+ * most significant bit first */
+template <class T>
+inline void packSamplesScalar(const T *src, size_t count,
+                              uint32_t bitsPerSample, uint8_t *dst)
+{
+    const uint64_t mask = (uint64_t(1) << bitsPerSample) - 1;
+    uint64_t acc = 0;
+    uint32_t accBits = 0;
+    for (size_t i = 0; i < count; ++i)
     {
-        res.resize(length);
-        if (length > 0 && m_file->read(offset, length, &res[0]) != length)
+        acc = (acc << bitsPerSample) | (static_cast<uint64_t>(src[i]) & mask);
+        accBits += bitsPerSample;
+        while (accBits >= 8)
         {
-            ok = false;
-            res.clear();
-            return res;
+            accBits -= 8;
+            *dst++ = static_cast<uint8_t>(acc >> accBits);
         }
-        // Strip trailing nul byte if found
-        if (length > 0 && res.back() == 0)
-            res.pop_back();
-        return res;
     }
+    if (accBits > 0)
+        *dst = static_cast<uint8_t>(acc << (8 - accBits));
+}
 
-    /** Read length bytes at offset (typically for ASCII tag) as a string */
-    std::string readString(uint64_t offset, size_t length, bool &ok) const
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+/** Store the 16 bytes of x, zero-extended to the type of dst */
+inline void storeBytesSSE2(uint8_t *dst, __m128i x)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), x);
+}
+
+inline void storeBytesSSE2(uint16_t *dst, __m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm_unpacklo_epi8(x, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8),
+                     _mm_unpackhi_epi8(x, zero));
+}
+
+inline void storeBytesSSE2(uint32_t *dst, __m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i lo = _mm_unpacklo_epi8(x, zero);
+    const __m128i hi = _mm_unpackhi_epi8(x, zero);
+    __m128i *out = reinterpret_cast<__m128i *>(dst);
+    _mm_storeu_si128(out, _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi, zero));
+}
+
+/** Store the 8 16-bit lanes of x, zero-extended to the type of dst */
+inline void storeWordsSSE2(uint16_t *dst, __m128i x)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst), x);
+}
+
+inline void storeWordsSSE2(uint32_t *dst, __m128i x)
+{
+    const __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm_unpacklo_epi16(x, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4),
+                     _mm_unpackhi_epi16(x, zero));
+}
+
+/** Unpack the 16 1-bit samples of the 2 bytes at src into bytes */
+inline __m128i unpack1BitSamplesSSE2(const uint8_t *src)
+{
+    uint16_t bytes;
+    std::memcpy(&bytes, src, sizeof(bytes));
+    // Broadcast each byte to 8 lanes, and test one bit in each of them
+    __m128i x = _mm_cvtsi32_si128(bytes);
+    x = _mm_unpacklo_epi8(x, x);
+    x = _mm_unpacklo_epi16(x, x);
+    x = _mm_unpacklo_epi32(x, x);
+    const __m128i bits = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4,
+                                      8, 16, 32, 64, -128);
+    x = _mm_cmpeq_epi8(_mm_and_si128(x, bits), bits);
+    return _mm_and_si128(x, _mm_set1_epi8(1));
+}
+
+/** Unpack the 16 2-bit samples of the 4 bytes at src into bytes */
+inline __m128i unpack2BitSamplesSSE2(const uint8_t *src)
+{
+    uint32_t bytes;
+    std::memcpy(&bytes, src, sizeof(bytes));
+    // Broadcast each byte to 4 lanes, and extract one sample in each of them
+    __m128i x = _mm_cvtsi32_si128(static_cast<int>(bytes));
+    x = _mm_unpacklo_epi8(x, x);
+    x = _mm_unpacklo_epi16(x, x);
+    const __m128i three = _mm_set1_epi8(3);
+    const __m128i s0 = _mm_and_si128(_mm_srli_epi16(x, 6), three);
+    const __m128i s1 = _mm_and_si128(_mm_srli_epi16(x, 4), three);
+    const __m128i s2 = _mm_and_si128(_mm_srli_epi16(x, 2), three);
+    const __m128i s3 = _mm_and_si128(x, three);
+    return _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(s0, _mm_set1_epi32(0x000000FF)),
+                     _mm_and_si128(s1, _mm_set1_epi32(0x0000FF00))),
+        _mm_or_si128(_mm_and_si128(s2, _mm_set1_epi32(0x00FF0000)),
+                     _mm_andnot_si128(_mm_set1_epi32(0x00FFFFFF), s3)));
+}
+
+/** Unpack the 16 4-bit samples of the 8 bytes at src into bytes */
+inline __m128i unpack4BitSamplesSSE2(const uint8_t *src)
+{
+    const __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(src));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    return _mm_unpacklo_epi8(_mm_and_si128(_mm_srli_epi16(x, 4), nibble),
+                             _mm_and_si128(x, nibble));
+}
+
+/** SSE2 kernel unpacking count 1, 2 or 4-bit samples, 16 samples at a
+ * time. Return the number of unpacked samples. */
+template <int BITS, class T>
+inline size_t unpackSubByteSamplesSSE2(const uint8_t *src, size_t count,
+                                       T *dst)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, src += 2 * BITS)
     {
-        std::string res;
-        readString(res, offset, length, ok);
-        return res;
+        storeBytesSSE2(dst + i, BITS == 1   ? unpack1BitSamplesSSE2(src)
+                                : BITS == 2 ? unpack2BitSamplesSSE2(src)
+                                            : unpack4BitSamplesSSE2(src));
     }
+    return i;
+}
 
-    /** Read an array of count values starting at offset */
-    template <class T>
-    void readArray(std::vector<T> &array, uint64_t offset, size_t count,
-                   bool &ok) const
+/** SSSE3 kernel unpacking count 12-bit samples into 16 or 32-bit values, 8
+ * samples (12 bytes) at a time. Return the number of unpacked samples. */
+template <class T>
+__attribute__((target("ssse3"))) inline size_t
+unpack12BitSamplesSSSE3(const uint8_t *src, size_t count, T *dst)
+{
+    // Each pair of samples is in 3 bytes b0 b1 b2: gather b0 b1 (shifted
+    // right by 4) and b1 b2 (masked) as big-endian 16-bit values
+    const __m128i shuffle = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7,
+                                          10, 9, 11, 10);
+    const __m128i evenLanes = _mm_set1_epi32(0x0000FFFF);
+    const __m128i lowBits = _mm_set1_epi16(0x0FFF);
+    const size_t byteCount = (count * 12 + 7) / 8;
+    size_t i = 0;
+    // Loads 16 bytes for 12 used ones
+    for (; i + 8 <= count && i / 2 * 3 + 16 <= byteCount; i += 8, src += 12)
     {
-#if __cplusplus >= 201703L
-        static_assert(
-            std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t> ||
-            std::is_same_v<T, uint16_t> || std::is_same_v<T, int16_t> ||
-            std::is_same_v<T, uint32_t> || std::is_same_v<T, int32_t> ||
-            std::is_same_v<T, uint64_t> || std::is_same_v<T, int64_t> ||
-            std::is_same_v<T, float> || std::is_same_v<T, double>);
-#endif
-
-        array.resize(count);
-        const size_t countBytes = count * sizeof(T);
-        if (count > 0 &&
-            m_file->read(offset, countBytes, &array[0]) != countBytes)
-        {
-            ok = false;
-            array.clear();
-        }
-        else if LIBERTIFF_CONSTEXPR (sizeof(T) > 1)
-        {
-            if (m_mustByteSwap)
-            {
-                if LIBERTIFF_CONSTEXPR (std::is_same<T, float>::value)
-                {
-                    uint32_t *uint32Array =
-                        reinterpret_cast<uint32_t *>(array.data());
-                    for (size_t i = 0; i < count; ++i)
-                    {
-                        uint32Array[i] = byteSwap(uint32Array[i]);
-                    }
-                }
-                else if LIBERTIFF_CONSTEXPR (std::is_same<T, double>::value)
-                {
-                    uint64_t *uint64Array =
-                        reinterpret_cast<uint64_t *>(array.data());
-                    for (size_t i = 0; i < count; ++i)
-                    {
-                        uint64Array[i] = byteSwap(uint64Array[i]);
-                    }
-                }
-                else
-                {
-                    for (size_t i = 0; i < count; ++i)
-                    {
-                        array[i] = byteSwap(array[i]);
-                    }
-                }
-            }
-        }
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        x = _mm_shuffle_epi8(x, shuffle);
+        x = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(x, 4), evenLanes),
+                         _mm_andnot_si128(evenLanes,
+                                          _mm_and_si128(x, lowBits)));
+        storeWordsSSE2(dst + i, x);
     }
+    return i;
+}
 
-    /** Read an array of count values starting at offset */
-    template <class T>
-    std::vector<T> readArray(uint64_t offset, size_t count, bool &ok) const
+/** SSSE3 kernel unpacking count 24-bit samples into 32-bit values, 4
+ * samples (12 bytes) at a time. Return the number of unpacked samples. */
+__attribute__((target("ssse3"))) inline size_t
+unpack24BitSamplesSSSE3(const uint8_t *src, size_t count, uint32_t *dst)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6,
+                                          -1, 11, 10, 9, -1);
+    const size_t byteCount = count * 3;
+    size_t i = 0;
+    // Loads 16 bytes for 12 used ones
+    for (; i + 4 <= count && i * 3 + 16 <= byteCount; i += 4, src += 12)
     {
-        std::vector<T> array;
-        readArray(array, offset, count, ok);
-        return array;
+        const __m128i x =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                         _mm_shuffle_epi8(x, shuffle));
     }
+    return i;
+}
 
-  private:
-    const std::shared_ptr<const FileReader> m_file;
-    const bool m_mustByteSwap;
-};
-}  // namespace LIBERTIFF_NS
+/** Unpack samples with the SIMD kernels available for bitsPerSample and
+ * the type of dst, and return the number of unpacked samples */
+inline size_t unpackSamplesSIMD(const uint8_t *src, size_t count,
+                                uint32_t bitsPerSample, uint8_t *dst)
+{
+    if (bitsPerSample == 1)
+        return unpackSubByteSamplesSSE2<1>(src, count, dst);
+    if (bitsPerSample == 2)
+        return unpackSubByteSamplesSSE2<2>(src, count, dst);
+    if (bitsPerSample == 4)
+        return unpackSubByteSamplesSSE2<4>(src, count, dst);
+    return 0;
+}
 
-namespace LIBERTIFF_NS
+inline size_t unpackSamplesSIMD(const uint8_t *src, size_t count,
+                                uint32_t bitsPerSample, uint16_t *dst)
 {
-/** Type of a TIFF tag code */
-typedef uint16_t TagCodeType;
+    if (bitsPerSample == 1)
+        return unpackSubByteSamplesSSE2<1>(src, count, dst);
+    if (bitsPerSample == 2)
+        return unpackSubByteSamplesSSE2<2>(src, count, dst);
+    if (bitsPerSample == 4)
+        return unpackSubByteSamplesSSE2<4>(src, count, dst);
+    if (bitsPerSample == 12 && cpuFeatures().ssse3)
+        return unpack12BitSamplesSSSE3(src, count, dst);
+    return 0;
+}
 
-/** TIFF tag codes */
-namespace TagCode
+inline size_t unpackSamplesSIMD(const uint8_t *src, size_t count,
+                                uint32_t bitsPerSample, uint32_t *dst)
 {
-constexpr TagCodeType SubFileType = 254;
-constexpr TagCodeType OldSubFileType = 255;
+    if (bitsPerSample == 1)
+        return unpackSubByteSamplesSSE2<1>(src, count, dst);
+    if (bitsPerSample == 2)
+        return unpackSubByteSamplesSSE2<2>(src, count, dst);
+    if (bitsPerSample == 4)
+        return unpackSubByteSamplesSSE2<4>(src, count, dst);
+    if (bitsPerSample == 12 && cpuFeatures().ssse3)
+        return unpack12BitSamplesSSSE3(src, count, dst);
+    if (bitsPerSample == 24 && cpuFeatures().ssse3)
+        return unpack24BitSamplesSSSE3(src, count, dst);
+    return 0;
+}
 
-// Base line and extended TIFF tags
-constexpr TagCodeType ImageWidth = 256;
-constexpr TagCodeType ImageLength = 257;
-constexpr TagCodeType BitsPerSample = 258;
-constexpr TagCodeType Compression = 259;
-constexpr TagCodeType PhotometricInterpretation = 262;
-constexpr TagCodeType DocumentName = 269;
-constexpr TagCodeType ImageDescription = 270;
-constexpr TagCodeType StripOffsets = 273;
-constexpr TagCodeType SamplesPerPixel = 277;
-constexpr TagCodeType RowsPerStrip = 278;
-constexpr TagCodeType StripByteCounts = 279;
-constexpr TagCodeType PlanarConfiguration = 284;
-constexpr TagCodeType Software = 305;
-constexpr TagCodeType DateTime = 306;
-constexpr TagCodeType Predictor = 317;
-constexpr TagCodeType ColorMap = 320;
-constexpr TagCodeType TileWidth = 322;
-constexpr TagCodeType TileLength = 323;
-constexpr TagCodeType TileOffsets = 324;
-constexpr TagCodeType TileByteCounts = 325;
-constexpr TagCodeType ExtraSamples = 338;
-constexpr TagCodeType SampleFormat = 339;
-constexpr TagCodeType JPEGTables = 347;
-
-constexpr TagCodeType Copyright = 33432;
-
-// GeoTIFF tags
-constexpr TagCodeType GeoTIFFPixelScale = 33550;
-constexpr TagCodeType GeoTIFFTiePoints = 33922;
-constexpr TagCodeType GeoTIFFGeoTransMatrix = 34264;
-constexpr TagCodeType GeoTIFFGeoKeyDirectory = 34735;
-constexpr TagCodeType GeoTIFFDoubleParams = 34736;
-constexpr TagCodeType GeoTIFFAsciiParams = 34737;
+/** Return a table reversing the order of the bits of a byte */
+inline const uint8_t *bitReverseTable()
+{
+    struct Table
+    {
+        uint8_t bytes[256];
 
-// GDAL tags
-constexpr TagCodeType GDAL_METADATA = 42112;
-constexpr TagCodeType GDAL_NODATA = 42113;
+        Table()
+        {
+            for (int i = 0; i < 256; ++i)
+            {
+                int v = 0;
+                for (int b = 0; b < 8; ++b)
+                    v |= ((i >> b) & 1) << (7 - b);
+                bytes[i] = static_cast<uint8_t>(v);
+            }
+        }
+    };
 
-// GeoTIFF related
-constexpr TagCodeType RPCCoefficients = 50844;
+    static const Table table;
+    return table.bytes;
+}
 
-// LERC compression related
-constexpr TagCodeType LERCParameters =
-    50674; /* Stores LERC version and additional compression method */
+/** Load the least significant bit of 16 values as bytes */
+inline __m128i loadLowBitsSSE2(const uint8_t *src)
+{
+    return _mm_and_si128(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)),
+        _mm_set1_epi8(1));
+}
 
-}  // namespace TagCode
+inline __m128i loadLowBitsSSE2(const uint16_t *src)
+{
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i *in = reinterpret_cast<const __m128i *>(src);
+    return _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128(in), one),
+                            _mm_and_si128(_mm_loadu_si128(in + 1), one));
+}
 
-/** Binary or'ed value of SubFileType flags */
-namespace SubFileTypeFlags
+inline __m128i loadLowBitsSSE2(const uint32_t *src)
 {
-constexpr uint32_t ReducedImage = 0x1; /* reduced resolution version */
-constexpr uint32_t Page = 0x2;         /* one page of many */
-constexpr uint32_t Mask = 0x4;         /* transparency mask */
-}  // namespace SubFileTypeFlags
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i *in = reinterpret_cast<const __m128i *>(src);
+    const __m128i lo =
+        _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(in), one),
+                        _mm_and_si128(_mm_loadu_si128(in + 1), one));
+    const __m128i hi =
+        _mm_packs_epi32(_mm_and_si128(_mm_loadu_si128(in + 2), one),
+                        _mm_and_si128(_mm_loadu_si128(in + 3), one));
+    return _mm_packus_epi16(lo, hi);
+}
 
-#define LIBERTIFF_CASE_TAGCODE_STR(x)                                          \
-    case TagCode::x:                                                           \
-        return #x
+/** SSE2 kernel packing count values into 1-bit samples, 16 samples at a
+ * time. Return the number of packed samples. */
+template <class T>
+inline size_t pack1BitSamplesSSE2(const T *src, size_t count, uint8_t *dst)
+{
+    const uint8_t *reverse = bitReverseTable();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16, dst += 2)
+    {
+        // Move the bit of each sample to the sign bit of its byte
+        const int mask =
+            _mm_movemask_epi8(_mm_slli_epi16(loadLowBitsSSE2(src + i), 7));
+        // movemask puts the first sample in the least significant bit
+        dst[0] = reverse[mask & 0xFF];
+        dst[1] = reverse[(mask >> 8) & 0xFF];
+    }
+    return i;
+}
+#endif
+}  // namespace detail
 
-inline const char *tagCodeName(TagCodeType tagCode)
+/** Unpack count unsigned integer samples of bitsPerSample bits (1 to 32)
+ * into dst.
+ *
+ * The samples are packed most significant bit first from the first byte of
+ * src, as in strips and tiles whose bit depth is not 8, 16, 32 or 64 (see
+ * Image::decodeStrile()). As rows are padded to a whole byte, a packed
+ * strile must be unpacked one row at a time. src must hold
+ * (count * bitsPerSample + 7) / 8 bytes.
+ *
+ * T must be uint8_t, uint16_t or uint32_t, and be large enough to hold
+ * bitsPerSample bits. Uses SIMD kernels for 1, 2 and 4-bit samples (SSE2),
+ * and for 12 and 24-bit samples (SSSE3, detected at runtime) on x86_64.
+ */
+template <class T>
+inline void unpackSamples(const uint8_t *src, size_t count,
+                          uint32_t bitsPerSample, T *dst)
 {
-    switch (tagCode)
+    LIBERTIFF_STATIC_ASSERT((std::is_same<T, uint8_t>::value ||
+                             std::is_same<T, uint16_t>::value ||
+                             std::is_same<T, uint32_t>::value));
+    assert(bitsPerSample >= 1 && bitsPerSample <= 8 * sizeof(T));
+    size_t i = 0;
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    i = detail::unpackSamplesSIMD(src, count, bitsPerSample, dst);
+    // The kernels stop on a byte boundary
+    src += i * bitsPerSample / 8;
+#endif
+    if (bitsPerSample == 8)
     {
-        LIBERTIFF_CASE_TAGCODE_STR(SubFileType);
-        LIBERTIFF_CASE_TAGCODE_STR(OldSubFileType);
-        LIBERTIFF_CASE_TAGCODE_STR(ImageWidth);
-        LIBERTIFF_CASE_TAGCODE_STR(ImageLength);
-        LIBERTIFF_CASE_TAGCODE_STR(BitsPerSample);
-        LIBERTIFF_CASE_TAGCODE_STR(Compression);
-        LIBERTIFF_CASE_TAGCODE_STR(PhotometricInterpretation);
-        LIBERTIFF_CASE_TAGCODE_STR(DocumentName);
-        LIBERTIFF_CASE_TAGCODE_STR(ImageDescription);
-        LIBERTIFF_CASE_TAGCODE_STR(StripOffsets);
-        LIBERTIFF_CASE_TAGCODE_STR(SamplesPerPixel);
-        LIBERTIFF_CASE_TAGCODE_STR(RowsPerStrip);
-        LIBERTIFF_CASE_TAGCODE_STR(StripByteCounts);
-        LIBERTIFF_CASE_TAGCODE_STR(PlanarConfiguration);
-        LIBERTIFF_CASE_TAGCODE_STR(Software);
-        LIBERTIFF_CASE_TAGCODE_STR(DateTime);
-        LIBERTIFF_CASE_TAGCODE_STR(Predictor);
-        LIBERTIFF_CASE_TAGCODE_STR(ColorMap);
-        LIBERTIFF_CASE_TAGCODE_STR(TileWidth);
-        LIBERTIFF_CASE_TAGCODE_STR(TileLength);
-        LIBERTIFF_CASE_TAGCODE_STR(TileOffsets);
-        LIBERTIFF_CASE_TAGCODE_STR(TileByteCounts);
-        LIBERTIFF_CASE_TAGCODE_STR(ExtraSamples);
-        LIBERTIFF_CASE_TAGCODE_STR(SampleFormat);
-        LIBERTIFF_CASE_TAGCODE_STR(Copyright);
-        LIBERTIFF_CASE_TAGCODE_STR(JPEGTables);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFPixelScale);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFTiePoints);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFGeoTransMatrix);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFGeoKeyDirectory);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFDoubleParams);
-        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFAsciiParams);
-        LIBERTIFF_CASE_TAGCODE_STR(GDAL_METADATA);
-        LIBERTIFF_CASE_TAGCODE_STR(GDAL_NODATA);
-        LIBERTIFF_CASE_TAGCODE_STR(RPCCoefficients);
-        LIBERTIFF_CASE_TAGCODE_STR(LERCParameters);
-        default:
-            break;
+        for (; i < count; ++i)
+            dst[i] = *src++;
+    }
+    else if (bitsPerSample == 12)
+    {
+        detail::unpack12BitSamplesScalar(src, count - i, dst + i);
+    }
+    else if (bitsPerSample == 24)
+    {
+        detail::unpack24BitSamplesScalar(src, count - i, dst + i);
+    }
+    else
+    {
+        detail::unpackSamplesScalar(src, count - i, bitsPerSample, dst + i);
     }
-    return "(unknown)";
 }
 
-#undef LIBERTIFF_CASE_TAGCODE_STR
+/** Pack count samples of src into bitsPerSample bits (1 to 32), most
+ * significant bit first, into dst. This is the reverse of unpackSamples(),
+ * e.g. to write a 1-bit mask.
+ *
+ * Only the bitsPerSample least significant bits of each value are kept,
+ * and the unused bits of the last byte are set to zero. dst must hold
+ * (count * bitsPerSample + 7) / 8 bytes. T must be uint8_t, uint16_t or
+ * uint32_t. Uses a SIMD kernel for 1-bit samples (SSE2) on x86_64.
+ */
+template <class T>
+inline void packSamples(const T *src, size_t count, uint32_t bitsPerSample,
+                        uint8_t *dst)
+{
+    LIBERTIFF_STATIC_ASSERT((std::is_same<T, uint8_t>::value ||
+                             std::is_same<T, uint16_t>::value ||
+                             std::is_same<T, uint32_t>::value));
+    assert(bitsPerSample >= 1 && bitsPerSample <= 32);
+    size_t i = 0;
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    if (bitsPerSample == 1)
+        i = detail::pack1BitSamplesSSE2(src, count, dst);
+    dst += i * bitsPerSample / 8;
+#endif
+    detail::packSamplesScalar(src + i, count - i, bitsPerSample, dst);
+}
+}  // namespace LIBERTIFF_NS
 
-/** Type of a TIFF tag type */
-typedef uint16_t TagTypeType;
+namespace LIBERTIFF_NS
+{
+#if defined(__clang__)
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wweak-vtables"
+#endif
 
-/** TIFF tag data types */
-namespace TagType
+/** Interface to read from a file. */
+class FileReader
 {
-constexpr TagTypeType Byte = 1;  /*! Unsigned 8-bit integer */
-constexpr TagTypeType ASCII = 2; /*! Character */
-constexpr TagTypeType Short = 3; /*! Unsigned 16-bit integer */
-constexpr TagTypeType Long = 4;  /*! Unsigned 32-bit integer */
-constexpr TagTypeType Rational =
-    5; /*! Positive number as a ratio of two unsigned 32-bit integers */
-constexpr TagTypeType SByte = 6;     /*! Signed 8-bit integer */
-constexpr TagTypeType Undefined = 7; /*! Untyped 8-bit data */
-constexpr TagTypeType SShort = 8;    /*! Signed 16-bit integer */
-constexpr TagTypeType SLong = 9;     /*! Signed 32-bit integer */
-constexpr TagTypeType SRational =
-    10; /*! Signed number as a ratio of two signed 32-bit integers */
-constexpr TagTypeType Float = 11;  /*! 32-bit IEEE-754 floating point number */
-constexpr TagTypeType Double = 12; /*! 64-bit IEEE-754 floating point number */
+  public:
+    virtual ~FileReader() = default;
 
-// BigTIFF additions
-constexpr TagTypeType Long8 = 16;  /*! Unsigned 64-bit integer */
-constexpr TagTypeType SLong8 = 17; /*! Signed 64-bit integer */
-constexpr TagTypeType IFD8 = 18;   /*! Unsigned 64-bit IFD offset */
-}  // namespace TagType
+    /** Return file size in bytes */
+    virtual uint64_t size() const = 0;
 
-#define LIBERTIFF_CASE_TAGTYPE_STR(x)                                          \
-    case TagType::x:                                                           \
-        return #x
+    /** Read 'count' bytes from offset 'offset' into 'buffer' and
+     * return the number of bytes actually read.
+     */
+    virtual size_t read(uint64_t offset, size_t count, void *buffer) const = 0;
 
-inline const char *tagTypeName(TagTypeType tagType)
-{
-    switch (tagType)
+    /** Return a pointer to the 'count' bytes at offset 'offset', if they
+     * can be directly accessed in memory (e.g. memory-mapped file), or
+     * nullptr otherwise (default implementation).
+     *
+     * The returned pointer must remain valid during the lifetime of the
+     * FileReader instance.
+     */
+    virtual const uint8_t *data(uint64_t /* offset */,
+                                size_t /* count */) const
     {
-        LIBERTIFF_CASE_TAGTYPE_STR(Byte);
-        LIBERTIFF_CASE_TAGTYPE_STR(ASCII);
-        LIBERTIFF_CASE_TAGTYPE_STR(Short);
-        LIBERTIFF_CASE_TAGTYPE_STR(Long);
-        LIBERTIFF_CASE_TAGTYPE_STR(Rational);
-        LIBERTIFF_CASE_TAGTYPE_STR(SByte);
-        LIBERTIFF_CASE_TAGTYPE_STR(Undefined);
-        LIBERTIFF_CASE_TAGTYPE_STR(SShort);
-        LIBERTIFF_CASE_TAGTYPE_STR(SLong);
-        LIBERTIFF_CASE_TAGTYPE_STR(SRational);
-        LIBERTIFF_CASE_TAGTYPE_STR(Float);
-        LIBERTIFF_CASE_TAGTYPE_STR(Double);
-        LIBERTIFF_CASE_TAGTYPE_STR(Long8);
-        LIBERTIFF_CASE_TAGTYPE_STR(SLong8);
-        LIBERTIFF_CASE_TAGTYPE_STR(IFD8);
-        default:
-            break;
+        return nullptr;
     }
-    return "(unknown)";
-}
 
-#undef LIBERTIFF_CASE_TAGTYPE_STR
+    /** Return whether data() may return a non-null pointer.
+     *
+     * This is queried once when a file is opened, so that data() is not
+     * called for each read from readers that never expose their bytes in
+     * memory. The default implementation returns whether data(0, 0) is not
+     * null.
+     */
+    virtual bool providesData() const
+    {
+        return data(0, 0) != nullptr;
+    }
 
-/** Type of a PlanarConfiguration value */
-typedef uint32_t PlanarConfigurationType;
+    /** Byte range to read with readMulti() */
+    struct Range
+    {
+        uint64_t offset; /*! Offset of the first byte to read */
+        size_t count;    /*! Number of bytes to read */
+        void *buffer;    /*! Destination buffer, of at least count bytes */
+    };
 
-/** Values of the PlanarConfiguration tag */
-namespace PlanarConfiguration
-{
-constexpr PlanarConfigurationType Contiguous = 1; /*! Single image plane */
-constexpr PlanarConfigurationType Separate =
-    2; /*! Separate planes per sample */
-}  // namespace PlanarConfiguration
+    /** Read several byte ranges, and return whether they could all be
+     * entirely read.
+     *
+     * The default implementation calls read() for each range. Backends
+     * for which each request has a high cost (network, object storage, ...)
+     * may override it to issue fewer requests.
+     */
+    virtual bool readMulti(const Range *ranges, size_t count) const
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (read(ranges[i].offset, ranges[i].count, ranges[i].buffer) !=
+                ranges[i].count)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
 
-#define LIBERTIFF_CASE_PLANAR_CONFIG_STR(x)                                    \
-    case PlanarConfiguration::x:                                               \
-        return #x
+#if defined(__clang__)
+#pragma clang diagnostic pop
+#endif
+}  // namespace LIBERTIFF_NS
 
-inline const char *
-planarConfigurationName(PlanarConfigurationType planarConfiguration)
+namespace LIBERTIFF_NS
 {
-    switch (planarConfiguration)
+/** Pool of reusable byte buffers, to avoid a heap allocation per read of
+ * strile data.
+ *
+ * This class is thread-safe.
+ */
+class BufferPool
+{
+  public:
+    /** Constructor.
+     *
+     * @param maxPooledBuffers Maximum number of buffers kept in the pool.
+     * @param maxBufferSize Buffers whose capacity exceeds this size are not
+     *                      kept in the pool.
+     */
+    explicit BufferPool(size_t maxPooledBuffers = 16,
+                        size_t maxBufferSize = 16 * 1024 * 1024)
+        : m_maxPooledBuffers(maxPooledBuffers), m_maxBufferSize(maxBufferSize)
     {
-        LIBERTIFF_CASE_PLANAR_CONFIG_STR(Contiguous);
-        LIBERTIFF_CASE_PLANAR_CONFIG_STR(Separate);
-        default:
-            break;
     }
-    return "(unknown)";
-}
 
-#undef LIBERTIFF_CASE_PLANAR_CONFIG_STR
+    /** Return a buffer of size bytes, reusing a pooled one if possible */
+    std::vector<uint8_t> acquire(size_t size)
+    {
+        std::vector<uint8_t> buffer;
+        {
+            std::lock_guard<std::mutex> oLock(m_mutex);
+            // Prefer the most recently released buffer that is large enough
+            for (size_t i = m_buffers.size(); i > 0; --i)
+            {
+                if (m_buffers[i - 1].capacity() >= size)
+                {
+                    buffer = std::move(m_buffers[i - 1]);
+                    m_buffers.erase(m_buffers.begin() +
+                                    static_cast<std::ptrdiff_t>(i - 1));
+                    break;
+                }
+            }
+        }
+        buffer.resize(size);
+        return buffer;
+    }
 
-/** Type of a PlanarConfiguration value */
-typedef uint32_t PhotometricInterpretationType;
+    /** Give back a buffer acquired with acquire() */
+    void release(std::vector<uint8_t> &&buffer)
+    {
+        if (buffer.capacity() == 0 || buffer.capacity() > m_maxBufferSize)
+            return;
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        if (m_buffers.size() < m_maxPooledBuffers)
+            m_buffers.push_back(std::move(buffer));
+    }
 
-/** Values of the PhotometricInterpretation tag */
-namespace PhotometricInterpretation
-{
-constexpr PhotometricInterpretationType MinIsWhite = 0;
-constexpr PhotometricInterpretationType MinIsBlack = 1;
-constexpr PhotometricInterpretationType RGB = 2;
-constexpr PhotometricInterpretationType Palette = 3;
-constexpr PhotometricInterpretationType Mask = 4;
-constexpr PhotometricInterpretationType Separated = 5;
-constexpr PhotometricInterpretationType YCbCr = 6;
-constexpr PhotometricInterpretationType CIELab = 8;
-constexpr PhotometricInterpretationType ICCLab = 9;
-constexpr PhotometricInterpretationType ITULab = 10;
-}  // namespace PhotometricInterpretation
+  private:
+    const size_t m_maxPooledBuffers;
+    const size_t m_maxBufferSize;
+    std::mutex m_mutex{};
+    std::vector<std::vector<uint8_t>> m_buffers{};
 
-#define LIBERTIFF_CASE_PHOTOMETRIC_STR(x)                                      \
-    case PhotometricInterpretation::x:                                         \
-        return #x
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+};
 
-inline const char *photometricInterpretationName(
-    PhotometricInterpretationType photometricInterpretation)
+/** Read context: associates a file, and the byte ordering of the TIFF file */
+class ReadContext
 {
-    switch (photometricInterpretation)
+  public:
+    /** Constructor */
+    ReadContext(const std::shared_ptr<const FileReader> &file,
+                bool mustByteSwap)
+        : m_file(file), m_fileProvidesData(file->providesData()),
+          m_mustByteSwap(mustByteSwap)
     {
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(MinIsWhite);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(MinIsBlack);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(RGB);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(Palette);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(Mask);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(Separated);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(YCbCr);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(CIELab);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(ICCLab);
-        LIBERTIFF_CASE_PHOTOMETRIC_STR(ITULab);
-        default:
-            break;
     }
-    return "(unknown)";
-}
-
-#undef LIBERTIFF_CASE_PHOTOMETRIC_STR
 
-/** Type of a Compression value */
-typedef uint32_t CompressionType;
+    /** Constructor with the content of the first bytes of the file, which
+     * are used to serve reads that fall within them */
+    ReadContext(const std::shared_ptr<const FileReader> &file,
+                bool mustByteSwap, std::vector<uint8_t> &&header)
+        : m_file(file), m_fileProvidesData(file->providesData()),
+          m_mustByteSwap(mustByteSwap), m_header(std::move(header))
+    {
+    }
 
-/** Compression methods */
-namespace Compression
-{
-constexpr CompressionType None = 1;
-constexpr CompressionType CCITT_RLE = 2;
-constexpr CompressionType CCITT_FAX3 = 3;
-constexpr CompressionType CCITT_FAX4 = 4;
-constexpr CompressionType LZW = 5;
-constexpr CompressionType OldJPEG = 6;
-constexpr CompressionType JPEG = 7;
-constexpr CompressionType Deflate =
-    8; /* Deflate compression, as recognized by Adobe */
-constexpr CompressionType PackBits = 32773;
-constexpr CompressionType LegacyDeflate =
-    32946;                              /* Deflate compression, legacy tag */
-constexpr CompressionType JBIG = 34661; /* ISO JBIG */
-constexpr CompressionType LERC =
-    34887; /* ESRI Lerc codec: https://github.com/Esri/lerc */
-constexpr CompressionType LZMA = 34925; /* LZMA2 */
-constexpr CompressionType ZSTD =
-    50000; /* ZSTD: WARNING not registered in Adobe-maintained registry */
-constexpr CompressionType WEBP =
-    50001; /* WEBP: WARNING not registered in Adobe-maintained registry */
-constexpr CompressionType JXL =
-    50002; /* JPEGXL: WARNING not registered in Adobe-maintained registry */
-constexpr CompressionType JXL_DNG_1_7 =
-    52546; /* JPEGXL from DNG 1.7 specification */
-}  // namespace Compression
+    /** Return if values of more than 1-byte must be byte swapped.
+     * To be only taken into account when reading pixels. Tag values are
+     * automatically byte-swapped */
+    inline bool mustByteSwap() const
+    {
+        return m_mustByteSwap;
+    }
 
-#define LIBERTIFF_CASE_COMPRESSION_STR(x)                                      \
-    case Compression::x:                                                       \
-        return #x
+    /** Return file size */
+    inline uint64_t size() const
+    {
+        return m_file->size();
+    }
 
-inline const char *compressionName(CompressionType compression)
-{
-    switch (compression)
+    /** Return a pointer to count raw bytes at offset if they can be directly
+     * accessed in memory (prefetched header, or FileReader::data()), or
+     * nullptr otherwise */
+    inline const uint8_t *data(uint64_t offset, size_t count) const
     {
-        LIBERTIFF_CASE_COMPRESSION_STR(None);
-        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_RLE);
-        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_FAX3);
-        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_FAX4);
-        LIBERTIFF_CASE_COMPRESSION_STR(LZW);
-        LIBERTIFF_CASE_COMPRESSION_STR(OldJPEG);
-        LIBERTIFF_CASE_COMPRESSION_STR(JPEG);
-        LIBERTIFF_CASE_COMPRESSION_STR(Deflate);
-        LIBERTIFF_CASE_COMPRESSION_STR(PackBits);
-        LIBERTIFF_CASE_COMPRESSION_STR(LegacyDeflate);
-        LIBERTIFF_CASE_COMPRESSION_STR(JBIG);
-        LIBERTIFF_CASE_COMPRESSION_STR(LERC);
-        LIBERTIFF_CASE_COMPRESSION_STR(LZMA);
-        LIBERTIFF_CASE_COMPRESSION_STR(ZSTD);
-        LIBERTIFF_CASE_COMPRESSION_STR(WEBP);
-        LIBERTIFF_CASE_COMPRESSION_STR(JXL);
-        LIBERTIFF_CASE_COMPRESSION_STR(JXL_DNG_1_7);
-        default:
-            break;
+        if (offset < m_header.size() && count <= m_header.size() - offset)
+            return m_header.data() + static_cast<size_t>(offset);
+        return m_fileProvidesData ? m_file->data(offset, count) : nullptr;
     }
-    return "(unknown)";
-}
 
-#undef LIBERTIFF_CASE_COMPRESSION_STR
+    /** Read count raw bytes at offset into buffer */
+    void read(uint64_t offset, size_t count, void *buffer, bool &ok) const
+    {
+        if (readInternal(offset, count, buffer) != count)
+            ok = false;
+    }
 
-/** Type of a SampleFormat value */
-typedef uint32_t SampleFormatType;
+    /** Read several byte ranges (cf FileReader::readMulti()) */
+    void readMulti(const FileReader::Range *ranges, size_t count,
+                   bool &ok) const
+    {
+        bool allInMemory = true;
+        for (size_t i = 0; i < count && allInMemory; ++i)
+            allInMemory = data(ranges[i].offset, ranges[i].count) != nullptr;
+        if (allInMemory)
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                if (ranges[i].count)
+                {
+                    std::memcpy(ranges[i].buffer,
+                                data(ranges[i].offset, ranges[i].count),
+                                ranges[i].count);
+                }
+            }
+        }
+        else if (!m_file->readMulti(ranges, count))
+        {
+            ok = false;
+        }
+    }
 
-/** Sample format */
-namespace SampleFormat
-{
-constexpr SampleFormatType UnsignedInt = 1;
-constexpr SampleFormatType SignedInt = 2;
-constexpr SampleFormatType IEEEFP = 3;
-constexpr SampleFormatType Void = 4;
-constexpr SampleFormatType ComplexInt = 5;
-constexpr SampleFormatType ComplexIEEEFP = 6;
-}  // namespace SampleFormat
+    /** Read single value at offset */
+    template <class T> T read(uint64_t offset, bool &ok) const
+    {
+#if __cplusplus >= 201703L
+        static_assert(
+            std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t> ||
+            std::is_same_v<T, uint16_t> || std::is_same_v<T, int16_t> ||
+            std::is_same_v<T, uint32_t> || std::is_same_v<T, int32_t> ||
+            std::is_same_v<T, uint64_t> || std::is_same_v<T, int64_t> ||
+            std::is_same_v<T, float> || std::is_same_v<T, double>);
+#endif
 
-#define LIBERTIFF_CASE_SAMPLE_FORMAT_STR(x)                                    \
-    case SampleFormat::x:                                                      \
-        return #x
+        T res = 0;
+        if (readInternal(offset, sizeof(res), &res) != sizeof(res))
+        {
+            ok = false;
+            return 0;
+        }
+        if LIBERTIFF_CONSTEXPR (sizeof(T) > 1)
+        {
+            if (m_mustByteSwap)
+                res = byteSwap(res);
+        }
+        return res;
+    }
 
-inline const char *sampleFormatName(SampleFormatType sampleFormat)
-{
-    switch (sampleFormat)
+    /** Decode a single value from a memory buffer holding bytes in the
+     * byte order of the file */
+    template <class T> T readFromMemory(const void *buffer) const
     {
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(UnsignedInt);
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(SignedInt);
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(IEEEFP);
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(Void);
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(ComplexInt);
-        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(ComplexIEEEFP);
-        default:
-            break;
+        T res;
+        std::memcpy(&res, buffer, sizeof(res));
+        if LIBERTIFF_CONSTEXPR (sizeof(T) > 1)
+        {
+            if (m_mustByteSwap)
+                res = byteSwap(res);
+        }
+        return res;
     }
-    return "(unknown)";
-}
 
-#undef LIBERTIFF_CASE_SAMPLE_FORMAT_STR
+    /** Decode a unsigned rational (type == Type::Rational) from a memory
+     * buffer holding bytes in the byte order of the file */
+    template <class T = uint32_t>
+    double readRationalFromMemory(const void *buffer, bool &ok) const
+    {
+        const auto numerator = readFromMemory<T>(buffer);
+        const auto denominator = readFromMemory<T>(
+            static_cast<const uint8_t *>(buffer) + sizeof(T));
+        if (denominator == 0)
+        {
+            ok = false;
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        return double(numerator) / denominator;
+    }
 
-/** Type of a ExtraSamples value */
-typedef uint32_t ExtraSamplesType;
+    /** Read a unsigned rational (type == Type::Rational) */
+    template <class T = uint32_t>
+    double readRational(uint64_t offset, bool &ok) const
+    {
+        const auto numerator = read<T>(offset, ok);
+        const auto denominator = read<T>(offset + sizeof(T), ok);
+        if (denominator == 0)
+        {
+            ok = false;
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+        return double(numerator) / denominator;
+    }
 
-/** Values of the ExtraSamples tag */
-namespace ExtraSamples
-{
-constexpr ExtraSamplesType Unspecified = 0;
-constexpr ExtraSamplesType AssociatedAlpha = 1;   /* premultiplied */
-constexpr ExtraSamplesType UnAssociatedAlpha = 2; /* unpremultiplied */
-}  // namespace ExtraSamples
+    /** Read a signed rational (type == Type::SRational) */
+    double readSignedRational(uint64_t offset, bool &ok) const
+    {
+        return readRational<int32_t>(offset, ok);
+    }
 
-/** Content of a tag entry in a Image File Directory (IFD) */
-struct TagEntry
-{
-    TagCodeType tag = 0;
-    TagTypeType type = 0;
-    uint64_t count = 0;  // number of values in the tag
+    /** Read length bytes at offset (typically for ASCII tag) as a string */
+    std::string readString(std::string &res, uint64_t offset, size_t length,
+                           bool &ok) const
+    {
+        res.resize(length);
+        if (length > 0 && readInternal(offset, length, &res[0]) != length)
+        {
+            ok = false;
+            res.clear();
+            return res;
+        }
+        // Strip trailing nul byte if found
+        if (length > 0 && res.back() == 0)
+            res.pop_back();
+        return res;
+    }
 
-    // Inline values. Only valid if value_offset == 0.
-    // The actual number in the arrays is count
-    union
+    /** Read length bytes at offset (typically for ASCII tag) as a string */
+    std::string readString(uint64_t offset, size_t length, bool &ok) const
     {
-        std::array<char, 8> charValues;
-        std::array<uint8_t, 8> uint8Values;
-        std::array<int8_t, 8> int8Values;
-        std::array<uint16_t, 4> uint16Values;
-        std::array<int16_t, 4> int16Values;
-        std::array<uint32_t, 2> uint32Values;
-        std::array<int32_t, 2> int32Values;
-        std::array<float, 2> float32Values;
-        std::array<double, 1>
-            float64Values;  // Valid for Double, Rational, SRational
-        std::array<uint64_t, 1> uint64Values = {0};
-        std::array<int64_t, 1> int64Values;
-    };
+        std::string res;
+        readString(res, offset, length, ok);
+        return res;
+    }
 
-    uint64_t value_offset = 0;         // 0 for inline values
-    bool invalid_value_offset = true;  // whether value_offset is invalid
+    /** Read an array of count values starting at offset */
+    template <class T>
+    void readArray(std::vector<T> &array, uint64_t offset, size_t count,
+                   bool &ok) const
+    {
+#if __cplusplus >= 201703L
+        static_assert(
+            std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t> ||
+            std::is_same_v<T, uint16_t> || std::is_same_v<T, int16_t> ||
+            std::is_same_v<T, uint32_t> || std::is_same_v<T, int32_t> ||
+            std::is_same_v<T, uint64_t> || std::is_same_v<T, int64_t> ||
+            std::is_same_v<T, float> || std::is_same_v<T, double>);
+#endif
+
+        array.resize(count);
+        const size_t countBytes = count * sizeof(T);
+        if (count > 0 &&
+            readInternal(offset, countBytes, &array[0]) != countBytes)
+        {
+            ok = false;
+            array.clear();
+        }
+        else
+        {
+            byteSwapIfNeeded(array.data(), count);
+        }
+    }
+
+    /** Byte-swap in place count values read from the file, if needed */
+    template <class T> void byteSwapIfNeeded(T *values, size_t count) const
+    {
+        if LIBERTIFF_CONSTEXPR (sizeof(T) > 1)
+        {
+            if (m_mustByteSwap)
+            {
+                byteSwapArray(values, count);
+            }
+        }
+    }
+
+    /** Read an array of count values starting at offset */
+    template <class T>
+    std::vector<T> readArray(uint64_t offset, size_t count, bool &ok) const
+    {
+        std::vector<T> array;
+        readArray(array, offset, count, ok);
+        return array;
+    }
+
+    /** Return the pool of buffers used to read strile data of this file */
+    inline BufferPool &bufferPool() const
+    {
+        return m_bufferPool;
+    }
+
+  private:
+    const std::shared_ptr<const FileReader> m_file;
+    // Cached FileReader::providesData()
+    const bool m_fileProvidesData;
+    const bool m_mustByteSwap;
+    const std::vector<uint8_t> m_header{};
+    mutable BufferPool m_bufferPool{};
+
+    /** Read count raw bytes at offset into buffer, directly from memory
+     * if possible, and return the number of bytes actually read */
+    size_t readInternal(uint64_t offset, size_t count, void *buffer) const
+    {
+        if (const uint8_t *ptr = data(offset, count))
+        {
+            std::memcpy(buffer, ptr, count);
+            return count;
+        }
+        return m_file->read(offset, count, buffer);
+    }
 };
+}  // namespace LIBERTIFF_NS
 
-// clang-format off
+namespace LIBERTIFF_NS
+{
+/** Type of a TIFF tag code */
+typedef uint16_t TagCodeType;
 
-/** Return the size in bytes of a tag data type, or 0 if unknown */
-inline uint32_t tagTypeSize(TagTypeType type)
+/** TIFF tag codes */
+namespace TagCode
 {
-    switch (type)
+constexpr TagCodeType SubFileType = 254;
+constexpr TagCodeType OldSubFileType = 255;
+
+// Base line and extended TIFF tags
+constexpr TagCodeType ImageWidth = 256;
+constexpr TagCodeType ImageLength = 257;
+constexpr TagCodeType BitsPerSample = 258;
+constexpr TagCodeType Compression = 259;
+constexpr TagCodeType PhotometricInterpretation = 262;
+constexpr TagCodeType DocumentName = 269;
+constexpr TagCodeType ImageDescription = 270;
+constexpr TagCodeType StripOffsets = 273;
+constexpr TagCodeType SamplesPerPixel = 277;
+constexpr TagCodeType RowsPerStrip = 278;
+constexpr TagCodeType StripByteCounts = 279;
+constexpr TagCodeType PlanarConfiguration = 284;
+constexpr TagCodeType Software = 305;
+constexpr TagCodeType DateTime = 306;
+constexpr TagCodeType Predictor = 317;
+constexpr TagCodeType ColorMap = 320;
+constexpr TagCodeType TileWidth = 322;
+constexpr TagCodeType TileLength = 323;
+constexpr TagCodeType TileOffsets = 324;
+constexpr TagCodeType TileByteCounts = 325;
+constexpr TagCodeType SubIFDs = 330;
+constexpr TagCodeType ExtraSamples = 338;
+constexpr TagCodeType SampleFormat = 339;
+constexpr TagCodeType JPEGTables = 347;
+
+constexpr TagCodeType Copyright = 33432;
+
+// GeoTIFF tags
+constexpr TagCodeType GeoTIFFPixelScale = 33550;
+constexpr TagCodeType GeoTIFFTiePoints = 33922;
+constexpr TagCodeType GeoTIFFGeoTransMatrix = 34264;
+constexpr TagCodeType GeoTIFFGeoKeyDirectory = 34735;
+constexpr TagCodeType GeoTIFFDoubleParams = 34736;
+constexpr TagCodeType GeoTIFFAsciiParams = 34737;
+
+// GDAL tags
+constexpr TagCodeType GDAL_METADATA = 42112;
+constexpr TagCodeType GDAL_NODATA = 42113;
+
+// GeoTIFF related
+constexpr TagCodeType RPCCoefficients = 50844;
+
+// LERC compression related
+constexpr TagCodeType LERCParameters =
+    50674; /* Stores LERC version and additional compression method */
+
+}  // namespace TagCode
+
+/** Binary or'ed value of SubFileType flags */
+namespace SubFileTypeFlags
+{
+constexpr uint32_t ReducedImage = 0x1; /* reduced resolution version */
+constexpr uint32_t Page = 0x2;         /* one page of many */
+constexpr uint32_t Mask = 0x4;         /* transparency mask */
+}  // namespace SubFileTypeFlags
+
+#define LIBERTIFF_CASE_TAGCODE_STR(x)                                          \
+    case TagCode::x:                                                           \
+        return #x
+
+inline const char *tagCodeName(TagCodeType tagCode)
+{
+    switch (tagCode)
     {
-        case TagType::Byte:      return 1;
-        case TagType::ASCII:     return 1;
-        case TagType::Short:     return 2;
-        case TagType::Long:      return 4;
-        case TagType::Rational:  return 8;  // 2 Long
-        case TagType::SByte:     return 1;
-        case TagType::Undefined: return 1;
-        case TagType::SShort:    return 2;
-        case TagType::SLong:     return 4;
-        case TagType::SRational: return 8;  // 2 SLong
-        case TagType::Float:     return 4;
-        case TagType::Double:    return 8;
-        case TagType::Long8:     return 8;
-        case TagType::SLong8:    return 8;
-        case TagType::IFD8:      return 8;
-        default: break;
+        LIBERTIFF_CASE_TAGCODE_STR(SubFileType);
+        LIBERTIFF_CASE_TAGCODE_STR(OldSubFileType);
+        LIBERTIFF_CASE_TAGCODE_STR(ImageWidth);
+        LIBERTIFF_CASE_TAGCODE_STR(ImageLength);
+        LIBERTIFF_CASE_TAGCODE_STR(BitsPerSample);
+        LIBERTIFF_CASE_TAGCODE_STR(Compression);
+        LIBERTIFF_CASE_TAGCODE_STR(PhotometricInterpretation);
+        LIBERTIFF_CASE_TAGCODE_STR(DocumentName);
+        LIBERTIFF_CASE_TAGCODE_STR(ImageDescription);
+        LIBERTIFF_CASE_TAGCODE_STR(StripOffsets);
+        LIBERTIFF_CASE_TAGCODE_STR(SamplesPerPixel);
+        LIBERTIFF_CASE_TAGCODE_STR(RowsPerStrip);
+        LIBERTIFF_CASE_TAGCODE_STR(StripByteCounts);
+        LIBERTIFF_CASE_TAGCODE_STR(PlanarConfiguration);
+        LIBERTIFF_CASE_TAGCODE_STR(Software);
+        LIBERTIFF_CASE_TAGCODE_STR(DateTime);
+        LIBERTIFF_CASE_TAGCODE_STR(Predictor);
+        LIBERTIFF_CASE_TAGCODE_STR(ColorMap);
+        LIBERTIFF_CASE_TAGCODE_STR(TileWidth);
+        LIBERTIFF_CASE_TAGCODE_STR(TileLength);
+        LIBERTIFF_CASE_TAGCODE_STR(TileOffsets);
+        LIBERTIFF_CASE_TAGCODE_STR(TileByteCounts);
+        LIBERTIFF_CASE_TAGCODE_STR(SubIFDs);
+        LIBERTIFF_CASE_TAGCODE_STR(ExtraSamples);
+        LIBERTIFF_CASE_TAGCODE_STR(SampleFormat);
+        LIBERTIFF_CASE_TAGCODE_STR(Copyright);
+        LIBERTIFF_CASE_TAGCODE_STR(JPEGTables);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFPixelScale);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFTiePoints);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFGeoTransMatrix);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFGeoKeyDirectory);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFDoubleParams);
+        LIBERTIFF_CASE_TAGCODE_STR(GeoTIFFAsciiParams);
+        LIBERTIFF_CASE_TAGCODE_STR(GDAL_METADATA);
+        LIBERTIFF_CASE_TAGCODE_STR(GDAL_NODATA);
+        LIBERTIFF_CASE_TAGCODE_STR(RPCCoefficients);
+        LIBERTIFF_CASE_TAGCODE_STR(LERCParameters);
+        default:
+            break;
     }
-    return 0;
+    return "(unknown)";
 }
 
-// clang-format on
+#undef LIBERTIFF_CASE_TAGCODE_STR
 
-namespace detail
+/** Type of a TIFF tag type */
+typedef uint16_t TagTypeType;
+
+/** TIFF tag data types */
+namespace TagType
 {
-template <class T>
-inline std::vector<T> readTagAsVectorInternal(const ReadContext &rc,
-                                              const TagEntry &tag,
-                                              TagTypeType expectedType,
-                                              const T *inlineValues, bool &ok)
+constexpr TagTypeType Byte = 1;  /*! Unsigned 8-bit integer */
+constexpr TagTypeType ASCII = 2; /*! Character */
+constexpr TagTypeType Short = 3; /*! Unsigned 16-bit integer */
+constexpr TagTypeType Long = 4;  /*! Unsigned 32-bit integer */
+constexpr TagTypeType Rational =
+    5; /*! Positive number as a ratio of two unsigned 32-bit integers */
+constexpr TagTypeType SByte = 6;     /*! Signed 8-bit integer */
+constexpr TagTypeType Undefined = 7; /*! Untyped 8-bit data */
+constexpr TagTypeType SShort = 8;    /*! Signed 16-bit integer */
+constexpr TagTypeType SLong = 9;     /*! Signed 32-bit integer */
+constexpr TagTypeType SRational =
+    10; /*! Signed number as a ratio of two signed 32-bit integers */
+constexpr TagTypeType Float = 11;  /*! 32-bit IEEE-754 floating point number */
+constexpr TagTypeType Double = 12; /*! 64-bit IEEE-754 floating point number */
+constexpr TagTypeType IFD = 13;     /*! Unsigned 32-bit IFD offset */
+
+// BigTIFF additions
+constexpr TagTypeType Long8 = 16;  /*! Unsigned 64-bit integer */
+constexpr TagTypeType SLong8 = 17; /*! Signed 64-bit integer */
+constexpr TagTypeType IFD8 = 18;   /*! Unsigned 64-bit IFD offset */
+}  // namespace TagType
+
+#define LIBERTIFF_CASE_TAGTYPE_STR(x)                                          \
+    case TagType::x:                                                           \
+        return #x
+
+inline const char *tagTypeName(TagTypeType tagType)
 {
-    if (tag.type == expectedType)
+    switch (tagType)
+    {
+        LIBERTIFF_CASE_TAGTYPE_STR(Byte);
+        LIBERTIFF_CASE_TAGTYPE_STR(ASCII);
+        LIBERTIFF_CASE_TAGTYPE_STR(Short);
+        LIBERTIFF_CASE_TAGTYPE_STR(Long);
+        LIBERTIFF_CASE_TAGTYPE_STR(Rational);
+        LIBERTIFF_CASE_TAGTYPE_STR(SByte);
+        LIBERTIFF_CASE_TAGTYPE_STR(Undefined);
+        LIBERTIFF_CASE_TAGTYPE_STR(SShort);
+        LIBERTIFF_CASE_TAGTYPE_STR(SLong);
+        LIBERTIFF_CASE_TAGTYPE_STR(SRational);
+        LIBERTIFF_CASE_TAGTYPE_STR(Float);
+        LIBERTIFF_CASE_TAGTYPE_STR(Double);
+        LIBERTIFF_CASE_TAGTYPE_STR(IFD);
+        LIBERTIFF_CASE_TAGTYPE_STR(Long8);
+        LIBERTIFF_CASE_TAGTYPE_STR(SLong8);
+        LIBERTIFF_CASE_TAGTYPE_STR(IFD8);
+        default:
+            break;
+    }
+    return "(unknown)";
+}
+
+#undef LIBERTIFF_CASE_TAGTYPE_STR
+
+/** Type of a PlanarConfiguration value */
+typedef uint32_t PlanarConfigurationType;
+
+/** Values of the PlanarConfiguration tag */
+namespace PlanarConfiguration
+{
+constexpr PlanarConfigurationType Contiguous = 1; /*! Single image plane */
+constexpr PlanarConfigurationType Separate =
+    2; /*! Separate planes per sample */
+}  // namespace PlanarConfiguration
+
+#define LIBERTIFF_CASE_PLANAR_CONFIG_STR(x)                                    \
+    case PlanarConfiguration::x:                                               \
+        return #x
+
+inline const char *
+planarConfigurationName(PlanarConfigurationType planarConfiguration)
+{
+    switch (planarConfiguration)
+    {
+        LIBERTIFF_CASE_PLANAR_CONFIG_STR(Contiguous);
+        LIBERTIFF_CASE_PLANAR_CONFIG_STR(Separate);
+        default:
+            break;
+    }
+    return "(unknown)";
+}
+
+#undef LIBERTIFF_CASE_PLANAR_CONFIG_STR
+
+/** Type of a PlanarConfiguration value */
+typedef uint32_t PhotometricInterpretationType;
+
+/** Values of the PhotometricInterpretation tag */
+namespace PhotometricInterpretation
+{
+constexpr PhotometricInterpretationType MinIsWhite = 0;
+constexpr PhotometricInterpretationType MinIsBlack = 1;
+constexpr PhotometricInterpretationType RGB = 2;
+constexpr PhotometricInterpretationType Palette = 3;
+constexpr PhotometricInterpretationType Mask = 4;
+constexpr PhotometricInterpretationType Separated = 5;
+constexpr PhotometricInterpretationType YCbCr = 6;
+constexpr PhotometricInterpretationType CIELab = 8;
+constexpr PhotometricInterpretationType ICCLab = 9;
+constexpr PhotometricInterpretationType ITULab = 10;
+}  // namespace PhotometricInterpretation
+
+#define LIBERTIFF_CASE_PHOTOMETRIC_STR(x)                                      \
+    case PhotometricInterpretation::x:                                         \
+        return #x
+
+inline const char *photometricInterpretationName(
+    PhotometricInterpretationType photometricInterpretation)
+{
+    switch (photometricInterpretation)
+    {
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(MinIsWhite);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(MinIsBlack);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(RGB);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(Palette);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(Mask);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(Separated);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(YCbCr);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(CIELab);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(ICCLab);
+        LIBERTIFF_CASE_PHOTOMETRIC_STR(ITULab);
+        default:
+            break;
+    }
+    return "(unknown)";
+}
+
+#undef LIBERTIFF_CASE_PHOTOMETRIC_STR
+
+/** Type of a Compression value */
+typedef uint32_t CompressionType;
+
+/** Compression methods */
+namespace Compression
+{
+constexpr CompressionType None = 1;
+constexpr CompressionType CCITT_RLE = 2;
+constexpr CompressionType CCITT_FAX3 = 3;
+constexpr CompressionType CCITT_FAX4 = 4;
+constexpr CompressionType LZW = 5;
+constexpr CompressionType OldJPEG = 6;
+constexpr CompressionType JPEG = 7;
+constexpr CompressionType Deflate =
+    8; /* Deflate compression, as recognized by Adobe */
+constexpr CompressionType PackBits = 32773;
+constexpr CompressionType LegacyDeflate =
+    32946;                              /* Deflate compression, legacy tag */
+constexpr CompressionType JBIG = 34661; /* ISO JBIG */
+constexpr CompressionType LERC =
+    34887; /* ESRI Lerc codec: https://github.com/Esri/lerc */
+constexpr CompressionType LZMA = 34925; /* LZMA2 */
+constexpr CompressionType ZSTD =
+    50000; /* ZSTD: WARNING not registered in Adobe-maintained registry */
+constexpr CompressionType WEBP =
+    50001; /* WEBP: WARNING not registered in Adobe-maintained registry */
+constexpr CompressionType JXL =
+    50002; /* JPEGXL: WARNING not registered in Adobe-maintained registry */
+constexpr CompressionType JXL_DNG_1_7 =
+    52546; /* JPEGXL from DNG 1.7 specification */
+}  // namespace Compression
+
+#define LIBERTIFF_CASE_COMPRESSION_STR(x)                                      \
+    case Compression::x:                                                       \
+        return #x
+
+inline const char *compressionName(CompressionType compression)
+{
+    switch (compression)
+    {
+        LIBERTIFF_CASE_COMPRESSION_STR(None);
+        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_RLE);
+        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_FAX3);
+        LIBERTIFF_CASE_COMPRESSION_STR(CCITT_FAX4);
+        LIBERTIFF_CASE_COMPRESSION_STR(LZW);
+        LIBERTIFF_CASE_COMPRESSION_STR(OldJPEG);
+        LIBERTIFF_CASE_COMPRESSION_STR(JPEG);
+        LIBERTIFF_CASE_COMPRESSION_STR(Deflate);
+        LIBERTIFF_CASE_COMPRESSION_STR(PackBits);
+        LIBERTIFF_CASE_COMPRESSION_STR(LegacyDeflate);
+        LIBERTIFF_CASE_COMPRESSION_STR(JBIG);
+        LIBERTIFF_CASE_COMPRESSION_STR(LERC);
+        LIBERTIFF_CASE_COMPRESSION_STR(LZMA);
+        LIBERTIFF_CASE_COMPRESSION_STR(ZSTD);
+        LIBERTIFF_CASE_COMPRESSION_STR(WEBP);
+        LIBERTIFF_CASE_COMPRESSION_STR(JXL);
+        LIBERTIFF_CASE_COMPRESSION_STR(JXL_DNG_1_7);
+        default:
+            break;
+    }
+    return "(unknown)";
+}
+
+#undef LIBERTIFF_CASE_COMPRESSION_STR
+
+/** Type of a SampleFormat value */
+typedef uint32_t SampleFormatType;
+
+/** Sample format */
+namespace SampleFormat
+{
+constexpr SampleFormatType UnsignedInt = 1;
+constexpr SampleFormatType SignedInt = 2;
+constexpr SampleFormatType IEEEFP = 3;
+constexpr SampleFormatType Void = 4;
+constexpr SampleFormatType ComplexInt = 5;
+constexpr SampleFormatType ComplexIEEEFP = 6;
+}  // namespace SampleFormat
+
+#define LIBERTIFF_CASE_SAMPLE_FORMAT_STR(x)                                    \
+    case SampleFormat::x:                                                      \
+        return #x
+
+inline const char *sampleFormatName(SampleFormatType sampleFormat)
+{
+    switch (sampleFormat)
+    {
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(UnsignedInt);
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(SignedInt);
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(IEEEFP);
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(Void);
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(ComplexInt);
+        LIBERTIFF_CASE_SAMPLE_FORMAT_STR(ComplexIEEEFP);
+        default:
+            break;
+    }
+    return "(unknown)";
+}
+
+#undef LIBERTIFF_CASE_SAMPLE_FORMAT_STR
+
+/** Type of a ExtraSamples value */
+typedef uint32_t ExtraSamplesType;
+
+/** Values of the ExtraSamples tag */
+namespace ExtraSamples
+{
+constexpr ExtraSamplesType Unspecified = 0;
+constexpr ExtraSamplesType AssociatedAlpha = 1;   /* premultiplied */
+constexpr ExtraSamplesType UnAssociatedAlpha = 2; /* unpremultiplied */
+}  // namespace ExtraSamples
+
+/** Type of a Predictor value */
+typedef uint32_t PredictorType;
+
+/** Values of the Predictor tag */
+namespace Predictor
+{
+constexpr PredictorType None = 1;
+constexpr PredictorType Horizontal = 2;    /* horizontal differencing */
+constexpr PredictorType FloatingPoint = 3; /* floating point predictor */
+}  // namespace Predictor
+
+/** Content of a tag entry in a Image File Directory (IFD) */
+struct TagEntry
+{
+    TagCodeType tag = 0;
+    TagTypeType type = 0;
+    // Placed here rather than at the end, so that it fits in the padding
+    // before count and the structure remains 32-byte large.
+    bool invalid_value_offset = true;  // whether value_offset is invalid
+    uint64_t count = 0;                // number of values in the tag
+
+    // Inline values. Only valid if value_offset == 0.
+    // The actual number in the arrays is count
+    union
+    {
+        std::array<char, 8> charValues;
+        std::array<uint8_t, 8> uint8Values;
+        std::array<int8_t, 8> int8Values;
+        std::array<uint16_t, 4> uint16Values;
+        std::array<int16_t, 4> int16Values;
+        std::array<uint32_t, 2> uint32Values;
+        std::array<int32_t, 2> int32Values;
+        std::array<float, 2> float32Values;
+        std::array<double, 1>
+            float64Values;  // Valid for Double, Rational, SRational
+        std::array<uint64_t, 1> uint64Values = {0};
+        std::array<int64_t, 1> int64Values;
+    };
+
+    uint64_t value_offset = 0;  // 0 for inline values
+};
+
+// The tags of all opened IFDs are kept in memory
+LIBERTIFF_STATIC_ASSERT(sizeof(TagEntry) <= 32);
+
+// clang-format off
+
+/** Return the size in bytes of a tag data type, or 0 if unknown */
+inline uint32_t tagTypeSize(TagTypeType type)
+{
+    switch (type)
+    {
+        case TagType::Byte:      return 1;
+        case TagType::ASCII:     return 1;
+        case TagType::Short:     return 2;
+        case TagType::Long:      return 4;
+        case TagType::Rational:  return 8;  // 2 Long
+        case TagType::SByte:     return 1;
+        case TagType::Undefined: return 1;
+        case TagType::SShort:    return 2;
+        case TagType::SLong:     return 4;
+        case TagType::SRational: return 8;  // 2 SLong
+        case TagType::Float:     return 4;
+        case TagType::Double:    return 8;
+        case TagType::IFD:       return 4;
+        case TagType::Long8:     return 8;
+        case TagType::SLong8:    return 8;
+        case TagType::IFD8:      return 8;
+        default: break;
+    }
+    return 0;
+}
+
+// clang-format on
+
+namespace detail
+{
+template <class T>
+inline std::vector<T> readTagAsVectorInternal(const ReadContext &rc,
+                                              const TagEntry &tag,
+                                              TagTypeType expectedType,
+                                              const T *inlineValues, bool &ok)
+{
+    if (tag.type == expectedType)
+    {
+        if (tag.value_offset)
+        {
+            if (!tag.invalid_value_offset)
+            {
+                if LIBERTIFF_CONSTEXPR (sizeof(tag.count) > sizeof(size_t))
+                {
+                    if (tag.count > std::numeric_limits<size_t>::max())
+                    {
+                        ok = false;
+                        return {};
+                    }
+                }
+                return rc.readArray<T>(tag.value_offset,
+                                       static_cast<size_t>(tag.count), ok);
+            }
+        }
+        else
+        {
+            return std::vector<T>(
+                inlineValues, inlineValues + static_cast<size_t>(tag.count));
+        }
+    }
+    ok = false;
+    return {};
+}
+
+/** Return the tag data type that must be used to read a tag as values of
+ * type T */
+template <class T> inline TagTypeType expectedTagType(const TagEntry &tag);
+
+/** Return a pointer to the inline values of a tag, as values of type T */
+template <class T> inline const T *inlineTagValues(const TagEntry &tag);
+
+#define LIBERTIFF_TAG_VALUE_TRAITS(T, tagType, arrayName)                      \
+    template <> inline TagTypeType expectedTagType<T>(const TagEntry &)       \
+    {                                                                          \
+        return tagType;                                                        \
+    }                                                                          \
+    template <> inline const T *inlineTagValues<T>(const TagEntry &tag)        \
+    {                                                                          \
+        return tag.arrayName.data();                                           \
+    }
+
+LIBERTIFF_TAG_VALUE_TRAITS(int8_t, TagType::SByte, int8Values)
+LIBERTIFF_TAG_VALUE_TRAITS(int16_t, TagType::SShort, int16Values)
+LIBERTIFF_TAG_VALUE_TRAITS(uint16_t, TagType::Short, uint16Values)
+LIBERTIFF_TAG_VALUE_TRAITS(int32_t, TagType::SLong, int32Values)
+LIBERTIFF_TAG_VALUE_TRAITS(uint32_t, TagType::Long, uint32Values)
+LIBERTIFF_TAG_VALUE_TRAITS(int64_t, TagType::SLong8, int64Values)
+LIBERTIFF_TAG_VALUE_TRAITS(uint64_t, TagType::Long8, uint64Values)
+LIBERTIFF_TAG_VALUE_TRAITS(float, TagType::Float, float32Values)
+LIBERTIFF_TAG_VALUE_TRAITS(double, TagType::Double, float64Values)
+
+#undef LIBERTIFF_TAG_VALUE_TRAITS
+
+template <> inline TagTypeType expectedTagType<uint8_t>(const TagEntry &tag)
+{
+    return tag.type == TagType::Undefined ? tag.type : TagType::Byte;
+}
+
+template <> inline const uint8_t *inlineTagValues<uint8_t>(const TagEntry &tag)
+{
+    return tag.uint8Values.data();
+}
+
+template <class T>
+inline std::vector<T> readTagAsVector(const ReadContext &rc,
+                                      const TagEntry &tag, bool &ok)
+{
+    return readTagAsVectorInternal(rc, tag, expectedTagType<T>(tag),
+                                   inlineTagValues<T>(tag), ok);
+}
+
+/** Decode count values of type T, in the byte order of the file, as uint64_t.
+ *
+ * The byte-swapping decision is taken out of the loops, which are simple
+ * enough for the compiler to vectorize them. Values to byte-swap are
+ * processed by chunks with byteSwapArray().
+ */
+template <class T>
+inline void decodeUIntArray(const ReadContext &rc, const uint8_t *src,
+                            size_t count, uint64_t *dst)
+{
+    if (sizeof(T) > 1 && rc.mustByteSwap())
+    {
+        constexpr size_t CHUNK_SIZE = 256;
+        T chunk[CHUNK_SIZE];
+        for (size_t i = 0; i < count; i += CHUNK_SIZE)
+        {
+            const size_t n = std::min(CHUNK_SIZE, count - i);
+            std::memcpy(chunk, src + i * sizeof(T), n * sizeof(T));
+            byteSwapArray(chunk, n);
+            for (size_t j = 0; j < n; ++j)
+                dst[i + j] = chunk[j];
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            T v;
+            std::memcpy(&v, src + i * sizeof(T), sizeof(T));
+            dst[i] = v;
+        }
+    }
+}
+
+/** Decode count values of an array tag of type Byte, Short, Long or Long8,
+ * in the byte order of the file, as uint64_t */
+inline void decodeUIntArray(const ReadContext &rc, TagTypeType type,
+                            const uint8_t *src, size_t count, uint64_t *dst)
+{
+    switch (type)
+    {
+        case TagType::Byte:
+            decodeUIntArray<uint8_t>(rc, src, count, dst);
+            break;
+        case TagType::Short:
+            decodeUIntArray<uint16_t>(rc, src, count, dst);
+            break;
+        case TagType::Long:
+            decodeUIntArray<uint32_t>(rc, src, count, dst);
+            break;
+        case TagType::Long8:
+            decodeUIntArray<uint64_t>(rc, src, count, dst);
+            break;
+        default:
+            assert(false);
+            break;
+    }
+}
+
+/** Lazily filled cache of the values of an out-of-line array tag of type
+ * Byte, Short, Long or Long8, such as TileOffsets or TileByteCounts.
+ *
+ * Values are read by pages of PAGE_SIZE_IN_BYTES bytes of the file, which are
+ * decoded and byte-swapped once. Lookups of an already cached page are
+ * lock-free.
+ *
+ * This class is thread-safe.
+ */
+class UIntArrayCache
+{
+  public:
+    /** Size in bytes of the file data of a page */
+    static constexpr size_t PAGE_SIZE_IN_BYTES = 4096;
+
+    /** Constructor. tag must remain valid during the lifetime of this
+     * instance. */
+    explicit UIntArrayCache(const TagEntry &tag)
+        : m_tag(tag),
+          m_valuesPerPage(PAGE_SIZE_IN_BYTES / tagTypeSize(tag.type)),
+          m_pageCount(static_cast<size_t>(tag.count / m_valuesPerPage +
+                                          (tag.count % m_valuesPerPage ? 1
+                                                                       : 0))),
+          m_pages(new std::atomic<const uint64_t *>[m_pageCount])
+    {
+        for (size_t i = 0; i < m_pageCount; ++i)
+            m_pages[i] = nullptr;
+    }
+
+    ~UIntArrayCache()
+    {
+        for (size_t i = 0; i < m_pageCount; ++i)
+            delete[] m_pages[i].load();
+    }
+
+    /** Return whether a cache can be used for tag */
+    static bool isCompatible(const TagEntry &tag, bool isBigTIFF)
+    {
+        return (tag.type == TagType::Byte || tag.type == TagType::Short ||
+                tag.type == TagType::Long ||
+                (isBigTIFF && tag.type == TagType::Long8)) &&
+               tag.value_offset != 0 && !tag.invalid_value_offset &&
+               tag.count / (PAGE_SIZE_IN_BYTES / tagTypeSize(tag.type)) <
+                   std::numeric_limits<size_t>::max() / sizeof(void *);
+    }
+
+    /** Return the value at index idx (must be lower than tag.count).
+     * ok is set to false if the page containing it could not be read, in
+     * which case the caller may try to read the value individually. The
+     * page is read again by the next lookup, as the error may be
+     * transient. */
+    uint64_t get(const ReadContext &rc, uint64_t idx, bool &ok) const
+    {
+        assert(idx < m_tag.count);
+        if (m_values)
+            return m_values[idx];
+        const size_t pageIdx = static_cast<size_t>(idx / m_valuesPerPage);
+        const uint64_t *page = m_pages[pageIdx].load(std::memory_order_acquire);
+        if (!page)
+            page = loadPage(rc, pageIdx);
+        if (!page)
+        {
+            ok = false;
+            return 0;
+        }
+        return page[static_cast<size_t>(idx % m_valuesPerPage)];
+    }
+
+    /** Copy count values starting at index first into out, if all the pages
+     * containing them are already loaded, and return whether they were */
+    bool copyLoadedRange(uint64_t first, uint64_t count, uint64_t *out) const
+    {
+        assert(first <= m_tag.count && count <= m_tag.count - first);
+        if (m_values)
+        {
+            std::memcpy(out, m_values + first, count * sizeof(uint64_t));
+            return true;
+        }
+        while (count > 0)
+        {
+            const size_t pageIdx = static_cast<size_t>(first / m_valuesPerPage);
+            const uint64_t *page =
+                m_pages[pageIdx].load(std::memory_order_acquire);
+            if (!page)
+                return false;
+            const size_t idxInPage =
+                static_cast<size_t>(first % m_valuesPerPage);
+            const size_t n = static_cast<size_t>(
+                std::min<uint64_t>(count, m_valuesPerPage - idxInPage));
+            std::memcpy(out, page + idxInPage, n * sizeof(uint64_t));
+            out += n;
+            first += n;
+            count -= n;
+        }
+        return true;
+    }
+
+    /** Return an estimate of the memory used by this instance, in bytes */
+    size_t memoryUsage() const
+    {
+        return sizeof(*this) +
+               m_pageCount * sizeof(std::atomic<const uint64_t *>) +
+               m_loadedPageBytes.load(std::memory_order_relaxed);
+    }
+
+    /** Also add the size of the pages loaded from now on to counter, which
+     * must remain valid during the lifetime of this instance. Must be
+     * called before the instance is shared between threads. */
+    void setMemoryUsageCounter(std::atomic<size_t> *counter)
+    {
+        m_memoryUsageCounter = counter;
+    }
+
+    /** Fill all pages from tag.count already decoded values (in host byte
+     * order, possibly unaligned), instead of reading them from the file.
+     * Must be called before any page is loaded, and thus before the
+     * instance is shared between threads. */
+    void preload(const void *values)
+    {
+        const uint8_t *src = static_cast<const uint8_t *>(values);
+        for (size_t pageIdx = 0; pageIdx < m_pageCount; ++pageIdx)
+        {
+            assert(!m_pages[pageIdx].load(std::memory_order_relaxed));
+            const uint64_t firstIdx = uint64_t(pageIdx) * m_valuesPerPage;
+            const size_t valueCount = static_cast<size_t>(
+                std::min<uint64_t>(m_valuesPerPage, m_tag.count - firstIdx));
+            uint64_t *page = new uint64_t[valueCount];
+            std::memcpy(page, src + firstIdx * sizeof(uint64_t),
+                        valueCount * sizeof(uint64_t));
+            m_pages[pageIdx].store(page, std::memory_order_release);
+            addLoadedPage(valueCount);
+        }
+    }
+
+    /** Serve the values from tag.count already decoded values (in host byte
+     * order, aligned on 8 bytes), instead of reading them from the file or
+     * copying them. values must remain valid during the lifetime of this
+     * instance, and this must be called before it is shared between
+     * threads. */
+    void useValues(const uint64_t *values)
+    {
+        m_values = values;
+    }
+
+  private:
+    const TagEntry &m_tag;
+    const size_t m_valuesPerPage;
+    const size_t m_pageCount;
+    const std::unique_ptr<std::atomic<const uint64_t *>[]> m_pages;
+    const uint64_t *m_values = nullptr;  // set by useValues()
+    mutable std::atomic<size_t> m_loadedPageBytes{0};
+    std::atomic<size_t> *m_memoryUsageCounter = nullptr;
+    mutable std::mutex m_mutex{};
+
+    UIntArrayCache(const UIntArrayCache &) = delete;
+    UIntArrayCache &operator=(const UIntArrayCache &) = delete;
+
+    /** Account for the memory of a newly loaded page of valueCount values */
+    void addLoadedPage(size_t valueCount) const
+    {
+        const size_t bytes = valueCount * sizeof(uint64_t);
+        m_loadedPageBytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (m_memoryUsageCounter)
+            m_memoryUsageCounter->fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    /** Load a page, and return it, or nullptr if it could not be read */
+    const uint64_t *loadPage(const ReadContext &rc, size_t pageIdx) const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const uint64_t *page = m_pages[pageIdx].load(std::memory_order_acquire);
+        if (page)
+            return page;
+
+        const uint64_t firstIdx = uint64_t(pageIdx) * m_valuesPerPage;
+        const size_t valueCount = static_cast<size_t>(
+            std::min<uint64_t>(m_valuesPerPage, m_tag.count - firstIdx));
+        const size_t valueSize = tagTypeSize(m_tag.type);
+        const uint64_t offset = m_tag.value_offset + firstIdx * valueSize;
+        const size_t byteCount = valueCount * valueSize;
+
+        std::vector<uint8_t> buffer;
+        const uint8_t *src = rc.data(offset, byteCount);
+        bool ok = true;
+        if (!src)
+        {
+            buffer.resize(byteCount);
+            rc.read(offset, byteCount, buffer.data(), ok);
+            src = buffer.data();
+        }
+        if (!ok)
+            return nullptr;
+        uint64_t *decoded = new uint64_t[valueCount];
+        decodeUIntArray(rc, m_tag.type, src, valueCount, decoded);
+        m_pages[pageIdx].store(decoded, std::memory_order_release);
+        addLoadedPage(valueCount);
+        return decoded;
+    }
+};
+
+}  // namespace detail
+
+/** Offsets of the IFDs visited while following a chain of IFDs, shared by
+ * all the Image instances of that chain, to detect cycles in corrupted files.
+ *
+ * Each offset is associated with its (0-based) position in the chain. As the
+ * next IFD offset of an IFD is a property of the file, a given offset can
+ * only be found at a different position if the chain has a cycle. Walking
+ * the chain several times is thus fine, and walking a chain of N IFDs costs
+ * O(N) time and memory.
+ *
+ * This class is thread-safe.
+ */
+class VisitedImageOffsets
+{
+  public:
+    /** Record that the IFD at offset imageOffset is at position index in the
+     * chain, and return false if it has already been visited at another
+     * position (that is the chain has a cycle) */
+    bool visit(uint64_t imageOffset, uint64_t index)
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const auto res = m_offsetToIndex.emplace(imageOffset, index);
+        return res.second || res.first->second == index;
+    }
+
+  private:
+    std::mutex m_mutex{};
+    std::unordered_map<uint64_t, uint64_t> m_offsetToIndex{};
+};
+
+/** Batch of tag value reads, to be issued with Image::readTags().
+ *
+ * The values of all out-of-line tags of the batch are fetched with a single
+ * FileReader::readMulti() call, which is useful when each request to the
+ * file has a high latency.
+ *
+ * The destination containers must remain valid until Image::readTags()
+ * has been called.
+ */
+class TagReadBatch
+{
+  public:
+    /** Request the values of a numeric tag to be read into values.
+     * Same constraints on T as for Image::readTagAsVector() */
+    template <class T> void add(const TagEntry &tag, std::vector<T> &values)
+    {
+        m_requests.push_back(Request{&tag, &values, prepareVector<T>,
+                                     finishVector<T>, clearVector<T>});
+    }
+
+    /** Request the value of an ASCII tag to be read into value */
+    void add(const TagEntry &tag, std::string &value)
+    {
+        m_requests.push_back(
+            Request{&tag, &value, prepareString, finishString, clearString});
+    }
+
+  private:
+    friend class Image;
+
+    struct Request
+    {
+        const TagEntry *tag;
+        void *container;
+
+        // Fill the container for inline values and return false, or size it
+        // and set the range to read for out-of-line values and return true.
+        bool (*prepare)(const TagEntry &tag, void *container,
+                        FileReader::Range &range, bool &ok);
+        // Post-process the container once out-of-line values have been read
+        void (*finish)(const ReadContext &rc, void *container);
+        // Clear the container on error
+        void (*clear)(void *container);
+    };
+
+    std::vector<Request> m_requests{};
+
+    template <class T>
+    static bool prepareVector(const TagEntry &tag, void *container,
+                              FileReader::Range &range, bool &ok)
+    {
+        auto &values = *static_cast<std::vector<T> *>(container);
+        values.clear();
+        if (tag.type != detail::expectedTagType<T>(tag))
+        {
+            ok = false;
+            return false;
+        }
+        if (!tag.value_offset)
+        {
+            const T *inlineValues = detail::inlineTagValues<T>(tag);
+            values.assign(inlineValues,
+                          inlineValues + static_cast<size_t>(tag.count));
+            return false;
+        }
+        if (tag.invalid_value_offset ||
+            tag.count > std::numeric_limits<size_t>::max() / sizeof(T))
+        {
+            ok = false;
+            return false;
+        }
+        values.resize(static_cast<size_t>(tag.count));
+        range.offset = tag.value_offset;
+        range.count = values.size() * sizeof(T);
+        range.buffer = values.data();
+        return true;
+    }
+
+    template <class T>
+    static void finishVector(const ReadContext &rc, void *container)
+    {
+        auto &values = *static_cast<std::vector<T> *>(container);
+        rc.byteSwapIfNeeded(values.data(), values.size());
+    }
+
+    template <class T> static void clearVector(void *container)
+    {
+        static_cast<std::vector<T> *>(container)->clear();
+    }
+
+    static bool prepareString(const TagEntry &tag, void *container,
+                              FileReader::Range &range, bool &ok)
+    {
+        auto &value = *static_cast<std::string *>(container);
+        value.clear();
+        if (tag.type != TagType::ASCII || tag.count == 0 ||
+            (tag.value_offset && tag.invalid_value_offset) ||
+            tag.count > std::numeric_limits<size_t>::max() - 1)
+        {
+            ok = false;
+            return false;
+        }
+        value.resize(static_cast<size_t>(tag.count));
+        if (!tag.value_offset)
+        {
+            std::memcpy(&value[0], tag.charValues.data(), value.size());
+            stripTrailingNul(value);
+            return false;
+        }
+        range.offset = tag.value_offset;
+        range.count = value.size();
+        range.buffer = &value[0];
+        return true;
+    }
+
+    static void finishString(const ReadContext &, void *container)
+    {
+        stripTrailingNul(*static_cast<std::string *>(container));
+    }
+
+    static void stripTrailingNul(std::string &value)
+    {
+        if (!value.empty() && value.back() == 0)
+            value.pop_back();
+    }
+
+    static void clearString(void *container)
+    {
+        static_cast<std::string *>(container)->clear();
+    }
+};
+
+namespace detail
+{
+/** Byte-swap in place count samples of sampleSize bytes */
+inline void byteSwapSamples(void *samples, size_t count, size_t sampleSize)
+{
+    if (sampleSize == 2)
+        byteSwapArrayKernels().swap16(samples, count);
+    else if (sampleSize == 4)
+        byteSwapArrayKernels().swap32(samples, count);
+    else if (sampleSize == 8)
+        byteSwapArrayKernels().swap64(samples, count);
+}
+
+/** Copy count samples of the size of T, spaced by srcStride bytes in src
+ * and dstStride bytes in dst, byte-swapping them if swap is set */
+template <class T>
+inline void copySamples(uint8_t *dst, size_t dstStride, const uint8_t *src,
+                        size_t srcStride, size_t count, bool swap)
+{
+    for (size_t i = 0; i < count; ++i, dst += dstStride, src += srcStride)
+    {
+        T v;
+        std::memcpy(&v, src, sizeof(T));
+        if (swap)
+            v = byteSwap(v);
+        std::memcpy(dst, &v, sizeof(T));
+    }
+}
+
+/** Copy count samples of sampleSize bytes (1, 2, 4 or 8) */
+inline void copySamples(uint8_t *dst, size_t dstStride, const uint8_t *src,
+                        size_t srcStride, size_t count, size_t sampleSize,
+                        bool swap)
+{
+    if (sampleSize == 1)
+        copySamples<uint8_t>(dst, dstStride, src, srcStride, count, false);
+    else if (sampleSize == 2)
+        copySamples<uint16_t>(dst, dstStride, src, srcStride, count, swap);
+    else if (sampleSize == 4)
+        copySamples<uint32_t>(dst, dstStride, src, srcStride, count, swap);
+    else if (sampleSize == 8)
+        copySamples<uint64_t>(dst, dstStride, src, srcStride, count, swap);
+}
+
+/** Unpack count samples of bitsPerSample bits into values of sampleSize
+ * bytes (1, 2 or 4) */
+inline void unpackSamplesOfSize(const uint8_t *src, size_t count,
+                                uint32_t bitsPerSample, uint8_t *dst,
+                                size_t sampleSize)
+{
+    if (sampleSize == 1)
+        LIBERTIFF_NS::unpackSamples(src, count, bitsPerSample, dst);
+    else if (sampleSize == 2)
+        LIBERTIFF_NS::unpackSamples(src, count, bitsPerSample,
+                                    reinterpret_cast<uint16_t *>(dst));
+    else if (sampleSize == 4)
+        LIBERTIFF_NS::unpackSamples(src, count, bitsPerSample,
+                                    reinterpret_cast<uint32_t *>(dst));
+}
+
+/** Scalar kernel undoing horizontal differencing (Predictor = 2) on the
+ * samples of index first to count - 1 of a row of samples of the size of
+ * T, in host byte order, with stride samples per pixel */
+template <class T>
+inline void undoHorizontalDifferencingScalar(uint8_t *row, size_t first,
+                                             size_t count, size_t stride)
+{
+    for (size_t i = std::max(first, stride); i < count; ++i)
+    {
+        T left;
+        T v;
+        std::memcpy(&left, row + (i - stride) * sizeof(T), sizeof(T));
+        std::memcpy(&v, row + i * sizeof(T), sizeof(T));
+        v = static_cast<T>(v + left);
+        std::memcpy(row + i * sizeof(T), &v, sizeof(T));
+    }
+}
+
+/** Scalar kernel interleaving the sampleSize byte planes of count samples,
+ * most significant plane first, into samples in host byte order */
+inline void interleaveBytePlanesScalar(const uint8_t *planes, size_t first,
+                                       size_t count, size_t sampleSize,
+                                       uint8_t *samples)
+{
+    const bool littleEndian = isHostLittleEndian();
+    for (size_t b = 0; b < sampleSize; ++b)
+    {
+        const uint8_t *src = planes + b * count;
+        uint8_t *dst = samples + first * sampleSize +
+                       (littleEndian ? sampleSize - 1 - b : b);
+        for (size_t i = first; i < count; ++i, dst += sampleSize)
+            *dst = src[i];
+    }
+}
+
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+// SSE2 is always available on x86_64, so these kernels need no dispatch.
+
+/** Add the lanes of the size of T of a and b */
+template <class T> inline __m128i addLanesSSE2(__m128i a, __m128i b);
+
+template <> inline __m128i addLanesSSE2<uint8_t>(__m128i a, __m128i b)
+{
+    return _mm_add_epi8(a, b);
+}
+
+template <> inline __m128i addLanesSSE2<uint16_t>(__m128i a, __m128i b)
+{
+    return _mm_add_epi16(a, b);
+}
+
+template <> inline __m128i addLanesSSE2<uint32_t>(__m128i a, __m128i b)
+{
+    return _mm_add_epi32(a, b);
+}
+
+template <> inline __m128i addLanesSSE2<uint64_t>(__m128i a, __m128i b)
+{
+    return _mm_add_epi64(a, b);
+}
+
+/** Shift x left by N bytes (zero if N >= 16) */
+template <int N> inline __m128i shiftLeftBytesSSE2(__m128i x)
+{
+    return N >= 16 ? _mm_setzero_si128() : _mm_slli_si128(x, N < 16 ? N : 0);
+}
+
+/** Broadcast the last N bytes of x to the whole vector */
+template <int N> inline __m128i broadcastLastBytesSSE2(__m128i x);
+
+template <> inline __m128i broadcastLastBytesSSE2<1>(__m128i x)
+{
+    x = _mm_srli_si128(x, 15);
+    x = _mm_unpacklo_epi8(x, x);
+    return _mm_shuffle_epi32(_mm_shufflelo_epi16(x, 0), 0);
+}
+
+template <> inline __m128i broadcastLastBytesSSE2<2>(__m128i x)
+{
+    return _mm_shuffle_epi32(_mm_shufflehi_epi16(x, 0xFF), 0xFF);
+}
+
+template <> inline __m128i broadcastLastBytesSSE2<4>(__m128i x)
+{
+    return _mm_shuffle_epi32(x, 0xFF);
+}
+
+template <> inline __m128i broadcastLastBytesSSE2<8>(__m128i x)
+{
+    return _mm_unpackhi_epi64(x, x);
+}
+
+/** SSE2 kernel undoing horizontal differencing on a row of count samples
+ * of the size of T, for pixels of PIXEL_BYTES (1, 2, 4 or 8) bytes.
+ *
+ * Each vector holds several pixels, whose prefix sum is computed with
+ * log2(16 / PIXEL_BYTES) shifted additions, to which the last pixel of the
+ * previous vector is added.
+ */
+template <class T, int PIXEL_BYTES>
+inline void undoHorizontalDifferencingSSE2(uint8_t *row, size_t count)
+{
+    const size_t byteCount = count * sizeof(T);
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= byteCount; i += 16)
+    {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<PIXEL_BYTES>(x));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<2 * PIXEL_BYTES>(x));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<4 * PIXEL_BYTES>(x));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<8 * PIXEL_BYTES>(x));
+        x = addLanesSSE2<T>(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), x);
+        carry = broadcastLastBytesSSE2<PIXEL_BYTES>(x);
+    }
+    undoHorizontalDifferencingScalar<T>(row, i / sizeof(T), count,
+                                        PIXEL_BYTES / sizeof(T));
+}
+
+/** Return a mask of the n (at most 16) low bytes of a vector */
+inline __m128i lowBytesMaskSSE2(size_t n)
+{
+    static const uint8_t bytes[32] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(bytes + 16 - n));
+}
+
+/** Broadcast the PIXEL_BYTES bytes at offset OFFSET of x to the first
+ * 16 / PIXEL_BYTES pixels of the vector */
+template <int PIXEL_BYTES, int OFFSET>
+inline __m128i broadcastPixelSSE2(__m128i x, __m128i pixelMask)
+{
+    x = _mm_and_si128(_mm_srli_si128(x, OFFSET), pixelMask);
+    x = _mm_or_si128(x, shiftLeftBytesSSE2<PIXEL_BYTES>(x));
+    x = _mm_or_si128(x, shiftLeftBytesSSE2<2 * PIXEL_BYTES>(x));
+    return _mm_or_si128(x, shiftLeftBytesSSE2<4 * PIXEL_BYTES>(x));
+}
+
+/** SSE2 kernel undoing horizontal differencing on a row of count samples
+ * of the size of T, for pixels of PIXEL_BYTES bytes that do not divide 16
+ * (e.g. 3 or 6 bytes for RGB pixels).
+ *
+ * Each vector holds the 16 / PIXEL_BYTES whole pixels at its beginning,
+ * whose prefix sum is computed as in the kernel for pixel sizes dividing
+ * 16. The following bytes are stored back unchanged, and are the first
+ * ones of the next, overlapping, vector, which is loaded before that
+ * store so that it does not wait for it.
+ */
+template <class T, int PIXEL_BYTES>
+inline void undoHorizontalDifferencingOverlappingSSE2(uint8_t *row,
+                                                      size_t count)
+{
+    constexpr int USED_BYTES = 16 / PIXEL_BYTES * PIXEL_BYTES;
+    const __m128i usedMask = lowBytesMaskSSE2(USED_BYTES);
+    const __m128i pixelMask = lowBytesMaskSSE2(PIXEL_BYTES);
+    const size_t byteCount = count * sizeof(T);
+    if (byteCount < 16)
+    {
+        undoHorizontalDifferencingScalar<T>(row, 0, count,
+                                            PIXEL_BYTES / sizeof(T));
+        return;
+    }
+    // Sum of the pixels decoded so far, broadcast to each pixel
+    __m128i carry = _mm_setzero_si128();
+    __m128i src = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+    size_t i = 0;
+    while (true)
+    {
+        const bool hasNext = i + USED_BYTES + 16 <= byteCount;
+        const __m128i next =
+            hasNext ? _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                          row + i + USED_BYTES))
+                    : src;
+        __m128i x = addLanesSSE2<T>(src, shiftLeftBytesSSE2<PIXEL_BYTES>(src));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<2 * PIXEL_BYTES>(x));
+        x = addLanesSSE2<T>(x, shiftLeftBytesSSE2<4 * PIXEL_BYTES>(x));
+        const __m128i last =
+            broadcastPixelSSE2<PIXEL_BYTES, USED_BYTES - PIXEL_BYTES>(
+                x, pixelMask);
+        x = addLanesSSE2<T>(x, carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i),
+                         _mm_or_si128(_mm_and_si128(usedMask, x),
+                                      _mm_andnot_si128(usedMask, src)));
+        i += USED_BYTES;
+        if (!hasNext)
+            break;
+        carry = addLanesSSE2<T>(carry, last);
+        src = next;
+    }
+    undoHorizontalDifferencingScalar<T>(row, i / sizeof(T), count,
+                                        PIXEL_BYTES / sizeof(T));
+}
+
+/** SSE2 kernel undoing horizontal differencing on a row of count samples
+ * of the size of T, for pixels of at least 16 bytes, for which the 16
+ * bytes of a vector only depend on already decoded bytes */
+template <class T>
+inline void undoHorizontalDifferencingWideSSE2(uint8_t *row, size_t count,
+                                               size_t stride)
+{
+    const size_t byteCount = count * sizeof(T);
+    const size_t pixelBytes = stride * sizeof(T);
+    size_t i = pixelBytes;
+    for (; i + 16 <= byteCount; i += 16)
+    {
+        const __m128i x =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+        const __m128i left = _mm_loadu_si128(
+            reinterpret_cast<const __m128i *>(row + i - pixelBytes));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(row + i),
+                         addLanesSSE2<T>(x, left));
+    }
+    undoHorizontalDifferencingScalar<T>(row, i / sizeof(T), count, stride);
+}
+
+/** Undo horizontal differencing with the SSE2 kernels, and return false if
+ * the pixel size is not handled by them */
+template <class T>
+inline bool undoHorizontalDifferencingSSE2(uint8_t *row, size_t count,
+                                           size_t stride)
+{
+    const size_t pixelBytes = stride * sizeof(T);
+    if (pixelBytes >= 16)
+        undoHorizontalDifferencingWideSSE2<T>(row, count, stride);
+    else if (pixelBytes == 1)
+        undoHorizontalDifferencingSSE2<T, 1>(row, count);
+    else if (pixelBytes == 2)
+        undoHorizontalDifferencingSSE2<T, 2>(row, count);
+    else if (pixelBytes == 4)
+        undoHorizontalDifferencingSSE2<T, 4>(row, count);
+    else if (pixelBytes == 8)
+        undoHorizontalDifferencingSSE2<T, 8>(row, count);
+    else if (pixelBytes == 3)
+        undoHorizontalDifferencingOverlappingSSE2<T, 3>(row, count);
+    else if (pixelBytes == 6)
+        undoHorizontalDifferencingOverlappingSSE2<T, 6>(row, count);
+    else
+        return false;
+    return true;
+}
+
+/** SSE2 kernel interleaving the byte planes of count samples of
+ * SAMPLE_SIZE (2, 4 or 8) bytes into little-endian samples, 16 samples at
+ * a time. Return the number of processed samples. */
+template <int SAMPLE_SIZE>
+inline size_t interleaveBytePlanesSSE2(const uint8_t *planes, size_t count,
+                                       uint8_t *samples)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        // Planes, least significant first
+        __m128i p[SAMPLE_SIZE];
+        for (int b = 0; b < SAMPLE_SIZE; ++b)
+        {
+            p[b] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+                planes + (SAMPLE_SIZE - 1 - b) * count + i));
+        }
+        // Interleave bytes, then 16-bit and 32-bit groups of bytes
+        __m128i v[8];
+        for (int b = 0; b < SAMPLE_SIZE; b += 2)
+        {
+            v[b] = _mm_unpacklo_epi8(p[b], p[b + 1]);
+            v[b + 1] = _mm_unpackhi_epi8(p[b], p[b + 1]);
+        }
+        __m128i *out = reinterpret_cast<__m128i *>(samples + i * SAMPLE_SIZE);
+        if (SAMPLE_SIZE == 2)
+        {
+            _mm_storeu_si128(out, v[0]);
+            _mm_storeu_si128(out + 1, v[1]);
+            continue;
+        }
+        __m128i w[8];
+        for (int b = 0; b < SAMPLE_SIZE; b += 4)
+        {
+            w[b] = _mm_unpacklo_epi16(v[b], v[b + 2]);
+            w[b + 1] = _mm_unpackhi_epi16(v[b], v[b + 2]);
+            w[b + 2] = _mm_unpacklo_epi16(v[b + 1], v[b + 3]);
+            w[b + 3] = _mm_unpackhi_epi16(v[b + 1], v[b + 3]);
+        }
+        if (SAMPLE_SIZE == 4)
+        {
+            for (int k = 0; k < 4; ++k)
+                _mm_storeu_si128(out + k, w[k]);
+            continue;
+        }
+        for (int k = 0; k < 4; ++k)
+        {
+            _mm_storeu_si128(out + 2 * k,
+                             _mm_unpacklo_epi32(w[k], w[k + 4]));
+            _mm_storeu_si128(out + 2 * k + 1,
+                             _mm_unpackhi_epi32(w[k], w[k + 4]));
+        }
+    }
+    return i;
+}
+#endif
+
+/** Undo horizontal differencing (Predictor = 2) on a row of count samples
+ * of sampleSize bytes (1, 2, 4 or 8), in host byte order, with stride
+ * samples per pixel.
+ *
+ * On x86_64, pixels of 1, 2, 3, 4, 6, 8 or at least 16 bytes are handled
+ * by SSE2 kernels. Other pixel sizes, which are less common, use scalar
+ * code.
+ */
+inline void undoHorizontalDifferencing(uint8_t *row, size_t count,
+                                       size_t stride, size_t sampleSize)
+{
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    if ((sampleSize == 1 &&
+         undoHorizontalDifferencingSSE2<uint8_t>(row, count, stride)) ||
+        (sampleSize == 2 &&
+         undoHorizontalDifferencingSSE2<uint16_t>(row, count, stride)) ||
+        (sampleSize == 4 &&
+         undoHorizontalDifferencingSSE2<uint32_t>(row, count, stride)) ||
+        (sampleSize == 8 &&
+         undoHorizontalDifferencingSSE2<uint64_t>(row, count, stride)))
+    {
+        return;
+    }
+#endif
+    if (sampleSize == 1)
+        undoHorizontalDifferencingScalar<uint8_t>(row, 0, count, stride);
+    else if (sampleSize == 2)
+        undoHorizontalDifferencingScalar<uint16_t>(row, 0, count, stride);
+    else if (sampleSize == 4)
+        undoHorizontalDifferencingScalar<uint32_t>(row, 0, count, stride);
+    else if (sampleSize == 8)
+        undoHorizontalDifferencingScalar<uint64_t>(row, 0, count, stride);
+}
+
+/** Undo the floating point predictor (Predictor = 3) on a row of count
+ * samples of sampleSize bytes, with stride samples per pixel.
+ *
+ * The encoded row holds the bytes of the samples grouped by significance,
+ * most significant first, with byte differencing applied on the whole row.
+ * The decoded samples are in host byte order. tmp must be at least
+ * count * sampleSize bytes large.
+ */
+inline void undoFloatingPointPredictor(uint8_t *row, size_t count,
+                                       size_t stride, size_t sampleSize,
+                                       uint8_t *tmp)
+{
+    const size_t byteCount = count * sampleSize;
+    undoHorizontalDifferencing(row, byteCount, stride, 1);
+    std::memcpy(tmp, row, byteCount);
+    size_t first = 0;
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    if (sampleSize == 2)
+        first = interleaveBytePlanesSSE2<2>(tmp, count, row);
+    else if (sampleSize == 4)
+        first = interleaveBytePlanesSSE2<4>(tmp, count, row);
+    else if (sampleSize == 8)
+        first = interleaveBytePlanesSSE2<8>(tmp, count, row);
+#endif
+    interleaveBytePlanesScalar(tmp, first, count, sampleSize, row);
+}
+}  // namespace detail
+
+/** Strip or tile needed to read a window of an image */
+struct StrileRead
+{
+    uint64_t idx = 0;        // index of the strip or tile
+    uint64_t offset = 0;     // offset of its data in the file
+    uint64_t byteCount = 0;  // size of its data
+};
+
+/** Range of the file covering the data of one or several striles */
+struct FileRange
+{
+    uint64_t offset = 0;
+    uint64_t size = 0;
+    // Striles covered by the range are ReadPlan::striles[firstStrile] to
+    // ReadPlan::striles[firstStrile + strileCount - 1]
+    size_t firstStrile = 0;
+    size_t strileCount = 0;
+};
+
+/** Striles needed to read a window of an image, and the file ranges to read
+ * to get their data, as returned by Image::planWindowRead() */
+struct ReadPlan
+{
+    // Sorted by increasing offset. Striles that have no data (sparse files)
+    // come first and are not covered by any range.
+    std::vector<StrileRead> striles{};
+    // Sorted by increasing offset
+    std::vector<FileRange> ranges{};
+};
+
+class Image;
+
+/** Interface of a decompressor of strip or tile data.
+ *
+ * Implementations must be thread-safe, as a codec may be used concurrently
+ * to decode several striles.
+ */
+class Codec
+{
+  public:
+    virtual ~Codec() = default;
+
+    /** Decompress the srcSize bytes of src, that are the data of a strile
+     * of image, into the dstSize bytes of dst.
+     *
+     * Return false if the data is corrupted or decompresses to less than
+     * dstSize bytes. Predictor and byte-swapping are applied afterwards by
+     * the caller, and must not be applied by the codec.
+     */
+    virtual bool decode(const Image &image, const uint8_t *src,
+                        size_t srcSize, uint8_t *dst,
+                        size_t dstSize) const = 0;
+};
+
+/** Built-in decompressor of PackBits (Apple Macintosh RLE) data */
+class PackBitsCodec final : public Codec
+{
+  public:
+    bool decode(const Image & /* image */, const uint8_t *src,
+                size_t srcSize, uint8_t *dst, size_t dstSize) const override
+    {
+        const uint8_t *const srcEnd = src + srcSize;
+        size_t out = 0;
+        while (src != srcEnd && out < dstSize)
+        {
+            const int n = static_cast<int8_t>(*src++);
+            if (n >= 0)
+            {
+                // Literal run of n + 1 bytes
+                const size_t count = std::min<size_t>(
+                    std::min<size_t>(size_t(n) + 1, dstSize - out),
+                    static_cast<size_t>(srcEnd - src));
+                std::memcpy(dst + out, src, count);
+                src += count;
+                out += count;
+            }
+            else if (n != -128 && src != srcEnd)
+            {
+                // Next byte repeated 1 - n times
+                const size_t count =
+                    std::min<size_t>(size_t(1 - n), dstSize - out);
+                std::memset(dst + out, *src++, count);
+                out += count;
+            }
+        }
+        return out == dstSize;
+    }
+};
+
+/** Built-in decompressor of LZW data, as written since TIFF 5.0 (with
+ * codes packed most significant bit first and "early change" of the code
+ * width).
+ *
+ * The code table is a flat array in which each code refers to an earlier
+ * occurrence of its string in the decompressed output, so that strings are
+ * emitted with a single memcpy() and no per-code allocation.
+ */
+class LZWCodec final : public Codec
+{
+  public:
+    bool decode(const Image & /* image */, const uint8_t *src,
+                size_t srcSize, uint8_t *dst, size_t dstSize) const override
+    {
+        constexpr uint32_t CLEAR_CODE = 256;
+        constexpr uint32_t EOI_CODE = 257;
+        constexpr uint32_t FIRST_CODE = 258;
+        constexpr uint32_t MIN_CODE_WIDTH = 9;
+        constexpr uint32_t MAX_CODE_WIDTH = 12;
+        constexpr uint32_t TABLE_SIZE = 1 << MAX_CODE_WIDTH;
+
+        struct Entry
+        {
+            uint32_t pos;  // position of the string in dst
+            uint32_t len;  // length of the string
+        };
+
+        // Positions in the table are 32-bit to keep it small enough to
+        // live on the stack
+        if (dstSize > std::numeric_limits<uint32_t>::max())
+            return false;
+        Entry table[TABLE_SIZE];
+        const uint8_t *const srcEnd = src + srcSize;
+        uint64_t bitBuffer = 0;
+        uint32_t bitCount = 0;
+        uint32_t codeWidth = MIN_CODE_WIDTH;
+        uint32_t nextCode = FIRST_CODE;
+        bool hasPrev = false;
+        size_t prevPos = 0;
+        size_t prevLen = 0;
+        size_t out = 0;
+        while (out < dstSize)
+        {
+            while (bitCount <= 56 && src != srcEnd)
+            {
+                bitBuffer = (bitBuffer << 8) | *src++;
+                bitCount += 8;
+            }
+            if (bitCount < codeWidth)
+                break;
+            bitCount -= codeWidth;
+            const uint32_t code = static_cast<uint32_t>(
+                (bitBuffer >> bitCount) & ((1U << codeWidth) - 1));
+
+            if (code == EOI_CODE)
+                break;
+            if (code == CLEAR_CODE)
+            {
+                codeWidth = MIN_CODE_WIDTH;
+                nextCode = FIRST_CODE;
+                hasPrev = false;
+                continue;
+            }
+
+            const size_t pos = out;
+            size_t len;
+            if (code < CLEAR_CODE)
+            {
+                dst[out++] = static_cast<uint8_t>(code);
+                len = 1;
+            }
+            else if (code < nextCode && code >= FIRST_CODE)
+            {
+                len = table[code].len;
+                const size_t count = std::min(len, dstSize - out);
+                std::memcpy(dst + out, dst + table[code].pos, count);
+                out += count;
+            }
+            else if (code == nextCode && hasPrev)
+            {
+                // String of the previous code followed by its first byte
+                len = prevLen + 1;
+                const size_t count = std::min(prevLen, dstSize - out);
+                std::memcpy(dst + out, dst + prevPos, count);
+                out += count;
+                if (out < dstSize)
+                    dst[out++] = dst[prevPos];
+            }
+            else
+            {
+                return false;
+            }
+
+            if (hasPrev && nextCode < TABLE_SIZE)
+            {
+                // The new string is the previous one followed by the first
+                // byte of the current one, which immediately follows it.
+                table[nextCode].pos = static_cast<uint32_t>(prevPos);
+                table[nextCode].len = static_cast<uint32_t>(prevLen + 1);
+                ++nextCode;
+                if (nextCode >= (1U << codeWidth) - 1 &&
+                    codeWidth < MAX_CODE_WIDTH)
+                {
+                    ++codeWidth;
+                }
+            }
+            hasPrev = true;
+            prevPos = pos;
+            prevLen = len;
+        }
+        return out == dstSize;
+    }
+};
+
+#ifdef LIBERTIFF_DEFLATE_DECODER
+namespace detail
+{
+/** Huffman decoding table of a Deflate block, for codes stored least
+ * significant bit first.
+ *
+ * Codes of at most rootBits bits are decoded with a single lookup in the
+ * root table, and longer ones with a second lookup in a subtable. Each
+ * entry packs the number of bits to consume (bits 0-4), its kind (bits
+ * 5-7), a number of extra bits (bits 8-11) and a value (bits 16-31).
+ */
+class HuffmanTable
+{
+  public:
+    enum Kind : uint32_t
+    {
+        LITERAL = 0,       // value is a byte
+        LITERAL_PAIR = 1,  // value packs two bytes, first in the low byte
+        BASE = 2,  // value is the base of a length or distance, to which
+                   // extraBits bits must be added
+        END_OF_BLOCK = 3,
+        SUBTABLE = 4,  // value is the offset of a subtable of extraBits bits
+        INVALID = 5,
+    };
+
+    static uint32_t makeEntry(Kind kind, uint32_t value,
+                              uint32_t extraBits = 0)
+    {
+        return (kind << 5) | (extraBits << 8) | (value << 16);
+    }
+
+    static uint32_t bitCount(uint32_t entry)
+    {
+        return entry & 31;
+    }
+
+    static Kind kind(uint32_t entry)
+    {
+        return static_cast<Kind>((entry >> 5) & 7);
+    }
+
+    static uint32_t extraBits(uint32_t entry)
+    {
+        return (entry >> 8) & 15;
+    }
+
+    static uint32_t value(uint32_t entry)
+    {
+        return entry >> 16;
+    }
+
+    /** Build the table from the code lengths (at most 15) of symbolCount
+     * symbols, symbolEntry(i) returning the entry of symbol i, without its
+     * bit count. Return false if the lengths over-subscribe the code space.
+     */
+    bool build(const uint8_t *lengths, uint32_t symbolCount,
+               uint32_t (*symbolEntry)(uint32_t), uint32_t rootBitCount)
+    {
+        constexpr uint32_t MAX_CODE_LENGTH = 15;
+        uint32_t counts[MAX_CODE_LENGTH + 1] = {0};
+        for (uint32_t i = 0; i < symbolCount; ++i)
+        {
+            if (lengths[i] > MAX_CODE_LENGTH)
+                return false;
+            ++counts[lengths[i]];
+        }
+        counts[0] = 0;
+        int left = 1;
+        for (uint32_t len = 1; len <= MAX_CODE_LENGTH; ++len)
+        {
+            left = 2 * left - static_cast<int>(counts[len]);
+            if (left < 0)
+                return false;
+        }
+
+        // Canonical codes, bit-reversed as they are read LSB first
+        uint32_t nextCode[MAX_CODE_LENGTH + 1] = {0};
+        for (uint32_t len = 1, code = 0; len <= MAX_CODE_LENGTH; ++len)
+        {
+            code = (code + counts[len - 1]) << 1;
+            nextCode[len] = code;
+        }
+        m_codes.resize(symbolCount);
+        for (uint32_t i = 0; i < symbolCount; ++i)
+        {
+            const uint32_t len = lengths[i];
+            if (len == 0)
+                continue;
+            uint32_t code = nextCode[len]++;
+            uint32_t reversed = 0;
+            for (uint32_t j = 0; j < len; ++j, code >>= 1)
+                reversed = (reversed << 1) | (code & 1);
+            m_codes[i] = static_cast<uint16_t>(reversed);
+        }
+
+        rootBits = rootBitCount;
+        const uint32_t rootSize = 1U << rootBits;
+        const uint32_t rootMask = rootSize - 1;
+        entries.assign(rootSize, makeEntry(INVALID, 0));
+
+        // Allocate the subtables, sized for the longest code of each prefix
+        m_subtableBits.assign(rootSize, 0);
+        for (uint32_t i = 0; i < symbolCount; ++i)
+        {
+            if (lengths[i] > rootBits)
+            {
+                uint8_t &bits = m_subtableBits[m_codes[i] & rootMask];
+                bits = std::max(bits, static_cast<uint8_t>(lengths[i] -
+                                                           rootBits));
+            }
+        }
+        for (uint32_t prefix = 0; prefix < rootSize; ++prefix)
+        {
+            const uint32_t bits = m_subtableBits[prefix];
+            if (bits)
+            {
+                entries[prefix] =
+                    makeEntry(SUBTABLE, static_cast<uint32_t>(entries.size()),
+                              bits) |
+                    rootBits;
+                entries.resize(entries.size() + (size_t(1) << bits),
+                               makeEntry(INVALID, 0));
+            }
+        }
+
+        // Replicate each code in all the entries it is a prefix of
+        for (uint32_t i = 0; i < symbolCount; ++i)
+        {
+            const uint32_t len = lengths[i];
+            if (len == 0)
+                continue;
+            const uint32_t code = m_codes[i];
+            if (len <= rootBits)
+            {
+                const uint32_t entry = symbolEntry(i) | len;
+                for (uint32_t k = code; k < rootSize; k += 1U << len)
+                    entries[k] = entry;
+            }
+            else
+            {
+                const uint32_t subtable = entries[code & rootMask];
+                const uint32_t offset = value(subtable);
+                const uint32_t size = 1U << extraBits(subtable);
+                const uint32_t entry = symbolEntry(i) | (len - rootBits);
+                for (uint32_t k = code >> rootBits; k < size;
+                     k += 1U << (len - rootBits))
+                {
+                    entries[offset + k] = entry;
+                }
+            }
+        }
+        return true;
+    }
+
+    /** Replace root entries of literals whose code is followed by the code
+     * of another literal within rootBits bits by an entry of the pair */
+    void addLiteralPairs()
+    {
+        const uint32_t rootSize = 1U << rootBits;
+        m_root.assign(entries.begin(), entries.begin() + rootSize);
+        for (uint32_t i = 0; i < rootSize; ++i)
+        {
+            const uint32_t first = m_root[i];
+            const uint32_t firstBits = bitCount(first);
+            if (kind(first) != LITERAL || firstBits >= rootBits)
+                continue;
+            const uint32_t second = m_root[i >> firstBits];
+            if (kind(second) == LITERAL &&
+                bitCount(second) <= rootBits - firstBits)
+            {
+                entries[i] =
+                    makeEntry(LITERAL_PAIR,
+                              value(first) | (value(second) << 8)) |
+                    (firstBits + bitCount(second));
+            }
+        }
+    }
+
+    uint32_t rootBits = 0;
+    std::vector<uint32_t> entries{};
+
+  private:
+    std::vector<uint16_t> m_codes{};
+    std::vector<uint8_t> m_subtableBits{};
+    std::vector<uint32_t> m_root{};
+};
+
+/** Entry of a symbol of the literal/length alphabet */
+inline uint32_t deflateLitLenEntry(uint32_t symbol)
+{
+    static const uint16_t lengthBases[] = {
+        3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+        31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t lengthExtraBits[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                              1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                              4, 4, 4, 4, 5, 5, 5, 5, 0};
+    if (symbol < 256)
+        return HuffmanTable::makeEntry(HuffmanTable::LITERAL, symbol);
+    if (symbol == 256)
+        return HuffmanTable::makeEntry(HuffmanTable::END_OF_BLOCK, 0);
+    if (symbol <= 285)
+    {
+        return HuffmanTable::makeEntry(HuffmanTable::BASE,
+                                       lengthBases[symbol - 257],
+                                       lengthExtraBits[symbol - 257]);
+    }
+    return HuffmanTable::makeEntry(HuffmanTable::INVALID, 0);
+}
+
+/** Entry of a symbol of the distance alphabet */
+inline uint32_t deflateDistanceEntry(uint32_t symbol)
+{
+    static const uint16_t distanceBases[] = {
+        1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+        33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+        1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577};
+    static const uint8_t distanceExtraBits[] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6,
+        6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    if (symbol < 30)
+    {
+        return HuffmanTable::makeEntry(HuffmanTable::BASE,
+                                       distanceBases[symbol],
+                                       distanceExtraBits[symbol]);
+    }
+    return HuffmanTable::makeEntry(HuffmanTable::INVALID, 0);
+}
+
+/** Entry of a symbol of the code length alphabet */
+inline uint32_t deflateCodeLengthEntry(uint32_t symbol)
+{
+    return HuffmanTable::makeEntry(HuffmanTable::LITERAL, symbol);
+}
+
+/** Decompressor of a raw Deflate (RFC 1951) stream, whose decompressed
+ * size is known, into a preallocated buffer.
+ *
+ * The whole input is available, so that there is no streaming state
+ * machine: bits are read through a 64-bit buffer refilled with 8 bytes at
+ * a time, and a single refill per decoded symbol provides enough bits for
+ * a length/distance pair and their extra bits.
+ */
+class Inflater
+{
+  public:
+    Inflater(const uint8_t *src, size_t srcSize, uint8_t *dst,
+             size_t dstSize)
+        : m_src(src), m_srcSize(srcSize), m_dst(dst), m_dstSize(dstSize)
+    {
+    }
+
+    /** Decompress exactly dstSize bytes, and return whether successful.
+     * Decompression stops as soon as the output buffer is full. */
+    bool inflate()
+    {
+        constexpr uint32_t LITLEN_ROOT_BITS = 10;
+        constexpr uint32_t DISTANCE_ROOT_BITS = 8;
+        bool final = false;
+        while (!final && m_out < m_dstSize)
+        {
+            refill();
+            if (isOverrun())
+                return false;
+            final = readBits(1) != 0;
+            const uint32_t type = readBits(2);
+            bool ok;
+            if (type == 0)
+            {
+                ok = copyStoredBlock();
+            }
+            else if (type == 1)
+            {
+                const auto &fixed = fixedTables();
+                ok = decodeBlock(fixed.litLen, fixed.distance);
+            }
+            else if (type == 2)
+            {
+                ok = readDynamicTables(LITLEN_ROOT_BITS, DISTANCE_ROOT_BITS) &&
+                     decodeBlock(m_litLen, m_distance);
+            }
+            else
+            {
+                ok = false;
+            }
+            if (!ok)
+                return false;
+        }
+        return m_out == m_dstSize && !isOverrun();
+    }
+
+  private:
+    const uint8_t *const m_src;
+    const size_t m_srcSize;
+    // Number of bytes loaded in the bit buffer, which may exceed m_srcSize
+    // as zeros are loaded past the end of the input
+    size_t m_srcPos = 0;
+    uint64_t m_bitBuffer = 0;
+    uint32_t m_bitCount = 0;
+    uint8_t *const m_dst;
+    const size_t m_dstSize;
+    size_t m_out = 0;
+    HuffmanTable m_litLen{};
+    HuffmanTable m_distance{};
+    HuffmanTable m_codeLength{};
+
+    struct FixedTables
+    {
+        HuffmanTable litLen{};
+        HuffmanTable distance{};
+
+        FixedTables()
+        {
+            uint8_t lengths[288];
+            std::memset(lengths, 8, 144);
+            std::memset(lengths + 144, 9, 112);
+            std::memset(lengths + 256, 7, 24);
+            std::memset(lengths + 280, 8, 8);
+            litLen.build(lengths, 288, deflateLitLenEntry, 9);
+            litLen.addLiteralPairs();
+            std::memset(lengths, 5, 32);
+            distance.build(lengths, 32, deflateDistanceEntry, 5);
+        }
+    };
+
+    static const FixedTables &fixedTables()
+    {
+        static const FixedTables tables;
+        return tables;
+    }
+
+    /** Fill the bit buffer with at least 56 bits */
+    void refill()
+    {
+        if (m_srcPos <= m_srcSize && m_srcSize - m_srcPos >= 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, m_src + m_srcPos, sizeof(word));
+            if (!isHostLittleEndian())
+                word = byteSwap(word);
+            // Bits beyond the new bit count are those of the next bytes,
+            // which will be loaded again at the same position
+            m_bitBuffer |= word << m_bitCount;
+            const uint32_t byteCount = (63 - m_bitCount) / 8;
+            m_srcPos += byteCount;
+            m_bitCount += 8 * byteCount;
+            return;
+        }
+        while (m_bitCount <= 56)
+        {
+            const uint64_t byte = m_srcPos < m_srcSize ? m_src[m_srcPos] : 0;
+            ++m_srcPos;
+            m_bitBuffer |= byte << m_bitCount;
+            m_bitCount += 8;
+        }
+    }
+
+    /** Return whether bits past the end of the input have been consumed */
+    bool isOverrun() const
+    {
+        return m_srcPos > m_srcSize &&
+               (m_srcPos - m_srcSize) * 8 > m_bitCount;
+    }
+
+    uint32_t readBits(uint32_t count)
+    {
+        const uint32_t bits =
+            static_cast<uint32_t>(m_bitBuffer & ((uint64_t(1) << count) - 1));
+        m_bitBuffer >>= count;
+        m_bitCount -= count;
+        return bits;
+    }
+
+    uint32_t decodeSymbol(const HuffmanTable &table)
+    {
+        uint32_t entry = table.entries[static_cast<size_t>(
+            m_bitBuffer & ((uint64_t(1) << table.rootBits) - 1))];
+        if (HuffmanTable::kind(entry) == HuffmanTable::SUBTABLE)
+        {
+            readBits(table.rootBits);
+            entry = table.entries[HuffmanTable::value(entry) +
+                                  static_cast<size_t>(
+                                      m_bitBuffer &
+                                      ((uint64_t(1)
+                                        << HuffmanTable::extraBits(entry)) -
+                                       1))];
+        }
+        readBits(HuffmanTable::bitCount(entry));
+        return entry;
+    }
+
+    bool copyStoredBlock()
+    {
+        // Go back to the first unconsumed byte
+        readBits(m_bitCount % 8);
+        size_t pos = m_srcPos - m_bitCount / 8;
+        m_bitBuffer = 0;
+        m_bitCount = 0;
+        if (pos > m_srcSize || m_srcSize - pos < 4)
+            return false;
+        const uint32_t len = m_src[pos] | (m_src[pos + 1] << 8);
+        const uint32_t nlen = m_src[pos + 2] | (m_src[pos + 3] << 8);
+        if (len != (~nlen & 0xFFFF))
+            return false;
+        pos += 4;
+        const size_t count = std::min<size_t>(len, m_dstSize - m_out);
+        if (m_srcSize - pos < count)
+            return false;
+        std::memcpy(m_dst + m_out, m_src + pos, count);
+        m_out += count;
+        m_srcPos = pos + count;
+        return true;
+    }
+
+    bool readDynamicTables(uint32_t litLenRootBits,
+                           uint32_t distanceRootBits)
+    {
+        static const uint8_t codeLengthOrder[19] = {
+            16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+        const uint32_t litLenCount = readBits(5) + 257;
+        const uint32_t distanceCount = readBits(5) + 1;
+        const uint32_t codeLengthCount = readBits(4) + 4;
+        if (litLenCount > 286 || distanceCount > 30)
+            return false;
+
+        uint8_t lengths[286 + 30] = {0};
+        for (uint32_t i = 0; i < codeLengthCount; ++i)
+        {
+            // Up to 19 * 3 = 57 bits, more than a refill guarantees
+            if (i % 16 == 0)
+                refill();
+            lengths[codeLengthOrder[i]] = static_cast<uint8_t>(readBits(3));
+        }
+        if (!m_codeLength.build(lengths, 19, deflateCodeLengthEntry, 7))
+            return false;
+
+        const uint32_t totalCount = litLenCount + distanceCount;
+        for (uint32_t i = 0; i < totalCount;)
+        {
+            refill();
+            const uint32_t entry = decodeSymbol(m_codeLength);
+            if (HuffmanTable::kind(entry) != HuffmanTable::LITERAL)
+                return false;
+            const uint32_t symbol = HuffmanTable::value(entry);
+            if (symbol < 16)
+            {
+                lengths[i++] = static_cast<uint8_t>(symbol);
+                continue;
+            }
+            uint8_t repeated = 0;
+            uint32_t count;
+            if (symbol == 16)
+            {
+                if (i == 0)
+                    return false;
+                repeated = lengths[i - 1];
+                count = 3 + readBits(2);
+            }
+            else if (symbol == 17)
+            {
+                count = 3 + readBits(3);
+            }
+            else
+            {
+                count = 11 + readBits(7);
+            }
+            if (count > totalCount - i)
+                return false;
+            std::memset(lengths + i, repeated, count);
+            i += count;
+        }
+        if (isOverrun() || lengths[256] == 0)
+            return false;
+
+        if (!m_litLen.build(lengths, litLenCount, deflateLitLenEntry,
+                            litLenRootBits) ||
+            !m_distance.build(lengths + litLenCount, distanceCount,
+                              deflateDistanceEntry, distanceRootBits))
+        {
+            return false;
+        }
+        m_litLen.addLiteralPairs();
+        return true;
+    }
+
+    bool decodeBlock(const HuffmanTable &litLen,
+                     const HuffmanTable &distance)
+    {
+        while (m_out < m_dstSize)
+        {
+            refill();
+            const uint32_t entry = decodeSymbol(litLen);
+            const auto kind = HuffmanTable::kind(entry);
+            if (kind == HuffmanTable::LITERAL)
+            {
+                m_dst[m_out++] = static_cast<uint8_t>(entry >> 16);
+                continue;
+            }
+            if (kind == HuffmanTable::LITERAL_PAIR)
+            {
+                m_dst[m_out++] = static_cast<uint8_t>(entry >> 16);
+                if (m_out < m_dstSize)
+                    m_dst[m_out++] = static_cast<uint8_t>(entry >> 24);
+                continue;
+            }
+            if (kind == HuffmanTable::END_OF_BLOCK)
+                return !isOverrun();
+            if (kind != HuffmanTable::BASE)
+                return false;
+
+            const uint32_t length = HuffmanTable::value(entry) +
+                                    readBits(HuffmanTable::extraBits(entry));
+            const uint32_t distanceEntry = decodeSymbol(distance);
+            if (HuffmanTable::kind(distanceEntry) != HuffmanTable::BASE)
+                return false;
+            const uint32_t dist =
+                HuffmanTable::value(distanceEntry) +
+                readBits(HuffmanTable::extraBits(distanceEntry));
+            if (dist > m_out)
+                return false;
+
+            const size_t count = std::min<size_t>(length, m_dstSize - m_out);
+            uint8_t *const out = m_dst + m_out;
+            const uint8_t *const match = out - dist;
+            if (dist >= count)
+            {
+                std::memcpy(out, match, count);
+            }
+            else if (dist == 1)
+            {
+                std::memset(out, *match, count);
+            }
+            else
+            {
+                // Overlapping copy, repeating the last dist bytes
+                for (size_t i = 0; i < count; ++i)
+                    out[i] = match[i];
+            }
+            m_out += count;
+        }
+        return !isOverrun();
+    }
+};
+}  // namespace detail
+
+/** Optional built-in decompressor of Deflate data (zlib format, as used by
+ * Compression::Deflate and Compression::LegacyDeflate).
+ *
+ * The Adler-32 checksum of the data is not verified.
+ */
+class DeflateCodec final : public Codec
+{
+  public:
+    bool decode(const Image & /* image */, const uint8_t *src,
+                size_t srcSize, uint8_t *dst, size_t dstSize) const override
+    {
+        // zlib header: deflate method, window of at most 32 KB, no preset
+        // dictionary, and valid check bits
+        if (srcSize < 2 || (src[0] & 0x0F) != 8 || (src[0] >> 4) > 7 ||
+            (src[1] & 0x20) != 0 || ((src[0] << 8) | src[1]) % 31 != 0)
+        {
+            return false;
+        }
+        detail::Inflater inflater(src + 2, srcSize - 2, dst, dstSize);
+        return inflater.inflate();
+    }
+};
+#endif
+
+/** Registry of the codecs used to decompress strips and tiles, keyed by
+ * the value of the Compression tag.
+ *
+ * Uncompressed data is handled by Image::decodeStrile() itself and does
+ * not need a codec. Codecs are typically registered at application
+ * startup in the global() instance, which comes with the built-in codecs
+ * registered (see registerBuiltinCodecs()).
+ *
+ * This class is thread-safe.
+ */
+class CodecRegistry
+{
+  public:
+    /** Constructor, with no registered codec */
+    CodecRegistry() = default;
+
+    /** Return the process-wide instance */
+    static CodecRegistry &global()
+    {
+        struct GlobalRegistry
+        {
+            CodecRegistry registry{};
+
+            GlobalRegistry()
+            {
+                registry.registerBuiltinCodecs();
+            }
+        };
+
+        static GlobalRegistry instance;
+        return instance.registry;
+    }
+
+    /** Register the codecs built in libertiff (PackBits, LZW, and Deflate
+     * if LIBERTIFF_DEFLATE_DECODER is defined) */
+    void registerBuiltinCodecs()
+    {
+        registerCodec(Compression::PackBits,
+                      std::make_shared<PackBitsCodec>());
+        registerCodec(Compression::LZW, std::make_shared<LZWCodec>());
+#ifdef LIBERTIFF_DEFLATE_DECODER
+        auto deflateCodec = std::make_shared<DeflateCodec>();
+        registerCodec(Compression::Deflate, deflateCodec);
+        registerCodec(Compression::LegacyDeflate, deflateCodec);
+#endif
+    }
+
+    /** Register the codec to use for a compression method, replacing any
+     * previously registered one */
+    void registerCodec(CompressionType compression,
+                       const std::shared_ptr<const Codec> &codec)
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        m_codecs[compression] = codec;
+    }
+
+    /** Unregister the codec of a compression method */
+    void unregisterCodec(CompressionType compression)
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        m_codecs.erase(compression);
+    }
+
+    /** Return the codec of a compression method, or nullptr if none is
+     * registered */
+    std::shared_ptr<const Codec> codec(CompressionType compression) const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const auto iter = m_codecs.find(compression);
+        return iter != m_codecs.end() ? iter->second : nullptr;
+    }
+
+  private:
+    mutable std::mutex m_mutex{};
+    std::unordered_map<CompressionType, std::shared_ptr<const Codec>>
+        m_codecs{};
+
+    CodecRegistry(const CodecRegistry &) = delete;
+    CodecRegistry &operator=(const CodecRegistry &) = delete;
+};
+
+/** Represents a TIFF Image File Directory (IFD). */
+class Image
+{
+  public:
+    /** Constructor. Should not be called directly. Use the open() method */
+    Image(const std::shared_ptr<const ReadContext> &rc, bool isBigTIFF)
+        : m_rc(rc), m_isBigTIFF(isBigTIFF)
+    {
+    }
+
+    /** Return read context */
+    const std::shared_ptr<const ReadContext> &readContext() const
+    {
+        return m_rc;
+    }
+
+    /** Return whether the file is BigTIFF (if false, classic TIFF) */
+    inline bool isBigTIFF() const
+    {
+        return m_isBigTIFF;
+    }
+
+    /** Return if values of more than 1-byte must be byte swapped.
+     * To be only taken into account when reading pixels. Tag values are
+     * automatically byte-swapped */
+    inline bool mustByteSwap() const
+    {
+        return m_rc->mustByteSwap();
+    }
+
+    /** Return the offset of the this IFD */
+    inline uint64_t offset() const
+    {
+        return m_offset;
+    }
+
+    /** Return the offset of the next IFD (to pass to Image::open()),
+         * or 0 if there is no more */
+    inline uint64_t nextImageOffset() const
+    {
+        return m_nextImageOffset;
+    }
+
+    /** Return value of SubFileType tag */
+    inline uint32_t subFileType() const
+    {
+        return m_subFileType;
+    }
+
+    /** Return width of the image in pixels */
+    inline uint32_t width() const
+    {
+        return m_width;
+    }
+
+    /** Return height of the image in pixels */
+    inline uint32_t height() const
+    {
+        return m_height;
+    }
+
+    /** Return number of bits per sample */
+    inline uint32_t bitsPerSample() const
+    {
+        return m_bitsPerSample;
+    }
+
+    /** Return number of samples (a.k.a. channels, bands) per pixel */
+    inline uint32_t samplesPerPixel() const
+    {
+        return m_samplesPerPixel;
+    }
+
+    /** Return planar configuration */
+    inline PlanarConfigurationType planarConfiguration() const
+    {
+        return m_planarConfiguration;
+    }
+
+    /** Return planar configuration */
+    inline PhotometricInterpretationType photometricInterpretation() const
+    {
+        return m_photometricInterpretation;
+    }
+
+    /** Return compression method used */
+    inline CompressionType compression() const
+    {
+        return m_compression;
+    }
+
+    /** Return predictor value (used for Deflate, LZW, ZStd, etc. compression) */
+    inline uint32_t predictor() const
+    {
+        return m_predictor;
+    }
+
+    /** Return sample format */
+    inline SampleFormatType sampleFormat() const
+    {
+        return m_sampleFormat;
+    }
+
+    /** Return the number of rows per strip */
+    inline uint32_t rowsPerStrip() const
+    {
+        return m_rowsPerStrip;
+    }
+
+    /** Return the sanitized number of rows per strip */
+    inline uint32_t rowsPerStripSanitized() const
+    {
+        return std::min(m_rowsPerStrip, m_height);
+    }
+
+    /** Return the number of strips/tiles.
+     * Return 0 if inconsistent values between ByteCounts and Offsets arrays. */
+    inline uint64_t strileCount() const
+    {
+        return m_strileCount;
+    }
+
+    /** Return whether image is tiled */
+    inline bool isTiled() const
+    {
+        return m_isTiled;
+    }
+
+    /** Return tile width */
+    inline uint32_t tileWidth() const
+    {
+        return m_tileWidth;
+    }
+
+    /** Return tile width */
+    inline uint32_t tileHeight() const
+    {
+        return m_tileHeight;
+    }
+
+    /** Return number of tiles per row */
+    uint32_t tilesPerRow() const
+    {
+        if (m_tileWidth > 0)
+        {
+            return uint32_t((uint64_t(m_width) + m_tileWidth - 1) /
+                            m_tileWidth);
+        }
+        return 0;
+    }
+
+    /** Return number of tiles per column */
+    uint32_t tilesPerCol() const
+    {
+        if (m_tileHeight > 0)
+        {
+            return uint32_t((uint64_t(m_height) + m_tileHeight - 1) /
+                            m_tileHeight);
+        }
+        return 0;
+    }
+
+    /** Convert a tile coordinate (xtile, ytile, bandIdx) to a flat index */
+    uint64_t tileCoordinateToIdx(uint32_t xtile, uint32_t ytile,
+                                 uint32_t bandIdx, bool &ok) const
+    {
+        if (m_isTiled && m_tileWidth > 0 && m_tileHeight > 0)
+        {
+            const uint32_t lTilesPerRow = tilesPerRow();
+            const uint32_t lTilesPerCol = tilesPerCol();
+            if (xtile >= lTilesPerRow || ytile >= lTilesPerCol)
+            {
+                ok = false;
+                return 0;
+            }
+            uint64_t idx = uint64_t(ytile) * lTilesPerRow + xtile;
+            if (bandIdx &&
+                m_planarConfiguration == PlanarConfiguration::Separate)
+            {
+                const uint64_t lTotalTiles =
+                    uint64_t(lTilesPerCol) * lTilesPerRow;
+                if (lTotalTiles >
+                    std::numeric_limits<uint64_t>::max() / bandIdx)
+                {
+                    ok = false;
+                    return 0;
+                }
+                idx += bandIdx * lTotalTiles;
+            }
+            return idx;
+        }
+        ok = false;
+        return 0;
+    }
+
+    /** Return the offset of strip/tile of index idx */
+    uint64_t strileOffset(uint64_t idx, bool &ok) const
+    {
+        return readCachedUIntTag(m_strileOffsetsTag,
+                                 m_strileOffsetsCache.get(), idx, ok);
+    }
+
+    /** Read the offsets of count striles, starting at index first, into out.
+     *
+     * This issues at most a single read of the underlying StripOffsets or
+     * TileOffsets array, which is then decoded in bulk. ok is set to false
+     * if the range is out of bounds or cannot be read.
+     */
+    void readStrileOffsets(uint64_t first, uint64_t count, uint64_t *out,
+                           bool &ok) const
+    {
+        readCachedUIntTagRange(m_strileOffsetsTag, m_strileOffsetsCache.get(),
+                               first, count, out, ok);
+    }
+
+    /** Return the offset of a tile from its coordinates */
+    uint64_t tileOffset(uint32_t xtile, uint32_t ytile, uint32_t bandIdx,
+                        bool &ok) const
+    {
+        const auto idx = tileCoordinateToIdx(xtile, ytile, bandIdx, ok);
+        return ok ? strileOffset(idx, ok) : 0;
+    }
+
+    /** Return the byte count of strip/tile of index idx */
+    uint64_t strileByteCount(uint64_t idx, bool &ok) const
+    {
+        return readCachedUIntTag(m_strileByteCountsTag,
+                                 m_strileByteCountsCache.get(), idx, ok);
+    }
+
+    /** Read the byte counts of count striles, starting at index first,
+     * into out.
+     *
+     * This issues at most a single read of the underlying StripByteCounts or
+     * TileByteCounts array, which is then decoded in bulk. ok is set to false
+     * if the range is out of bounds or cannot be read.
+     */
+    void readStrileByteCounts(uint64_t first, uint64_t count, uint64_t *out,
+                              bool &ok) const
+    {
+        readCachedUIntTagRange(m_strileByteCountsTag,
+                               m_strileByteCountsCache.get(), first, count,
+                               out, ok);
+    }
+
+    /** Return the offset of a tile from its coordinates */
+    uint64_t tileByteCount(uint32_t xtile, uint32_t ytile, uint32_t bandIdx,
+                           bool &ok) const
+    {
+        const auto idx = tileCoordinateToIdx(xtile, ytile, bandIdx, ok);
+        return ok ? strileByteCount(idx, ok) : 0;
+    }
+
+    /** Read the raw (possibly compressed) data of the strip/tile of index idx
+     * into buffer, which is resized to its byte count.
+     *
+     * ok is set to false if idx is out of range, or if the data is beyond the
+     * end of the file or cannot be read. Sparse striles give an empty buffer.
+     */
+    void readStrile(uint64_t idx, std::vector<uint8_t> &buffer, bool &ok) const
+    {
+        uint64_t offset = 0;
+        uint64_t byteCount = 0;
+        if (!getStrileLocation(idx, offset, byteCount))
+        {
+            ok = false;
+            buffer.clear();
+            return;
+        }
+        buffer.resize(static_cast<size_t>(byteCount));
+        if (byteCount)
+            m_rc->read(offset, buffer.size(), buffer.data(), ok);
+    }
+
+    /** Read the raw (possibly compressed) data of the count striles of
+     * index indices[0] to indices[count - 1], and call
+     * callback(uint64_t idx, const uint8_t *data, size_t size) for each of
+     * them, in order of increasing file offset. data is only valid during
+     * the call, and is nullptr for sparse striles.
+     *
+     * Striles whose data are adjacent in the file are fetched with a single
+     * read, in a buffer of the bufferPool() of the read context. ok is set
+     * to false if a strile cannot be read, in which case callback is not
+     * called for it.
+     */
+    template <class Callback>
+    void readStriles(const uint64_t *indices, size_t count,
+                     Callback &&callback, bool &ok) const
+    {
+        std::vector<StrileRead> striles;
+        striles.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            StrileRead strile;
+            strile.idx = indices[i];
+            if (getStrileLocation(strile.idx, strile.offset, strile.byteCount))
+                striles.push_back(strile);
+            else
+                ok = false;
+        }
+        readStrileLocations(striles, std::forward<Callback>(callback), ok);
+    }
+
+    /** Same as above, for count striles whose offset and byte count are
+     * already known, such as the striles of a ReadPlan returned by
+     * planWindowRead(). Their location is checked, but not looked up again.
+     */
+    template <class Callback>
+    void readStriles(const StrileRead *striles, size_t count,
+                     Callback &&callback, bool &ok) const
+    {
+        std::vector<StrileRead> checkedStriles;
+        checkedStriles.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            StrileRead strile = striles[i];
+            if (strile.idx < m_strileCount &&
+                checkStrileLocation(strile.offset, strile.byteCount))
+                checkedStriles.push_back(strile);
+            else
+                ok = false;
+        }
+        readStrileLocations(checkedStriles, std::forward<Callback>(callback),
+                            ok);
+    }
+
+    /** Return the striles needed to read the window of width x height pixels
+     * starting at column x and line y, for the bandCount bands of the bands
+     * array (or all bands if bandCount == 0), and the file ranges to read
+     * to get their data.
+     *
+     * Striles whose data are separated by at most maxGap bytes are merged
+     * into a single range. ok is set to false if the window or a band is out
+     * of bounds, if the image has no samples (e.g. missing SamplesPerPixel
+     * tag), or if the strile arrays cannot be read.
+     */
+    ReadPlan planWindowRead(uint32_t x, uint32_t y, uint32_t width,
+                            uint32_t height, const uint32_t *bands,
+                            size_t bandCount, uint64_t maxGap, bool &ok) const
+    {
+        ReadPlan plan;
+        if (width == 0 || height == 0 || x >= m_width ||
+            width > m_width - x || y >= m_height || height > m_height - y ||
+            m_strileCount == 0 || m_samplesPerPixel == 0)
+        {
+            ok = false;
+            return plan;
+        }
+        for (size_t i = 0; i < bandCount; ++i)
+        {
+            if (bands[i] >= m_samplesPerPixel)
+            {
+                ok = false;
+                return plan;
+            }
+        }
+
+        // With separate planes, each band has its own striles
+        std::vector<uint32_t> planes;
+        if (m_planarConfiguration == PlanarConfiguration::Separate)
+        {
+            if (bandCount == 0)
+            {
+                for (uint32_t i = 0; i < m_samplesPerPixel; ++i)
+                    planes.push_back(i);
+            }
+            else
+            {
+                planes.assign(bands, bands + bandCount);
+                std::sort(planes.begin(), planes.end());
+                planes.erase(std::unique(planes.begin(), planes.end()),
+                             planes.end());
+            }
+        }
+        else
+        {
+            planes.push_back(0);
+        }
+
+        uint32_t blockWidth;
+        uint32_t blockHeight;
+        uint64_t blocksPerRow;
+        uint64_t blocksPerPlane;
+        if (!getBlockGeometry(blockWidth, blockHeight, blocksPerRow,
+                              blocksPerPlane) ||
+            planes.back() >= m_strileCount / blocksPerPlane)
+        {
+            ok = false;
+            return plan;
+        }
+
+        const uint32_t firstBlockX = x / blockWidth;
+        const uint32_t lastBlockX = (x + width - 1) / blockWidth;
+        const uint32_t firstBlockY = y / blockHeight;
+        const uint32_t lastBlockY = (y + height - 1) / blockHeight;
+        const size_t blockCountX = lastBlockX - firstBlockX + 1;
+        std::vector<uint64_t> offsets(blockCountX);
+        std::vector<uint64_t> byteCounts(blockCountX);
+        for (uint32_t plane : planes)
+        {
+            for (uint32_t blockY = firstBlockY; blockY <= lastBlockY; ++blockY)
+            {
+                // Striles of a row of blocks are consecutive
+                const uint64_t first = plane * blocksPerPlane +
+                                       blockY * blocksPerRow + firstBlockX;
+                readStrileOffsets(first, blockCountX, offsets.data(), ok);
+                readStrileByteCounts(first, blockCountX, byteCounts.data(),
+                                     ok);
+                if (!ok)
+                {
+                    plan.striles.clear();
+                    return plan;
+                }
+                for (size_t i = 0; i < blockCountX; ++i)
+                {
+                    StrileRead strile;
+                    strile.idx = first + i;
+                    strile.offset = offsets[i];
+                    strile.byteCount = byteCounts[i];
+                    plan.striles.push_back(strile);
+                }
+            }
+        }
+
+        const auto hasData = [](const StrileRead &strile)
+        { return strile.offset != 0 && strile.byteCount != 0; };
+        std::sort(plan.striles.begin(), plan.striles.end(),
+                  [&hasData](const StrileRead &a, const StrileRead &b)
+                  {
+                      if (hasData(a) != hasData(b))
+                          return !hasData(a);
+                      if (a.offset != b.offset)
+                          return a.offset < b.offset;
+                      return a.idx < b.idx;
+                  });
+
+        for (size_t i = 0; i < plan.striles.size(); ++i)
+        {
+            const StrileRead &strile = plan.striles[i];
+            if (!hasData(strile))
+                continue;
+            if (strile.byteCount >
+                std::numeric_limits<uint64_t>::max() - strile.offset)
+            {
+                ok = false;
+                plan.striles.clear();
+                plan.ranges.clear();
+                return plan;
+            }
+            const uint64_t end = strile.offset + strile.byteCount;
+            if (!plan.ranges.empty())
+            {
+                FileRange &range = plan.ranges.back();
+                const uint64_t rangeEnd = range.offset + range.size;
+                if (strile.offset <= rangeEnd ||
+                    strile.offset - rangeEnd <= maxGap)
+                {
+                    range.size = std::max(rangeEnd, end) - range.offset;
+                    ++range.strileCount;
+                    continue;
+                }
+            }
+            FileRange range;
+            range.offset = strile.offset;
+            range.size = strile.byteCount;
+            range.firstStrile = i;
+            range.strileCount = 1;
+            plan.ranges.push_back(range);
+        }
+        return plan;
+    }
+
+    /** Read the window of width x height pixels starting at column x and
+     * line y, for the bandCount bands of the bands array (or all bands if
+     * bandCount == 0), into dstBuffer.
+     *
+     * The value of the k-th requested band of pixel (i, j) of the window is
+     * written in host byte order at byte offset
+     * j * dstLineStride + i * dstPixelStride + k * S of dstBuffer, where S
+     * is the sample size: bitsPerSample() / 8 for 8, 16, 32 or 64 bits per
+     * sample. Other bit depths up to 32 bits are unpacked with
+     * unpackSamples() to unsigned integers of S = 1 (up to 8 bits), 2 (up
+     * to 16 bits) or 4 bytes. Striles without data (sparse files) give zero
+     * values.
+     *
+     * Compressed striles are decoded with decodeStrile(). ok is set to false
+     * if the image is not supported, if the window or a band is out of
+     * bounds, or if the data cannot be read or decoded.
+     */
+    void readWindow(uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                    const uint32_t *bands, size_t bandCount, void *dstBuffer,
+                    size_t dstPixelStride, size_t dstLineStride,
+                    bool &ok) const
+    {
+        if (m_bitsPerSample == 0 ||
+            (m_bitsPerSample > 32 && m_bitsPerSample != 64))
+        {
+            ok = false;
+            return;
+        }
+        const ReadPlan plan = planWindowRead(x, y, width, height, bands,
+                                             bandCount, 0, ok);
+        if (!ok)
+            return;
+
+        std::vector<uint32_t> bandList;
+        if (bandCount == 0)
+        {
+            for (uint32_t i = 0; i < m_samplesPerPixel; ++i)
+                bandList.push_back(i);
+        }
+        else
+        {
+            bandList.assign(bands, bands + bandCount);
+        }
+
+        uint32_t blockWidth = 0;
+        uint32_t blockHeight = 0;
+        uint64_t blocksPerRow = 0;
+        uint64_t blocksPerPlane = 0;
+        getBlockGeometry(blockWidth, blockHeight, blocksPerRow,
+                         blocksPerPlane);
+
+        const bool separate =
+            m_planarConfiguration == PlanarConfiguration::Separate;
+        // Samples of other bit depths are packed, and unpacked row by row
+        const bool packed = m_bitsPerSample != 8 && m_bitsPerSample != 16 &&
+                            m_bitsPerSample != 32 && m_bitsPerSample != 64;
+        const size_t sampleSize = m_bitsPerSample <= 8    ? 1
+                                  : m_bitsPerSample <= 16 ? 2
+                                  : m_bitsPerSample <= 32 ? 4
+                                                          : 8;
+        const size_t stride = separate ? 1 : m_samplesPerPixel;
+        const size_t srcPixelStride = stride * sampleSize;
+        const uint64_t srcLineStride =
+            packed ? (uint64_t(blockWidth) * stride * m_bitsPerSample + 7) / 8
+                   : uint64_t(blockWidth) * srcPixelStride;
+        const bool swap = !packed && m_rc->mustByteSwap() && sampleSize > 1;
+        // As in undoPredictorAndByteSwap(), uncompressed 24-bit samples are
+        // stored in the byte order of the file
+        const bool swapPacked = m_bitsPerSample == 24 &&
+                                m_rc->mustByteSwap() != isHostLittleEndian();
+
+        // Whole rows of striles can be copied at once if the requested bands
+        // and the destination pixel layout match the ones of the striles
+        bool sameLayout = dstPixelStride == srcPixelStride;
+        if (separate)
+        {
+            sameLayout = sameLayout && bandList.size() == 1;
+        }
+        else
+        {
+            sameLayout = sameLayout && bandList.size() == m_samplesPerPixel;
+            for (size_t k = 0; sameLayout && k < bandList.size(); ++k)
+                sameLayout = bandList[k] == k;
+        }
+
+        uint8_t *const dst = static_cast<uint8_t *>(dstBuffer);
+        static const uint8_t zeros[8] = {0};
+        // Resolved once, rather than for each strile
+        const auto codec = compressionCodec();
+        std::vector<uint8_t> decoded = m_rc->bufferPool().acquire(0);
+        std::vector<uint8_t> unpacked = m_rc->bufferPool().acquire(
+            packed ? (width * stride + 8) * sampleSize : 0);
+        std::vector<uint8_t> swapped = m_rc->bufferPool().acquire(
+            swapPacked ? (width * stride + 8) * 3 : 0);
+        readStriles(
+            plan.striles.data(), plan.striles.size(),
+            [&](uint64_t idx, const uint8_t *data, size_t size)
+            {
+                const uint64_t plane = idx / blocksPerPlane;
+                const uint64_t blockIdx = idx % blocksPerPlane;
+                const uint32_t blockX =
+                    static_cast<uint32_t>(blockIdx % blocksPerRow) *
+                    blockWidth;
+                const uint32_t blockY =
+                    static_cast<uint32_t>(blockIdx / blocksPerRow) *
+                    blockHeight;
+
+                // Intersection of the strile with the window
+                const uint32_t x0 = std::max(x, blockX);
+                const uint32_t x1 = static_cast<uint32_t>(
+                    std::min(uint64_t(x) + width,
+                             uint64_t(blockX) + blockWidth));
+                const uint32_t y0 = std::max(y, blockY);
+                const uint32_t y1 = static_cast<uint32_t>(
+                    std::min(uint64_t(y) + height,
+                             uint64_t(blockY) + blockHeight));
+                const size_t pixelCount = x1 - x0;
+
+                // Uncompressed striles, including packed ones, are used
+                // directly
+                const bool decode =
+                    data && m_compression != Compression::None;
+                if (decode)
+                {
+                    bool decodeOk = true;
+                    decodeStrileData(idx, codec.get(), data, size, decoded,
+                                     decodeOk);
+                    if (!decodeOk)
+                    {
+                        ok = false;
+                        return;
+                    }
+                    data = decoded.data();
+                    size = decoded.size();
+                }
+                const bool swapStrile = swap && !decode;
+                const bool swapPackedStrile = swapPacked && !decode;
+
+                // Range of the needed samples in a row of the strile. To
+                // unpack packed samples from a byte boundary, their first
+                // sample is rounded down to a multiple of 8.
+                const size_t firstSample = (x0 - blockX) * stride;
+                const size_t endSample = (x1 - blockX) * stride;
+                const size_t firstPackedSample = firstSample / 8 * 8;
+
+                size_t srcLineStep = 0;
+                if (data)
+                {
+                    // Strips at the bottom of the image and tiles at the
+                    // edges may be truncated to the last needed row
+                    const uint64_t requiredSize =
+                        (y1 - 1 - blockY) * srcLineStride +
+                        (packed ? (uint64_t(endSample) * m_bitsPerSample + 7) /
+                                      8
+                                : uint64_t(endSample) * sampleSize);
+                    if (size < requiredSize)
+                    {
+                        ok = false;
+                        return;
+                    }
+                    data += static_cast<size_t>(
+                        (y0 - blockY) * srcLineStride +
+                        (packed ? firstPackedSample / 8 * m_bitsPerSample
+                                : firstSample * sampleSize));
+                    srcLineStep = static_cast<size_t>(srcLineStride);
+                }
+
+                uint8_t *dstLine = dst + (y0 - y) * dstLineStride +
+                                   (x0 - x) * dstPixelStride;
+                for (uint32_t row = y0; row < y1; ++row)
+                {
+                    const uint8_t *line = data;
+                    if (data && packed)
+                    {
+                        const uint8_t *packedLine = data;
+                        if (swapPackedStrile)
+                        {
+                            const size_t lineSize =
+                                (endSample - firstPackedSample) * 3;
+                            std::memcpy(swapped.data(), data, lineSize);
+                            for (size_t i = 0; i < lineSize; i += 3)
+                                std::swap(swapped[i], swapped[i + 2]);
+                            packedLine = swapped.data();
+                        }
+                        detail::unpackSamplesOfSize(
+                            packedLine, endSample - firstPackedSample,
+                            m_bitsPerSample, unpacked.data(), sampleSize);
+                        line = unpacked.data() +
+                               (firstSample - firstPackedSample) * sampleSize;
+                    }
+                    if (sameLayout)
+                    {
+                        const size_t lineSize = pixelCount * srcPixelStride;
+                        if (!line)
+                        {
+                            std::memset(dstLine, 0, lineSize);
+                        }
+                        else
+                        {
+                            std::memcpy(dstLine, line, lineSize);
+                            if (swapStrile)
+                            {
+                                detail::byteSwapSamples(
+                                    dstLine, lineSize / sampleSize,
+                                    sampleSize);
+                            }
+                        }
+                    }
+                    else
+                    {
+                        for (size_t k = 0; k < bandList.size(); ++k)
+                        {
+                            if (separate && bandList[k] != plane)
+                                continue;
+                            const uint8_t *src =
+                                line ? line + (separate ? 0
+                                                        : bandList[k] *
+                                                              sampleSize)
+                                     : zeros;
+                            detail::copySamples(
+                                dstLine + k * sampleSize, dstPixelStride,
+                                src, line ? srcPixelStride : 0, pixelCount,
+                                sampleSize, swapStrile);
+                        }
+                    }
+                    if (data)
+                        data += srcLineStep;
+                    dstLine += dstLineStride;
+                }
+            },
+            ok);
+        m_rc->bufferPool().release(std::move(swapped));
+        m_rc->bufferPool().release(std::move(unpacked));
+        m_rc->bufferPool().release(std::move(decoded));
+    }
+
+    /** Return the size in bytes of the decoded data of the strip or tile of
+     * index idx, as returned by decodeStrile(), or 0 in case of error.
+     *
+     * This is the number of rows of the strile (which is smaller for the
+     * last strip of an image) multiplied by the size of a row of tile or
+     * image width, rounded up to a whole byte.
+     */
+    size_t decodedStrileSize(uint64_t idx) const
+    {
+        size_t rowCount = 0;
+        size_t rowSize = 0;
+        if (!getDecodedStrileLayout(idx, rowCount, rowSize))
+            return 0;
+        return rowCount * rowSize;
+    }
+
+    /** Read and decode the data of the strip or tile of index idx into dst,
+     * which is resized to decodedStrileSize(idx).
+     *
+     * Compressed data is decoded with the codec registered for
+     * compression() in CodecRegistry::global(), and the predictor is then
+     * undone. Samples of 16, 32 or 64 bits are returned in host byte order.
+     * Samples of other bit depths are returned packed most significant bit
+     * first, each row starting on a byte boundary, and can be expanded with
+     * unpackSamples(). Striles without data (sparse files) are filled with
+     * zeros.
+     *
+     * ok is set to false if idx is out of range, if no codec is registered
+     * for the compression method, if the predictor is not supported for the
+     * bit depth, or if the data cannot be read or decoded.
+     */
+    void decodeStrile(uint64_t idx, std::vector<uint8_t> &dst, bool &ok) const
+    {
+        uint64_t offset = 0;
+        uint64_t byteCount = 0;
+        if (!getStrileLocation(idx, offset, byteCount))
+        {
+            ok = false;
+            dst.clear();
+            return;
+        }
+        const auto codec = compressionCodec();
+        if (byteCount == 0)
+        {
+            decodeStrileData(idx, codec.get(), nullptr, 0, dst, ok);
+            return;
+        }
+        const size_t size = static_cast<size_t>(byteCount);
+        const uint8_t *data = m_rc->data(offset, size);
+        if (data)
+        {
+            decodeStrileData(idx, codec.get(), data, size, dst, ok);
+            return;
+        }
+        std::vector<uint8_t> buffer = m_rc->bufferPool().acquire(size);
+        bool readOk = true;
+        m_rc->read(offset, size, buffer.data(), readOk);
+        if (readOk)
+            decodeStrileData(idx, codec.get(), buffer.data(), size, dst, ok);
+        else
+            ok = false;
+        m_rc->bufferPool().release(std::move(buffer));
+    }
+
+    /** Return the list of tags */
+    inline const std::vector<TagEntry> &tags() const
+    {
+        return m_tags;
+    }
+
+    /** Return the (first) tag corresponding to a code, or nullptr if not found.
+     * Lookup is done by binary search, in O(log(number of tags)) */
+    const TagEntry *tag(TagCodeType tagCode) const
+    {
+        if (m_sortedTagIndices.empty())
+        {
+            // Tags are sorted by increasing code, as required by the spec
+            const auto iter = std::lower_bound(
+                m_tags.begin(), m_tags.end(), tagCode,
+                [](const TagEntry &entry, TagCodeType code)
+                { return entry.tag < code; });
+            if (iter != m_tags.end() && iter->tag == tagCode)
+                return &(*iter);
+        }
+        else
+        {
+            const auto iter = std::lower_bound(
+                m_sortedTagIndices.begin(), m_sortedTagIndices.end(), tagCode,
+                [this](uint16_t idx, TagCodeType code)
+                { return m_tags[idx].tag < code; });
+            if (iter != m_sortedTagIndices.end() &&
+                m_tags[*iter].tag == tagCode)
+            {
+                return &m_tags[*iter];
+            }
+        }
+        return nullptr;
+    }
+
+    /** Read an ASCII tag as a string */
+    std::string readTagAsString(const TagEntry &tag, bool &ok) const
+    {
+        if (tag.type == TagType::ASCII)
+        {
+            if (tag.value_offset)
+            {
+                if LIBERTIFF_CONSTEXPR (sizeof(tag.count) > sizeof(size_t))
+                {
+                    // "- 1" not strictly necessary, but pleases Coverity Scan
+                    if (tag.count > std::numeric_limits<size_t>::max() - 1)
+                    {
+                        ok = false;
+                        return std::string();
+                    }
+                }
+                return readContext()->readString(
+                    tag.value_offset, static_cast<size_t>(tag.count), ok);
+            }
+            if (tag.count)
+            {
+                std::string res(tag.charValues.data(),
+                                static_cast<size_t>(tag.count));
+                if (res.back() == 0)
+                    res.pop_back();
+                return res;
+            }
+        }
+        ok = false;
+        return std::string();
+    }
+
+    /** Read a numeric tag as a vector. You must use a type T which is
+     * consistent with the tag.type value. For example, if
+     * tag.type == libertiff::TagType::Short, T must be uint16_t.
+     * libertiff::TagType::Undefined must be read with T=uint8_t.
+     */
+    template <class T>
+    std::vector<T> readTagAsVector(const TagEntry &tag, bool &ok) const
+    {
+        return detail::readTagAsVector<T>(*(m_rc.get()), tag, ok);
+    }
+
+    /** Read the values of all the tags of a batch, issuing a single
+     * FileReader::readMulti() call for out-of-line values.
+     *
+     * ok is set to false if any of the requests failed, in which case the
+     * corresponding containers are empty.
+     */
+    void readTags(const TagReadBatch &batch, bool &ok) const
+    {
+        std::vector<FileReader::Range> ranges;
+        std::vector<const TagReadBatch::Request *> pendingRequests;
+        for (const auto &request : batch.m_requests)
+        {
+            FileReader::Range range{0, 0, nullptr};
+            if (request.prepare(*(request.tag), request.container, range, ok))
+            {
+                ranges.push_back(range);
+                pendingRequests.push_back(&request);
+            }
+        }
+        if (ranges.empty())
+            return;
+
+        bool readOk = true;
+        m_rc->readMulti(ranges.data(), ranges.size(), readOk);
+        for (const auto *request : pendingRequests)
+        {
+            if (readOk)
+                request->finish(*(m_rc.get()), request->container);
+            else
+                request->clear(request->container);
+        }
+        if (!readOk)
+            ok = false;
+    }
+
+    /** Returns a new Image instance for the IFD starting at offset imageOffset.
+     *
+     * visitedImageOffsets and indexInChain are used to detect cycles when
+     * following the chain of IFDs with next(). If visitedImageOffsets is
+     * null, a new chain starting at imageOffset is created.
+     */
+    template <bool isBigTIFF>
+    static std::unique_ptr<const Image>
+    open(const std::shared_ptr<const ReadContext> &rc,
+         const uint64_t imageOffset,
+         const std::shared_ptr<VisitedImageOffsets> &visitedImageOffsets =
+             nullptr,
+         uint64_t indexInChain = 0)
+    {
+        if (imageOffset == 0)
+            return nullptr;
+
+        auto image = LIBERTIFF_NS::make_unique<Image>(rc, isBigTIFF);
+
+        image->m_offset = imageOffset;
+        image->m_indexInChain = indexInChain;
+        image->m_visitedImageOffsets =
+            visitedImageOffsets ? visitedImageOffsets
+                                : std::make_shared<VisitedImageOffsets>();
+
+        // To prevent infinite looping on corrupted files
+        if (!image->m_visitedImageOffsets->visit(imageOffset, indexInChain))
+            return nullptr;
+
+        bool ok = true;
+        int tagCount = 0;
+        uint64_t offset = imageOffset;
+        if LIBERTIFF_CONSTEXPR (isBigTIFF)
+        {
+            // To prevent unsigned integer overflows in later additions. The
+            // theoretical max should be much closer to UINT64_MAX, but half of
+            // it is already more than needed in practice :-)
+            if (offset >= std::numeric_limits<uint64_t>::max() / 2)
+                return nullptr;
+
+            const auto tagCount64Bit = rc->read<uint64_t>(offset, ok);
+            // Artificially limit to the same number of entries as ClassicTIFF
+            if (tagCount64Bit > std::numeric_limits<uint16_t>::max())
+                return nullptr;
+            tagCount = static_cast<int>(tagCount64Bit);
+            offset += sizeof(uint64_t);
+        }
+        else
+        {
+            tagCount = rc->read<uint16_t>(offset, ok);
+            offset += sizeof(uint16_t);
+        }
+        if (!ok)
+            return nullptr;
+
+        // Fetch the whole directory (entries + next IFD offset) in a single
+        // read, and decode entries from that in-memory buffer.
+        constexpr size_t entrySize = isBigTIFF ? 20 : 12;
+        constexpr size_t nextImageOffsetSize =
+            isBigTIFF ? sizeof(uint64_t) : sizeof(uint32_t);
+        const size_t entriesSize = static_cast<size_t>(tagCount) * entrySize;
+        // If the file can be accessed directly in memory, decode entries
+        // from there without any copy.
+        std::vector<uint8_t> buffer;
+        bool nextImageOffsetOk = true;
+        const uint8_t *directoryData =
+            rc->data(offset, entriesSize + nextImageOffsetSize);
+        if (!directoryData)
+        {
+            buffer.resize(entriesSize + nextImageOffsetSize);
+            rc->read(offset, buffer.size(), buffer.data(), nextImageOffsetOk);
+            if (!nextImageOffsetOk)
+            {
+                // Truncated file: the next IFD offset might be missing while
+                // the entries are still available.
+                if (entriesSize > 0)
+                    rc->read(offset, entriesSize, buffer.data(), ok);
+                if (!ok)
+                    return nullptr;
+            }
+            directoryData = buffer.data();
+        }
+
+        image->m_tags.reserve(tagCount);
+        assert(tagCount <= 65535);
+        for (int i = 0; i < tagCount; ++i)
+        {
+            const uint8_t *entryData = directoryData + i * entrySize;
+            TagEntry entry;
+
+            // Read tag code
+            entry.tag = rc->readFromMemory<uint16_t>(entryData);
+
+            // Read tag data type
+            entry.type =
+                rc->readFromMemory<uint16_t>(entryData + sizeof(uint16_t));
+
+            // Read number of values
+            const uint8_t *countData = entryData + 2 * sizeof(uint16_t);
+            if LIBERTIFF_CONSTEXPR (isBigTIFF)
+            {
+                entry.count = rc->readFromMemory<uint64_t>(countData);
+            }
+            else
+            {
+                entry.count = rc->readFromMemory<uint32_t>(countData);
+            }
+
+            uint32_t singleValue = 0;
+            bool singleValueFitsInUInt32 = false;
+            if (entry.count)
+            {
+                if LIBERTIFF_CONSTEXPR (isBigTIFF)
+                {
+                    image->ParseTagEntryDataOrOffset<uint64_t>(
+                        entry, countData + sizeof(uint64_t),
+                        singleValueFitsInUInt32, singleValue, ok);
+                }
+                else
+                {
+                    image->ParseTagEntryDataOrOffset<uint32_t>(
+                        entry, countData + sizeof(uint32_t),
+                        singleValueFitsInUInt32, singleValue, ok);
+                }
+            }
+            if (!ok)
+                return nullptr;
+
+            image->processTag(entry, singleValueFitsInUInt32, singleValue);
+            image->processPerSampleTag(entry);
+
+            image->m_tags.push_back(entry);
+        }
+
+        image->finalTagProcessing();
+
+        if (nextImageOffsetOk)
+        {
+            if LIBERTIFF_CONSTEXPR (isBigTIFF)
+                image->m_nextImageOffset =
+                    rc->readFromMemory<uint64_t>(directoryData + entriesSize);
+            else
+                image->m_nextImageOffset =
+                    rc->readFromMemory<uint32_t>(directoryData + entriesSize);
+        }
+
+        image->m_openFunc = open<isBigTIFF>;
+
+        return std::unique_ptr<const Image>(image.release());
+    }
+
+    /** Returns a new Image instance for the IFD starting at offset
+     * imageOffset, or nullptr if it is one of alreadyVisitedImageOffsets.
+     *
+     * This is the signature used before VisitedImageOffsets was introduced,
+     * kept for compatibility. The offsets are recorded as the previous IFDs
+     * of the chain of the returned Image, so that next() stops if it finds
+     * one of them again. Compare and Alloc are template parameters so that
+     * calls passing {} select the other overload.
+     */
+    template <bool isBigTIFF, class Compare, class Alloc>
+    static std::unique_ptr<const Image>
+    open(const std::shared_ptr<const ReadContext> &rc,
+         const uint64_t imageOffset,
+         const std::set<uint64_t, Compare, Alloc> &alreadyVisitedImageOffsets)
+    {
+        auto visitedImageOffsets = std::make_shared<VisitedImageOffsets>();
+        uint64_t indexInChain = 0;
+        for (uint64_t offset : alreadyVisitedImageOffsets)
+            visitedImageOffsets->visit(offset, indexInChain++);
+        return open<isBigTIFF>(rc, imageOffset, visitedImageOffsets,
+                               indexInChain);
+    }
+
+    /** Returns a new Image instance at the next IFD, or nullptr if there is none */
+    std::unique_ptr<const Image> next() const
+    {
+        return m_openFunc(m_rc, m_nextImageOffset, m_visitedImageOffsets,
+                          m_indexInChain + 1);
+    }
+
+    /** Return the offsets of the SubIFDs of this image (SubIFDs tag), or an
+     * empty array if there are none.
+     */
+    std::vector<uint64_t> subIFDOffsets(bool &ok) const
+    {
+        std::vector<uint64_t> offsets;
+        const TagEntry *tag = this->tag(TagCode::SubIFDs);
+        if (!tag)
+            return offsets;
+
+        // SubIFDs are of type IFD or IFD8, or Long or Long8 for older writers
+        TagEntry uintTag(*tag);
+        if (uintTag.type == TagType::IFD)
+            uintTag.type = TagType::Long;
+        else if (uintTag.type == TagType::IFD8)
+            uintTag.type = TagType::Long8;
+        // Protect against absurd counts on corrupted files
+        if (uintTag.count > m_rc->size() / sizeof(uint32_t))
+        {
+            ok = false;
+            return offsets;
+        }
+        offsets.resize(static_cast<size_t>(uintTag.count));
+        readUIntTagRange(&uintTag, 0, uintTag.count, offsets.data(), ok);
+        if (!ok)
+            offsets.clear();
+        return offsets;
+    }
+
+    /** Returns a new Image instance for the SubIFD at offset subIFDOffset
+     * (typically one of the values of subIFDOffsets()), or nullptr if it
+     * cannot be opened.
+     *
+     * next() on the returned image follows the chain of that SubIFD.
+     */
+    std::unique_ptr<const Image> openSubIFD(uint64_t subIFDOffset) const
+    {
+        return m_openFunc(m_rc, subIFDOffset, nullptr, 0);
+    }
+
+  private:
+    const std::shared_ptr<const ReadContext> m_rc;
+    std::unique_ptr<const Image> (*m_openFunc)(
+        const std::shared_ptr<const ReadContext> &, const uint64_t,
+        const std::shared_ptr<VisitedImageOffsets> &, uint64_t) = nullptr;
+
+    std::shared_ptr<VisitedImageOffsets> m_visitedImageOffsets{};
+    uint64_t m_indexInChain = 0;
+    uint64_t m_offset = 0;
+    uint64_t m_nextImageOffset = 0;
+    uint32_t m_subFileType = 0;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_bitsPerSample = 0;
+    uint32_t m_samplesPerPixel = 0;
+    uint32_t m_rowsPerStrip = 0;
+    CompressionType m_compression = Compression::None;
+    SampleFormatType m_sampleFormat = SampleFormat::UnsignedInt;
+    PlanarConfigurationType m_planarConfiguration =
+        PlanarConfiguration::Contiguous;
+    PhotometricInterpretationType m_photometricInterpretation =
+        PhotometricInterpretation::MinIsBlack;
+    uint32_t m_predictor = 0;
+
+    const bool m_isBigTIFF;
+    bool m_isTiled = false;
+    uint32_t m_tileWidth = 0;
+    uint32_t m_tileHeight = 0;
+    uint64_t m_strileCount = 0;
+
+    std::vector<TagEntry> m_tags{};
+    // Indices of m_tags sorted by increasing tag code. Only set if m_tags
+    // is not already sorted
+    std::vector<uint16_t> m_sortedTagIndices{};
+    const TagEntry *m_strileOffsetsTag = nullptr;
+    const TagEntry *m_strileByteCountsTag = nullptr;
+    // Only allocated for out-of-line strile arrays
+    std::unique_ptr<detail::UIntArrayCache> m_strileOffsetsCache{};
+    std::unique_ptr<detail::UIntArrayCache> m_strileByteCountsCache{};
+
+    Image(const Image &) = delete;
+    Image &operator=(const Image &) = delete;
+
+    friend class TiffDocument;
+
+    /** Also add the memory of the strile array pages loaded from now on to
+     * counter */
+    void setMemoryUsageCounter(std::atomic<size_t> *counter) const
+    {
+        if (m_strileOffsetsCache)
+            m_strileOffsetsCache->setMemoryUsageCounter(counter);
+        if (m_strileByteCountsCache)
+            m_strileByteCountsCache->setMemoryUsageCounter(counter);
+    }
+
+    /** Return an estimate of the memory used by this instance, in bytes */
+    size_t memoryUsage() const
+    {
+        size_t usage = sizeof(*this) + m_tags.capacity() * sizeof(TagEntry) +
+                       m_sortedTagIndices.capacity() * sizeof(uint16_t);
+        if (m_strileOffsetsCache)
+            usage += m_strileOffsetsCache->memoryUsage();
+        if (m_strileByteCountsCache)
+            usage += m_strileByteCountsCache->memoryUsage();
+        return usage;
+    }
+
+    /** Process tag */
+    void processTag(const TagEntry &entry, bool singleValueFitsInUInt32,
+                    uint32_t singleValue)
+    {
+        if (singleValueFitsInUInt32)
+        {
+            switch (entry.tag)
+            {
+                case TagCode::SubFileType:
+                    m_subFileType = singleValue;
+                    break;
+
+                case TagCode::ImageWidth:
+                    m_width = singleValue;
+                    break;
+
+                case TagCode::ImageLength:
+                    m_height = singleValue;
+                    break;
+
+                case TagCode::Compression:
+                    m_compression = singleValue;
+                    break;
+
+                case TagCode::SamplesPerPixel:
+                    m_samplesPerPixel = singleValue;
+                    break;
+
+                case TagCode::RowsPerStrip:
+                    m_rowsPerStrip = singleValue;
+                    break;
+
+                case TagCode::PlanarConfiguration:
+                    m_planarConfiguration = singleValue;
+                    break;
+
+                case TagCode::PhotometricInterpretation:
+                    m_photometricInterpretation = singleValue;
+                    break;
+
+                case TagCode::Predictor:
+                    m_predictor = singleValue;
+                    break;
+
+                case TagCode::TileWidth:
+                    m_tileWidth = singleValue;
+                    break;
+
+                case TagCode::TileLength:
+                    m_tileHeight = singleValue;
+                    break;
+
+                default:
+                    break;
+            }
+        }
+    }
+
+    /** Process tags whose values are repeated per sample */
+    void processPerSampleTag(const TagEntry &entry)
+    {
+        if (entry.count &&
+            (entry.type == TagType::Byte || entry.type == TagType::Short ||
+             entry.type == TagType::Long))
+        {
+            // Values of those 2 tags are repeated per sample, but should be
+            // at the same value.
+            if (entry.tag == TagCode::SampleFormat)
+            {
+                bool localOk = true;
+                const auto sampleFormat =
+                    static_cast<uint32_t>(readUIntTag(&entry, 0, localOk));
+                if (localOk)
+                {
+                    m_sampleFormat = sampleFormat;
+                }
+            }
+            else if (entry.tag == TagCode::BitsPerSample)
+            {
+                bool localOk = true;
+                const auto bitsPerSample =
+                    static_cast<uint32_t>(readUIntTag(&entry, 0, localOk));
+                if (localOk)
+                {
+                    m_bitsPerSample = bitsPerSample;
+                }
+            }
+        }
+    }
+
+    /** Final tag processing */
+    void finalTagProcessing()
+    {
+        // Index tags by code for files that do not sort them
+        const auto lessByCode = [](const TagEntry &a, const TagEntry &b)
+        { return a.tag < b.tag; };
+        if (!std::is_sorted(m_tags.begin(), m_tags.end(), lessByCode))
+        {
+            m_sortedTagIndices.resize(m_tags.size());
+            for (size_t i = 0; i < m_tags.size(); ++i)
+                m_sortedTagIndices[i] = static_cast<uint16_t>(i);
+            std::stable_sort(m_sortedTagIndices.begin(),
+                             m_sortedTagIndices.end(),
+                             [this](uint16_t a, uint16_t b)
+                             { return m_tags[a].tag < m_tags[b].tag; });
+        }
+
+        m_strileOffsetsTag = tag(TagCode::TileOffsets);
+        if (m_strileOffsetsTag)
+        {
+            m_strileByteCountsTag = tag(TagCode::TileByteCounts);
+            if (m_strileByteCountsTag &&
+                m_strileOffsetsTag->count == m_strileByteCountsTag->count)
+            {
+                m_isTiled = true;
+                m_strileCount = m_strileOffsetsTag->count;
+            }
+        }
+        else
+        {
+            m_strileOffsetsTag = tag(TagCode::StripOffsets);
+            if (m_strileOffsetsTag)
+            {
+                m_strileByteCountsTag = tag(TagCode::StripByteCounts);
+                if (m_strileByteCountsTag &&
+                    m_strileOffsetsTag->count == m_strileByteCountsTag->count)
+                {
+                    m_strileCount = m_strileOffsetsTag->count;
+                }
+            }
+        }
+
+        if (m_strileOffsetsTag &&
+            detail::UIntArrayCache::isCompatible(*m_strileOffsetsTag,
+                                                 m_isBigTIFF))
+        {
+            m_strileOffsetsCache =
+                LIBERTIFF_NS::make_unique<detail::UIntArrayCache>(
+                    *m_strileOffsetsTag);
+        }
+        if (m_strileByteCountsTag &&
+            detail::UIntArrayCache::isCompatible(*m_strileByteCountsTag,
+                                                 m_isBigTIFF))
+        {
+            m_strileByteCountsCache =
+                LIBERTIFF_NS::make_unique<detail::UIntArrayCache>(
+                    *m_strileByteCountsTag);
+        }
+    }
+
+    /** Read a value from a byte/short/long/long8 array tag, using its page
+     * cache if available */
+    uint64_t readCachedUIntTag(const TagEntry *tag,
+                               const detail::UIntArrayCache *cache,
+                               uint64_t idx, bool &ok) const
+    {
+        if (cache && idx < tag->count)
+        {
+            bool cacheOk = true;
+            const uint64_t value = cache->get(*(m_rc.get()), idx, cacheOk);
+            if (cacheOk)
+                return value;
+        }
+        return readUIntTag(tag, idx, ok);
+    }
+
+    /** Read count values, starting at index first, from a
+     * byte/short/long/long8 array tag, from its page cache if available and
+     * already loaded */
+    void readCachedUIntTagRange(const TagEntry *tag,
+                                const detail::UIntArrayCache *cache,
+                                uint64_t first, uint64_t count, uint64_t *out,
+                                bool &ok) const
+    {
+        if (cache && first <= tag->count && count <= tag->count - first &&
+            cache->copyLoadedRange(first, count, out))
+        {
+            return;
+        }
+        readUIntTagRange(tag, first, count, out, ok);
+    }
+
+    /** Return the dimensions of a strip or tile (a strip being as wide as
+     * the image), the number of striles per row of striles and the number
+     * of striles per plane */
+    bool getBlockGeometry(uint32_t &blockWidth, uint32_t &blockHeight,
+                          uint64_t &blocksPerRow,
+                          uint64_t &blocksPerPlane) const
+    {
+        if (m_isTiled)
+        {
+            blockWidth = m_tileWidth;
+            blockHeight = m_tileHeight;
+            blocksPerRow = tilesPerRow();
+        }
+        else
+        {
+            blockWidth = m_width;
+            blockHeight = rowsPerStripSanitized();
+            if (blockHeight == 0)
+                blockHeight = m_height;
+            blocksPerRow = 1;
+        }
+        if (blockWidth == 0 || blockHeight == 0)
+            return false;
+        const uint64_t blocksPerCol =
+            (uint64_t(m_height) + blockHeight - 1) / blockHeight;
+        blocksPerPlane = blocksPerRow * blocksPerCol;
+        return true;
+    }
+
+    /** Return the number of rows of the decoded data of strile idx, and the
+     * size in bytes of each row */
+    bool getDecodedStrileLayout(uint64_t idx, size_t &rowCount,
+                                size_t &rowSize) const
+    {
+        uint32_t blockWidth;
+        uint32_t blockHeight;
+        uint64_t blocksPerRow;
+        uint64_t blocksPerPlane;
+        if (idx >= m_strileCount || m_bitsPerSample == 0 ||
+            m_bitsPerSample > 64 || m_samplesPerPixel == 0 ||
+            !getBlockGeometry(blockWidth, blockHeight, blocksPerRow,
+                              blocksPerPlane))
+        {
+            return false;
+        }
+        uint64_t rows = blockHeight;
+        if (!m_isTiled)
+        {
+            const uint64_t firstRow =
+                (idx % blocksPerPlane) / blocksPerRow * blockHeight;
+            if (firstRow >= m_height)
+                return false;
+            rows = std::min<uint64_t>(blockHeight, m_height - firstRow);
+        }
+        const uint64_t samplesPerRow =
+            uint64_t(blockWidth) *
+            (m_planarConfiguration == PlanarConfiguration::Separate
+                 ? 1
+                 : m_samplesPerPixel);
+        const uint64_t bytesPerRow = (samplesPerRow * m_bitsPerSample + 7) / 8;
+        if (bytesPerRow > std::numeric_limits<size_t>::max() / rows)
+            return false;
+        rowCount = static_cast<size_t>(rows);
+        rowSize = static_cast<size_t>(bytesPerRow);
+        return true;
+    }
+
+    /** Return the codec registered for compression(), or nullptr if there is
+     * none or the data is uncompressed */
+    std::shared_ptr<const Codec> compressionCodec() const
+    {
+        if (m_compression == Compression::None)
+            return nullptr;
+        return CodecRegistry::global().codec(m_compression);
+    }
+
+    /** Decode the srcSize bytes of src, the raw data of strile idx (or
+     * nullptr for a strile without data), into dst, with codec as returned
+     * by compressionCodec() */
+    void decodeStrileData(uint64_t idx, const Codec *codec,
+                          const uint8_t *src, size_t srcSize,
+                          std::vector<uint8_t> &dst, bool &ok) const
+    {
+        size_t rowCount = 0;
+        size_t rowSize = 0;
+        if (!getDecodedStrileLayout(idx, rowCount, rowSize))
+        {
+            ok = false;
+            dst.clear();
+            return;
+        }
+        const size_t dstSize = rowCount * rowSize;
+        if (!src)
+        {
+            dst.assign(dstSize, 0);
+            return;
+        }
+
+        if (m_compression != Compression::None ? !codec : srcSize < dstSize)
+        {
+            ok = false;
+            dst.clear();
+            return;
+        }
+
+        dst.resize(dstSize);
+        if (!codec)
+        {
+            std::memcpy(dst.data(), src, dstSize);
+        }
+        else if (!codec->decode(*this, src, srcSize, dst.data(), dstSize))
+        {
+            ok = false;
+            return;
+        }
+        undoPredictorAndByteSwap(dst.data(), rowCount, rowSize, ok);
+    }
+
+    /** Undo the predictor and byte-swap the samples of rowCount rows of
+     * rowSize bytes of decoded data */
+    void undoPredictorAndByteSwap(uint8_t *data, size_t rowCount,
+                                  size_t rowSize, bool &ok) const
+    {
+        // As in libtiff, the predictor is ignored for uncompressed data
+        const PredictorType predictor =
+            m_compression == Compression::None || m_predictor == 0
+                ? Predictor::None
+                : m_predictor;
+        const bool wholeBytes = m_bitsPerSample == 8 ||
+                                m_bitsPerSample == 16 ||
+                                m_bitsPerSample == 32 || m_bitsPerSample == 64;
+        const size_t sampleSize = m_bitsPerSample / 8;
+        const size_t stride =
+            m_planarConfiguration == PlanarConfiguration::Separate
+                ? 1
+                : m_samplesPerPixel;
+        if (predictor == Predictor::FloatingPoint)
+        {
+            // Bytes are already laid out independently of the byte order
+            if (!wholeBytes || sampleSize == 1)
+            {
+                ok = false;
+                return;
+            }
+            const size_t count = rowSize / sampleSize;
+            std::vector<uint8_t> tmp = m_rc->bufferPool().acquire(rowSize);
+            for (size_t i = 0; i < rowCount; ++i)
+            {
+                detail::undoFloatingPointPredictor(data + i * rowSize, count,
+                                                   stride, sampleSize,
+                                                   tmp.data());
+            }
+            m_rc->bufferPool().release(std::move(tmp));
+            return;
+        }
+
+        if (m_rc->mustByteSwap() && wholeBytes && sampleSize > 1)
+        {
+            detail::byteSwapSamples(data, rowCount * rowSize / sampleSize,
+                                    sampleSize);
+        }
+        else if (m_bitsPerSample == 24 &&
+                 m_rc->mustByteSwap() != isHostLittleEndian())
+        {
+            // As in libtiff, 24-bit samples are stored in the byte order of
+            // the file: make them most significant byte first like other
+            // packed bit depths
+            uint8_t *const end = data + rowCount * rowSize;
+            for (uint8_t *ptr = data; ptr + 3 <= end; ptr += 3)
+                std::swap(ptr[0], ptr[2]);
+        }
+        if (predictor == Predictor::Horizontal)
+        {
+            if (!wholeBytes)
+            {
+                ok = false;
+                return;
+            }
+            const size_t count = rowSize / sampleSize;
+            for (size_t i = 0; i < rowCount; ++i)
+            {
+                detail::undoHorizontalDifferencing(data + i * rowSize, count,
+                                                   stride, sampleSize);
+            }
+        }
+        else if (predictor != Predictor::None)
+        {
+            ok = false;
+        }
+    }
+
+    /** Read the data of striles whose location has been checked, in order
+     * of increasing file offset, for readStriles() */
+    template <class Callback>
+    void readStrileLocations(std::vector<StrileRead> &striles,
+                             Callback &&callback, bool &ok) const
+    {
+        std::sort(striles.begin(), striles.end(),
+                  [](const StrileRead &a, const StrileRead &b)
+                  { return a.offset < b.offset; });
+
+        constexpr uint64_t MAX_BATCH_SIZE = 16 * 1024 * 1024;
+        size_t i = 0;
+        while (i < striles.size())
+        {
+            if (striles[i].byteCount == 0)
+            {
+                callback(striles[i].idx, static_cast<const uint8_t *>(nullptr),
+                         size_t(0));
+                ++i;
+                continue;
+            }
+
+            // Batch adjacent striles
+            const uint64_t batchOffset = striles[i].offset;
+            uint64_t batchEnd = batchOffset + striles[i].byteCount;
+            size_t batchLast = i;
+            while (batchLast + 1 < striles.size() &&
+                   striles[batchLast + 1].offset == batchEnd &&
+                   striles[batchLast + 1].byteCount > 0 &&
+                   batchEnd + striles[batchLast + 1].byteCount - batchOffset <=
+                       MAX_BATCH_SIZE)
+            {
+                ++batchLast;
+                batchEnd += striles[batchLast].byteCount;
+            }
+            const size_t batchSize =
+                static_cast<size_t>(batchEnd - batchOffset);
+
+            // Directly from memory if possible, or through a pooled buffer
+            std::vector<uint8_t> buffer;
+            const uint8_t *batchData = m_rc->data(batchOffset, batchSize);
+            bool batchOk = true;
+            if (!batchData)
+            {
+                buffer = m_rc->bufferPool().acquire(batchSize);
+                m_rc->read(batchOffset, batchSize, buffer.data(), batchOk);
+                batchData = buffer.data();
+            }
+            if (batchOk)
+            {
+                for (size_t j = i; j <= batchLast; ++j)
+                {
+                    callback(striles[j].idx,
+                             batchData +
+                                 static_cast<size_t>(striles[j].offset -
+                                                     batchOffset),
+                             static_cast<size_t>(striles[j].byteCount));
+                }
+            }
+            else
+            {
+                ok = false;
+            }
+            m_rc->bufferPool().release(std::move(buffer));
+            i = batchLast + 1;
+        }
+    }
+
+    /** Get the location of the data of strile idx, checking it with
+     * checkStrileLocation() */
+    bool getStrileLocation(uint64_t idx, uint64_t &offset,
+                           uint64_t &byteCount) const
+    {
+        if (idx >= m_strileCount)
+            return false;
+        bool ok = true;
+        offset = strileOffset(idx, ok);
+        byteCount = strileByteCount(idx, ok);
+        return ok && checkStrileLocation(offset, byteCount);
+    }
+
+    /** Check that the data of a strile at offset, of byteCount bytes, is
+     * within the file. Sparse striles, whose offset or byte count is zero,
+     * get a zero offset and byte count */
+    bool checkStrileLocation(uint64_t &offset, uint64_t &byteCount) const
+    {
+        if (offset == 0 || byteCount == 0)
+        {
+            offset = 0;
+            byteCount = 0;
+            return true;
+        }
+        return byteCount <= m_rc->size() &&
+               offset <= m_rc->size() - byteCount &&
+               byteCount <= std::numeric_limits<size_t>::max();
+    }
+
+    /** Read a value from a byte/short/long/long8 array tag */
+    uint64_t readUIntTag(const TagEntry *tag, uint64_t idx, bool &ok) const
+    {
+        if (tag && idx < tag->count)
+        {
+            if (tag->type == TagType::Byte)
+            {
+                if (tag->count <= (m_isBigTIFF ? 8 : 4))
+                {
+                    return tag->uint8Values[size_t(idx)];
+                }
+                return m_rc->read<uint8_t>(
+                    tag->value_offset + sizeof(uint8_t) * idx, ok);
+            }
+            else if (tag->type == TagType::Short)
+            {
+                if (tag->count <= (m_isBigTIFF ? 4 : 2))
+                {
+                    return tag->uint16Values[size_t(idx)];
+                }
+                return m_rc->read<uint16_t>(
+                    tag->value_offset + sizeof(uint16_t) * idx, ok);
+            }
+            else if (tag->type == TagType::Long)
+            {
+                if (tag->count <= (m_isBigTIFF ? 2 : 1))
+                {
+                    return tag->uint32Values[size_t(idx)];
+                }
+                return m_rc->read<uint32_t>(
+                    tag->value_offset + sizeof(uint32_t) * idx, ok);
+            }
+            else if (m_isBigTIFF && tag->type == TagType::Long8)
+            {
+                if (tag->count <= 1)
+                {
+                    return tag->uint64Values[size_t(idx)];
+                }
+                return m_rc->read<uint64_t>(
+                    tag->value_offset + sizeof(uint64_t) * idx, ok);
+            }
+        }
+        ok = false;
+        return 0;
+    }
+
+    /** Read count values, starting at index first, from a
+     * byte/short/long/long8 array tag */
+    void readUIntTagRange(const TagEntry *tag, uint64_t first, uint64_t count,
+                          uint64_t *out, bool &ok) const
+    {
+        if (!tag || first > tag->count || count > tag->count - first)
+        {
+            ok = false;
+            return;
+        }
+        if (count == 0)
+            return;
+
+        if (tag->value_offset == 0)
+        {
+            // Inline values
+            for (uint64_t i = 0; i < count; ++i)
+                out[i] = readUIntTag(tag, first + i, ok);
+            return;
+        }
+
+        if (!(tag->type == TagType::Byte || tag->type == TagType::Short ||
+              tag->type == TagType::Long ||
+              (m_isBigTIFF && tag->type == TagType::Long8)))
+        {
+            ok = false;
+            return;
+        }
+        const size_t valueSize = tagTypeSize(tag->type);
+        if (count > std::numeric_limits<size_t>::max() / valueSize)
+        {
+            ok = false;
+            return;
+        }
+        const size_t byteCount = static_cast<size_t>(count) * valueSize;
+        const uint64_t offset = tag->value_offset + first * valueSize;
+
+        std::vector<uint8_t> buffer;
+        const uint8_t *src = m_rc->data(offset, byteCount);
+        if (!src)
+        {
+            buffer.resize(byteCount);
+            bool readOk = true;
+            m_rc->read(offset, byteCount, buffer.data(), readOk);
+            if (!readOk)
+            {
+                ok = false;
+                return;
+            }
+            src = buffer.data();
+        }
+        detail::decodeUIntArray(*(m_rc.get()), tag->type, src,
+                                static_cast<size_t>(count), out);
+    }
+
+    /** Return whether the out-of-line values of entry cannot be within
+     * the file */
+    bool isInvalidValueOffset(const TagEntry &entry) const
+    {
+        const uint32_t dataTypeSize = tagTypeSize(entry.type);
+        if (dataTypeSize > std::numeric_limits<uint64_t>::max() / entry.count)
+            return true;
+        const uint64_t byteCount = uint64_t(dataTypeSize) * entry.count;
+
+        // Size of tag data beyond which we check the tag position and size
+        // w.r.t the file size.
+        constexpr uint32_t THRESHOLD_CHECK_FILE_SIZE = 10 * 1000 * 1000;
+
+        return byteCount > THRESHOLD_CHECK_FILE_SIZE &&
+               (m_rc->size() < byteCount ||
+                entry.value_offset > m_rc->size() - byteCount);
+    }
+
+    /** Parse the data-or-offset field of a tag entry, pointed by data
+     * (in the byte order of the file) */
+    template <class DataOrOffsetType>
+    void ParseTagEntryDataOrOffset(TagEntry &entry, const uint8_t *data,
+                                   bool &singleValueFitsInUInt32,
+                                   uint32_t &singleValue, bool &ok)
     {
-        if (tag.value_offset)
+        LIBERTIFF_STATIC_ASSERT(
+            (std::is_same<DataOrOffsetType, uint32_t>::value ||
+             std::is_same<DataOrOffsetType, uint64_t>::value));
+        assert(entry.count > 0);
+
+        const uint32_t dataTypeSize = tagTypeSize(entry.type);
+        if (dataTypeSize == 0)
         {
-            if (!tag.invalid_value_offset)
+            return;
+        }
+
+        // There are 2 cases:
+        // - either the number of values for the data type can fit
+        //   in the next DataOrOffsetType bytes
+        // - or it cannot, and then the next DataOrOffsetType bytes are an offset
+        //   to the values
+        if (dataTypeSize > sizeof(DataOrOffsetType) / entry.count)
+        {
+            // Out-of-line values. We read a file offset
+            entry.value_offset = m_rc->readFromMemory<DataOrOffsetType>(data);
+            if (entry.value_offset == 0)
             {
-                if LIBERTIFF_CONSTEXPR (sizeof(tag.count) > sizeof(size_t))
+                // value_offset = 0 for a out-of-line tag is obviously
+                // wrong and would cause later confusion in readTagAsVector<>,
+                // so better reject the file.
+                ok = false;
+                return;
+            }
+            entry.invalid_value_offset = isInvalidValueOffset(entry);
+        }
+        else if (dataTypeSize == sizeof(uint8_t))
+        {
+            // Read up to 4 (classic) or 8 (BigTIFF) inline bytes
+            std::memcpy(&entry.uint8Values[0], data, size_t(entry.count));
+            if (entry.count == 1 && entry.type == TagType::Byte)
+            {
+                singleValueFitsInUInt32 = true;
+                singleValue = entry.uint8Values[0];
+            }
+        }
+        else if (dataTypeSize == sizeof(uint16_t))
+        {
+            // Read up to 2 (classic) or 4 (BigTIFF) inline 16-bit values
+            assert(entry.count <= 4);
+            for (uint32_t idx = 0; idx < entry.count; ++idx)
+            {
+                entry.uint16Values[idx] = m_rc->readFromMemory<uint16_t>(
+                    data + idx * sizeof(uint16_t));
+            }
+            if (entry.count == 1 && entry.type == TagType::Short)
+            {
+                singleValueFitsInUInt32 = true;
+                singleValue = entry.uint16Values[0];
+            }
+        }
+        else if (dataTypeSize == sizeof(uint32_t))
+        {
+            // Read up to 1 (classic) or 2 (BigTIFF) inline 32-bit values
+            entry.uint32Values[0] = m_rc->readFromMemory<uint32_t>(data);
+            if (entry.count == 1 && entry.type == TagType::Long)
+            {
+                singleValueFitsInUInt32 = true;
+                singleValue = entry.uint32Values[0];
+            }
+            if LIBERTIFF_CONSTEXPR (std::is_same<DataOrOffsetType,
+                                                 uint64_t>::value)
+            {
+                if (entry.count == 2)
                 {
-                    if (tag.count > std::numeric_limits<size_t>::max())
-                    {
-                        ok = false;
-                        return {};
-                    }
+                    entry.uint32Values[1] =
+                        m_rc->readFromMemory<uint32_t>(data + sizeof(uint32_t));
                 }
-                return rc.readArray<T>(tag.value_offset,
-                                       static_cast<size_t>(tag.count), ok);
+            }
+        }
+        else if LIBERTIFF_CONSTEXPR (std::is_same<DataOrOffsetType,
+                                                  uint64_t>::value)
+        {
+            if (dataTypeSize == sizeof(uint64_t))
+            {
+                // Read one inline 64-bit value
+                if (entry.type == TagType::Rational)
+                    entry.float64Values[0] =
+                        m_rc->readRationalFromMemory(data, ok);
+                else if (entry.type == TagType::SRational)
+                    entry.float64Values[0] =
+                        m_rc->readRationalFromMemory<int32_t>(data, ok);
+                else
+                    entry.uint64Values[0] =
+                        m_rc->readFromMemory<uint64_t>(data);
+            }
+            else
+            {
+                assert(false);
             }
         }
         else
         {
-            return std::vector<T>(
-                inlineValues, inlineValues + static_cast<size_t>(tag.count));
+            // fprintf(stderr, "Unexpected case: tag=%u, dataType=%u, count=%u\n", entry.tag, entry.type, entry.count);
+            assert(false);
         }
     }
-    ok = false;
-    return {};
-}
-
-template <class T>
-inline std::vector<T> readTagAsVector(const ReadContext &rc,
-                                      const TagEntry &tag, bool &ok);
-
-template <>
-inline std::vector<int8_t> readTagAsVector(const ReadContext &rc,
-                                           const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(rc, tag, TagType::SByte,
-                                   tag.int8Values.data(), ok);
-}
-
-template <>
-inline std::vector<uint8_t> readTagAsVector(const ReadContext &rc,
-                                            const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(
-        rc, tag, tag.type == TagType::Undefined ? tag.type : TagType::Byte,
-        tag.uint8Values.data(), ok);
-}
+};
 
-template <>
-inline std::vector<int16_t> readTagAsVector(const ReadContext &rc,
-                                            const TagEntry &tag, bool &ok)
+/** Options for open() */
+struct OpenOptions
 {
-    return readTagAsVectorInternal(rc, tag, TagType::SShort,
-                                   tag.int16Values.data(), ok);
-}
+    /** Number of bytes at the beginning of the file that are read with a
+     * single request when opening it. IFD and tag value reads that fall
+     * within that window are then served from memory, which avoids many
+     * round trips for files that have their IFDs at the beginning, like
+     * Cloud-Optimized GeoTIFFs. Set to 0 to disable. Ignored if the
+     * FileReader provides direct memory access through FileReader::data()
+     */
+    size_t headerPrefetchBytes = 16 * 1024;
+};
 
-template <>
-inline std::vector<uint16_t> readTagAsVector(const ReadContext &rc,
-                                             const TagEntry &tag, bool &ok)
+/** Open a TIFF file and return its first Image File Directory
+ */
+template <bool acceptBigTIFF = true>
+std::unique_ptr<const Image> open(const std::shared_ptr<const FileReader> &file,
+                                  const OpenOptions &options = OpenOptions())
 {
-    return readTagAsVectorInternal(rc, tag, TagType::Short,
-                                   tag.uint16Values.data(), ok);
-}
+    const uint8_t *const fileData =
+        file->providesData() ? file->data(0, 2) : nullptr;
+    std::vector<uint8_t> header;
+    if (options.headerPrefetchBytes > 0 && !fileData)
+    {
+        header.resize(options.headerPrefetchBytes);
+        header.resize(file->read(0, header.size(), header.data()));
+    }
 
-template <>
-inline std::vector<int32_t> readTagAsVector(const ReadContext &rc,
-                                            const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(rc, tag, TagType::SLong,
-                                   tag.int32Values.data(), ok);
-}
+    unsigned char signature[2] = {0, 0};
+    if (header.size() >= 2)
+        std::memcpy(signature, header.data(), 2);
+    else if (fileData)
+        std::memcpy(signature, fileData, 2);
+    else
+        (void)file->read(0, 2, signature);
+    const bool littleEndian = signature[0] == 'I' && signature[1] == 'I';
+    const bool bigEndian = signature[0] == 'M' && signature[1] == 'M';
+    if (!littleEndian && !bigEndian)
+        return nullptr;
 
-template <>
-inline std::vector<uint32_t> readTagAsVector(const ReadContext &rc,
-                                             const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(rc, tag, TagType::Long,
-                                   tag.uint32Values.data(), ok);
-}
+    const bool mustByteSwap = littleEndian ^ isHostLittleEndian();
 
-template <>
-inline std::vector<int64_t> readTagAsVector(const ReadContext &rc,
-                                            const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(rc, tag, TagType::SLong8,
-                                   tag.int64Values.data(), ok);
-}
+    auto rc =
+        std::make_shared<ReadContext>(file, mustByteSwap, std::move(header));
+    bool ok = true;
+    const int version = rc->read<uint16_t>(2, ok);
+    constexpr int CLASSIC_TIFF_VERSION = 42;
+    if (version == CLASSIC_TIFF_VERSION)
+    {
+        const auto firstImageOffset = rc->read<uint32_t>(4, ok);
+        return Image::open<false>(rc, firstImageOffset);
+    }
+    else if LIBERTIFF_CONSTEXPR (acceptBigTIFF)
+    {
+        constexpr int BIGTIFF_VERSION = 43;
+        if (version == BIGTIFF_VERSION)
+        {
+            const auto byteSizeOfOffsets = rc->read<uint16_t>(4, ok);
+            if (byteSizeOfOffsets != 8)
+                return nullptr;
+            const auto zeroWord = rc->read<uint16_t>(6, ok);
+            if (zeroWord != 0 || !ok)
+                return nullptr;
+            const auto firstImageOffset = rc->read<uint64_t>(8, ok);
+            return Image::open<true>(rc, firstImageOffset);
+        }
+    }
 
-template <>
-inline std::vector<uint64_t> readTagAsVector(const ReadContext &rc,
-                                             const TagEntry &tag, bool &ok)
-{
-    return readTagAsVectorInternal(rc, tag, TagType::Long8,
-                                   tag.uint64Values.data(), ok);
+    return nullptr;
 }
 
-template <>
-inline std::vector<float> readTagAsVector(const ReadContext &rc,
-                                          const TagEntry &tag, bool &ok)
+namespace detail
 {
-    return readTagAsVectorInternal(rc, tag, TagType::Float,
-                                   tag.float32Values.data(), ok);
-}
-
-template <>
-inline std::vector<double> readTagAsVector(const ReadContext &rc,
-                                           const TagEntry &tag, bool &ok)
+/** Return the 64-bit FNV-1a hash of size bytes */
+inline uint64_t fnv1a64(const uint8_t *data, size_t size)
 {
-    return readTagAsVectorInternal(rc, tag, TagType::Double,
-                                   tag.float64Values.data(), ok);
+    uint64_t hash = 0xcbf29ce484222325U;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3U;
+    }
+    return hash;
 }
 
-}  // namespace detail
-
-/** Represents a TIFF Image File Directory (IFD). */
-class Image
+/** Append values, in host byte order, to a buffer */
+class BinaryWriter
 {
   public:
-    /** Constructor. Should not be called directly. Use the open() method */
-    Image(const std::shared_ptr<const ReadContext> &rc, bool isBigTIFF)
-        : m_rc(rc), m_isBigTIFF(isBigTIFF)
+    explicit BinaryWriter(std::vector<uint8_t> &buffer) : m_buffer(buffer)
     {
     }
 
-    /** Return read context */
-    const std::shared_ptr<const ReadContext> &readContext() const
+    template <class T> void write(T value)
     {
-        return m_rc;
+        writeBytes(&value, sizeof(T));
     }
 
-    /** Return whether the file is BigTIFF (if false, classic TIFF) */
-    inline bool isBigTIFF() const
+    void writeBytes(const void *data, size_t size)
     {
-        return m_isBigTIFF;
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        m_buffer.insert(m_buffer.end(), bytes, bytes + size);
     }
 
-    /** Return if values of more than 1-byte must be byte swapped.
-     * To be only taken into account when reading pixels. Tag values are
-     * automatically byte-swapped */
-    inline bool mustByteSwap() const
+  private:
+    std::vector<uint8_t> &m_buffer;
+};
+
+/** Read values, in host byte order, from a buffer, with bounds checking */
+class BinaryReader
+{
+  public:
+    BinaryReader(const uint8_t *data, size_t size) : m_data(data), m_size(size)
     {
-        return m_rc->mustByteSwap();
     }
 
-    /** Return the offset of the this IFD */
-    inline uint64_t offset() const
+    /** Read a value. ok is set to false if the buffer is too short */
+    template <class T> T read(bool &ok)
     {
-        return m_offset;
+        T value{};
+        if (const uint8_t *ptr = readBytes(sizeof(T), ok))
+            std::memcpy(&value, ptr, sizeof(T));
+        return value;
     }
 
-    /** Return the offset of the next IFD (to pass to Image::open()),
-         * or 0 if there is no more */
-    inline uint64_t nextImageOffset() const
+    /** Return a pointer to the next size bytes, or nullptr (and ok set to
+     * false) if the buffer is too short */
+    const uint8_t *readBytes(size_t size, bool &ok)
     {
-        return m_nextImageOffset;
+        if (size > m_size - m_pos)
+        {
+            ok = false;
+            return nullptr;
+        }
+        const uint8_t *ptr = m_data + m_pos;
+        m_pos += size;
+        return ptr;
     }
 
-    /** Return value of SubFileType tag */
-    inline uint32_t subFileType() const
+    /** Return the number of bytes not read yet */
+    size_t remaining() const
     {
-        return m_subFileType;
+        return m_size - m_pos;
     }
 
-    /** Return width of the image in pixels */
-    inline uint32_t width() const
+  private:
+    const uint8_t *const m_data;
+    const size_t m_size;
+    size_t m_pos = 0;
+};
+}  // namespace detail
+
+/** TIFF file whose IFDs are parsed at most once.
+ *
+ * IFDs of the main chain are lazily parsed when first accessed with
+ * firstImage() or next(), and then cached by offset for the lifetime of the
+ * document, so that several threads, or several walks of the chain, share
+ * the same Image instances.
+ *
+ * This class is thread-safe.
+ */
+class TiffDocument
+{
+  public:
+    /** Constructor. Should not be called directly. Use the open() method */
+    TiffDocument(const std::shared_ptr<const ReadContext> &rc, bool isBigTIFF)
+        : m_rc(rc), m_isBigTIFF(isBigTIFF)
     {
-        return m_width;
     }
 
-    /** Return height of the image in pixels */
-    inline uint32_t height() const
+    /** Return read context */
+    const std::shared_ptr<const ReadContext> &readContext() const
     {
-        return m_height;
+        return m_rc;
     }
 
-    /** Return number of bits per sample */
-    inline uint32_t bitsPerSample() const
+    /** Return whether the file is BigTIFF (if false, classic TIFF) */
+    inline bool isBigTIFF() const
     {
-        return m_bitsPerSample;
+        return m_isBigTIFF;
     }
 
-    /** Return number of samples (a.k.a. channels, bands) per pixel */
-    inline uint32_t samplesPerPixel() const
+    /** Return the first IFD of the file. Never null */
+    inline const Image *firstImage() const
     {
-        return m_samplesPerPixel;
+        return m_firstImage;
     }
 
-    /** Return planar configuration */
-    inline PlanarConfigurationType planarConfiguration() const
+    /** Return the IFD following image (which must have been returned by this
+     * document) in the main chain, or nullptr if there is none.
+     *
+     * The returned pointer remains valid for the lifetime of the document.
+     */
+    const Image *next(const Image &image) const
     {
-        return m_planarConfiguration;
+        uint64_t indexInChain;
+        {
+            std::lock_guard<std::mutex> oLock(m_mutex);
+            const auto iter = m_slots.find(image.offset());
+            if (iter == m_slots.end())
+                return nullptr;
+            indexInChain = iter->second->indexInChain;
+        }
+        return imageAt(image.nextImageOffset(), indexInChain + 1);
     }
 
-    /** Return planar configuration */
-    inline PhotometricInterpretationType photometricInterpretation() const
+    /** Return the number of IFDs parsed so far */
+    size_t cachedImageCount() const
     {
-        return m_photometricInterpretation;
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        return m_slots.size();
     }
 
-    /** Return compression method used */
-    inline CompressionType compression() const
+    /** Return an estimate of the memory used by the document and the IFDs
+     * parsed so far, in bytes.
+     *
+     * This is maintained as IFDs and strile array pages are loaded, so that
+     * it is cheap to call.
+     */
+    size_t memoryUsage() const
     {
-        return m_compression;
+        return sizeof(*this) + m_memoryUsage.load(std::memory_order_relaxed);
     }
 
-    /** Return predictor value (used for Deflate, LZW, ZStd, etc. compression) */
-    inline uint32_t predictor() const
+    /** Serialize the structure of the file (IFD offsets, tag entries and
+     * decoded strile offset and byte count arrays of the IFDs of the main
+     * chain) into a binary index, to be passed to openFromIndex().
+     *
+     * IFDs that have not been parsed yet are parsed. mtime is a
+     * caller-defined modification time of the file, that is stored in the
+     * index to detect changes of the file.
+     *
+     * The index is in host byte order, and all its fields are aligned on 8
+     * bytes, so that it can be memory-mapped.
+     */
+    std::vector<uint8_t> writeIndex(uint64_t mtime) const
     {
-        return m_predictor;
+        std::vector<const Image *> images;
+        for (const Image *image = m_firstImage; image; image = next(*image))
+            images.push_back(image);
+
+        std::vector<uint8_t> index;
+        detail::BinaryWriter writer(index);
+        writer.writeBytes(indexMagic(), INDEX_MAGIC_SIZE);
+        writer.write<uint32_t>(INDEX_VERSION);
+        writer.write<uint32_t>(indexFlags(m_isBigTIFF, m_rc->mustByteSwap()));
+        writer.write<uint64_t>(m_rc->size());
+        writer.write<uint64_t>(mtime);
+        bool ok = true;
+        writer.write<uint64_t>(headerHash(*m_rc, ok));
+        writer.write<uint64_t>(images.size());
+        for (const Image *image : images)
+        {
+            writer.write<uint64_t>(image->m_offset);
+            writer.write<uint64_t>(image->m_nextImageOffset);
+            writer.write<uint32_t>(image->m_bitsPerSample);
+            writer.write<uint32_t>(image->m_sampleFormat);
+            writer.write<uint64_t>(image->m_tags.size());
+            for (const TagEntry &tag : image->m_tags)
+            {
+                constexpr uint8_t padding[3] = {0, 0, 0};
+                writer.write<uint16_t>(tag.tag);
+                writer.write<uint16_t>(tag.type);
+                writer.write<uint8_t>(tag.invalid_value_offset ? 1 : 0);
+                writer.writeBytes(padding, sizeof(padding));
+                writer.write<uint64_t>(tag.count);
+                writer.writeBytes(&tag.uint8Values, sizeof(tag.uint8Values));
+                writer.write<uint64_t>(tag.value_offset);
+            }
+
+            // Decoded strile arrays, only for out-of-line ones
+            std::vector<uint64_t> values;
+            if (image->m_strileOffsetsCache &&
+                image->m_strileOffsetsTag->count <= m_rc->size())
+            {
+                values.resize(
+                    static_cast<size_t>(image->m_strileOffsetsTag->count));
+                image->readStrileOffsets(0, values.size(), values.data(), ok);
+            }
+            writeUIntArray(writer, values, ok);
+            values.clear();
+            if (image->m_strileByteCountsCache &&
+                image->m_strileByteCountsTag->count <= m_rc->size())
+            {
+                values.resize(
+                    static_cast<size_t>(image->m_strileByteCountsTag->count));
+                image->readStrileByteCounts(0, values.size(), values.data(),
+                                            ok);
+            }
+            writeUIntArray(writer, values, ok);
+        }
+        if (!ok)
+            index.clear();
+        return index;
     }
 
-    /** Return sample format */
-    inline SampleFormatType sampleFormat() const
+    /** Open a TIFF file from an index generated by writeIndex(), without
+     * parsing its IFDs nor reading its strile arrays.
+     *
+     * The strile arrays are copied from the index, which thus only needs to
+     * remain valid during this call. This costs O(number of striles): see
+     * the other overload to use them in place.
+     *
+     * Returns nullptr if the index is invalid, or does not match the file,
+     * that is if the size of the file, mtime or the content of the beginning
+     * of the file differ from the ones at the time the index was generated.
+     * The caller may then fall back to open().
+     */
+    static std::unique_ptr<const TiffDocument>
+    openFromIndex(const std::shared_ptr<const FileReader> &file,
+                  const uint8_t *index, size_t indexSize, uint64_t mtime)
+    {
+        return openFromIndex(file, index, indexSize, mtime, nullptr);
+    }
+
+    /** Open a TIFF file from an index generated by writeIndex(), such as a
+     * memory-mapped index file, which is kept alive by the document.
+     *
+     * If index is aligned on 8 bytes, the strile arrays are used in place
+     * rather than copied, so that opening costs O(number of IFDs and tags),
+     * independently of the number of striles. They are not counted by
+     * memoryUsage().
+     *
+     * Returns nullptr in the same cases as the other overload.
+     */
+    static std::unique_ptr<const TiffDocument>
+    openFromIndex(const std::shared_ptr<const FileReader> &file,
+                  const std::shared_ptr<const uint8_t> &index,
+                  size_t indexSize, uint64_t mtime)
     {
-        return m_sampleFormat;
+        if (!index)
+            return nullptr;
+        return openFromIndex(file, index.get(), indexSize, mtime, index);
     }
 
-    /** Return the number of rows per strip */
-    inline uint32_t rowsPerStrip() const
+    /** Open a TIFF file, and parse its first IFD */
+    static std::unique_ptr<const TiffDocument>
+    open(const std::shared_ptr<const FileReader> &file,
+         const OpenOptions &options = OpenOptions())
     {
-        return m_rowsPerStrip;
+        auto firstImage = LIBERTIFF_NS::open(file, options);
+        if (!firstImage)
+            return nullptr;
+        auto document = LIBERTIFF_NS::make_unique<TiffDocument>(
+            firstImage->readContext(), firstImage->isBigTIFF());
+        const uint64_t offset = firstImage->offset();
+        document->m_visitedImageOffsets->visit(offset, 0);
+        Slot *slot = document->slot(offset, 0);
+        std::call_once(
+            slot->onceFlag, [&document, slot, &firstImage]()
+            { document->setSlotImage(slot, std::move(firstImage)); });
+        document->m_firstImage = slot->image.get();
+        return std::unique_ptr<const TiffDocument>(document.release());
     }
 
-    /** Return the sanitized number of rows per strip */
-    inline uint32_t rowsPerStripSanitized() const
+  private:
+    struct Slot
     {
-        return std::min(m_rowsPerStrip, m_height);
-    }
+        uint64_t indexInChain = 0;
+        std::once_flag onceFlag{};
+        std::unique_ptr<const Image> image{};
+        // Set once image has been set, for accesses that do not go through
+        // onceFlag
+        std::atomic<bool> loaded{false};
+    };
 
-    /** Return the number of strips/tiles.
-     * Return 0 if inconsistent values between ByteCounts and Offsets arrays. */
-    inline uint64_t strileCount() const
+    const std::shared_ptr<const ReadContext> m_rc;
+    const bool m_isBigTIFF;
+    // Index whose strile arrays are used in place, if any
+    std::shared_ptr<const uint8_t> m_index{};
+    // Memory used by slots and IFDs, see memoryUsage()
+    mutable std::atomic<size_t> m_memoryUsage{0};
+    const Image *m_firstImage = nullptr;
+    const std::shared_ptr<VisitedImageOffsets> m_visitedImageOffsets =
+        std::make_shared<VisitedImageOffsets>();
+    mutable std::mutex m_mutex{};
+    mutable std::unordered_map<uint64_t, std::unique_ptr<Slot>> m_slots{};
+
+    TiffDocument(const TiffDocument &) = delete;
+    TiffDocument &operator=(const TiffDocument &) = delete;
+
+    static constexpr uint32_t INDEX_VERSION = 1;
+    static constexpr size_t INDEX_MAGIC_SIZE = 8;
+    // Number of bytes at the beginning of the file whose hash is stored in
+    // the index
+    static constexpr size_t INDEX_HEADER_HASH_SIZE = 4096;
+    static constexpr uint32_t INDEX_FLAG_BIGTIFF = 0x1;
+    static constexpr uint32_t INDEX_FLAG_MUST_BYTE_SWAP = 0x2;
+    static constexpr uint32_t INDEX_FLAG_HOST_BIG_ENDIAN = 0x4;
+
+    static const char *indexMagic()
     {
-        return m_strileCount;
+        return "LTIFFIDX";
     }
 
-    /** Return whether image is tiled */
-    inline bool isTiled() const
+    static uint32_t indexFlags(bool isBigTIFF, bool mustByteSwap)
     {
-        return m_isTiled;
+        return (isBigTIFF ? INDEX_FLAG_BIGTIFF : 0) |
+               (mustByteSwap ? INDEX_FLAG_MUST_BYTE_SWAP : 0) |
+               (isHostLittleEndian() ? 0 : INDEX_FLAG_HOST_BIG_ENDIAN);
     }
 
-    /** Return tile width */
-    inline uint32_t tileWidth() const
+    /** Return the hash of the beginning of the file */
+    static uint64_t headerHash(const ReadContext &rc, bool &ok)
     {
-        return m_tileWidth;
+        std::vector<uint8_t> header(static_cast<size_t>(
+            std::min(rc.size(), uint64_t(INDEX_HEADER_HASH_SIZE))));
+        rc.read(0, header.size(), header.data(), ok);
+        return detail::fnv1a64(header.data(), header.size());
     }
 
-    /** Return tile width */
-    inline uint32_t tileHeight() const
+    static void writeUIntArray(detail::BinaryWriter &writer,
+                               const std::vector<uint64_t> &values, bool ok)
     {
-        return m_tileHeight;
+        if (!ok)
+            return;
+        writer.write<uint64_t>(values.size());
+        writer.writeBytes(values.data(), values.size() * sizeof(uint64_t));
     }
 
-    /** Return number of tiles per row */
-    uint32_t tilesPerRow() const
+    /** Open a TIFF file from an index. If owner is not null, it owns the
+     * index, which is then kept alive by the document, and its strile
+     * arrays are used in place */
+    static std::unique_ptr<const TiffDocument>
+    openFromIndex(const std::shared_ptr<const FileReader> &file,
+                  const uint8_t *index, size_t indexSize, uint64_t mtime,
+                  const std::shared_ptr<const uint8_t> &owner)
     {
-        if (m_tileWidth > 0)
+        detail::BinaryReader reader(index, indexSize);
+        bool ok = true;
+        const uint8_t *magic = reader.readBytes(INDEX_MAGIC_SIZE, ok);
+        if (!magic || std::memcmp(magic, indexMagic(), INDEX_MAGIC_SIZE) != 0)
+            return nullptr;
+        if (reader.read<uint32_t>(ok) != INDEX_VERSION)
+            return nullptr;
+        const uint32_t flags = reader.read<uint32_t>(ok);
+        const bool isBigTIFF = (flags & INDEX_FLAG_BIGTIFF) != 0;
+        const bool mustByteSwap = (flags & INDEX_FLAG_MUST_BYTE_SWAP) != 0;
+        if (!ok || flags != indexFlags(isBigTIFF, mustByteSwap))
+            return nullptr;
+
+        auto rc = std::make_shared<ReadContext>(file, mustByteSwap);
+        if (reader.read<uint64_t>(ok) != rc->size() ||
+            reader.read<uint64_t>(ok) != mtime ||
+            reader.read<uint64_t>(ok) != headerHash(*rc, ok) || !ok)
         {
-            return uint32_t((uint64_t(m_width) + m_tileWidth - 1) /
-                            m_tileWidth);
+            return nullptr;
         }
-        return 0;
+
+        const uint64_t imageCount = reader.read<uint64_t>(ok);
+        if (!ok || imageCount == 0)
+            return nullptr;
+        auto document = LIBERTIFF_NS::make_unique<TiffDocument>(rc, isBigTIFF);
+        document->m_index = owner;
+        for (uint64_t i = 0; i < imageCount; ++i)
+        {
+            if (!document->loadImageFromIndex(reader, i, owner != nullptr))
+                return nullptr;
+        }
+        return std::unique_ptr<const TiffDocument>(document.release());
     }
 
-    /** Return number of tiles per column */
-    uint32_t tilesPerCol() const
+    /** Load the decoded values of an out-of-line strile array tag from the
+     * index into cache, or let cache use them in place if inPlace is set and
+     * they are suitably aligned */
+    static bool readUIntArray(detail::BinaryReader &reader,
+                              const TagEntry *tag,
+                              detail::UIntArrayCache *cache, bool inPlace)
     {
-        if (m_tileHeight > 0)
+        bool ok = true;
+        const uint64_t count = reader.read<uint64_t>(ok);
+        if (!ok)
+            return false;
+        if (count == 0)
+            return true;
+        if (!cache || count != tag->count ||
+            count > std::numeric_limits<size_t>::max() / sizeof(uint64_t))
+            return false;
+        const uint8_t *values = reader.readBytes(
+            static_cast<size_t>(count) * sizeof(uint64_t), ok);
+        if (!values)
+            return false;
+        if (inPlace &&
+            reinterpret_cast<uintptr_t>(values) % alignof(uint64_t) == 0)
         {
-            return uint32_t((uint64_t(m_height) + m_tileHeight - 1) /
-                            m_tileHeight);
+            cache->useValues(reinterpret_cast<const uint64_t *>(values));
         }
-        return 0;
+        else
+        {
+            cache->preload(values);
+        }
+        return true;
     }
 
-    /** Convert a tile coordinate (xtile, ytile, bandIdx) to a flat index */
-    uint64_t tileCoordinateToIdx(uint32_t xtile, uint32_t ytile,
-                                 uint32_t bandIdx, bool &ok) const
+    /** Create the IFD at position indexInChain in the main chain from its
+     * description in the index, using its strile arrays in place if
+     * inPlace is set */
+    bool loadImageFromIndex(detail::BinaryReader &reader, uint64_t indexInChain,
+                            bool inPlace)
     {
-        if (m_isTiled && m_tileWidth > 0 && m_tileHeight > 0)
+        bool ok = true;
+        const uint64_t offset = reader.read<uint64_t>(ok);
+        const uint64_t nextImageOffset = reader.read<uint64_t>(ok);
+        const uint32_t bitsPerSample = reader.read<uint32_t>(ok);
+        const uint32_t sampleFormat = reader.read<uint32_t>(ok);
+        const uint64_t tagCount = reader.read<uint64_t>(ok);
+        if (!ok || offset == 0 ||
+            tagCount > std::numeric_limits<uint16_t>::max() ||
+            !m_visitedImageOffsets->visit(offset, indexInChain))
         {
-            const uint32_t lTilesPerRow = tilesPerRow();
-            const uint32_t lTilesPerCol = tilesPerCol();
-            if (xtile >= lTilesPerRow || ytile >= lTilesPerCol)
+            return false;
+        }
+
+        auto image = LIBERTIFF_NS::make_unique<Image>(m_rc, m_isBigTIFF);
+        image->m_offset = offset;
+        image->m_nextImageOffset = nextImageOffset;
+        image->m_indexInChain = indexInChain;
+        image->m_visitedImageOffsets = m_visitedImageOffsets;
+        if (m_isBigTIFF)
+            image->m_openFunc = Image::open<true>;
+        else
+            image->m_openFunc = Image::open<false>;
+
+        const uint64_t inlineSize = m_isBigTIFF ? 8 : 4;
+        image->m_tags.reserve(static_cast<size_t>(tagCount));
+        for (uint64_t i = 0; i < tagCount; ++i)
+        {
+            TagEntry entry;
+            entry.tag = reader.read<uint16_t>(ok);
+            entry.type = reader.read<uint16_t>(ok);
+            reader.readBytes(4, ok);  // invalid_value_offset and padding
+            entry.count = reader.read<uint64_t>(ok);
+            if (const uint8_t *inlineValues =
+                    reader.readBytes(sizeof(entry.uint8Values), ok))
             {
-                ok = false;
-                return 0;
+                std::memcpy(&entry.uint8Values, inlineValues,
+                            sizeof(entry.uint8Values));
             }
-            uint64_t idx = uint64_t(ytile) * lTilesPerRow + xtile;
-            if (bandIdx &&
-                m_planarConfiguration == PlanarConfiguration::Separate)
+            entry.value_offset = reader.read<uint64_t>(ok);
+            if (!ok)
+                return false;
+
+            // Inline values must fit in the entry
+            const uint32_t dataTypeSize = tagTypeSize(entry.type);
+            if (entry.value_offset == 0 && dataTypeSize != 0 &&
+                entry.count > inlineSize / dataTypeSize)
             {
-                const uint64_t lTotalTiles =
-                    uint64_t(lTilesPerCol) * lTilesPerRow;
-                if (lTotalTiles >
-                    std::numeric_limits<uint64_t>::max() / bandIdx)
-                {
-                    ok = false;
-                    return 0;
-                }
-                idx += bandIdx * lTotalTiles;
+                return false;
             }
-            return idx;
+            // Recomputed against the file size rather than trusted, as when
+            // parsing the IFD (inline values keep the default)
+            entry.invalid_value_offset =
+                entry.value_offset == 0 || entry.count == 0 ||
+                dataTypeSize == 0 || image->isInvalidValueOffset(entry);
+            // The decoded values of strile arrays follow in the index:
+            // reject counts that cannot fit in it before allocating their
+            // caches
+            if ((entry.tag == TagCode::StripOffsets ||
+                 entry.tag == TagCode::StripByteCounts ||
+                 entry.tag == TagCode::TileOffsets ||
+                 entry.tag == TagCode::TileByteCounts) &&
+                detail::UIntArrayCache::isCompatible(entry, m_isBigTIFF) &&
+                entry.count > reader.remaining() / sizeof(uint64_t))
+            {
+                return false;
+            }
+
+            uint32_t singleValue = 0;
+            bool singleValueFitsInUInt32 = false;
+            if (entry.count == 1 && entry.value_offset == 0)
+            {
+                singleValueFitsInUInt32 = true;
+                if (entry.type == TagType::Byte)
+                    singleValue = entry.uint8Values[0];
+                else if (entry.type == TagType::Short)
+                    singleValue = entry.uint16Values[0];
+                else if (entry.type == TagType::Long)
+                    singleValue = entry.uint32Values[0];
+                else
+                    singleValueFitsInUInt32 = false;
+            }
+            image->processTag(entry, singleValueFitsInUInt32, singleValue);
+            image->m_tags.push_back(entry);
         }
-        ok = false;
-        return 0;
+        // Stored in the index, as they may require reading out-of-line
+        // values
+        image->m_bitsPerSample = bitsPerSample;
+        image->m_sampleFormat = sampleFormat;
+        image->finalTagProcessing();
+
+        if (!readUIntArray(reader, image->m_strileOffsetsTag,
+                           image->m_strileOffsetsCache.get(), inPlace) ||
+            !readUIntArray(reader, image->m_strileByteCountsTag,
+                           image->m_strileByteCountsCache.get(), inPlace))
+        {
+            return false;
+        }
+
+        Slot *slot = this->slot(offset, indexInChain);
+        std::call_once(slot->onceFlag, [this, slot, &image]()
+                       { setSlotImage(slot, std::move(image)); });
+        if (indexInChain == 0)
+            m_firstImage = slot->image.get();
+        return slot->image != nullptr;
     }
 
-    /** Return the offset of strip/tile of index idx */
-    uint64_t strileOffset(uint64_t idx, bool &ok) const
+    /** Return the slot for the IFD at offset, creating it if needed */
+    Slot *slot(uint64_t offset, uint64_t indexInChain) const
     {
-        return readUIntTag(m_strileOffsetsTag, idx, ok);
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        auto &slot = m_slots[offset];
+        if (!slot)
+        {
+            slot = LIBERTIFF_NS::make_unique<Slot>();
+            slot->indexInChain = indexInChain;
+            m_memoryUsage.fetch_add(
+                sizeof(std::pair<const uint64_t, std::unique_ptr<Slot>>) +
+                    sizeof(Slot),
+                std::memory_order_relaxed);
+        }
+        return slot.get();
     }
 
-    /** Return the offset of a tile from its coordinates */
-    uint64_t tileOffset(uint32_t xtile, uint32_t ytile, uint32_t bandIdx,
-                        bool &ok) const
+    /** Set the image of slot, and account for its memory. Must be called
+     * from the onceFlag of slot */
+    void setSlotImage(Slot *slot, std::unique_ptr<const Image> image) const
     {
-        const auto idx = tileCoordinateToIdx(xtile, ytile, bandIdx, ok);
-        return ok ? strileOffset(idx, ok) : 0;
+        if (image)
+        {
+            image->setMemoryUsageCounter(&m_memoryUsage);
+            m_memoryUsage.fetch_add(image->memoryUsage(),
+                                    std::memory_order_relaxed);
+        }
+        slot->image = std::move(image);
+        slot->loaded.store(true, std::memory_order_release);
     }
 
-    /** Return the byte count of strip/tile of index idx */
-    uint64_t strileByteCount(uint64_t idx, bool &ok) const
+    /** Return the IFD at offset, which is at position indexInChain in the
+     * main chain, parsing it if it is not already cached */
+    const Image *imageAt(uint64_t offset, uint64_t indexInChain) const
     {
-        return readUIntTag(m_strileByteCountsTag, idx, ok);
+        // To prevent infinite looping on corrupted files
+        if (offset == 0 ||
+            !m_visitedImageOffsets->visit(offset, indexInChain))
+            return nullptr;
+
+        // Parse outside of m_mutex, so that parsing an IFD does not block
+        // accesses to other IFDs, but only once per IFD.
+        Slot *slot = this->slot(offset, indexInChain);
+        std::call_once(slot->onceFlag,
+                       [this, slot, offset]()
+                       {
+                           if (m_isBigTIFF)
+                               setSlotImage(slot, Image::open<true>(
+                                                      m_rc, offset,
+                                                      m_visitedImageOffsets,
+                                                      slot->indexInChain));
+                           else
+                               setSlotImage(slot, Image::open<false>(
+                                                      m_rc, offset,
+                                                      m_visitedImageOffsets,
+                                                      slot->indexInChain));
+                       });
+        return slot->image.get();
     }
+};
 
-    /** Return the offset of a tile from its coordinates */
-    uint64_t tileByteCount(uint32_t xtile, uint32_t ytile, uint32_t bandIdx,
-                           bool &ok) const
+/** Index of the offsets of the IFDs of the main chain of a file.
+ *
+ * It is built by only following the next IFD offsets, without decoding
+ * any tag entry: for each IFD, only its tag count and its next IFD offset
+ * are read. This gives the page count of a file, and allows opening any
+ * page directly.
+ *
+ * This class is thread-safe.
+ */
+class IFDChainIndex
+{
+  public:
+    /** Constructor. Should not be called directly. Use the build() method */
+    IFDChainIndex(const std::shared_ptr<const ReadContext> &rc, bool isBigTIFF)
+        : m_rc(rc), m_isBigTIFF(isBigTIFF)
     {
-        const auto idx = tileCoordinateToIdx(xtile, ytile, bandIdx, ok);
-        return ok ? strileByteCount(idx, ok) : 0;
     }
 
-    /** Return the list of tags */
-    inline const std::vector<TagEntry> &tags() const
+    /** Return the number of IFDs in the chain */
+    inline size_t pageCount() const
     {
-        return m_tags;
+        return m_offsets.size();
     }
 
-    /** Return the (first) tag corresponding to a code, or nullptr if not found */
-    const TagEntry *tag(TagCodeType tagCode) const
+    /** Return the offset of the IFD of (0-based) index page */
+    inline uint64_t offset(size_t page) const
     {
-        for (const auto &tag : m_tags)
-        {
-            if (tag.tag == tagCode)
-                return &tag;
-        }
-        return nullptr;
+        return m_offsets[page];
     }
 
-    /** Read an ASCII tag as a string */
-    std::string readTagAsString(const TagEntry &tag, bool &ok) const
+    /** Return the offsets of all IFDs of the chain */
+    inline const std::vector<uint64_t> &offsets() const
     {
-        if (tag.type == TagType::ASCII)
-        {
-            if (tag.value_offset)
-            {
-                if LIBERTIFF_CONSTEXPR (sizeof(tag.count) > sizeof(size_t))
-                {
-                    // "- 1" not strictly necessary, but pleases Coverity Scan
-                    if (tag.count > std::numeric_limits<size_t>::max() - 1)
-                    {
-                        ok = false;
-                        return std::string();
-                    }
-                }
-                return readContext()->readString(
-                    tag.value_offset, static_cast<size_t>(tag.count), ok);
-            }
-            if (tag.count)
-            {
-                std::string res(tag.charValues.data(),
-                                static_cast<size_t>(tag.count));
-                if (res.back() == 0)
-                    res.pop_back();
-                return res;
-            }
-        }
-        ok = false;
-        return std::string();
+        return m_offsets;
     }
 
-    /** Read a numeric tag as a vector. You must use a type T which is
-     * consistent with the tag.type value. For example, if
-     * tag.type == libertiff::TagType::Short, T must be uint16_t.
-     * libertiff::TagType::Undefined must be read with T=uint8_t.
-     */
-    template <class T>
-    std::vector<T> readTagAsVector(const TagEntry &tag, bool &ok) const
+    /** Return whether the end of the chain was reached normally, that is
+     * not because of a read error or a cycle */
+    inline bool isComplete() const
     {
-        return detail::readTagAsVector<T>(*(m_rc.get()), tag, ok);
+        return m_isComplete;
     }
 
-    /** Returns a new Image instance for the IFD starting at offset imageOffset */
-    template <bool isBigTIFF>
-    static std::unique_ptr<const Image>
-    open(const std::shared_ptr<const ReadContext> &rc,
-         const uint64_t imageOffset,
-         const std::set<uint64_t> &alreadyVisitedImageOffsets =
-             std::set<uint64_t>())
+    /** Returns a new Image instance for the IFD of (0-based) index page, or
+     * nullptr if page is out of range or the IFD cannot be read.
+     *
+     * Image::next() can be used on the returned image.
+     */
+    std::unique_ptr<const Image> openPage(size_t page) const
     {
-        // To prevent infinite looping on corrupted files
-        if (imageOffset == 0 || alreadyVisitedImageOffsets.find(imageOffset) !=
-                                    alreadyVisitedImageOffsets.end())
-        {
+        if (page >= m_offsets.size())
             return nullptr;
-        }
+        if (m_isBigTIFF)
+            return Image::open<true>(m_rc, m_offsets[page],
+                                     m_visitedImageOffsets, page);
+        else
+            return Image::open<false>(m_rc, m_offsets[page],
+                                      m_visitedImageOffsets, page);
+    }
 
-        auto image = LIBERTIFF_NS::make_unique<Image>(rc, isBigTIFF);
+    /** Build the index of the chain of IFDs starting at firstImage (typically
+     * returned by open()) */
+    static std::unique_ptr<const IFDChainIndex> build(const Image &firstImage)
+    {
+        auto index = LIBERTIFF_NS::make_unique<IFDChainIndex>(
+            firstImage.readContext(), firstImage.isBigTIFF());
+        if (firstImage.isBigTIFF())
+            index->followChain<true>(firstImage.offset());
+        else
+            index->followChain<false>(firstImage.offset());
+        return std::unique_ptr<const IFDChainIndex>(index.release());
+    }
 
-        image->m_offset = imageOffset;
-        image->m_alreadyVisitedImageOffsets = alreadyVisitedImageOffsets;
-        image->m_alreadyVisitedImageOffsets.insert(imageOffset);
+  private:
+    const std::shared_ptr<const ReadContext> m_rc;
+    const bool m_isBigTIFF;
+    bool m_isComplete = false;
+    std::vector<uint64_t> m_offsets{};
+    const std::shared_ptr<VisitedImageOffsets> m_visitedImageOffsets =
+        std::make_shared<VisitedImageOffsets>();
 
-        bool ok = true;
-        int tagCount = 0;
-        uint64_t offset = imageOffset;
-        if LIBERTIFF_CONSTEXPR (isBigTIFF)
-        {
-            // To prevent unsigned integer overflows in later additions. The
-            // theoretical max should be much closer to UINT64_MAX, but half of
-            // it is already more than needed in practice :-)
-            if (offset >= std::numeric_limits<uint64_t>::max() / 2)
-                return nullptr;
+    IFDChainIndex(const IFDChainIndex &) = delete;
+    IFDChainIndex &operator=(const IFDChainIndex &) = delete;
 
-            const auto tagCount64Bit = rc->read<uint64_t>(offset, ok);
-            // Artificially limit to the same number of entries as ClassicTIFF
-            if (tagCount64Bit > std::numeric_limits<uint16_t>::max())
-                return nullptr;
-            tagCount = static_cast<int>(tagCount64Bit);
-            offset += sizeof(uint64_t);
-        }
-        else
-        {
-            tagCount = rc->read<uint16_t>(offset, ok);
-            offset += sizeof(uint16_t);
-        }
-        if (!ok)
-            return nullptr;
-        image->m_tags.reserve(tagCount);
-        assert(tagCount <= 65535);
-        for (int i = 0; i < tagCount; ++i)
+    template <bool isBigTIFF> void followChain(uint64_t imageOffset)
+    {
+        constexpr uint64_t entrySize = isBigTIFF ? 20 : 12;
+        while (imageOffset != 0)
         {
-            TagEntry entry;
-
-            // Read tag code
-            entry.tag = rc->read<uint16_t>(offset, ok);
-            offset += sizeof(uint16_t);
-
-            // Read tag data type
-            entry.type = rc->read<uint16_t>(offset, ok);
-            offset += sizeof(uint16_t);
+            // Same checks as in Image::open()
+            if (!m_visitedImageOffsets->visit(imageOffset, m_offsets.size()))
+                return;
 
-            // Read number of values
+            bool ok = true;
+            uint64_t tagCount;
+            uint64_t nextImageOffsetPos;
             if LIBERTIFF_CONSTEXPR (isBigTIFF)
             {
-                auto count = rc->read<uint64_t>(offset, ok);
-                entry.count = count;
-                offset += sizeof(count);
+                if (imageOffset >= std::numeric_limits<uint64_t>::max() / 2)
+                    return;
+                tagCount = m_rc->read<uint64_t>(imageOffset, ok);
+                if (tagCount > std::numeric_limits<uint16_t>::max())
+                    return;
+                nextImageOffsetPos = imageOffset + sizeof(uint64_t);
             }
             else
             {
-                auto count = rc->read<uint32_t>(offset, ok);
-                entry.count = count;
-                offset += sizeof(count);
-            }
-
-            uint32_t singleValue = 0;
-            bool singleValueFitsInUInt32 = false;
-            if (entry.count)
-            {
-                if LIBERTIFF_CONSTEXPR (isBigTIFF)
-                {
-                    image->ParseTagEntryDataOrOffset<uint64_t>(
-                        entry, offset, singleValueFitsInUInt32, singleValue,
-                        ok);
-                }
-                else
-                {
-                    image->ParseTagEntryDataOrOffset<uint32_t>(
-                        entry, offset, singleValueFitsInUInt32, singleValue,
-                        ok);
-                }
+                tagCount = m_rc->read<uint16_t>(imageOffset, ok);
+                nextImageOffsetPos = imageOffset + sizeof(uint16_t);
             }
             if (!ok)
-                return nullptr;
-
-            image->processTag(entry, singleValueFitsInUInt32, singleValue);
+                return;
+            m_offsets.push_back(imageOffset);
 
-            image->m_tags.push_back(entry);
+            nextImageOffsetPos += tagCount * entrySize;
+            if LIBERTIFF_CONSTEXPR (isBigTIFF)
+                imageOffset = m_rc->read<uint64_t>(nextImageOffsetPos, ok);
+            else
+                imageOffset = m_rc->read<uint32_t>(nextImageOffsetPos, ok);
+            if (!ok)
+                return;
         }
+        m_isComplete = true;
+    }
+};
 
-        image->finalTagProcessing();
-
-        if LIBERTIFF_CONSTEXPR (isBigTIFF)
-            image->m_nextImageOffset = rc->read<uint64_t>(offset, ok);
-        else
-            image->m_nextImageOffset = rc->read<uint32_t>(offset, ok);
+/** Resolution levels of an image: the full-resolution image and its
+ * reduced-resolution versions (overviews), with their transparency masks.
+ *
+ * Overviews are looked for both in the SubIFDs of the full-resolution image
+ * and in the IFDs that follow it in the main chain and have the
+ * SubFileTypeFlags::ReducedImage or SubFileTypeFlags::Mask flag set.
+ * Masks are associated with the level of the same dimensions.
+ *
+ * This class is thread-safe.
+ */
+class Pyramid
+{
+  public:
+    /** Return the number of resolution levels (including the full-resolution
+     * one) */
+    inline size_t levelCount() const
+    {
+        return m_levels.size();
+    }
 
-        image->m_openFunc = open<isBigTIFF>;
+    /** Return the image of level idx. Level 0 is the full-resolution image,
+     * and following levels have decreasing widths */
+    inline const Image &level(size_t idx) const
+    {
+        return *(m_levels[idx].image);
+    }
 
-        return std::unique_ptr<const Image>(image.release());
+    /** Return the transparency mask of level idx, or nullptr if none */
+    inline const Image *mask(size_t idx) const
+    {
+        return m_levels[idx].mask.get();
     }
 
-    /** Returns a new Image instance at the next IFD, or nullptr if there is none */
-    std::unique_ptr<const Image> next() const
+    /** Return the index of the lowest resolution level whose width is at
+     * least targetWidth, that is the smallest one that can be downsampled
+     * to targetWidth, or 0 if targetWidth is larger than the full-resolution
+     * width. Runs in logarithmic time.
+     */
+    size_t bestLevel(uint32_t targetWidth) const
     {
-        return m_openFunc(m_rc, m_nextImageOffset,
-                          m_alreadyVisitedImageOffsets);
+        // m_levels is sorted by decreasing width: find the first level whose
+        // width is lower than targetWidth, and take the one before it.
+        const auto iter =
+            std::upper_bound(m_levels.begin(), m_levels.end(), targetWidth,
+                             [](uint32_t width, const Level &level)
+                             { return level.image->width() < width; });
+        const size_t idx = static_cast<size_t>(iter - m_levels.begin());
+        return idx == 0 ? 0 : idx - 1;
     }
 
-  private:
-    const std::shared_ptr<const ReadContext> m_rc;
-    std::unique_ptr<const Image> (*m_openFunc)(
-        const std::shared_ptr<const ReadContext> &, const uint64_t,
-        const std::set<uint64_t> &) = nullptr;
+    /** Build the pyramid whose full-resolution level is fullResolutionImage,
+     * typically a page of the main chain returned by open(), Image::next()
+     * or IFDChainIndex::openPage(). */
+    static std::unique_ptr<const Pyramid>
+    build(std::unique_ptr<const Image> fullResolutionImage)
+    {
+        if (!fullResolutionImage)
+            return nullptr;
 
-    std::set<uint64_t> m_alreadyVisitedImageOffsets{};
-    uint64_t m_offset = 0;
-    uint64_t m_nextImageOffset = 0;
-    uint32_t m_subFileType = 0;
-    uint32_t m_width = 0;
-    uint32_t m_height = 0;
-    uint32_t m_bitsPerSample = 0;
-    uint32_t m_samplesPerPixel = 0;
-    uint32_t m_rowsPerStrip = 0;
-    CompressionType m_compression = Compression::None;
-    SampleFormatType m_sampleFormat = SampleFormat::UnsignedInt;
-    PlanarConfigurationType m_planarConfiguration =
-        PlanarConfiguration::Contiguous;
-    PhotometricInterpretationType m_photometricInterpretation =
-        PhotometricInterpretation::MinIsBlack;
-    uint32_t m_predictor = 0;
+        auto pyramid = LIBERTIFF_NS::make_unique<Pyramid>();
+        const Image *fullResolution = fullResolutionImage.get();
+        pyramid->m_levels.push_back(
+            Level{std::move(fullResolutionImage), nullptr});
 
-    const bool m_isBigTIFF;
-    bool m_isTiled = false;
-    uint32_t m_tileWidth = 0;
-    uint32_t m_tileHeight = 0;
-    uint64_t m_strileCount = 0;
+        std::unordered_set<uint64_t> seenOffsets{fullResolution->offset()};
+        std::vector<std::unique_ptr<const Image>> masks;
+        const auto addImage =
+            [&pyramid, &masks, &seenOffsets,
+             fullResolution](std::unique_ptr<const Image> image)
+        {
+            if (!seenOffsets.insert(image->offset()).second)
+                return;
+            if (image->subFileType() & SubFileTypeFlags::Mask)
+                masks.push_back(std::move(image));
+            else if (image->width() <= fullResolution->width())
+                pyramid->m_levels.push_back(Level{std::move(image), nullptr});
+        };
+
+        // SubIFDs of the full-resolution image, and the chains that
+        // may start from them
+        bool ok = true;
+        for (uint64_t subIFDOffset : fullResolution->subIFDOffsets(ok))
+        {
+            auto image = fullResolution->openSubIFD(subIFDOffset);
+            while (image && !seenOffsets.count(image->offset()))
+            {
+                auto nextImage = image->next();
+                addImage(std::move(image));
+                image = std::move(nextImage);
+            }
+        }
 
-    std::vector<TagEntry> m_tags{};
-    const TagEntry *m_strileOffsetsTag = nullptr;
-    const TagEntry *m_strileByteCountsTag = nullptr;
+        // Overviews and masks following the full-resolution image in its
+        // chain
+        constexpr uint32_t overviewOrMaskFlags =
+            SubFileTypeFlags::ReducedImage | SubFileTypeFlags::Mask;
+        auto image = fullResolution->next();
+        while (image && (image->subFileType() & overviewOrMaskFlags) != 0)
+        {
+            auto nextImage = image->next();
+            addImage(std::move(image));
+            image = std::move(nextImage);
+        }
 
-    Image(const Image &) = delete;
-    Image &operator=(const Image &) = delete;
+        // Keep the full-resolution level first
+        std::stable_sort(pyramid->m_levels.begin() + 1,
+                         pyramid->m_levels.end(),
+                         [](const Level &a, const Level &b)
+                         { return a.image->width() > b.image->width(); });
 
-    /** Process tag */
-    void processTag(const TagEntry &entry, bool singleValueFitsInUInt32,
-                    uint32_t singleValue)
-    {
-        if (singleValueFitsInUInt32)
+        for (auto &mask : masks)
         {
-            switch (entry.tag)
+            for (auto &level : pyramid->m_levels)
             {
-                case TagCode::SubFileType:
-                    m_subFileType = singleValue;
+                if (!level.mask && level.image->width() == mask->width() &&
+                    level.image->height() == mask->height())
+                {
+                    level.mask = std::move(mask);
                     break;
+                }
+            }
+        }
 
-                case TagCode::ImageWidth:
-                    m_width = singleValue;
-                    break;
+        return std::unique_ptr<const Pyramid>(pyramid.release());
+    }
 
-                case TagCode::ImageLength:
-                    m_height = singleValue;
-                    break;
+  private:
+    struct Level
+    {
+        std::unique_ptr<const Image> image;
+        std::unique_ptr<const Image> mask;
+    };
 
-                case TagCode::Compression:
-                    m_compression = singleValue;
-                    break;
+    std::vector<Level> m_levels{};
+};
+}  // namespace LIBERTIFF_NS
 
-                case TagCode::SamplesPerPixel:
-                    m_samplesPerPixel = singleValue;
-                    break;
+#ifdef LIBERTIFF_C_FILE_READER
+#include <cstdio>
+#include <mutex>
 
-                case TagCode::RowsPerStrip:
-                    m_rowsPerStrip = singleValue;
-                    break;
+namespace LIBERTIFF_NS
+{
+/** Interface to read from a FILE* handle */
+class CFileReader final : public FileReader
+{
+  public:
+    explicit CFileReader(FILE *f) : m_f(f)
+    {
+    }
 
-                case TagCode::PlanarConfiguration:
-                    m_planarConfiguration = singleValue;
-                    break;
+    ~CFileReader() override
+    {
+        fclose(m_f);
+    }
 
-                case TagCode::PhotometricInterpretation:
-                    m_photometricInterpretation = singleValue;
-                    break;
+    uint64_t size() const override
+    {
+        std::lock_guard<std::mutex> oLock(m_oMutex);
+        fseek(m_f, 0, SEEK_END);
+        return ftell(m_f);
+    }
 
-                case TagCode::Predictor:
-                    m_predictor = singleValue;
-                    break;
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        std::lock_guard<std::mutex> oLock(m_oMutex);
+        if (fseek(m_f, static_cast<long>(offset), SEEK_SET) != 0)
+            return 0;
+        return fread(buffer, 1, count, m_f);
+    }
 
-                case TagCode::TileWidth:
-                    m_tileWidth = singleValue;
-                    break;
+  private:
+    FILE *const m_f;
+    mutable std::mutex m_oMutex{};
 
-                case TagCode::TileLength:
-                    m_tileHeight = singleValue;
-                    break;
+    CFileReader(const CFileReader &) = delete;
+    CFileReader &operator=(const CFileReader &) = delete;
+};
+}  // namespace LIBERTIFF_NS
+#endif
 
-                default:
-                    break;
-            }
-        }
+#ifdef LIBERTIFF_POSIX_FILE_READER
+#include <cerrno>
+#include <sys/stat.h>
+#include <unistd.h>
 
-        if (entry.count &&
-            (entry.type == TagType::Byte || entry.type == TagType::Short ||
-             entry.type == TagType::Long))
+namespace LIBERTIFF_NS
+{
+/** Interface to read from a POSIX file descriptor, using pread().
+ *
+ * Contrary to CFileReader, reads are not serialized: concurrent calls to
+ * read() from several threads do not contend on any lock.
+ * On 32-bit systems, _FILE_OFFSET_BITS=64 should be defined to be able to
+ * read files larger than 2 GB.
+ */
+class PosixFileReader final : public FileReader
+{
+  public:
+    /** Constructor. Takes ownership of fd, which is closed by the destructor */
+    explicit PosixFileReader(int fd) : m_fd(fd), m_size(getFileSize(fd))
+    {
+    }
+
+    ~PosixFileReader() override
+    {
+        close(m_fd);
+    }
+
+    uint64_t size() const override
+    {
+        return m_size;
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        // Max number of bytes requested per pread() call
+        constexpr size_t MAX_CHUNK_SIZE = 1024 * 1024 * 1024;
+
+        size_t totalRead = 0;
+        while (totalRead < count)
         {
-            // Values of those 2 tags are repeated per sample, but should be
-            // at the same value.
-            if (entry.tag == TagCode::SampleFormat)
+            if (offset + totalRead < offset ||
+                offset + totalRead >
+                    static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
             {
-                bool localOk = true;
-                const auto sampleFormat =
-                    static_cast<uint32_t>(readUIntTag(&entry, 0, localOk));
-                if (localOk)
-                {
-                    m_sampleFormat = sampleFormat;
-                }
+                break;
             }
-            else if (entry.tag == TagCode::BitsPerSample)
+            const ssize_t nRead =
+                pread(m_fd, static_cast<char *>(buffer) + totalRead,
+                      std::min(count - totalRead, MAX_CHUNK_SIZE),
+                      static_cast<off_t>(offset + totalRead));
+            if (nRead < 0)
             {
-                bool localOk = true;
-                const auto bitsPerSample =
-                    static_cast<uint32_t>(readUIntTag(&entry, 0, localOk));
-                if (localOk)
-                {
-                    m_bitsPerSample = bitsPerSample;
-                }
+                if (errno == EINTR)
+                    continue;
+                break;
             }
+            if (nRead == 0)
+                break;
+            totalRead += static_cast<size_t>(nRead);
         }
+        return totalRead;
     }
 
-    /** Final tag processing */
-    void finalTagProcessing()
+  private:
+    const int m_fd;
+    const uint64_t m_size;
+
+    PosixFileReader(const PosixFileReader &) = delete;
+    PosixFileReader &operator=(const PosixFileReader &) = delete;
+
+    static uint64_t getFileSize(int fd)
     {
-        m_strileOffsetsTag = tag(TagCode::TileOffsets);
-        if (m_strileOffsetsTag)
-        {
-            m_strileByteCountsTag = tag(TagCode::TileByteCounts);
-            if (m_strileByteCountsTag &&
-                m_strileOffsetsTag->count == m_strileByteCountsTag->count)
-            {
-                m_isTiled = true;
-                m_strileCount = m_strileOffsetsTag->count;
-            }
-        }
-        else
+        struct stat statBuf;
+        if (fstat(fd, &statBuf) != 0 || statBuf.st_size < 0)
+            return 0;
+        return static_cast<uint64_t>(statBuf.st_size);
+    }
+};
+}  // namespace LIBERTIFF_NS
+#endif
+
+#ifdef LIBERTIFF_MMAP_FILE_READER
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace LIBERTIFF_NS
+{
+/** Interface to read from a POSIX file descriptor, by memory-mapping the
+ * whole file in read-only mode.
+ *
+ * Bytes are directly accessible through data(), which the library uses to
+ * avoid copies when parsing IFDs and reading tag values.
+ * If the file cannot be mapped, isMapped() returns false and the reader
+ * behaves as an empty file.
+ */
+class MMapFileReader final : public FileReader
+{
+  public:
+    /** Constructor. Takes ownership of fd, which is closed once the file
+     * is mapped */
+    explicit MMapFileReader(int fd)
+    {
+        struct stat statBuf;
+        if (fstat(fd, &statBuf) == 0 && statBuf.st_size > 0 &&
+            static_cast<uint64_t>(statBuf.st_size) <=
+                std::numeric_limits<size_t>::max())
         {
-            m_strileOffsetsTag = tag(TagCode::StripOffsets);
-            if (m_strileOffsetsTag)
+            const size_t size = static_cast<size_t>(statBuf.st_size);
+            void *ptr = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr != MAP_FAILED)
             {
-                m_strileByteCountsTag = tag(TagCode::StripByteCounts);
-                if (m_strileByteCountsTag &&
-                    m_strileOffsetsTag->count == m_strileByteCountsTag->count)
-                {
-                    m_strileCount = m_strileOffsetsTag->count;
-                }
+                m_data = static_cast<const uint8_t *>(ptr);
+                m_size = size;
             }
         }
+        close(fd);
+    }
+
+    ~MMapFileReader() override
+    {
+        if (m_data)
+            munmap(const_cast<uint8_t *>(m_data), m_size);
+    }
+
+    /** Return whether the file could be mapped (which is not the case of
+     * empty files) */
+    bool isMapped() const
+    {
+        return m_data != nullptr;
+    }
+
+    uint64_t size() const override
+    {
+        return m_size;
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        if (offset >= m_size)
+            return 0;
+        count = std::min(count, m_size - static_cast<size_t>(offset));
+        std::memcpy(buffer, m_data + offset, count);
+        return count;
+    }
+
+    const uint8_t *data(uint64_t offset, size_t count) const override
+    {
+        if (offset > m_size || count > m_size - static_cast<size_t>(offset))
+            return nullptr;
+        return m_data + offset;
+    }
+
+  private:
+    const uint8_t *m_data = nullptr;
+    size_t m_size = 0;
+
+    MMapFileReader(const MMapFileReader &) = delete;
+    MMapFileReader &operator=(const MMapFileReader &) = delete;
+};
+}  // namespace LIBERTIFF_NS
+#endif
+
+#ifdef LIBERTIFF_CACHING_FILE_READER
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace LIBERTIFF_NS
+{
+/** FileReader decorator caching blocks of another FileReader.
+ *
+ * Reads are split into aligned blocks, which are kept in a memory-bounded
+ * least-recently-used cache. The cache is split into shards, each with its
+ * own lock, so that concurrent readers rarely contend.
+ * Consecutive missing blocks of a read are fetched with a single read of
+ * the underlying FileReader. Reads larger than half of the cache size are
+ * not cached.
+ *
+ * This class is thread-safe if the underlying FileReader is thread-safe.
+ */
+class CachingFileReader final : public FileReader
+{
+  public:
+    /** Constructor.
+     *
+     * @param file Underlying file reader.
+     * @param blockSize Size in bytes of cached blocks.
+     * @param maxCacheSize Maximum number of bytes of cached blocks.
+     * @param shardCount Number of independently locked shards.
+     */
+    explicit CachingFileReader(const std::shared_ptr<const FileReader> &file,
+                               size_t blockSize = 16 * 1024,
+                               size_t maxCacheSize = 16 * 1024 * 1024,
+                               size_t shardCount = 16)
+        : m_file(file), m_size(file->size()),
+          m_blockSize(std::max<size_t>(1, blockSize)),
+          m_maxCacheSize(maxCacheSize),
+          m_shardCount(std::max<size_t>(1, shardCount)),
+          m_maxShardSize(
+              std::max(m_blockSize, m_maxCacheSize / m_shardCount)),
+          m_shards(new Shard[m_shardCount])
+    {
     }
 
-    /** Read a value from a byte/short/long/long8 array tag */
-    uint64_t readUIntTag(const TagEntry *tag, uint64_t idx, bool &ok) const
+    uint64_t size() const override
     {
-        if (tag && idx < tag->count)
+        return m_size;
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        if (count == 0 || offset >= m_size)
+            return 0;
+        count = static_cast<size_t>(std::min<uint64_t>(count, m_size - offset));
+        if (count > m_maxCacheSize / 2)
+            return m_file->read(offset, count, buffer);
+
+        uint8_t *out = static_cast<uint8_t *>(buffer);
+        const uint64_t lastBlockIdx = (offset + count - 1) / m_blockSize;
+        uint64_t blockIdx = offset / m_blockSize;
+        while (blockIdx <= lastBlockIdx)
         {
-            if (tag->type == TagType::Byte)
-            {
-                if (tag->count <= (m_isBigTIFF ? 8 : 4))
-                {
-                    return tag->uint8Values[size_t(idx)];
-                }
-                return m_rc->read<uint8_t>(
-                    tag->value_offset + sizeof(uint8_t) * idx, ok);
-            }
-            else if (tag->type == TagType::Short)
+            if (copyFromCache(blockIdx, offset, count, out))
             {
-                if (tag->count <= (m_isBigTIFF ? 4 : 2))
-                {
-                    return tag->uint16Values[size_t(idx)];
-                }
-                return m_rc->read<uint16_t>(
-                    tag->value_offset + sizeof(uint16_t) * idx, ok);
+                ++blockIdx;
+                continue;
             }
-            else if (tag->type == TagType::Long)
+
+            // Collect the run of consecutive missing blocks, to fetch them
+            // in a single request. The block ending the run, if any, is
+            // copied from the cache by copyFromCache().
+            uint64_t runEndIdx = blockIdx + 1;
+            while (runEndIdx <= lastBlockIdx &&
+                   !copyFromCache(runEndIdx, offset, count, out))
             {
-                if (tag->count <= (m_isBigTIFF ? 2 : 1))
-                {
-                    return tag->uint32Values[size_t(idx)];
-                }
-                return m_rc->read<uint32_t>(
-                    tag->value_offset + sizeof(uint32_t) * idx, ok);
+                ++runEndIdx;
             }
-            else if (m_isBigTIFF && tag->type == TagType::Long8)
+
+            const uint64_t runOffset = blockIdx * m_blockSize;
+            const size_t runSize = static_cast<size_t>(std::min<uint64_t>(
+                (runEndIdx - blockIdx) * m_blockSize, m_size - runOffset));
+            std::vector<uint8_t> runData(runSize);
+            const size_t runRead =
+                m_file->read(runOffset, runSize, runData.data());
+            for (uint64_t idx = blockIdx; idx < runEndIdx; ++idx)
             {
-                if (tag->count <= 1)
+                const size_t blockOffsetInRun =
+                    static_cast<size_t>(idx - blockIdx) * m_blockSize;
+                const size_t thisBlockSize =
+                    std::min(m_blockSize, runSize - blockOffsetInRun);
+                if (blockOffsetInRun + thisBlockSize > runRead)
                 {
-                    return tag->uint64Values[size_t(idx)];
+                    // Return the number of bytes before the failed block
+                    const uint64_t failedOffset =
+                        runOffset + std::min(runRead, blockOffsetInRun);
+                    return failedOffset > offset
+                               ? static_cast<size_t>(failedOffset - offset)
+                               : 0;
                 }
-                return m_rc->read<uint64_t>(
-                    tag->value_offset + sizeof(uint64_t) * idx, ok);
+                ++m_missCount;
+                std::vector<uint8_t> block(
+                    runData.begin() + blockOffsetInRun,
+                    runData.begin() + blockOffsetInRun + thisBlockSize);
+                copyBlockPart(idx, block, offset, count, out);
+                insertInCache(idx, std::move(block));
             }
+            blockIdx = runEndIdx + 1;
         }
-        ok = false;
-        return 0;
+        return count;
     }
 
-    template <class DataOrOffsetType>
-    void ParseTagEntryDataOrOffset(TagEntry &entry, uint64_t &offset,
-                                   bool &singleValueFitsInUInt32,
-                                   uint32_t &singleValue, bool &ok)
+    const uint8_t *data(uint64_t offset, size_t count) const override
     {
-        LIBERTIFF_STATIC_ASSERT(
-            (std::is_same<DataOrOffsetType, uint32_t>::value ||
-             std::is_same<DataOrOffsetType, uint64_t>::value));
-        assert(entry.count > 0);
+        return m_file->data(offset, count);
+    }
 
-        const uint32_t dataTypeSize = tagTypeSize(entry.type);
-        if (dataTypeSize == 0)
-        {
-            return;
-        }
+    bool providesData() const override
+    {
+        return m_file->providesData();
+    }
 
-        // There are 2 cases:
-        // - either the number of values for the data type can fit
-        //   in the next DataOrOffsetType bytes
-        // - or it cannot, and then the next DataOrOffsetType bytes are an offset
-        //   to the values
-        if (dataTypeSize > sizeof(DataOrOffsetType) / entry.count)
+    bool readMulti(const Range *ranges, size_t count) const override
+    {
+        // Serve the blocks that are cached, and collect the blocks missing
+        // for all ranges, as well as the ranges too large to be cached, to
+        // fetch them with a single readMulti() call of the underlying reader.
+        std::vector<Range> fetchRanges;
+        // Missing blocks, with the index of a range that needs each of them
+        std::vector<std::pair<uint64_t, size_t>> missingBlocks;
+        for (size_t i = 0; i < count; ++i)
         {
-            // Out-of-line values. We read a file offset
-            entry.value_offset = m_rc->read<DataOrOffsetType>(offset, ok);
-            if (entry.value_offset == 0)
-            {
-                // value_offset = 0 for a out-of-line tag is obviously
-                // wrong and would cause later confusion in readTagAsVector<>,
-                // so better reject the file.
-                ok = false;
-                return;
-            }
-            if (dataTypeSize >
-                std::numeric_limits<uint64_t>::max() / entry.count)
-            {
-                entry.invalid_value_offset = true;
-            }
-            else
+            const Range &range = ranges[i];
+            if (range.count == 0)
+                continue;
+            if (range.offset >= m_size || range.count > m_size - range.offset)
+                return false;
+            if (range.count > m_maxCacheSize / 2)
             {
-                const uint64_t byteCount = uint64_t(dataTypeSize) * entry.count;
-
-                // Size of tag data beyond which we check the tag position and size
-                // w.r.t the file size.
-                constexpr uint32_t THRESHOLD_CHECK_FILE_SIZE = 10 * 1000 * 1000;
-
-                entry.invalid_value_offset =
-                    (byteCount > THRESHOLD_CHECK_FILE_SIZE &&
-                     (m_rc->size() < byteCount ||
-                      entry.value_offset > m_rc->size() - byteCount));
+                fetchRanges.push_back(range);
+                continue;
             }
-        }
-        else if (dataTypeSize == sizeof(uint8_t))
-        {
-            // Read up to 4 (classic) or 8 (BigTIFF) inline bytes
-            m_rc->read(offset, size_t(entry.count), &entry.uint8Values[0], ok);
-            if (entry.count == 1 && entry.type == TagType::Byte)
+            uint8_t *out = static_cast<uint8_t *>(range.buffer);
+            const uint64_t lastBlockIdx =
+                (range.offset + range.count - 1) / m_blockSize;
+            for (uint64_t idx = range.offset / m_blockSize;
+                 idx <= lastBlockIdx; ++idx)
             {
-                singleValueFitsInUInt32 = true;
-                singleValue = entry.uint8Values[0];
+                if (!copyFromCache(idx, range.offset, range.count, out))
+                    missingBlocks.emplace_back(idx, i);
             }
         }
-        else if (dataTypeSize == sizeof(uint16_t))
+        if (fetchRanges.empty() && missingBlocks.empty())
+            return true;
+        std::sort(missingBlocks.begin(), missingBlocks.end());
+
+        // Group consecutive missing blocks into runs
+        const size_t firstRunIdx = fetchRanges.size();
+        std::vector<std::vector<uint8_t>> runData;
+        for (size_t i = 0; i < missingBlocks.size();)
         {
-            // Read up to 2 (classic) or 4 (BigTIFF) inline 16-bit values
-            assert(entry.count <= 4);
-            for (uint32_t idx = 0; idx < entry.count; ++idx)
-            {
-                entry.uint16Values[idx] =
-                    m_rc->read<uint16_t>(offset + idx * sizeof(uint16_t), ok);
-            }
-            if (entry.count == 1 && entry.type == TagType::Short)
+            size_t j = i + 1;
+            while (j < missingBlocks.size() &&
+                   missingBlocks[j].first <= missingBlocks[j - 1].first + 1)
             {
-                singleValueFitsInUInt32 = true;
-                singleValue = entry.uint16Values[0];
+                ++j;
             }
+            const uint64_t runOffset = missingBlocks[i].first * m_blockSize;
+            const uint64_t runEnd = std::min<uint64_t>(
+                (missingBlocks[j - 1].first + 1) * m_blockSize, m_size);
+            runData.emplace_back(static_cast<size_t>(runEnd - runOffset));
+            fetchRanges.push_back(
+                Range{runOffset, runData.back().size(), nullptr});
+            i = j;
         }
-        else if (dataTypeSize == sizeof(uint32_t))
+        for (size_t i = 0; i < runData.size(); ++i)
+            fetchRanges[firstRunIdx + i].buffer = runData[i].data();
+
+        if (!m_file->readMulti(fetchRanges.data(), fetchRanges.size()))
+            return false;
+
+        // Copy the fetched blocks into the ranges that need them, and cache
+        // them
+        size_t missingIdx = 0;
+        for (size_t i = 0; i < runData.size(); ++i)
         {
-            // Read up to 1 (classic) or 2 (BigTIFF) inline 32-bit values
-            entry.uint32Values[0] = m_rc->read<uint32_t>(offset, ok);
-            if (entry.count == 1 && entry.type == TagType::Long)
-            {
-                singleValueFitsInUInt32 = true;
-                singleValue = entry.uint32Values[0];
-            }
-            if LIBERTIFF_CONSTEXPR (std::is_same<DataOrOffsetType,
-                                                 uint64_t>::value)
+            const uint64_t firstBlockIdx =
+                fetchRanges[firstRunIdx + i].offset / m_blockSize;
+            for (size_t blockOffsetInRun = 0;
+                 blockOffsetInRun < runData[i].size();
+                 blockOffsetInRun += m_blockSize)
             {
-                if (entry.count == 2)
+                const uint64_t idx =
+                    firstBlockIdx + blockOffsetInRun / m_blockSize;
+                const size_t thisBlockSize = std::min(
+                    m_blockSize, runData[i].size() - blockOffsetInRun);
+                std::vector<uint8_t> block(
+                    runData[i].begin() + blockOffsetInRun,
+                    runData[i].begin() + blockOffsetInRun + thisBlockSize);
+                for (; missingIdx < missingBlocks.size() &&
+                       missingBlocks[missingIdx].first == idx;
+                     ++missingIdx)
                 {
-                    entry.uint32Values[1] =
-                        m_rc->read<uint32_t>(offset + sizeof(uint32_t), ok);
+                    const Range &range =
+                        ranges[missingBlocks[missingIdx].second];
+                    copyBlockPart(idx, block, range.offset, range.count,
+                                  static_cast<uint8_t *>(range.buffer));
                 }
+                ++m_missCount;
+                insertInCache(idx, std::move(block));
             }
         }
-        else if LIBERTIFF_CONSTEXPR (std::is_same<DataOrOffsetType,
-                                                  uint64_t>::value)
-        {
-            if (dataTypeSize == sizeof(uint64_t))
-            {
-                // Read one inline 64-bit value
-                if (entry.type == TagType::Rational)
-                    entry.float64Values[0] = m_rc->readRational(offset, ok);
-                else if (entry.type == TagType::SRational)
-                    entry.float64Values[0] =
-                        m_rc->readSignedRational(offset, ok);
-                else
-                    entry.uint64Values[0] = m_rc->read<uint64_t>(offset, ok);
-            }
-            else
-            {
-                assert(false);
-            }
-        }
-        else
-        {
-            // fprintf(stderr, "Unexpected case: tag=%u, dataType=%u, count=%u\n", entry.tag, entry.type, entry.count);
-            assert(false);
-        }
+        return true;
+    }
 
-        offset += sizeof(DataOrOffsetType);
+    /** Return the number of blocks served from the cache */
+    uint64_t hitCount() const
+    {
+        return m_hitCount;
     }
-};
 
-/** Open a TIFF file and return its first Image File Directory
- */
-template <bool acceptBigTIFF = true>
-std::unique_ptr<const Image> open(const std::shared_ptr<const FileReader> &file)
-{
-    unsigned char signature[2] = {0, 0};
-    (void)file->read(0, 2, signature);
-    const bool littleEndian = signature[0] == 'I' && signature[1] == 'I';
-    const bool bigEndian = signature[0] == 'M' && signature[1] == 'M';
-    if (!littleEndian && !bigEndian)
-        return nullptr;
+    /** Return the number of blocks fetched from the underlying reader */
+    uint64_t missCount() const
+    {
+        return m_missCount;
+    }
 
-    const bool mustByteSwap = littleEndian ^ isHostLittleEndian();
+  private:
+    struct CachedBlock
+    {
+        uint64_t idx;
+        std::vector<uint8_t> data;
+    };
 
-    auto rc = std::make_shared<ReadContext>(file, mustByteSwap);
-    bool ok = true;
-    const int version = rc->read<uint16_t>(2, ok);
-    constexpr int CLASSIC_TIFF_VERSION = 42;
-    if (version == CLASSIC_TIFF_VERSION)
+    struct Shard
     {
-        const auto firstImageOffset = rc->read<uint32_t>(4, ok);
-        return Image::open<false>(rc, firstImageOffset, {});
+        std::mutex mutex{};
+        std::list<CachedBlock> lru{};  // most recently used first
+        std::unordered_map<uint64_t, std::list<CachedBlock>::iterator> map{};
+        size_t cachedSize = 0;
+    };
+
+    const std::shared_ptr<const FileReader> m_file;
+    const uint64_t m_size;
+    const size_t m_blockSize;
+    const size_t m_maxCacheSize;
+    const size_t m_shardCount;
+    const size_t m_maxShardSize;
+    const std::unique_ptr<Shard[]> m_shards;
+    mutable std::atomic<uint64_t> m_hitCount{0};
+    mutable std::atomic<uint64_t> m_missCount{0};
+
+    CachingFileReader(const CachingFileReader &) = delete;
+    CachingFileReader &operator=(const CachingFileReader &) = delete;
+
+    Shard &shard(uint64_t blockIdx) const
+    {
+        return m_shards[static_cast<size_t>(blockIdx % m_shardCount)];
     }
-    else if LIBERTIFF_CONSTEXPR (acceptBigTIFF)
+
+    /** Copy the part of block blockIdx that intersects [offset, offset+count[
+     * into the corresponding location of out */
+    void copyBlockPart(uint64_t blockIdx, const std::vector<uint8_t> &block,
+                       uint64_t offset, size_t count, uint8_t *out) const
     {
-        constexpr int BIGTIFF_VERSION = 43;
-        if (version == BIGTIFF_VERSION)
+        const uint64_t blockOffset = blockIdx * m_blockSize;
+        const uint64_t start = std::max(blockOffset, offset);
+        const uint64_t end =
+            std::min<uint64_t>(blockOffset + block.size(), offset + count);
+        if (start < end)
         {
-            const auto byteSizeOfOffsets = rc->read<uint16_t>(4, ok);
-            if (byteSizeOfOffsets != 8)
-                return nullptr;
-            const auto zeroWord = rc->read<uint16_t>(6, ok);
-            if (zeroWord != 0 || !ok)
-                return nullptr;
-            const auto firstImageOffset = rc->read<uint64_t>(8, ok);
-            return Image::open<true>(rc, firstImageOffset, {});
+            std::memcpy(out + static_cast<size_t>(start - offset),
+                        block.data() + static_cast<size_t>(start - blockOffset),
+                        static_cast<size_t>(end - start));
         }
     }
 
-    return nullptr;
-}
+    /** Copy the relevant part of block blockIdx into out if it is cached,
+     * and return whether it was */
+    bool copyFromCache(uint64_t blockIdx, uint64_t offset, size_t count,
+                       uint8_t *out) const
+    {
+        Shard &s = shard(blockIdx);
+        std::lock_guard<std::mutex> oLock(s.mutex);
+        const auto iter = s.map.find(blockIdx);
+        if (iter == s.map.end())
+            return false;
+        s.lru.splice(s.lru.begin(), s.lru, iter->second);
+        copyBlockPart(blockIdx, iter->second->data, offset, count, out);
+        ++m_hitCount;
+        return true;
+    }
+
+    void insertInCache(uint64_t blockIdx, std::vector<uint8_t> &&block) const
+    {
+        Shard &s = shard(blockIdx);
+        std::lock_guard<std::mutex> oLock(s.mutex);
+        if (s.map.find(blockIdx) != s.map.end())
+            return;
+        s.cachedSize += block.size();
+        s.lru.push_front(CachedBlock{blockIdx, std::move(block)});
+        s.map[blockIdx] = s.lru.begin();
+        while (s.cachedSize > m_maxShardSize)
+        {
+            const CachedBlock &evicted = s.lru.back();
+            s.cachedSize -= evicted.data.size();
+            s.map.erase(evicted.idx);
+            s.lru.pop_back();
+        }
+    }
+};
 }  // namespace LIBERTIFF_NS
+#endif
 
-#ifdef LIBERTIFF_C_FILE_READER
-#include <cstdio>
+#ifdef LIBERTIFF_METADATA_CACHE
+#include <list>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 
 namespace LIBERTIFF_NS
 {
-/** Interface to read from a FILE* handle */
-class CFileReader final : public FileReader
+/** Memory-bounded least-recently-used cache of opened TiffDocument, keyed
+ * by a caller-supplied identity of the file (see makeKey()).
+ *
+ * Cached documents are immutable and can be shared by all users of a file.
+ * The memory usage of a document is estimated when it is inserted and each
+ * time it is retrieved, as it grows when more IFDs or strile array pages are
+ * loaded. Documents maintain that estimate as they grow, so that refreshing
+ * it is cheap. Evicted
+ * documents remain valid for as long as they are referenced.
+ *
+ * This class is thread-safe.
+ */
+class MetadataCache
 {
   public:
-    explicit CFileReader(FILE *f) : m_f(f)
+    /** Constructor.
+     *
+     * @param maxMemoryUsage Maximum estimated memory usage, in bytes, of
+     *                       cached documents.
+     */
+    explicit MetadataCache(size_t maxMemoryUsage = 64 * 1024 * 1024)
+        : m_maxMemoryUsage(maxMemoryUsage)
     {
     }
 
-    ~CFileReader() override
+    /** Return the process-wide instance */
+    static MetadataCache &global()
     {
-        fclose(m_f);
+        static MetadataCache cache;
+        return cache;
     }
 
-    uint64_t size() const override
+    /** Return a key identifying a file from its path, size and modification
+     * time, so that a modified file gets a new entry */
+    static std::string makeKey(const std::string &path, uint64_t size,
+                               uint64_t mtime)
     {
-        std::lock_guard<std::mutex> oLock(m_oMutex);
-        fseek(m_f, 0, SEEK_END);
-        return ftell(m_f);
+        std::string key(path);
+        key += '\0';
+        key += std::to_string(size);
+        key += '\0';
+        key += std::to_string(mtime);
+        return key;
     }
 
-    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    /** Return the document cached for key, or nullptr if there is none */
+    std::shared_ptr<const TiffDocument> get(const std::string &key)
     {
-        std::lock_guard<std::mutex> oLock(m_oMutex);
-        if (fseek(m_f, static_cast<long>(offset), SEEK_SET) != 0)
-            return 0;
-        return fread(buffer, 1, count, m_f);
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const auto iter = m_map.find(key);
+        if (iter == m_map.end())
+        {
+            ++m_missCount;
+            return nullptr;
+        }
+        ++m_hitCount;
+        m_lru.splice(m_lru.begin(), m_lru, iter->second);
+        Entry &entry = *(iter->second);
+        auto document = entry.document;
+        updateMemoryUsage(entry);
+        evictIfNeeded();
+        return document;
+    }
+
+    /** Insert document in the cache for key, and return the cached document
+     * for key, which may be another one if it was inserted concurrently */
+    std::shared_ptr<const TiffDocument>
+    insert(const std::string &key,
+           const std::shared_ptr<const TiffDocument> &document)
+    {
+        if (!document)
+            return nullptr;
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const auto iter = m_map.find(key);
+        if (iter != m_map.end())
+            return iter->second->document;
+        m_lru.push_front(Entry{key, document, 0});
+        m_map[key] = m_lru.begin();
+        updateMemoryUsage(m_lru.front());
+        evictIfNeeded();
+        return document;
+    }
+
+    /** Return the document cached for key, or open it from file and cache
+     * it. Returns nullptr if it cannot be opened */
+    std::shared_ptr<const TiffDocument>
+    open(const std::string &key, const std::shared_ptr<const FileReader> &file,
+         const OpenOptions &options = OpenOptions())
+    {
+        auto document = get(key);
+        if (document)
+            return document;
+        // Open outside of the lock, as it involves I/O
+        return insert(key, TiffDocument::open(file, options));
+    }
+
+    /** Remove the document cached for key, if any */
+    void remove(const std::string &key)
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        const auto iter = m_map.find(key);
+        if (iter != m_map.end())
+            evict(iter->second);
+    }
+
+    /** Remove all cached documents */
+    void clear()
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        m_map.clear();
+        m_lru.clear();
+        m_memoryUsage = 0;
+    }
+
+    /** Set the maximum estimated memory usage, in bytes, of cached
+     * documents */
+    void setMaxMemoryUsage(size_t maxMemoryUsage)
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        m_maxMemoryUsage = maxMemoryUsage;
+        evictIfNeeded();
+    }
+
+    /** Return the estimated memory usage, in bytes, of cached documents */
+    size_t memoryUsage() const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        return m_memoryUsage;
+    }
+
+    /** Return the number of cached documents */
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        return m_lru.size();
+    }
+
+    /** Return the number of lookups that found a cached document */
+    uint64_t hitCount() const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        return m_hitCount;
+    }
+
+    /** Return the number of lookups that did not find a cached document */
+    uint64_t missCount() const
+    {
+        std::lock_guard<std::mutex> oLock(m_mutex);
+        return m_missCount;
     }
 
   private:
-    FILE *const m_f;
-    mutable std::mutex m_oMutex{};
+    struct Entry
+    {
+        std::string key;
+        std::shared_ptr<const TiffDocument> document;
+        size_t memoryUsage;
+    };
 
-    CFileReader(const CFileReader &) = delete;
-    CFileReader &operator=(const CFileReader &) = delete;
+    mutable std::mutex m_mutex{};
+    std::list<Entry> m_lru{};  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> m_map{};
+    size_t m_maxMemoryUsage;
+    size_t m_memoryUsage = 0;
+    uint64_t m_hitCount = 0;
+    uint64_t m_missCount = 0;
+
+    MetadataCache(const MetadataCache &) = delete;
+    MetadataCache &operator=(const MetadataCache &) = delete;
+
+    void updateMemoryUsage(Entry &entry)
+    {
+        const size_t usage = entry.key.size() + sizeof(Entry) +
+                             entry.document->memoryUsage();
+        m_memoryUsage = m_memoryUsage - entry.memoryUsage + usage;
+        entry.memoryUsage = usage;
+    }
+
+    void evict(std::list<Entry>::iterator iter)
+    {
+        m_memoryUsage -= iter->memoryUsage;
+        m_map.erase(iter->key);
+        m_lru.erase(iter);
+    }
+
+    void evictIfNeeded()
+    {
+        while (m_memoryUsage > m_maxMemoryUsage && !m_lru.empty())
+            evict(std::prev(m_lru.end()));
+    }
 };
 }  // namespace LIBERTIFF_NS
 #endif
@@ -2,8 +2,27 @@
 // Copyright 2024, Even Rouault <even.rouault at spatialys.com>
 
 #define LIBERTIFF_C_FILE_READER
+#define LIBERTIFF_CACHING_FILE_READER
+#define LIBERTIFF_METADATA_CACHE
+#define LIBERTIFF_DEFLATE_DECODER
+#ifndef _WIN32
+#define LIBERTIFF_POSIX_FILE_READER
+#define LIBERTIFF_MMAP_FILE_READER
+#endif
 #include "libertiff.hpp"
 
+#include <map>
+#include <set>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#ifdef LIBERTIFF_TESTS_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
 #include "gtest_include.h"
 
 // So argc, argv can be used from test fixtures
@@ -43,6 +62,261 @@ struct test : public ::testing::Test
 {
 };
 
+// FileReader wrapper counting the number of read(), readMulti() and data()
+// calls
+class CountingFileReader final : public libertiff::FileReader
+{
+  public:
+    explicit CountingFileReader(
+        const std::shared_ptr<const libertiff::FileReader> &file)
+        : m_file(file)
+    {
+    }
+
+    uint64_t size() const override
+    {
+        return m_file->size();
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        ++m_readCount;
+        return m_file->read(offset, count, buffer);
+    }
+
+    const uint8_t *data(uint64_t offset, size_t count) const override
+    {
+        ++m_dataCount;
+        return m_file->data(offset, count);
+    }
+
+    bool providesData() const override
+    {
+        return m_file->providesData();
+    }
+
+    bool readMulti(const Range *ranges, size_t count) const override
+    {
+        ++m_readMultiCount;
+        return m_file->readMulti(ranges, count);
+    }
+
+    int readCount() const
+    {
+        return m_readCount;
+    }
+
+    int readMultiCount() const
+    {
+        return m_readMultiCount;
+    }
+
+    int dataCount() const
+    {
+        return m_dataCount;
+    }
+
+  private:
+    const std::shared_ptr<const libertiff::FileReader> m_file;
+    mutable int m_readCount = 0;
+    mutable int m_readMultiCount = 0;
+    mutable int m_dataCount = 0;
+};
+
+// FileReader reading from a memory buffer
+class MemoryFileReader final : public libertiff::FileReader
+{
+  public:
+    explicit MemoryFileReader(const std::vector<uint8_t> &data) : m_data(data)
+    {
+    }
+
+    uint64_t size() const override
+    {
+        return m_data.size();
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        if (offset >= m_data.size())
+            return 0;
+        count = static_cast<size_t>(
+            std::min<uint64_t>(count, m_data.size() - offset));
+        if (count)
+            std::memcpy(buffer, m_data.data() + offset, count);
+        return count;
+    }
+
+  private:
+    const std::vector<uint8_t> m_data;
+};
+
+// Writer of a classic TIFF file, in little or big endian byte order
+class TestTIFFWriter
+{
+  public:
+    // IFD entry, whose values are of type Short, Long or IFD
+    struct Entry
+    {
+        uint16_t code;
+        uint16_t type;
+        std::vector<uint32_t> values;
+    };
+
+    // Write the header, with a first IFD at offset 8
+    explicit TestTIFFWriter(bool bigEndian = false) : m_bigEndian(bigEndian)
+    {
+        m_data.push_back(bigEndian ? 'M' : 'I');
+        m_data.push_back(bigEndian ? 'M' : 'I');
+        writeUInt16(42);
+        writeUInt32(8);
+    }
+
+    // Return the size of an IFD with entries, including their values that
+    // do not fit in the entries
+    static uint32_t ifdSize(const std::vector<Entry> &entries)
+    {
+        uint32_t size = 2 + static_cast<uint32_t>(entries.size()) * 12 + 4;
+        for (const auto &entry : entries)
+        {
+            if (valuesSize(entry) > 4)
+                size += valuesSize(entry);
+        }
+        return size;
+    }
+
+    // Write an IFD with entries at the end of the file, followed by their
+    // values that do not fit in the entries
+    void writeIFD(const std::vector<Entry> &entries, uint32_t nextIFDOffset)
+    {
+        uint32_t extraOffset =
+            size() + 2 + static_cast<uint32_t>(entries.size()) * 12 + 4;
+        writeUInt16(static_cast<uint32_t>(entries.size()));
+        for (const auto &entry : entries)
+        {
+            writeUInt16(entry.code);
+            writeUInt16(entry.type);
+            writeUInt32(static_cast<uint32_t>(entry.values.size()));
+            if (valuesSize(entry) > 4)
+            {
+                writeUInt32(extraOffset);
+                extraOffset += valuesSize(entry);
+            }
+            else
+            {
+                writeValues(entry);
+                for (uint32_t i = valuesSize(entry); i < 4; ++i)
+                    m_data.push_back(0);
+            }
+        }
+        writeUInt32(nextIFDOffset);
+        for (const auto &entry : entries)
+        {
+            if (valuesSize(entry) > 4)
+                writeValues(entry);
+        }
+    }
+
+    void writeUInt16(uint32_t v)
+    {
+        const uint8_t lo = static_cast<uint8_t>(v & 0xff);
+        const uint8_t hi = static_cast<uint8_t>((v >> 8) & 0xff);
+        m_data.push_back(m_bigEndian ? hi : lo);
+        m_data.push_back(m_bigEndian ? lo : hi);
+    }
+
+    void writeUInt32(uint32_t v)
+    {
+        writeUInt16(m_bigEndian ? v >> 16 : v & 0xffff);
+        writeUInt16(m_bigEndian ? v & 0xffff : v >> 16);
+    }
+
+    uint32_t size() const
+    {
+        return static_cast<uint32_t>(m_data.size());
+    }
+
+    std::vector<uint8_t> &data()
+    {
+        return m_data;
+    }
+
+  private:
+    const bool m_bigEndian;
+    std::vector<uint8_t> m_data{};
+
+    static uint32_t valuesSize(const Entry &entry)
+    {
+        return static_cast<uint32_t>(
+            entry.values.size() *
+            (entry.type == libertiff::TagType::Short ? 2 : 4));
+    }
+
+    void writeValues(const Entry &entry)
+    {
+        for (uint32_t v : entry.values)
+        {
+            if (entry.type == libertiff::TagType::Short)
+                writeUInt16(v);
+            else
+                writeUInt32(v);
+        }
+    }
+};
+
+// Build a classic TIFF file with a single IFD of a 1-column image with
+// stripCount strips of one row, with out-of-line StripOffsets (Long) and
+// StripByteCounts (Short) arrays. Strip i has offset 1000 + i and byte count
+// i % 65536 (the strip data itself is not written).
+static std::vector<uint8_t> buildManyStripsFile(uint32_t stripCount,
+                                                bool bigEndian)
+{
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> byteCounts;
+    for (uint32_t i = 0; i < stripCount; ++i)
+    {
+        offsets.push_back(1000 + i);
+        byteCounts.push_back(i % 65536);
+    }
+    TestTIFFWriter writer(bigEndian);
+    writer.writeIFD(
+        {{libertiff::TagCode::ImageWidth, libertiff::TagType::Short, {1}},
+         {libertiff::TagCode::ImageLength, libertiff::TagType::Long,
+          {stripCount}},
+         {libertiff::TagCode::StripOffsets, libertiff::TagType::Long,
+          offsets},
+         {libertiff::TagCode::RowsPerStrip, libertiff::TagType::Short, {1}},
+         {libertiff::TagCode::StripByteCounts, libertiff::TagType::Short,
+          byteCounts}},
+        0);
+    return writer.data();
+}
+
+// Build a little-endian classic TIFF file with ifdCount IFDs, each with a
+// single ImageWidth tag whose value is the IFD index. If cycleToIdx >= 0,
+// the last IFD points back to the IFD of that index.
+static std::vector<uint8_t> buildMultiIFDFile(uint32_t ifdCount,
+                                              int64_t cycleToIdx = -1)
+{
+    const auto entries = [](uint32_t i)
+    {
+        return std::vector<TestTIFFWriter::Entry>{
+            {libertiff::TagCode::ImageWidth, libertiff::TagType::Long, {i}}};
+    };
+    const uint32_t ifdSize = TestTIFFWriter::ifdSize(entries(0));
+    TestTIFFWriter writer;
+    for (uint32_t i = 0; i < ifdCount; ++i)
+    {
+        uint32_t nextIFDOffset = 0;
+        if (i + 1 < ifdCount)
+            nextIFDOffset = 8 + (i + 1) * ifdSize;
+        else if (cycleToIdx >= 0)
+            nextIFDOffset = 8 + static_cast<uint32_t>(cycleToIdx) * ifdSize;
+        writer.writeIFD(entries(i), nextIFDOffset);
+    }
+    return writer.data();
+}
+
 TEST_F(test, le_strip_single_band)
 {
     FILE *f = fopen("data/le_strip_single_band.tif", "rb");
@@ -474,4 +748,3208 @@ TEST_F(test, geotiff)
     }
 }
 
+TEST_F(test, ifd_read_in_single_request)
+{
+    FILE *f = fopen("data/geotiff.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<libertiff::CFileReader>(f));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto tiff = libertiff::open(file, options);
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_EQ(tiff->tags().size(), 15);
+    // Signature, version, first IFD offset, tag count and directory
+    EXPECT_EQ(file->readCount(), 5);
+}
+
+TEST_F(test, header_prefetch)
+{
+    FILE *f = fopen("data/geotiff.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<libertiff::CFileReader>(f));
+    auto tiff = libertiff::open(file);
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_EQ(tiff->tags().size(), 15);
+    {
+        bool ok = true;
+        const auto *tag = tiff->tag(libertiff::TagCode::GeoTIFFAsciiParams);
+        ASSERT_NE(tag, nullptr);
+        EXPECT_STREQ(tiff->readTagAsString(*tag, ok).c_str(),
+                     "NAD27 / UTM zone 11N|");
+    }
+    {
+        bool ok = true;
+        EXPECT_EQ(tiff->strileOffset(0, ok), 8);
+        EXPECT_TRUE(ok);
+    }
+    // The whole file fits in the prefetched window
+    EXPECT_EQ(file->readCount(), 1);
+
+    // Window smaller than the file: only its content is served from memory
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 500;
+    tiff = libertiff::open(file, options);
+    ASSERT_NE(tiff, nullptr);
+    // Prefetch and directory
+    EXPECT_EQ(file->readCount(), 1 + 2);
+    {
+        bool ok = true;
+        const auto *tag = tiff->tag(libertiff::TagCode::GeoTIFFTiePoints);
+        ASSERT_NE(tag, nullptr);
+        const auto v = std::vector<double>{0, 0, 0, 440720, 3751320, 0};
+        EXPECT_EQ(tiff->readTagAsVector<double>(*tag, ok), v);
+    }
+    EXPECT_EQ(file->readCount(), 1 + 3);
+}
+
+TEST_F(test, ifd_missing_next_ifd_offset)
+{
+    // Classic TIFF with a single entry and a truncated next IFD offset
+    const std::vector<uint8_t> data = {
+        'I', 'I', 42, 0, 8, 0, 0, 0,           // header
+        1,   0,                                // tag count
+        0,   1,   3,  0, 1, 0, 0, 0, 20, 0, 0, 0,  // ImageWidth = 20
+        0,   0};                               // truncated next IFD offset
+    auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_EQ(tiff->width(), 20);
+    EXPECT_EQ(tiff->nextImageOffset(), 0);
+}
+
+// Read all striles of a file from several threads, and check that each
+// thread gets the same result as a single-threaded read.
+static void
+checkConcurrentStrileReads(const std::shared_ptr<libertiff::FileReader> &file)
+{
+    auto tiff = libertiff::open(file);
+    ASSERT_NE(tiff, nullptr);
+    const auto readAll = [&tiff](std::vector<uint8_t> &out)
+    {
+        out.clear();
+        for (uint64_t i = 0; i < tiff->strileCount(); ++i)
+        {
+            bool ok = true;
+            const auto offset = tiff->strileOffset(i, ok);
+            const auto byteCount = tiff->strileByteCount(i, ok);
+            if (!ok)
+                return false;
+            std::vector<uint8_t> buffer(static_cast<size_t>(byteCount));
+            tiff->readContext()->read(offset, buffer.size(), buffer.data(), ok);
+            if (!ok)
+                return false;
+            out.insert(out.end(), buffer.begin(), buffer.end());
+        }
+        return true;
+    };
+
+    std::vector<uint8_t> expected;
+    ASSERT_TRUE(readAll(expected));
+    ASSERT_FALSE(expected.empty());
+
+    constexpr int THREAD_COUNT = 8;
+    constexpr int ITERATIONS = 100;
+    std::vector<int> success(THREAD_COUNT, 0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; ++i)
+    {
+        threads.emplace_back(
+            [&readAll, &expected, &success, i]()
+            {
+                std::vector<uint8_t> got;
+                for (int iter = 0; iter < ITERATIONS; ++iter)
+                {
+                    if (readAll(got) && got == expected)
+                        ++success[i];
+                }
+            });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    for (int i = 0; i < THREAD_COUNT; ++i)
+        EXPECT_EQ(success[i], ITERATIONS);
+}
+
+TEST_F(test, concurrent_reads_c_file_reader)
+{
+    FILE *f = fopen("data/tiled.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    checkConcurrentStrileReads(std::make_shared<libertiff::CFileReader>(f));
+}
+
+#ifdef LIBERTIFF_POSIX_FILE_READER
+TEST_F(test, posix_file_reader)
+{
+    const int fd = ::open("data/tiled.tif", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto file = std::make_shared<libertiff::PosixFileReader>(fd);
+    FILE *f = fopen("data/tiled.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    const libertiff::CFileReader cFile(f);
+    EXPECT_EQ(file->size(), cFile.size());
+
+    // Read beyond end of file
+    std::vector<uint8_t> buffer(16);
+    EXPECT_EQ(file->read(file->size() - 10, buffer.size(), buffer.data()),
+              10U);
+    EXPECT_EQ(file->read(file->size(), buffer.size(), buffer.data()), 0U);
+
+    checkConcurrentStrileReads(file);
+}
+#endif
+
+#ifdef LIBERTIFF_MMAP_FILE_READER
+TEST_F(test, mmap_file_reader)
+{
+    const int fd = ::open("data/geotiff.tif", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto mmapFile = std::make_shared<libertiff::MMapFileReader>(fd);
+    ASSERT_NE(mmapFile->data(0, 2), nullptr);
+    EXPECT_EQ(mmapFile->data(mmapFile->size(), 1), nullptr);
+    auto file = std::make_shared<CountingFileReader>(mmapFile);
+    auto tiff = libertiff::open(file);
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_EQ(tiff->width(), 20);
+    EXPECT_EQ(tiff->tags().size(), 15);
+    {
+        bool ok = true;
+        EXPECT_EQ(tiff->strileOffset(0, ok), 8);
+        EXPECT_TRUE(ok);
+    }
+    {
+        bool ok = true;
+        const auto *tag = tiff->tag(libertiff::TagCode::GeoTIFFTiePoints);
+        ASSERT_NE(tag, nullptr);
+        const auto v = std::vector<double>{0, 0, 0, 440720, 3751320, 0};
+        EXPECT_EQ(tiff->readTagAsVector<double>(*tag, ok), v);
+    }
+    {
+        bool ok = true;
+        const auto *tag = tiff->tag(libertiff::TagCode::GeoTIFFAsciiParams);
+        ASSERT_NE(tag, nullptr);
+        EXPECT_STREQ(tiff->readTagAsString(*tag, ok).c_str(),
+                     "NAD27 / UTM zone 11N|");
+    }
+    // Everything has been read directly from the mapping
+    EXPECT_EQ(file->readCount(), 0);
+
+    checkConcurrentStrileReads(mmapFile);
+}
+
+TEST_F(test, mmap_file_reader_failure)
+{
+    // Directories cannot be mapped
+    const int fd = ::open("data", O_RDONLY);
+    ASSERT_GE(fd, 0);
+    libertiff::MMapFileReader mmapFile(fd);
+    EXPECT_FALSE(mmapFile.isMapped());
+    EXPECT_EQ(mmapFile.size(), 0);
+    EXPECT_FALSE(mmapFile.providesData());
+
+    const int validFd = ::open("data/geotiff.tif", O_RDONLY);
+    ASSERT_GE(validFd, 0);
+    libertiff::MMapFileReader validMMapFile(validFd);
+    EXPECT_TRUE(validMMapFile.isMapped());
+    EXPECT_TRUE(validMMapFile.providesData());
+}
+#endif
+
+TEST_F(test, caching_file_reader)
+{
+    FILE *f = fopen("data/geotiff.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto underlyingFile = std::make_shared<CountingFileReader>(
+        std::make_shared<libertiff::CFileReader>(f));
+    auto file = std::make_shared<libertiff::CachingFileReader>(underlyingFile);
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    for (int iter = 0; iter < 2; ++iter)
+    {
+        auto tiff = libertiff::open(file, options);
+        ASSERT_NE(tiff, nullptr);
+        bool ok = true;
+        const auto *tag = tiff->tag(libertiff::TagCode::GeoTIFFGeoKeyDirectory);
+        ASSERT_NE(tag, nullptr);
+        EXPECT_EQ(tiff->readTagAsVector<uint16_t>(*tag, ok).size(), 24U);
+        EXPECT_TRUE(ok);
+    }
+    // The whole file fits in a single block
+    EXPECT_EQ(underlyingFile->readCount(), 1);
+    EXPECT_EQ(file->missCount(), 1U);
+    EXPECT_GT(file->hitCount(), 10U);
+    // CFileReader does not expose its bytes in memory, so data() is not
+    // called for each read
+    EXPECT_EQ(underlyingFile->dataCount(), 0);
+}
+
+TEST_F(test, caching_file_reader_small_blocks)
+{
+    FILE *f = fopen("data/tiled.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto underlyingFile = std::make_shared<libertiff::CFileReader>(f);
+    std::vector<uint8_t> expected(static_cast<size_t>(underlyingFile->size()));
+    ASSERT_EQ(underlyingFile->read(0, expected.size(), expected.data()),
+              expected.size());
+
+    // Cache much smaller than the file, to exercise eviction
+    libertiff::CachingFileReader file(underlyingFile, 7, 64, 3);
+    EXPECT_EQ(file.size(), expected.size());
+    for (size_t offset = 0; offset < expected.size(); offset += 5)
+    {
+        for (size_t count : {1, 3, 7, 8, 15, 30})
+        {
+            std::vector<uint8_t> got(count);
+            const size_t expectedCount =
+                std::min(count, expected.size() - offset);
+            ASSERT_EQ(file.read(offset, count, got.data()), expectedCount);
+            ASSERT_TRUE(std::equal(got.begin(), got.begin() + expectedCount,
+                                   expected.begin() + offset));
+        }
+    }
+    std::vector<uint8_t> got(16);
+    EXPECT_EQ(file.read(expected.size(), got.size(), got.data()), 0U);
+    EXPECT_GT(file.hitCount(), 0U);
+    EXPECT_GT(file.missCount(), 0U);
+
+    checkConcurrentStrileReads(std::make_shared<libertiff::CachingFileReader>(
+        underlyingFile, 100, 4000, 4));
+}
+
+TEST_F(test, read_tags_batch)
+{
+    FILE *f = fopen("data/geotiff.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<libertiff::CFileReader>(f));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto tiff = libertiff::open(file, options);
+    ASSERT_NE(tiff, nullptr);
+    const int readCountAfterOpen = file->readCount();
+
+    const auto *pixelScaleTag =
+        tiff->tag(libertiff::TagCode::GeoTIFFPixelScale);
+    const auto *tiePointsTag = tiff->tag(libertiff::TagCode::GeoTIFFTiePoints);
+    const auto *geoKeysTag =
+        tiff->tag(libertiff::TagCode::GeoTIFFGeoKeyDirectory);
+    const auto *asciiParamsTag =
+        tiff->tag(libertiff::TagCode::GeoTIFFAsciiParams);
+    const auto *widthTag = tiff->tag(libertiff::TagCode::ImageWidth);
+    ASSERT_NE(pixelScaleTag, nullptr);
+    ASSERT_NE(tiePointsTag, nullptr);
+    ASSERT_NE(geoKeysTag, nullptr);
+    ASSERT_NE(asciiParamsTag, nullptr);
+    ASSERT_NE(widthTag, nullptr);
+
+    std::vector<double> pixelScale, tiePoints;
+    std::vector<uint16_t> geoKeys, width;
+    std::string asciiParams;
+    libertiff::TagReadBatch batch;
+    batch.add(*pixelScaleTag, pixelScale);
+    batch.add(*tiePointsTag, tiePoints);
+    batch.add(*geoKeysTag, geoKeys);
+    batch.add(*asciiParamsTag, asciiParams);
+    batch.add(*widthTag, width);
+    bool ok = true;
+    tiff->readTags(batch, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(file->readMultiCount(), 1);
+    EXPECT_EQ(file->readCount(), readCountAfterOpen);
+
+    EXPECT_EQ(pixelScale, (std::vector<double>{60, 60, 0}));
+    EXPECT_EQ(tiePoints, (std::vector<double>{0, 0, 0, 440720, 3751320, 0}));
+    EXPECT_EQ(geoKeys, (std::vector<uint16_t>{
+                           1,    1,     0,  5, 1024, 0, 1, 1,     1025, 0, 1, 1,
+                           1026, 34737, 21, 0, 3072, 0, 1, 26711, 3076, 0, 1,
+                           9001}));
+    EXPECT_STREQ(asciiParams.c_str(), "NAD27 / UTM zone 11N|");
+    EXPECT_EQ(width, std::vector<uint16_t>{20});
+
+    // Type mismatch
+    std::vector<uint32_t> wrongType;
+    libertiff::TagReadBatch badBatch;
+    badBatch.add(*geoKeysTag, wrongType);
+    badBatch.add(*pixelScaleTag, pixelScale);
+    ok = true;
+    tiff->readTags(badBatch, ok);
+    EXPECT_FALSE(ok);
+    EXPECT_TRUE(wrongType.empty());
+    EXPECT_EQ(pixelScale, (std::vector<double>{60, 60, 0}));
+}
+
+TEST_F(test, caching_file_reader_read_multi)
+{
+    FILE *f = fopen("data/tiled.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto cFile = std::make_shared<libertiff::CFileReader>(f);
+    auto underlyingFile = std::make_shared<CountingFileReader>(cFile);
+    libertiff::CachingFileReader file(underlyingFile, 64, 64 * 1024);
+    std::vector<uint8_t> buf1(10), buf2(100), buf3(10);
+    const libertiff::FileReader::Range ranges[] = {
+        {0, buf1.size(), buf1.data()},
+        {1000, buf2.size(), buf2.data()},
+        {70, buf3.size(), buf3.data()}};
+    EXPECT_TRUE(file.readMulti(ranges, 3));
+    EXPECT_EQ(underlyingFile->readMultiCount(), 1);
+    EXPECT_EQ(underlyingFile->readCount(), 0);
+    for (const auto &range : ranges)
+    {
+        std::vector<uint8_t> expected(range.count);
+        ASSERT_EQ(cFile->read(range.offset, range.count, expected.data()),
+                  range.count);
+        EXPECT_EQ(0, memcmp(expected.data(), range.buffer, range.count));
+    }
+
+    // Now everything comes from the cache
+    EXPECT_TRUE(file.readMulti(ranges, 3));
+    EXPECT_EQ(underlyingFile->readMultiCount(), 1);
+    EXPECT_EQ(underlyingFile->readCount(), 0);
+}
+
+TEST_F(test, caching_file_reader_read_multi_shared_and_large_ranges)
+{
+    FILE *f = fopen("data/tiled.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto cFile = std::make_shared<libertiff::CFileReader>(f);
+    auto underlyingFile = std::make_shared<CountingFileReader>(cFile);
+    libertiff::CachingFileReader file(underlyingFile, 64, 1024);
+    // Two ranges sharing a block, and one too large to be cached, which are
+    // all fetched with a single request, even if the cache is smaller than
+    // the missing blocks
+    std::vector<uint8_t> buf1(10), buf2(100), buf3(600);
+    const libertiff::FileReader::Range ranges[] = {
+        {0, buf1.size(), buf1.data()},
+        {5, buf2.size(), buf2.data()},
+        {1000, buf3.size(), buf3.data()}};
+    EXPECT_TRUE(file.readMulti(ranges, 3));
+    EXPECT_EQ(underlyingFile->readMultiCount(), 1);
+    EXPECT_EQ(underlyingFile->readCount(), 0);
+    EXPECT_EQ(file.missCount(), 2);
+    EXPECT_EQ(file.hitCount(), 0);
+    for (const auto &range : ranges)
+    {
+        std::vector<uint8_t> expected(range.count);
+        ASSERT_EQ(cFile->read(range.offset, range.count, expected.data()),
+                  range.count);
+        EXPECT_EQ(0, memcmp(expected.data(), range.buffer, range.count));
+    }
+
+    // Only the large range is fetched again
+    EXPECT_TRUE(file.readMulti(ranges, 3));
+    EXPECT_EQ(underlyingFile->readMultiCount(), 2);
+    EXPECT_EQ(file.missCount(), 2);
+    EXPECT_EQ(file.hitCount(), 3);
+
+    // Ranges beyond the end of file cannot be entirely read
+    const libertiff::FileReader::Range beyondEnd[] = {
+        {cFile->size() - 5, buf1.size(), buf1.data()}};
+    EXPECT_FALSE(file.readMulti(beyondEnd, 1));
+}
+
+TEST_F(test, many_ifds)
+{
+    // Walking the chain must scale linearly with the number of IFDs
+    constexpr uint32_t IFD_COUNT = 100 * 1000;
+    auto file =
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(IFD_COUNT));
+    auto tiff = libertiff::open(file);
+    ASSERT_NE(tiff, nullptr);
+    uint32_t count = 0;
+    while (tiff)
+    {
+        ASSERT_EQ(tiff->width(), count);
+        ++count;
+        tiff = tiff->next();
+    }
+    EXPECT_EQ(count, IFD_COUNT);
+}
+
+TEST_F(test, many_ifds_with_cycle)
+{
+    constexpr uint32_t IFD_COUNT = 1000;
+    auto file = std::make_shared<MemoryFileReader>(
+        buildMultiIFDFile(IFD_COUNT, IFD_COUNT / 2));
+    auto first = libertiff::open(file);
+    ASSERT_NE(first, nullptr);
+    // Walk the chain twice from the same first IFD
+    for (int iter = 0; iter < 2; ++iter)
+    {
+        std::unique_ptr<const libertiff::Image> tiff = first->next();
+        uint32_t count = 1;
+        while (tiff)
+        {
+            ++count;
+            tiff = tiff->next();
+        }
+        EXPECT_EQ(count, IFD_COUNT);
+    }
+}
+
+TEST_F(test, tag_lookup_unsorted_tags)
+{
+    // Classic TIFF with tags not sorted by code, and a duplicated tag
+    const std::vector<uint8_t> data = {
+        'I', 'I', 42, 0, 8, 0, 0, 0,  // header
+        4, 0,                         // tag count
+        1, 1, 3, 0, 1, 0, 0, 0, 30, 0, 0, 0,  // ImageLength = 30
+        0, 1, 3, 0, 1, 0, 0, 0, 20, 0, 0, 0,  // ImageWidth = 20
+        14, 1, 2, 0, 2, 0, 0, 0, 'a', 0, 0, 0,  // ImageDescription = "a"
+        0, 1, 3, 0, 1, 0, 0, 0, 21, 0, 0, 0,  // ImageWidth = 21
+        0, 0, 0, 0};                          // next IFD offset
+    auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_EQ(tiff->height(), 30);
+    const auto *tag = tiff->tag(libertiff::TagCode::ImageWidth);
+    ASSERT_NE(tag, nullptr);
+    EXPECT_EQ(tag, &(tiff->tags()[1]));
+    tag = tiff->tag(libertiff::TagCode::ImageLength);
+    ASSERT_NE(tag, nullptr);
+    EXPECT_EQ(tag->uint16Values[0], 30);
+    tag = tiff->tag(libertiff::TagCode::ImageDescription);
+    ASSERT_NE(tag, nullptr);
+    bool ok = true;
+    EXPECT_STREQ(tiff->readTagAsString(*tag, ok).c_str(), "a");
+    EXPECT_EQ(tiff->tag(libertiff::TagCode::SubFileType), nullptr);
+    EXPECT_EQ(tiff->tag(libertiff::TagCode::Copyright), nullptr);
+}
+
+TEST_F(test, tag_lookup_sorted_tags)
+{
+    FILE *f = fopen("data/geotiff.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto tiff = libertiff::open(std::make_shared<libertiff::CFileReader>(f));
+    ASSERT_NE(tiff, nullptr);
+    for (const auto &tag : tiff->tags())
+        EXPECT_EQ(tiff->tag(tag.tag), &tag);
+    EXPECT_EQ(tiff->tag(0), nullptr);
+    EXPECT_EQ(tiff->tag(libertiff::TagCode::Software), nullptr);
+    EXPECT_EQ(tiff->tag(65535), nullptr);
+}
+
+TEST_F(test, strile_page_cache)
+{
+    constexpr uint32_t STRIP_COUNT = 10000;
+    for (bool bigEndian : {false, true})
+    {
+        auto file = std::make_shared<CountingFileReader>(
+            std::make_shared<MemoryFileReader>(
+                buildManyStripsFile(STRIP_COUNT, bigEndian)));
+        libertiff::OpenOptions options;
+        options.headerPrefetchBytes = 0;
+        auto tiff = libertiff::open(file, options);
+        ASSERT_NE(tiff, nullptr);
+        ASSERT_EQ(tiff->strileCount(), STRIP_COUNT);
+        const int readCountAfterOpen = file->readCount();
+        // Random access
+        {
+            bool ok = true;
+            EXPECT_EQ(tiff->strileOffset(STRIP_COUNT - 1, ok),
+                      1000 + STRIP_COUNT - 1);
+            EXPECT_EQ(tiff->strileByteCount(STRIP_COUNT - 1, ok),
+                      STRIP_COUNT - 1);
+            EXPECT_TRUE(ok);
+        }
+        // Sequential iteration
+        for (uint32_t i = 0; i < STRIP_COUNT; ++i)
+        {
+            bool ok = true;
+            ASSERT_EQ(tiff->strileOffset(i, ok), 1000 + i);
+            ASSERT_EQ(tiff->strileByteCount(i, ok), i);
+            ASSERT_TRUE(ok);
+        }
+        {
+            bool ok = true;
+            EXPECT_EQ(tiff->strileOffset(STRIP_COUNT, ok), 0);
+            EXPECT_FALSE(ok);
+        }
+        // One read per 4 KB page of each array
+        constexpr int PAGE_SIZE_IN_BYTES = 4096;
+        EXPECT_EQ(file->readCount() - readCountAfterOpen,
+                  (STRIP_COUNT * 4 + PAGE_SIZE_IN_BYTES - 1) /
+                          PAGE_SIZE_IN_BYTES +
+                      (STRIP_COUNT * 2 + PAGE_SIZE_IN_BYTES - 1) /
+                          PAGE_SIZE_IN_BYTES);
+    }
+}
+
+TEST_F(test, strile_page_cache_truncated_file)
+{
+    // Truncate the file in the middle of the StripByteCounts array: values
+    // before the truncation must still be readable.
+    constexpr uint32_t STRIP_COUNT = 10000;
+    auto data = buildManyStripsFile(STRIP_COUNT, false);
+    data.resize(data.size() - STRIP_COUNT);
+    auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(tiff, nullptr);
+    for (uint32_t i = 0; i < STRIP_COUNT; ++i)
+    {
+        bool ok = true;
+        const auto byteCount = tiff->strileByteCount(i, ok);
+        if (i < STRIP_COUNT / 2)
+        {
+            ASSERT_TRUE(ok);
+            ASSERT_EQ(byteCount, i);
+        }
+        else
+        {
+            ASSERT_FALSE(ok);
+        }
+    }
+}
+
+// FileReader whose reads fail while setFailing(true) is in effect
+class FlakyFileReader final : public libertiff::FileReader
+{
+  public:
+    explicit FlakyFileReader(
+        const std::shared_ptr<const libertiff::FileReader> &file)
+        : m_file(file)
+    {
+    }
+
+    uint64_t size() const override
+    {
+        return m_file->size();
+    }
+
+    size_t read(uint64_t offset, size_t count, void *buffer) const override
+    {
+        ++m_readCount;
+        return m_failing ? 0 : m_file->read(offset, count, buffer);
+    }
+
+    void setFailing(bool failing)
+    {
+        m_failing = failing;
+    }
+
+    int readCount() const
+    {
+        return m_readCount;
+    }
+
+  private:
+    const std::shared_ptr<const libertiff::FileReader> m_file;
+    bool m_failing = false;
+    mutable int m_readCount = 0;
+};
+
+TEST_F(test, strile_page_cache_transient_error)
+{
+    constexpr uint32_t STRIP_COUNT = 10000;
+    auto file = std::make_shared<FlakyFileReader>(
+        std::make_shared<MemoryFileReader>(
+            buildManyStripsFile(STRIP_COUNT, false)));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto tiff = libertiff::open(file, options);
+    ASSERT_NE(tiff, nullptr);
+
+    file->setFailing(true);
+    bool ok = true;
+    tiff->strileOffset(5000, ok);
+    EXPECT_FALSE(ok);
+
+    // The page is read again once the error is gone, and then cached
+    file->setFailing(false);
+    ok = true;
+    EXPECT_EQ(tiff->strileOffset(5000, ok), 1000 + 5000);
+    EXPECT_TRUE(ok);
+    const int readCount = file->readCount();
+    EXPECT_EQ(tiff->strileOffset(5001, ok), 1000 + 5001);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(file->readCount(), readCount);
+}
+
+TEST_F(test, read_strile_ranges)
+{
+    constexpr uint32_t STRIP_COUNT = 10000;
+    for (bool bigEndian : {false, true})
+    {
+        auto file = std::make_shared<CountingFileReader>(
+            std::make_shared<MemoryFileReader>(
+                buildManyStripsFile(STRIP_COUNT, bigEndian)));
+        libertiff::OpenOptions options;
+        options.headerPrefetchBytes = 0;
+        auto tiff = libertiff::open(file, options);
+        ASSERT_NE(tiff, nullptr);
+        const int readCountAfterOpen = file->readCount();
+
+        std::vector<uint64_t> offsets(STRIP_COUNT);
+        std::vector<uint64_t> byteCounts(STRIP_COUNT);
+        bool ok = true;
+        tiff->readStrileOffsets(0, STRIP_COUNT, offsets.data(), ok);
+        tiff->readStrileByteCounts(0, STRIP_COUNT, byteCounts.data(), ok);
+        ASSERT_TRUE(ok);
+        EXPECT_EQ(file->readCount(), readCountAfterOpen + 2);
+        for (uint32_t i = 0; i < STRIP_COUNT; ++i)
+        {
+            ASSERT_EQ(offsets[i], 1000 + i);
+            ASSERT_EQ(byteCounts[i], i);
+        }
+
+        tiff->readStrileOffsets(STRIP_COUNT - 3, 3, offsets.data(), ok);
+        EXPECT_TRUE(ok);
+        EXPECT_EQ(offsets[0], 1000 + STRIP_COUNT - 3);
+        EXPECT_EQ(offsets[2], 1000 + STRIP_COUNT - 1);
+
+        tiff->readStrileOffsets(STRIP_COUNT, 0, offsets.data(), ok);
+        EXPECT_TRUE(ok);
+
+        tiff->readStrileOffsets(STRIP_COUNT - 3, 4, offsets.data(), ok);
+        EXPECT_FALSE(ok);
+
+        ok = true;
+        tiff->readStrileByteCounts(STRIP_COUNT + 1, 0, byteCounts.data(), ok);
+        EXPECT_FALSE(ok);
+    }
+}
+
+TEST_F(test, read_strile_ranges_inline)
+{
+    FILE *f = fopen("data/le_strip_single_band.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto tiff = libertiff::open(std::make_shared<libertiff::CFileReader>(f));
+    ASSERT_NE(tiff, nullptr);
+    uint64_t offset = 0;
+    uint64_t byteCount = 0;
+    bool ok = true;
+    tiff->readStrileOffsets(0, 1, &offset, ok);
+    tiff->readStrileByteCounts(0, 1, &byteCount, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(offset, 146);
+    EXPECT_EQ(byteCount, 2);
+}
+
+template <class T> static void checkByteSwapArray()
+{
+    libertiff::byteSwapArray(static_cast<T *>(nullptr), 0);
+    for (size_t count = 1; count < 80; ++count)
+    {
+        std::vector<uint8_t> bytes(count * sizeof(T));
+        for (size_t i = 0; i < bytes.size(); ++i)
+            bytes[i] = static_cast<uint8_t>(i + 1);
+        std::vector<T> values(count);
+        memcpy(values.data(), bytes.data(), bytes.size());
+        std::vector<T> expected(count);
+        for (size_t i = 0; i < count; ++i)
+            expected[i] = libertiff::byteSwap(values[i]);
+        libertiff::byteSwapArray(values.data(), count);
+        EXPECT_EQ(memcmp(values.data(), expected.data(), count * sizeof(T)),
+                  0)
+            << "size=" << sizeof(T) << ", count=" << count;
+    }
+}
+
+TEST_F(test, byte_swap_array)
+{
+    checkByteSwapArray<uint8_t>();
+    checkByteSwapArray<uint16_t>();
+    checkByteSwapArray<int16_t>();
+    checkByteSwapArray<uint32_t>();
+    checkByteSwapArray<int32_t>();
+    checkByteSwapArray<float>();
+    checkByteSwapArray<uint64_t>();
+    checkByteSwapArray<int64_t>();
+    checkByteSwapArray<double>();
+
+#if defined(LIBERTIFF_HAVE_X86_64_SIMD_DISPATCH)
+    // Also check kernels that were not selected by the dispatcher
+    std::vector<uint32_t> values(37);
+    for (size_t i = 0; i < values.size(); ++i)
+        values[i] = static_cast<uint32_t>(0x01020304U * (i + 1));
+    std::vector<uint32_t> expected(values);
+    libertiff::detail::byteSwapArrayScalar<uint32_t>(expected.data(),
+                                                     expected.size());
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        std::vector<uint32_t> tmp(values);
+        libertiff::detail::byteSwapArraySSSE3<uint32_t>(tmp.data(),
+                                                        tmp.size());
+        EXPECT_EQ(tmp, expected);
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        std::vector<uint32_t> tmp(values);
+        libertiff::detail::byteSwapArrayAVX2<uint32_t>(tmp.data(), tmp.size());
+        EXPECT_EQ(tmp, expected);
+    }
+#endif
+}
+
+TEST_F(test, ifd_chain_index)
+{
+    constexpr uint32_t IFD_COUNT = 1000;
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(IFD_COUNT)));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto first = libertiff::open(file, options);
+    ASSERT_NE(first, nullptr);
+    const int readCountAfterOpen = file->readCount();
+
+    auto index = libertiff::IFDChainIndex::build(*first);
+    ASSERT_NE(index, nullptr);
+    // Only the tag count and next IFD offset of each IFD are read
+    EXPECT_EQ(file->readCount(), readCountAfterOpen + 2 * IFD_COUNT);
+    EXPECT_TRUE(index->isComplete());
+    ASSERT_EQ(index->pageCount(), IFD_COUNT);
+    EXPECT_EQ(index->offsets().size(), IFD_COUNT);
+    EXPECT_EQ(index->offset(0), first->offset());
+
+    auto page = index->openPage(IFD_COUNT - 2);
+    ASSERT_NE(page, nullptr);
+    EXPECT_EQ(page->offset(), index->offset(IFD_COUNT - 2));
+    EXPECT_EQ(page->width(), IFD_COUNT - 2);
+    page = page->next();
+    ASSERT_NE(page, nullptr);
+    EXPECT_EQ(page->width(), IFD_COUNT - 1);
+    EXPECT_EQ(page->next(), nullptr);
+
+    EXPECT_EQ(index->openPage(IFD_COUNT), nullptr);
+}
+
+TEST_F(test, ifd_chain_index_with_cycle)
+{
+    constexpr uint32_t IFD_COUNT = 1000;
+    auto file = std::make_shared<MemoryFileReader>(
+        buildMultiIFDFile(IFD_COUNT, IFD_COUNT / 2));
+    auto first = libertiff::open(file);
+    ASSERT_NE(first, nullptr);
+    auto index = libertiff::IFDChainIndex::build(*first);
+    ASSERT_NE(index, nullptr);
+    EXPECT_FALSE(index->isComplete());
+    EXPECT_EQ(index->pageCount(), IFD_COUNT);
+    auto page = index->openPage(IFD_COUNT - 1);
+    ASSERT_NE(page, nullptr);
+    EXPECT_EQ(page->width(), IFD_COUNT - 1);
+    EXPECT_EQ(page->next(), nullptr);
+}
+
+TEST_F(test, ifd_chain_index_files)
+{
+    {
+        FILE *f = fopen("data/two_ifds.tif", "rb");
+        ASSERT_NE(f, nullptr);
+        auto tiff =
+            libertiff::open(std::make_shared<libertiff::CFileReader>(f));
+        ASSERT_NE(tiff, nullptr);
+        auto index = libertiff::IFDChainIndex::build(*tiff);
+        EXPECT_TRUE(index->isComplete());
+        ASSERT_EQ(index->pageCount(), 2);
+        EXPECT_EQ(index->offset(1), tiff->nextImageOffset());
+        EXPECT_NE(index->openPage(1), nullptr);
+    }
+    {
+        FILE *f = fopen("data/le_bigtiff_strip_single_band.tif", "rb");
+        ASSERT_NE(f, nullptr);
+        auto tiff =
+            libertiff::open(std::make_shared<libertiff::CFileReader>(f));
+        ASSERT_NE(tiff, nullptr);
+        auto index = libertiff::IFDChainIndex::build(*tiff);
+        EXPECT_TRUE(index->isComplete());
+        ASSERT_EQ(index->pageCount(), 1);
+        auto page = index->openPage(0);
+        ASSERT_NE(page, nullptr);
+        EXPECT_TRUE(page->isBigTIFF());
+    }
+    {
+        FILE *f = fopen("data/self_cycling.tif", "rb");
+        ASSERT_NE(f, nullptr);
+        auto tiff =
+            libertiff::open(std::make_shared<libertiff::CFileReader>(f));
+        ASSERT_NE(tiff, nullptr);
+        auto index = libertiff::IFDChainIndex::build(*tiff);
+        EXPECT_FALSE(index->isComplete());
+        EXPECT_EQ(index->pageCount(), 1);
+    }
+}
+
+struct TestIFD
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t subFileType;
+    std::vector<uint32_t> subIFDs;  // indices of SubIFDs
+    int next;                       // index of next IFD, or -1
+};
+
+// Build a little-endian ClassicTIFF file with the specified IFDs, the first
+// one being the first IFD of the main chain.
+static std::vector<uint8_t> buildTIFFWithIFDs(const std::vector<TestIFD> &ifds)
+{
+    const auto entries = [](const TestIFD &ifd,
+                            const std::vector<uint32_t> &ifdOffsets)
+    {
+        std::vector<TestTIFFWriter::Entry> result = {
+            {libertiff::TagCode::SubFileType, libertiff::TagType::Long,
+             {ifd.subFileType}},
+            {libertiff::TagCode::ImageWidth, libertiff::TagType::Long,
+             {ifd.width}},
+            {libertiff::TagCode::ImageLength, libertiff::TagType::Long,
+             {ifd.height}}};
+        if (!ifd.subIFDs.empty())
+        {
+            result.push_back(
+                {libertiff::TagCode::SubIFDs, libertiff::TagType::IFD, {}});
+            for (uint32_t idx : ifd.subIFDs)
+                result.back().values.push_back(ifdOffsets[idx]);
+        }
+        return result;
+    };
+
+    // The size of IFDs does not depend on the offsets of their SubIFDs
+    std::vector<uint32_t> ifdOffsets(ifds.size());
+    uint32_t offset = 8;
+    for (size_t i = 0; i < ifds.size(); ++i)
+    {
+        ifdOffsets[i] = offset;
+        offset += TestTIFFWriter::ifdSize(entries(ifds[i], ifdOffsets));
+    }
+
+    TestTIFFWriter writer;
+    for (const auto &ifd : ifds)
+    {
+        writer.writeIFD(entries(ifd, ifdOffsets),
+                        ifd.next >= 0 ? ifdOffsets[ifd.next] : 0);
+    }
+    return writer.data();
+}
+
+TEST_F(test, pyramid_sub_ifds)
+{
+    constexpr uint32_t REDUCED = libertiff::SubFileTypeFlags::ReducedImage;
+    constexpr uint32_t MASK = libertiff::SubFileTypeFlags::Mask;
+    constexpr uint32_t PAGE = libertiff::SubFileTypeFlags::Page;
+    const std::vector<TestIFD> ifds = {
+        {1000, 800, 0, {1, 2, 3}, 4},
+        {250, 200, REDUCED, {}, -1},
+        {500, 400, REDUCED, {}, -1},
+        {500, 400, REDUCED | MASK, {}, -1},
+        {100, 50, PAGE, {5}, -1},
+        {50, 25, REDUCED, {}, -1},
+    };
+    auto file = std::make_shared<MemoryFileReader>(buildTIFFWithIFDs(ifds));
+    auto tiff = libertiff::open(file);
+    ASSERT_NE(tiff, nullptr);
+    EXPECT_STREQ(libertiff::tagCodeName(libertiff::TagCode::SubIFDs),
+                 "SubIFDs");
+    EXPECT_STREQ(libertiff::tagTypeName(libertiff::TagType::IFD), "IFD");
+
+    bool ok = true;
+    EXPECT_EQ(tiff->subIFDOffsets(ok).size(), 3);
+    EXPECT_TRUE(ok);
+    auto page2 = tiff->next();
+    ASSERT_NE(page2, nullptr);
+
+    auto pyramid = libertiff::Pyramid::build(std::move(tiff));
+    ASSERT_NE(pyramid, nullptr);
+    ASSERT_EQ(pyramid->levelCount(), 3);
+    EXPECT_EQ(pyramid->level(0).width(), 1000);
+    EXPECT_EQ(pyramid->level(1).width(), 500);
+    EXPECT_EQ(pyramid->level(2).width(), 250);
+    EXPECT_EQ(pyramid->mask(0), nullptr);
+    ASSERT_NE(pyramid->mask(1), nullptr);
+    EXPECT_EQ(pyramid->mask(1)->subFileType(), REDUCED | MASK);
+    EXPECT_EQ(pyramid->mask(2), nullptr);
+
+    EXPECT_EQ(pyramid->bestLevel(2000), 0);
+    EXPECT_EQ(pyramid->bestLevel(1000), 0);
+    EXPECT_EQ(pyramid->bestLevel(999), 0);
+    EXPECT_EQ(pyramid->bestLevel(500), 1);
+    EXPECT_EQ(pyramid->bestLevel(300), 1);
+    EXPECT_EQ(pyramid->bestLevel(250), 2);
+    EXPECT_EQ(pyramid->bestLevel(1), 2);
+
+    EXPECT_EQ(page2->subIFDOffsets(ok).size(), 1);
+    pyramid = libertiff::Pyramid::build(std::move(page2));
+    ASSERT_NE(pyramid, nullptr);
+    ASSERT_EQ(pyramid->levelCount(), 2);
+    EXPECT_EQ(pyramid->level(1).width(), 50);
+}
+
+TEST_F(test, pyramid_main_chain)
+{
+    constexpr uint32_t REDUCED = libertiff::SubFileTypeFlags::ReducedImage;
+    constexpr uint32_t MASK = libertiff::SubFileTypeFlags::Mask;
+    const std::vector<TestIFD> ifds = {
+        {1000, 800, 0, {}, 1},    {1000, 800, MASK, {}, 2},
+        {500, 400, REDUCED, {}, 3}, {500, 400, REDUCED | MASK, {}, 4},
+        {250, 200, REDUCED, {}, 5}, {100, 50, 0, {}, -1},
+    };
+    auto file = std::make_shared<MemoryFileReader>(buildTIFFWithIFDs(ifds));
+    auto pyramid = libertiff::Pyramid::build(libertiff::open(file));
+    ASSERT_NE(pyramid, nullptr);
+    ASSERT_EQ(pyramid->levelCount(), 3);
+    EXPECT_EQ(pyramid->level(0).width(), 1000);
+    EXPECT_EQ(pyramid->level(1).width(), 500);
+    EXPECT_EQ(pyramid->level(2).width(), 250);
+    ASSERT_NE(pyramid->mask(0), nullptr);
+    EXPECT_EQ(pyramid->mask(0)->subFileType(), MASK);
+    ASSERT_NE(pyramid->mask(1), nullptr);
+    EXPECT_EQ(pyramid->mask(1)->subFileType(), REDUCED | MASK);
+    EXPECT_EQ(pyramid->mask(2), nullptr);
+    EXPECT_EQ(pyramid->bestLevel(400), 1);
+
+    EXPECT_EQ(libertiff::Pyramid::build(nullptr), nullptr);
+}
+
+TEST_F(test, tiff_document)
+{
+    constexpr uint32_t IFD_COUNT = 1000;
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(IFD_COUNT)));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto document = libertiff::TiffDocument::open(file, options);
+    ASSERT_NE(document, nullptr);
+    EXPECT_FALSE(document->isBigTIFF());
+    EXPECT_EQ(document->cachedImageCount(), 1);
+
+    std::vector<const libertiff::Image *> images;
+    for (const auto *image = document->firstImage(); image;
+         image = document->next(*image))
+    {
+        ASSERT_EQ(image->width(), images.size());
+        images.push_back(image);
+    }
+    ASSERT_EQ(images.size(), IFD_COUNT);
+    EXPECT_EQ(document->cachedImageCount(), IFD_COUNT);
+
+    // Walking again does not parse IFDs again, and returns the same images
+    const int readCount = file->readCount();
+    size_t idx = 0;
+    for (const auto *image = document->firstImage(); image;
+         image = document->next(*image), ++idx)
+    {
+        ASSERT_LT(idx, images.size());
+        ASSERT_EQ(image, images[idx]);
+    }
+    EXPECT_EQ(idx, IFD_COUNT);
+    EXPECT_EQ(file->readCount(), readCount);
+}
+
+TEST_F(test, tiff_document_concurrent_walks)
+{
+    constexpr uint32_t IFD_COUNT = 1000;
+    auto file =
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(IFD_COUNT));
+    auto document = libertiff::TiffDocument::open(file);
+    ASSERT_NE(document, nullptr);
+
+    constexpr int THREAD_COUNT = 8;
+    std::vector<std::vector<const libertiff::Image *>> images(THREAD_COUNT);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; ++i)
+    {
+        threads.emplace_back(
+            [&document, &images, i]()
+            {
+                for (const auto *image = document->firstImage(); image;
+                     image = document->next(*image))
+                {
+                    images[i].push_back(image);
+                }
+            });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(document->cachedImageCount(), IFD_COUNT);
+    ASSERT_EQ(images[0].size(), IFD_COUNT);
+    for (int i = 1; i < THREAD_COUNT; ++i)
+        EXPECT_EQ(images[i], images[0]);
+}
+
+TEST_F(test, tiff_document_with_cycle)
+{
+    constexpr uint32_t IFD_COUNT = 100;
+    auto file = std::make_shared<MemoryFileReader>(
+        buildMultiIFDFile(IFD_COUNT, IFD_COUNT / 2));
+    auto document = libertiff::TiffDocument::open(file);
+    ASSERT_NE(document, nullptr);
+    for (int iter = 0; iter < 2; ++iter)
+    {
+        uint32_t count = 0;
+        for (const auto *image = document->firstImage(); image;
+             image = document->next(*image))
+        {
+            ++count;
+        }
+        EXPECT_EQ(count, IFD_COUNT);
+    }
+
+    EXPECT_EQ(libertiff::TiffDocument::open(std::make_shared<MemoryFileReader>(
+                  std::vector<uint8_t>{'I', 'I'})),
+              nullptr);
+}
+
+TEST_F(test, tiff_document_index)
+{
+    constexpr uint32_t STRIP_COUNT = 10000;
+    for (bool bigEndian : {false, true})
+    {
+        auto memoryFile = std::make_shared<MemoryFileReader>(
+            buildManyStripsFile(STRIP_COUNT, bigEndian));
+        auto document = libertiff::TiffDocument::open(memoryFile);
+        ASSERT_NE(document, nullptr);
+        constexpr uint64_t MTIME = 1234;
+        const auto index = document->writeIndex(MTIME);
+        ASSERT_FALSE(index.empty());
+
+        auto file = std::make_shared<CountingFileReader>(memoryFile);
+        auto indexedDocument = libertiff::TiffDocument::openFromIndex(
+            file, index.data(), index.size(), MTIME);
+        ASSERT_NE(indexedDocument, nullptr);
+        // Only the beginning of the file is read, to check its hash
+        EXPECT_EQ(file->readCount(), 1);
+
+        const auto *image = indexedDocument->firstImage();
+        ASSERT_NE(image, nullptr);
+        const auto *refImage = document->firstImage();
+        EXPECT_EQ(image->offset(), refImage->offset());
+        EXPECT_EQ(image->width(), refImage->width());
+        EXPECT_EQ(image->height(), refImage->height());
+        EXPECT_EQ(image->bitsPerSample(), refImage->bitsPerSample());
+        EXPECT_EQ(image->rowsPerStrip(), refImage->rowsPerStrip());
+        EXPECT_EQ(image->tags().size(), refImage->tags().size());
+        ASSERT_EQ(image->strileCount(), STRIP_COUNT);
+
+        std::vector<uint64_t> offsets(STRIP_COUNT);
+        bool ok = true;
+        image->readStrileOffsets(0, STRIP_COUNT, offsets.data(), ok);
+        ASSERT_TRUE(ok);
+        for (uint32_t i = 0; i < STRIP_COUNT; ++i)
+        {
+            ASSERT_EQ(offsets[i], 1000 + i);
+            ASSERT_EQ(image->strileByteCount(i, ok), i);
+        }
+        EXPECT_TRUE(ok);
+        // Strile arrays come from the index
+        EXPECT_EQ(file->readCount(), 1);
+        EXPECT_EQ(indexedDocument->next(*image), nullptr);
+
+        // Mismatching modification time
+        EXPECT_EQ(libertiff::TiffDocument::openFromIndex(
+                      file, index.data(), index.size(), MTIME + 1),
+                  nullptr);
+
+        // Truncated or corrupted indices
+        for (size_t size = 0; size < index.size(); size += 7)
+        {
+            EXPECT_EQ(libertiff::TiffDocument::openFromIndex(
+                          file, index.data(), size, MTIME),
+                      nullptr);
+        }
+        auto corruptedIndex = index;
+        corruptedIndex[0] = 'X';
+        EXPECT_EQ(libertiff::TiffDocument::openFromIndex(
+                      file, corruptedIndex.data(), corruptedIndex.size(),
+                      MTIME),
+                  nullptr);
+
+        // Index owned by the document, whose strile arrays are used in place
+        {
+            auto ownedIndex =
+                std::make_shared<const std::vector<uint8_t>>(index);
+            const std::shared_ptr<const uint8_t> indexData(
+                ownedIndex, ownedIndex->data());
+            auto inPlaceDocument = libertiff::TiffDocument::openFromIndex(
+                file, indexData, ownedIndex->size(), MTIME);
+            ASSERT_NE(inPlaceDocument, nullptr);
+            ownedIndex.reset();
+            EXPECT_LT(inPlaceDocument->memoryUsage(),
+                      indexedDocument->memoryUsage() -
+                          STRIP_COUNT * sizeof(uint64_t));
+            const auto *inPlaceImage = inPlaceDocument->firstImage();
+            ASSERT_NE(inPlaceImage, nullptr);
+            const int readCount = file->readCount();
+            std::vector<uint64_t> byteCounts(STRIP_COUNT);
+            inPlaceImage->readStrileByteCounts(0, STRIP_COUNT,
+                                               byteCounts.data(), ok);
+            ASSERT_TRUE(ok);
+            for (uint32_t i = 0; i < STRIP_COUNT; ++i)
+            {
+                ASSERT_EQ(inPlaceImage->strileOffset(i, ok), 1000 + i);
+                ASSERT_EQ(byteCounts[i], i);
+            }
+            EXPECT_TRUE(ok);
+            EXPECT_EQ(file->readCount(), readCount);
+        }
+    }
+}
+
+TEST_F(test, tiff_document_index_modified_file)
+{
+    auto data = buildMultiIFDFile(10);
+    auto document = libertiff::TiffDocument::open(
+        std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(document, nullptr);
+    const auto index = document->writeIndex(0);
+    ASSERT_FALSE(index.empty());
+
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<MemoryFileReader>(data));
+    auto indexedDocument = libertiff::TiffDocument::openFromIndex(
+        file, index.data(), index.size(), 0);
+    ASSERT_NE(indexedDocument, nullptr);
+    uint32_t count = 0;
+    for (const auto *image = indexedDocument->firstImage(); image;
+         image = indexedDocument->next(*image))
+    {
+        EXPECT_EQ(image->width(), count);
+        ++count;
+    }
+    EXPECT_EQ(count, 10);
+    EXPECT_EQ(indexedDocument->cachedImageCount(), 10);
+    EXPECT_EQ(file->readCount(), 1);
+
+    // Same size, but different content
+    data.back() ^= 1;
+    EXPECT_EQ(libertiff::TiffDocument::openFromIndex(
+                  std::make_shared<MemoryFileReader>(data), index.data(),
+                  index.size(), 0),
+              nullptr);
+}
+
+TEST_F(test, tiff_document_index_tag_values)
+{
+    FILE *f = fopen("data/image_description.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto file = std::make_shared<libertiff::CFileReader>(f);
+    auto document = libertiff::TiffDocument::open(file);
+    ASSERT_NE(document, nullptr);
+    const auto index = document->writeIndex(0);
+    auto indexedDocument = libertiff::TiffDocument::openFromIndex(
+        file, index.data(), index.size(), 0);
+    ASSERT_NE(indexedDocument, nullptr);
+    const auto *image = indexedDocument->firstImage();
+    const auto *tag = image->tag(libertiff::TagCode::ImageDescription);
+    ASSERT_NE(tag, nullptr);
+    bool ok = true;
+    const auto *refImage = document->firstImage();
+    EXPECT_EQ(image->readTagAsString(*tag, ok),
+              refImage->readTagAsString(
+                  *(refImage->tag(libertiff::TagCode::ImageDescription)),
+                  ok));
+    EXPECT_TRUE(ok);
+}
+
+TEST_F(test, metadata_cache)
+{
+    auto memoryFile =
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(100));
+    auto file = std::make_shared<CountingFileReader>(memoryFile);
+    libertiff::MetadataCache cache;
+    const std::string key = libertiff::MetadataCache::makeKey("a.tif", 1, 2);
+    EXPECT_NE(key, libertiff::MetadataCache::makeKey("a.tif", 1, 3));
+
+    auto document = cache.open(key, file);
+    ASSERT_NE(document, nullptr);
+    EXPECT_EQ(cache.missCount(), 1);
+    EXPECT_EQ(cache.hitCount(), 0);
+    const int readCount = file->readCount();
+    EXPECT_EQ(cache.open(key, file), document);
+    EXPECT_EQ(cache.get(key), document);
+    EXPECT_EQ(cache.hitCount(), 2);
+    EXPECT_EQ(file->readCount(), readCount);
+    EXPECT_EQ(cache.size(), 1);
+
+    // Memory usage is updated as IFDs are parsed
+    const size_t memoryUsage = cache.memoryUsage();
+    EXPECT_GT(memoryUsage, 0);
+    for (const auto *image = document->firstImage(); image;
+         image = document->next(*image))
+    {
+    }
+    EXPECT_EQ(cache.get(key), document);
+    EXPECT_GT(cache.memoryUsage(), memoryUsage);
+
+    // and as strile array pages are loaded
+    {
+        auto manyStripsDocument = cache.open(
+            "many_strips", std::make_shared<MemoryFileReader>(
+                               buildManyStripsFile(10000, false)));
+        ASSERT_NE(manyStripsDocument, nullptr);
+        const size_t documentMemoryUsage = manyStripsDocument->memoryUsage();
+        const size_t cacheMemoryUsage = cache.memoryUsage();
+        bool ok = true;
+        EXPECT_EQ(manyStripsDocument->firstImage()->strileOffset(5000, ok),
+                  1000 + 5000);
+        EXPECT_TRUE(ok);
+        EXPECT_GE(manyStripsDocument->memoryUsage(),
+                  documentMemoryUsage + 4096);
+        EXPECT_EQ(cache.get("many_strips"), manyStripsDocument);
+        EXPECT_GE(cache.memoryUsage(), cacheMemoryUsage + 4096);
+        cache.remove("many_strips");
+    }
+
+    // Eviction of the least recently used document
+    cache.setMaxMemoryUsage(cache.memoryUsage() + memoryUsage / 2);
+    auto otherDocument = cache.open("other", file);
+    ASSERT_NE(otherDocument, nullptr);
+    EXPECT_EQ(cache.size(), 1);
+    EXPECT_EQ(cache.get(key), nullptr);
+    EXPECT_EQ(cache.get("other"), otherDocument);
+    // Evicted documents remain usable
+    EXPECT_NE(document->firstImage(), nullptr);
+
+    cache.remove("other");
+    EXPECT_EQ(cache.size(), 0);
+    EXPECT_EQ(cache.memoryUsage(), 0);
+
+    // Files that cannot be opened are not cached
+    EXPECT_EQ(cache.open("invalid", std::make_shared<MemoryFileReader>(
+                                         std::vector<uint8_t>{'I', 'I'})),
+              nullptr);
+    EXPECT_EQ(cache.size(), 0);
+
+    EXPECT_EQ(&libertiff::MetadataCache::global(),
+              &libertiff::MetadataCache::global());
+}
+
+TEST_F(test, metadata_cache_concurrent_opens)
+{
+    auto file = std::make_shared<MemoryFileReader>(buildMultiIFDFile(10));
+    libertiff::MetadataCache cache;
+    constexpr int THREAD_COUNT = 8;
+    constexpr int ITERATIONS = 100;
+    std::vector<std::shared_ptr<const libertiff::TiffDocument>> documents(
+        THREAD_COUNT);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < THREAD_COUNT; ++i)
+    {
+        threads.emplace_back(
+            [&cache, &file, &documents, i]()
+            {
+                for (int iter = 0; iter < ITERATIONS; ++iter)
+                {
+                    auto document =
+                        cache.open(std::to_string(iter % 4), file);
+                    if (iter == 0)
+                        documents[i] = document;
+                }
+            });
+    }
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(cache.hitCount() + cache.missCount(),
+              uint64_t(THREAD_COUNT * ITERATIONS));
+    EXPECT_EQ(cache.size(), 4);
+    // All threads got the same document for the same key
+    for (int i = 0; i < THREAD_COUNT; ++i)
+    {
+        ASSERT_NE(documents[i], nullptr);
+        EXPECT_EQ(documents[i], cache.get("0"));
+    }
+}
+
+// Description of a single-IFD classic TIFF image, for buildImageFile()
+struct TestImage
+{
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint16_t samplesPerPixel = 1;  // 0 to omit the SamplesPerPixel tag
+    uint16_t bitsPerSample = 8;
+    uint16_t sampleFormat = libertiff::SampleFormat::UnsignedInt;
+    uint16_t planarConfiguration = libertiff::PlanarConfiguration::Contiguous;
+    uint16_t compression = libertiff::Compression::None;
+    uint16_t predictor = 1;
+    uint32_t tileWidth = 0;  // 0 for a stripped image
+    uint32_t tileHeight = 0;
+    uint32_t rowsPerStrip = 0;
+    bool bigEndian = false;
+    uint32_t strileGap = 0;  // number of bytes between the data of striles
+    std::vector<std::vector<uint8_t>> striles{};  // data of each strile
+};
+
+static std::vector<uint8_t> buildImageFile(const TestImage &image)
+{
+    const bool isTiled = image.tileWidth > 0;
+    const uint32_t strileCount = static_cast<uint32_t>(image.striles.size());
+    std::vector<TestTIFFWriter::Entry> entries = {
+        {libertiff::TagCode::ImageWidth, libertiff::TagType::Long,
+         {image.width}},
+        {libertiff::TagCode::ImageLength, libertiff::TagType::Long,
+         {image.height}},
+        {libertiff::TagCode::BitsPerSample, libertiff::TagType::Short,
+         std::vector<uint32_t>(std::max<uint16_t>(image.samplesPerPixel, 1),
+                               image.bitsPerSample)},
+        {libertiff::TagCode::Compression, libertiff::TagType::Short,
+         {image.compression}},
+        {libertiff::TagCode::PhotometricInterpretation,
+         libertiff::TagType::Short,
+         {libertiff::PhotometricInterpretation::MinIsBlack}},
+    };
+    size_t offsetsEntryIdx;
+    if (isTiled)
+    {
+        if (image.samplesPerPixel > 0)
+        {
+            entries.push_back({libertiff::TagCode::SamplesPerPixel,
+                               libertiff::TagType::Short,
+                               {image.samplesPerPixel}});
+        }
+        entries.push_back({libertiff::TagCode::PlanarConfiguration,
+                           libertiff::TagType::Short,
+                           {image.planarConfiguration}});
+        entries.push_back({libertiff::TagCode::Predictor,
+                           libertiff::TagType::Short,
+                           {image.predictor}});
+        entries.push_back({libertiff::TagCode::TileWidth,
+                           libertiff::TagType::Long,
+                           {image.tileWidth}});
+        entries.push_back({libertiff::TagCode::TileLength,
+                           libertiff::TagType::Long,
+                           {image.tileHeight}});
+        offsetsEntryIdx = entries.size();
+        entries.push_back({libertiff::TagCode::TileOffsets,
+                           libertiff::TagType::Long,
+                           std::vector<uint32_t>(strileCount)});
+        entries.push_back({libertiff::TagCode::TileByteCounts,
+                           libertiff::TagType::Long,
+                           {}});
+    }
+    else
+    {
+        offsetsEntryIdx = entries.size();
+        entries.push_back({libertiff::TagCode::StripOffsets,
+                           libertiff::TagType::Long,
+                           std::vector<uint32_t>(strileCount)});
+        if (image.samplesPerPixel > 0)
+        {
+            entries.push_back({libertiff::TagCode::SamplesPerPixel,
+                               libertiff::TagType::Short,
+                               {image.samplesPerPixel}});
+        }
+        entries.push_back({libertiff::TagCode::RowsPerStrip,
+                           libertiff::TagType::Long,
+                           {image.rowsPerStrip}});
+        entries.push_back({libertiff::TagCode::StripByteCounts,
+                           libertiff::TagType::Long,
+                           {}});
+        entries.push_back({libertiff::TagCode::PlanarConfiguration,
+                           libertiff::TagType::Short,
+                           {image.planarConfiguration}});
+        entries.push_back({libertiff::TagCode::Predictor,
+                           libertiff::TagType::Short,
+                           {image.predictor}});
+    }
+    entries.push_back(
+        {libertiff::TagCode::SampleFormat, libertiff::TagType::Short,
+         std::vector<uint32_t>(std::max<uint16_t>(image.samplesPerPixel, 1),
+                               image.sampleFormat)});
+    const size_t byteCountsEntryIdx =
+        offsetsEntryIdx + (isTiled ? 1 : image.samplesPerPixel > 0 ? 3 : 2);
+    for (const auto &strile : image.striles)
+    {
+        entries[byteCountsEntryIdx].values.push_back(
+            static_cast<uint32_t>(strile.size()));
+    }
+
+    uint32_t dataOffset = 8 + TestTIFFWriter::ifdSize(entries);
+    for (uint32_t i = 0; i < strileCount; ++i)
+    {
+        entries[offsetsEntryIdx].values[i] = dataOffset;
+        dataOffset +=
+            static_cast<uint32_t>(image.striles[i].size()) + image.strileGap;
+    }
+
+    TestTIFFWriter writer(image.bigEndian);
+    writer.writeIFD(entries, 0);
+    std::vector<uint8_t> &data = writer.data();
+    for (const auto &strile : image.striles)
+    {
+        data.insert(data.end(), strile.begin(), strile.end());
+        data.resize(data.size() + image.strileGap);
+    }
+    return data;
+}
+
+TEST_F(test, plan_window_read_tiled)
+{
+    // 100x100 image with 16x16 tiles (7x7 tiles per plane) and 3 separate
+    // planes
+    TestImage desc;
+    desc.width = 100;
+    desc.height = 100;
+    desc.samplesPerPixel = 3;
+    desc.planarConfiguration = libertiff::PlanarConfiguration::Separate;
+    desc.tileWidth = 16;
+    desc.tileHeight = 16;
+    desc.strileGap = 100;
+    desc.striles.resize(3 * 7 * 7, std::vector<uint8_t>(256));
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    ASSERT_TRUE(tiff->isTiled());
+    ASSERT_EQ(tiff->strileCount(), 3 * 7 * 7);
+
+    // Tiles 1 to 3 of tile row 1, for planes 0 and 2
+    const uint32_t bands[] = {2, 0, 2};
+    bool ok = true;
+    auto plan = tiff->planWindowRead(20, 20, 30, 10, bands, 3, 0, ok);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(plan.striles.size(), 6);
+    const uint64_t expectedIdx[] = {8, 9, 10, 98 + 8, 98 + 9, 98 + 10};
+    for (size_t i = 0; i < 6; ++i)
+    {
+        EXPECT_EQ(plan.striles[i].idx, expectedIdx[i]);
+        EXPECT_EQ(plan.striles[i].offset,
+                  tiff->strileOffset(expectedIdx[i], ok));
+        EXPECT_EQ(plan.striles[i].byteCount, 256);
+    }
+    // Striles are 100 bytes apart: no merging
+    EXPECT_EQ(plan.ranges.size(), 6);
+
+    plan = tiff->planWindowRead(20, 20, 30, 10, bands, 3, 100, ok);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(plan.ranges.size(), 2);
+    EXPECT_EQ(plan.ranges[0].offset, plan.striles[0].offset);
+    EXPECT_EQ(plan.ranges[0].size, 3 * 256 + 2 * 100);
+    EXPECT_EQ(plan.ranges[0].firstStrile, 0);
+    EXPECT_EQ(plan.ranges[0].strileCount, 3);
+    EXPECT_EQ(plan.ranges[1].firstStrile, 3);
+    EXPECT_EQ(plan.ranges[1].strileCount, 3);
+
+    plan = tiff->planWindowRead(20, 20, 30, 10, bands, 3,
+                                std::numeric_limits<uint64_t>::max(), ok);
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(plan.ranges.size(), 1);
+
+    // All bands, whole image
+    plan = tiff->planWindowRead(0, 0, 100, 100, nullptr, 0, 0, ok);
+    ASSERT_TRUE(ok);
+    EXPECT_EQ(plan.striles.size(), 3 * 7 * 7);
+
+    // Out of bounds
+    tiff->planWindowRead(90, 0, 11, 1, nullptr, 0, 0, ok);
+    EXPECT_FALSE(ok);
+    ok = true;
+    const uint32_t invalidBand = 3;
+    tiff->planWindowRead(0, 0, 1, 1, &invalidBand, 1, 0, ok);
+    EXPECT_FALSE(ok);
+}
+
+TEST_F(test, plan_window_read_strips)
+{
+    // 10x25 image with 3 contiguous bands, 4 rows per strip, and a sparse
+    // strip.
+    TestImage desc;
+    desc.width = 10;
+    desc.height = 25;
+    desc.samplesPerPixel = 3;
+    desc.rowsPerStrip = 4;
+    for (int i = 0; i < 7; ++i)
+        desc.striles.push_back(std::vector<uint8_t>(i == 3 ? 0 : 120));
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    ASSERT_EQ(tiff->strileCount(), 7);
+
+    const uint32_t band = 1;
+    bool ok = true;
+    auto plan = tiff->planWindowRead(2, 7, 3, 10, &band, 1, 0, ok);
+    ASSERT_TRUE(ok);
+    // Strips 1 to 4, with the sparse one first
+    ASSERT_EQ(plan.striles.size(), 4);
+    EXPECT_EQ(plan.striles[0].idx, 3);
+    EXPECT_EQ(plan.striles[1].idx, 1);
+    EXPECT_EQ(plan.striles[2].idx, 2);
+    EXPECT_EQ(plan.striles[3].idx, 4);
+    ASSERT_EQ(plan.ranges.size(), 1);
+    EXPECT_EQ(plan.ranges[0].firstStrile, 1);
+    EXPECT_EQ(plan.ranges[0].strileCount, 3);
+    EXPECT_EQ(plan.ranges[0].size, 3 * 120);
+}
+
+TEST_F(test, plan_window_read_no_samples_per_pixel)
+{
+    // Separate planes, but no SamplesPerPixel tag
+    TestImage desc;
+    desc.width = 4;
+    desc.height = 4;
+    desc.samplesPerPixel = 0;
+    desc.planarConfiguration = libertiff::PlanarConfiguration::Separate;
+    desc.rowsPerStrip = 4;
+    desc.striles.push_back(std::vector<uint8_t>(16));
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    ASSERT_EQ(tiff->samplesPerPixel(), 0);
+    ASSERT_EQ(tiff->strileCount(), 1);
+
+    bool ok = true;
+    const auto plan = tiff->planWindowRead(0, 0, 4, 4, nullptr, 0, 0, ok);
+    EXPECT_FALSE(ok);
+    EXPECT_TRUE(plan.striles.empty());
+
+    ok = true;
+    std::vector<uint8_t> buffer(16);
+    tiff->readWindow(0, 0, 4, 4, nullptr, 0, buffer.data(), 1, 4, ok);
+    EXPECT_FALSE(ok);
+}
+
+TEST_F(test, buffer_pool)
+{
+    libertiff::BufferPool pool(2, 1000);
+    auto buffer = pool.acquire(100);
+    EXPECT_EQ(buffer.size(), 100);
+    const uint8_t *ptr = buffer.data();
+    pool.release(std::move(buffer));
+    // Reuse of the pooled allocation
+    buffer = pool.acquire(50);
+    EXPECT_EQ(buffer.size(), 50);
+    EXPECT_EQ(buffer.data(), ptr);
+    pool.release(std::move(buffer));
+    // Too large buffers are not pooled
+    buffer = pool.acquire(2000);
+    EXPECT_NE(buffer.data(), ptr);
+    pool.release(std::move(buffer));
+    buffer = pool.acquire(10);
+    EXPECT_EQ(buffer.data(), ptr);
+}
+
+static TestImage makeTiledTestImage(uint32_t strileGap)
+{
+    // 64x32 image with 16x16 tiles, strile i filled with value i
+    TestImage desc;
+    desc.width = 64;
+    desc.height = 32;
+    desc.tileWidth = 16;
+    desc.tileHeight = 16;
+    desc.strileGap = strileGap;
+    for (int i = 0; i < 8; ++i)
+    {
+        desc.striles.push_back(
+            std::vector<uint8_t>(256, static_cast<uint8_t>(i)));
+    }
+    // Sparse tile
+    desc.striles[5].clear();
+    return desc;
+}
+
+TEST_F(test, read_strile)
+{
+    const auto data = buildImageFile(makeTiledTestImage(0));
+    auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(tiff, nullptr);
+    std::vector<uint8_t> buffer;
+    bool ok = true;
+    tiff->readStrile(2, buffer, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(buffer, std::vector<uint8_t>(256, 2));
+    tiff->readStrile(5, buffer, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_TRUE(buffer.empty());
+    tiff->readStrile(8, buffer, ok);
+    EXPECT_FALSE(ok);
+
+    // Last tile truncated: its data is beyond the end of the file
+    const std::vector<uint8_t> truncatedData(data.begin(), data.end() - 1);
+    tiff =
+        libertiff::open(std::make_shared<MemoryFileReader>(truncatedData));
+    ASSERT_NE(tiff, nullptr);
+    ok = true;
+    tiff->readStrile(6, buffer, ok);
+    EXPECT_TRUE(ok);
+    tiff->readStrile(7, buffer, ok);
+    EXPECT_FALSE(ok);
+}
+
+TEST_F(test, read_strile_zero_offset)
+{
+    // Tile 2 has a byte count, but a zero offset: it is sparse, as in
+    // planWindowRead(), and must not be read from the file header.
+    auto data = buildImageFile(makeTiledTestImage(0));
+    {
+        auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+        ASSERT_NE(tiff, nullptr);
+        const auto *offsetsTag = tiff->tag(libertiff::TagCode::TileOffsets);
+        ASSERT_NE(offsetsTag, nullptr);
+        ASSERT_EQ(offsetsTag->type, libertiff::TagType::Long);
+        memset(data.data() + offsetsTag->value_offset + 2 * sizeof(uint32_t),
+               0, sizeof(uint32_t));
+    }
+    auto tiff = libertiff::open(std::make_shared<MemoryFileReader>(data));
+    ASSERT_NE(tiff, nullptr);
+    bool ok = true;
+    EXPECT_EQ(tiff->strileOffset(2, ok), 0);
+    EXPECT_EQ(tiff->strileByteCount(2, ok), 256);
+
+    std::vector<uint8_t> buffer;
+    tiff->readStrile(2, buffer, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_TRUE(buffer.empty());
+
+    const uint64_t indices[] = {2};
+    int callCount = 0;
+    tiff->readStriles(
+        indices, 1,
+        [&callCount](uint64_t idx, const uint8_t *strileData, size_t size)
+        {
+            ++callCount;
+            EXPECT_EQ(idx, 2);
+            EXPECT_EQ(strileData, nullptr);
+            EXPECT_EQ(size, 0);
+        },
+        ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(callCount, 1);
+
+    // Tiles 1 to 3 of the first row, with zeros for tile 2
+    std::vector<uint8_t> window(48 * 16, 0xFF);
+    tiff->readWindow(16, 0, 48, 16, nullptr, 0, window.data(), 1, 48, ok);
+    ASSERT_TRUE(ok);
+    for (uint32_t y = 0; y < 16; ++y)
+    {
+        for (uint32_t x = 0; x < 48; ++x)
+        {
+            const uint32_t tile = 1 + x / 16;
+            EXPECT_EQ(window[y * 48 + x], tile == 2 ? 0 : tile);
+        }
+    }
+}
+
+TEST_F(test, read_striles)
+{
+    for (uint32_t strileGap : {0, 10})
+    {
+        auto file = std::make_shared<CountingFileReader>(
+            std::make_shared<MemoryFileReader>(
+                buildImageFile(makeTiledTestImage(strileGap))));
+        libertiff::OpenOptions options;
+        options.headerPrefetchBytes = 0;
+        auto tiff = libertiff::open(file, options);
+        ASSERT_NE(tiff, nullptr);
+
+        const uint64_t indices[] = {7, 1, 5, 0, 2, 6};
+        std::vector<uint64_t> seenIndices;
+        bool ok = true;
+        // Load the strile offset and byte count arrays
+        std::vector<uint8_t> buffer;
+        tiff->readStrile(0, buffer, ok);
+        ASSERT_TRUE(ok);
+        const int readCount = file->readCount();
+        tiff->readStriles(
+            indices, 6,
+            [&seenIndices](uint64_t idx, const uint8_t *data, size_t size)
+            {
+                seenIndices.push_back(idx);
+                if (idx == 5)
+                {
+                    EXPECT_EQ(data, nullptr);
+                    EXPECT_EQ(size, 0);
+                }
+                else
+                {
+                    ASSERT_EQ(size, 256);
+                    EXPECT_EQ(data[0], idx);
+                    EXPECT_EQ(data[255], idx);
+                }
+            },
+            ok);
+        EXPECT_TRUE(ok);
+        EXPECT_EQ(seenIndices, (std::vector<uint64_t>{5, 0, 1, 2, 6, 7}));
+        // Adjacent tiles 0-2 and 6-7 are read at once if there is no gap
+        // between striles
+        EXPECT_EQ(file->readCount() - readCount, strileGap == 0 ? 2 : 5);
+
+        // Out of range strile
+        const uint64_t invalidIndices[] = {1, 100};
+        seenIndices.clear();
+        tiff->readStriles(
+            invalidIndices, 2,
+            [&seenIndices](uint64_t idx, const uint8_t *, size_t)
+            { seenIndices.push_back(idx); },
+            ok);
+        EXPECT_FALSE(ok);
+        EXPECT_EQ(seenIndices, (std::vector<uint64_t>{1}));
+    }
+}
+
+TEST_F(test, read_striles_from_plan)
+{
+    auto file = std::make_shared<CountingFileReader>(
+        std::make_shared<MemoryFileReader>(
+            buildImageFile(makeTiledTestImage(0))));
+    libertiff::OpenOptions options;
+    options.headerPrefetchBytes = 0;
+    auto tiff = libertiff::open(file, options);
+    ASSERT_NE(tiff, nullptr);
+
+    // Second row of tiles, with the sparse tile 5
+    bool ok = true;
+    const auto plan = tiff->planWindowRead(0, 16, 64, 16, nullptr, 0, 0, ok);
+    ASSERT_TRUE(ok);
+    ASSERT_EQ(plan.striles.size(), 4);
+    const int readCount = file->readCount();
+    std::vector<uint64_t> seenIndices;
+    tiff->readStriles(
+        plan.striles.data(), plan.striles.size(),
+        [&seenIndices](uint64_t idx, const uint8_t *data, size_t size)
+        {
+            seenIndices.push_back(idx);
+            if (idx == 5)
+            {
+                EXPECT_EQ(data, nullptr);
+                EXPECT_EQ(size, 0);
+            }
+            else
+            {
+                ASSERT_EQ(size, 256);
+                EXPECT_EQ(data[0], idx);
+            }
+        },
+        ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(seenIndices, (std::vector<uint64_t>{5, 4, 6, 7}));
+    // Tiles 4, 6 and 7 are adjacent, as tile 5 has no data
+    EXPECT_EQ(file->readCount() - readCount, 1);
+
+    // Locations are still checked
+    libertiff::StrileRead invalidStriles[2];
+    invalidStriles[0] = plan.striles[1];
+    invalidStriles[1].idx = 1;
+    invalidStriles[1].offset = file->size();
+    invalidStriles[1].byteCount = 1;
+    seenIndices.clear();
+    tiff->readStriles(
+        invalidStriles, 2,
+        [&seenIndices](uint64_t idx, const uint8_t *, size_t)
+        { seenIndices.push_back(idx); },
+        ok);
+    EXPECT_FALSE(ok);
+    EXPECT_EQ(seenIndices, (std::vector<uint64_t>{plan.striles[1].idx}));
+}
+
+// Value of band b of pixel (x, y) of images built by
+// fillUncompressedStriles()
+static uint64_t testPixelValue(uint32_t x, uint32_t y, uint32_t b,
+                               size_t sampleSize)
+{
+    const uint64_t v = uint64_t(b) * 10000 + y * 100 + x;
+    return sampleSize == 8 ? v * 0x100000001ULL
+                           : v & ((uint64_t(1) << (sampleSize * 8)) - 1);
+}
+
+// Value of band b of pixel (x, y) of images whose bit depth is not a whole
+// number of bytes, built by fillUncompressedStriles()
+static uint64_t testPackedPixelValue(uint32_t x, uint32_t y, uint32_t b,
+                                     uint32_t bitsPerSample)
+{
+    return testPixelValue(x, y, b, 8) & ((uint64_t(1) << bitsPerSample) - 1);
+}
+
+// Fill the striles of an uncompressed image with testPixelValue() values,
+// or testPackedPixelValue() values packed most significant bit first
+static void fillUncompressedStriles(TestImage &image)
+{
+    const size_t sampleSize = image.bitsPerSample / 8;
+    const bool packed = image.bitsPerSample % 8 != 0;
+    const bool separate = image.planarConfiguration ==
+                          libertiff::PlanarConfiguration::Separate;
+    const uint32_t planeCount = separate ? image.samplesPerPixel : 1;
+    const uint32_t bandsPerPlane = separate ? 1 : image.samplesPerPixel;
+    const bool isTiled = image.tileWidth > 0;
+    const uint32_t blockWidth = isTiled ? image.tileWidth : image.width;
+    const uint32_t blockHeight =
+        isTiled ? image.tileHeight : image.rowsPerStrip;
+    const uint32_t blocksPerRow =
+        (image.width + blockWidth - 1) / blockWidth;
+    const uint32_t blocksPerCol =
+        (image.height + blockHeight - 1) / blockHeight;
+    image.striles.clear();
+    for (uint32_t plane = 0; plane < planeCount; ++plane)
+    {
+        for (uint32_t by = 0; by < blocksPerCol; ++by)
+        {
+            for (uint32_t bx = 0; bx < blocksPerRow; ++bx)
+            {
+                std::vector<uint8_t> strile;
+                const uint32_t rows =
+                    isTiled ? blockHeight
+                            : std::min(blockHeight,
+                                       image.height - by * blockHeight);
+                for (uint32_t j = 0; j < rows; ++j)
+                {
+                    uint32_t acc = 0;
+                    uint32_t accBits = 0;
+                    for (uint32_t i = 0; i < blockWidth; ++i)
+                    {
+                        for (uint32_t b = 0; b < bandsPerPlane; ++b)
+                        {
+                            if (packed)
+                            {
+                                const uint64_t v = testPackedPixelValue(
+                                    bx * blockWidth + i,
+                                    by * blockHeight + j, plane + b,
+                                    image.bitsPerSample);
+                                for (uint32_t bit = image.bitsPerSample;
+                                     bit-- > 0;)
+                                {
+                                    acc = (acc << 1) | ((v >> bit) & 1);
+                                    if (++accBits == 8)
+                                    {
+                                        strile.push_back(
+                                            static_cast<uint8_t>(acc));
+                                        acc = 0;
+                                        accBits = 0;
+                                    }
+                                }
+                                continue;
+                            }
+                            const uint64_t v = testPixelValue(
+                                bx * blockWidth + i, by * blockHeight + j,
+                                plane + b, sampleSize);
+                            for (size_t k = 0; k < sampleSize; ++k)
+                            {
+                                const size_t shift =
+                                    8 * (image.bigEndian
+                                             ? sampleSize - 1 - k
+                                             : k);
+                                strile.push_back(
+                                    static_cast<uint8_t>(v >> shift));
+                            }
+                        }
+                    }
+                    // Rows are padded to a whole byte
+                    if (accBits > 0)
+                        strile.push_back(
+                            static_cast<uint8_t>(acc << (8 - accBits)));
+                }
+                image.striles.push_back(std::move(strile));
+            }
+        }
+    }
+}
+
+// Return the value of a sample of sampleSize bytes in host byte order
+static uint64_t readHostSample(const uint8_t *ptr, size_t sampleSize)
+{
+    switch (sampleSize)
+    {
+        case 1:
+            return *ptr;
+        case 2:
+        {
+            uint16_t v;
+            std::memcpy(&v, ptr, sizeof(v));
+            return v;
+        }
+        case 4:
+        {
+            uint32_t v;
+            std::memcpy(&v, ptr, sizeof(v));
+            return v;
+        }
+        default:
+            break;
+    }
+    uint64_t v;
+    std::memcpy(&v, ptr, sizeof(v));
+    return v;
+}
+
+TEST_F(test, read_window)
+{
+    for (uint16_t bitsPerSample : {8, 16, 32, 64})
+    {
+        for (uint16_t planarConfiguration :
+             {libertiff::PlanarConfiguration::Contiguous,
+              libertiff::PlanarConfiguration::Separate})
+        {
+            for (bool isTiled : {false, true})
+            {
+                for (bool bigEndian : {false, true})
+                {
+                    SCOPED_TRACE(testing::Message()
+                                 << "bitsPerSample=" << bitsPerSample
+                                 << " planarConfiguration="
+                                 << planarConfiguration
+                                 << " isTiled=" << isTiled
+                                 << " bigEndian=" << bigEndian);
+                    TestImage desc;
+                    desc.width = 10;
+                    desc.height = 7;
+                    desc.samplesPerPixel = 3;
+                    desc.bitsPerSample = bitsPerSample;
+                    desc.planarConfiguration = planarConfiguration;
+                    desc.bigEndian = bigEndian;
+                    if (isTiled)
+                    {
+                        desc.tileWidth = 4;
+                        desc.tileHeight = 4;
+                    }
+                    else
+                    {
+                        desc.rowsPerStrip = 3;
+                    }
+                    fillUncompressedStriles(desc);
+                    auto tiff = libertiff::open(
+                        std::make_shared<MemoryFileReader>(
+                            buildImageFile(desc)));
+                    ASSERT_NE(tiff, nullptr);
+                    const size_t sampleSize = bitsPerSample / 8;
+
+                    // Whole image, all bands, packed
+                    {
+                        std::vector<uint8_t> buffer(10 * 7 * 3 * sampleSize);
+                        bool ok = true;
+                        tiff->readWindow(0, 0, 10, 7, nullptr, 0,
+                                         buffer.data(), 3 * sampleSize,
+                                         10 * 3 * sampleSize, ok);
+                        ASSERT_TRUE(ok);
+                        for (uint32_t y = 0; y < 7; ++y)
+                        {
+                            for (uint32_t x = 0; x < 10; ++x)
+                            {
+                                for (uint32_t b = 0; b < 3; ++b)
+                                {
+                                    EXPECT_EQ(
+                                        readHostSample(
+                                            buffer.data() +
+                                                ((y * 10 + x) * 3 + b) *
+                                                    sampleSize,
+                                            sampleSize),
+                                        testPixelValue(x, y, b,
+                                                       sampleSize));
+                                }
+                            }
+                        }
+                    }
+
+                    // Window straddling striles, with bands reordered and
+                    // padding in the destination
+                    {
+                        const uint32_t bands[] = {2, 0};
+                        const size_t pixelStride = 2 * sampleSize + 1;
+                        const size_t lineStride = 8 * pixelStride + 3;
+                        std::vector<uint8_t> buffer(5 * lineStride);
+                        bool ok = true;
+                        tiff->readWindow(1, 2, 8, 5, bands, 2, buffer.data(),
+                                         pixelStride, lineStride, ok);
+                        ASSERT_TRUE(ok);
+                        for (uint32_t j = 0; j < 5; ++j)
+                        {
+                            for (uint32_t i = 0; i < 8; ++i)
+                            {
+                                for (uint32_t k = 0; k < 2; ++k)
+                                {
+                                    EXPECT_EQ(
+                                        readHostSample(
+                                            buffer.data() + j * lineStride +
+                                                i * pixelStride +
+                                                k * sampleSize,
+                                            sampleSize),
+                                        testPixelValue(1 + i, 2 + j, bands[k],
+                                                       sampleSize));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_F(test, read_window_errors)
+{
+    TestImage desc;
+    desc.width = 8;
+    desc.height = 8;
+    desc.bitsPerSample = 16;
+    desc.tileWidth = 4;
+    desc.tileHeight = 4;
+    fillUncompressedStriles(desc);
+    // Sparse tile
+    desc.striles[1].clear();
+    // Tile truncated before its last row
+    desc.striles[3].resize(3 * 4 * 2);
+
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    std::vector<uint16_t> buffer(8 * 8, 0xFFFF);
+    bool ok = true;
+    tiff->readWindow(0, 0, 8, 3, nullptr, 0, buffer.data(), 2, 16, ok);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(buffer[0], testPixelValue(0, 0, 0, 2));
+    EXPECT_EQ(buffer[2 * 8 + 5], 0);
+    EXPECT_EQ(buffer[2 * 8 + 3], testPixelValue(3, 2, 0, 2));
+
+    tiff->readWindow(4, 4, 4, 4, nullptr, 0, buffer.data(), 2, 8, ok);
+    EXPECT_FALSE(ok);
+
+    ok = true;
+    tiff->readWindow(4, 4, 4, 5, nullptr, 0, buffer.data(), 2, 8, ok);
+    EXPECT_FALSE(ok);
+
+    ok = true;
+    const uint32_t band = 1;
+    tiff->readWindow(0, 0, 4, 4, &band, 1, buffer.data(), 2, 8, ok);
+    EXPECT_FALSE(ok);
+
+    // No registered codec
+    desc.compression = libertiff::Compression::JBIG;
+    tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    ok = true;
+    tiff->readWindow(0, 0, 4, 4, nullptr, 0, buffer.data(), 2, 8, ok);
+    EXPECT_FALSE(ok);
+}
+
+// Test codec, for data whose bytes are XOR'ed with 0x5A
+class XorCodec final : public libertiff::Codec
+{
+  public:
+    static constexpr libertiff::CompressionType COMPRESSION = 65000;
+
+    bool decode(const libertiff::Image &, const uint8_t *src, size_t srcSize,
+                uint8_t *dst, size_t dstSize) const override
+    {
+        if (srcSize < dstSize)
+            return false;
+        for (size_t i = 0; i < dstSize; ++i)
+            dst[i] = static_cast<uint8_t>(src[i] ^ 0x5A);
+        return true;
+    }
+};
+
+// Apply the predictor of image, and XorCodec compression, to its striles
+// as filled by fillUncompressedStriles()
+static void encodeTestStriles(TestImage &image)
+{
+    const size_t sampleSize = image.bitsPerSample / 8;
+    const size_t stride = image.planarConfiguration ==
+                                  libertiff::PlanarConfiguration::Separate
+                              ? 1
+                              : image.samplesPerPixel;
+    const size_t rowSize =
+        (image.tileWidth ? image.tileWidth : image.width) * stride *
+        sampleSize;
+    const size_t count = rowSize / sampleSize;
+    const auto getSample = [&image, sampleSize](const uint8_t *ptr)
+    {
+        uint64_t v = 0;
+        for (size_t k = 0; k < sampleSize; ++k)
+        {
+            const size_t shift =
+                8 * (image.bigEndian ? sampleSize - 1 - k : k);
+            v |= uint64_t(ptr[k]) << shift;
+        }
+        return v;
+    };
+    const auto setSample = [&image, sampleSize](uint8_t *ptr, uint64_t v)
+    {
+        for (size_t k = 0; k < sampleSize; ++k)
+        {
+            const size_t shift =
+                8 * (image.bigEndian ? sampleSize - 1 - k : k);
+            ptr[k] = static_cast<uint8_t>(v >> shift);
+        }
+    };
+
+    for (auto &strile : image.striles)
+    {
+        for (size_t rowOffset = 0; rowOffset < strile.size();
+             rowOffset += rowSize)
+        {
+            uint8_t *row = strile.data() + rowOffset;
+            if (image.predictor == libertiff::Predictor::Horizontal)
+            {
+                for (size_t i = count - 1; i >= stride; --i)
+                {
+                    setSample(row + i * sampleSize,
+                              getSample(row + i * sampleSize) -
+                                  getSample(row + (i - stride) * sampleSize));
+                }
+            }
+            else if (image.predictor == libertiff::Predictor::FloatingPoint)
+            {
+                std::vector<uint8_t> tmp(rowSize);
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const uint64_t v = getSample(row + i * sampleSize);
+                    for (size_t b = 0; b < sampleSize; ++b)
+                    {
+                        tmp[b * count + i] = static_cast<uint8_t>(
+                            v >> (8 * (sampleSize - 1 - b)));
+                    }
+                }
+                for (size_t i = rowSize - 1; i >= stride; --i)
+                    tmp[i] = static_cast<uint8_t>(tmp[i] - tmp[i - stride]);
+                std::memcpy(row, tmp.data(), rowSize);
+            }
+        }
+        for (auto &byte : strile)
+            byte ^= 0x5A;
+    }
+    image.compression = XorCodec::COMPRESSION;
+}
+
+TEST_F(test, codec_registry)
+{
+    libertiff::CodecRegistry registry;
+    EXPECT_EQ(registry.codec(XorCodec::COMPRESSION), nullptr);
+    auto codec = std::make_shared<XorCodec>();
+    registry.registerCodec(XorCodec::COMPRESSION, codec);
+    EXPECT_EQ(registry.codec(XorCodec::COMPRESSION), codec);
+    registry.unregisterCodec(XorCodec::COMPRESSION);
+    EXPECT_EQ(registry.codec(XorCodec::COMPRESSION), nullptr);
+
+    EXPECT_EQ(&libertiff::CodecRegistry::global(),
+              &libertiff::CodecRegistry::global());
+}
+
+TEST_F(test, decode_strile)
+{
+    libertiff::CodecRegistry::global().registerCodec(
+        XorCodec::COMPRESSION, std::make_shared<XorCodec>());
+
+    for (uint16_t predictor :
+         {libertiff::Predictor::None, libertiff::Predictor::Horizontal,
+          libertiff::Predictor::FloatingPoint})
+    {
+        for (uint16_t bitsPerSample : {8, 16, 32, 64})
+        {
+            if (predictor == libertiff::Predictor::FloatingPoint &&
+                bitsPerSample == 8)
+            {
+                continue;
+            }
+            for (bool bigEndian : {false, true})
+            {
+                SCOPED_TRACE(testing::Message()
+                             << "predictor=" << predictor
+                             << " bitsPerSample=" << bitsPerSample
+                             << " bigEndian=" << bigEndian);
+                TestImage desc;
+                desc.width = 7;
+                desc.height = 5;
+                desc.samplesPerPixel = 2;
+                desc.bitsPerSample = bitsPerSample;
+                desc.rowsPerStrip = 2;
+                desc.predictor = predictor;
+                desc.bigEndian = bigEndian;
+                if (predictor == libertiff::Predictor::FloatingPoint)
+                    desc.sampleFormat = libertiff::SampleFormat::IEEEFP;
+                fillUncompressedStriles(desc);
+                encodeTestStriles(desc);
+                auto tiff = libertiff::open(
+                    std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+                ASSERT_NE(tiff, nullptr);
+                const size_t sampleSize = bitsPerSample / 8;
+
+                // Last strip has a single row
+                EXPECT_EQ(tiff->decodedStrileSize(2), 7 * 2 * sampleSize);
+                std::vector<uint8_t> decoded;
+                bool ok = true;
+                tiff->decodeStrile(1, decoded, ok);
+                ASSERT_TRUE(ok);
+                ASSERT_EQ(decoded.size(), 2 * 7 * 2 * sampleSize);
+                for (uint32_t j = 0; j < 2; ++j)
+                {
+                    for (uint32_t i = 0; i < 7; ++i)
+                    {
+                        for (uint32_t b = 0; b < 2; ++b)
+                        {
+                            EXPECT_EQ(
+                                readHostSample(decoded.data() +
+                                                   ((j * 7 + i) * 2 + b) *
+                                                       sampleSize,
+                                               sampleSize),
+                                testPixelValue(i, 2 + j, b, sampleSize));
+                        }
+                    }
+                }
+
+                std::vector<uint8_t> buffer(7 * 5 * sampleSize);
+                const uint32_t band = 1;
+                tiff->readWindow(0, 0, 7, 5, &band, 1, buffer.data(),
+                                 sampleSize, 7 * sampleSize, ok);
+                ASSERT_TRUE(ok);
+                for (uint32_t y = 0; y < 5; ++y)
+                {
+                    for (uint32_t x = 0; x < 7; ++x)
+                    {
+                        EXPECT_EQ(readHostSample(buffer.data() +
+                                                     (y * 7 + x) * sampleSize,
+                                                 sampleSize),
+                                  testPixelValue(x, y, 1, sampleSize));
+                    }
+                }
+            }
+        }
+    }
+
+    // Unsupported predictor
+    TestImage desc;
+    desc.width = 4;
+    desc.height = 4;
+    desc.rowsPerStrip = 4;
+    desc.predictor = 4;
+    fillUncompressedStriles(desc);
+    encodeTestStriles(desc);
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    std::vector<uint8_t> decoded;
+    bool ok = true;
+    tiff->decodeStrile(0, decoded, ok);
+    EXPECT_FALSE(ok);
+
+    // No registered codec
+    libertiff::CodecRegistry::global().unregisterCodec(XorCodec::COMPRESSION);
+    desc.predictor = libertiff::Predictor::None;
+    tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    ok = true;
+    tiff->decodeStrile(0, decoded, ok);
+    EXPECT_FALSE(ok);
+    ok = true;
+    tiff->decodeStrile(1, decoded, ok);
+    EXPECT_FALSE(ok);
+}
+
+// Compress data with PackBits, using runs for sequences of 3 or more
+// identical bytes
+static std::vector<uint8_t> encodePackBits(const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> out;
+    size_t i = 0;
+    while (i < data.size())
+    {
+        size_t run = 1;
+        while (i + run < data.size() && run < 128 &&
+               data[i + run] == data[i])
+        {
+            ++run;
+        }
+        if (run >= 3)
+        {
+            out.push_back(static_cast<uint8_t>(1 - static_cast<int>(run)));
+            out.push_back(data[i]);
+            i += run;
+            continue;
+        }
+        size_t literal = 0;
+        while (i + literal < data.size() && literal < 128 &&
+               !(i + literal + 2 < data.size() &&
+                 data[i + literal] == data[i + literal + 1] &&
+                 data[i + literal] == data[i + literal + 2]))
+        {
+            ++literal;
+        }
+        out.push_back(static_cast<uint8_t>(literal - 1));
+        out.insert(out.end(), data.begin() + static_cast<ptrdiff_t>(i),
+                   data.begin() + static_cast<ptrdiff_t>(i + literal));
+        i += literal;
+    }
+    return out;
+}
+
+// Compress data with TIFF LZW, following the code width changes and table
+// resets of libtiff
+static std::vector<uint8_t> encodeLZW(const std::vector<uint8_t> &data)
+{
+    std::vector<uint8_t> out;
+    uint64_t bitBuffer = 0;
+    int bitCount = 0;
+    int codeWidth = 9;
+    const auto putCode = [&](int code)
+    {
+        bitBuffer = (bitBuffer << codeWidth) | static_cast<uint64_t>(code);
+        bitCount += codeWidth;
+        while (bitCount >= 8)
+        {
+            bitCount -= 8;
+            out.push_back(static_cast<uint8_t>(bitBuffer >> bitCount));
+        }
+    };
+
+    std::map<std::pair<int, uint8_t>, int> table;
+    int nextCode = 258;
+    const auto addCode = [&]()
+    {
+        ++nextCode;
+        if (nextCode == 4094)
+        {
+            putCode(256);
+            table.clear();
+            nextCode = 258;
+            codeWidth = 9;
+        }
+        else if (nextCode > (1 << codeWidth) - 1)
+        {
+            ++codeWidth;
+        }
+    };
+
+    putCode(256);
+    int prefix = -1;
+    for (uint8_t c : data)
+    {
+        if (prefix < 0)
+        {
+            prefix = c;
+            continue;
+        }
+        const auto iter = table.find(std::make_pair(prefix, c));
+        if (iter != table.end())
+        {
+            prefix = iter->second;
+            continue;
+        }
+        putCode(prefix);
+        table[std::make_pair(prefix, c)] = nextCode;
+        addCode();
+        prefix = c;
+    }
+    if (prefix >= 0)
+    {
+        putCode(prefix);
+        addCode();
+    }
+    putCode(257);
+    if (bitCount > 0)
+        out.push_back(static_cast<uint8_t>(bitBuffer << (8 - bitCount)));
+    return out;
+}
+
+// Data mixing runs, repeated patterns and pseudo-random bytes
+static std::vector<uint8_t> makeCompressibleData(size_t size)
+{
+    std::vector<uint8_t> data(size);
+    uint32_t state = 12345;
+    for (size_t i = 0; i < size; ++i)
+    {
+        state = state * 1103515245 + 12345;
+        switch ((i / 500) % 3)
+        {
+            case 0:
+                data[i] = static_cast<uint8_t>(i / 50);
+                break;
+            case 1:
+                data[i] = static_cast<uint8_t>(i % 7);
+                break;
+            default:
+                data[i] = static_cast<uint8_t>(state >> 24);
+                break;
+        }
+    }
+    return data;
+}
+
+TEST_F(test, packbits_codec)
+{
+    TestImage desc;
+    desc.width = 1;
+    desc.height = 1;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+
+    const libertiff::PackBitsCodec codec;
+    for (size_t size : {1, 2, 3, 127, 128, 129, 1000, 100000})
+    {
+        const auto data = makeCompressibleData(size);
+        const auto encoded = encodePackBits(data);
+        std::vector<uint8_t> decoded(size);
+        EXPECT_TRUE(codec.decode(*tiff, encoded.data(), encoded.size(),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(decoded, data);
+    }
+
+    // No-op code, run, and literal run
+    const uint8_t encoded[] = {0x80, 0xFE, 7, 1, 8, 9};
+    uint8_t decoded[5] = {0};
+    EXPECT_TRUE(codec.decode(*tiff, encoded, sizeof(encoded), decoded,
+                             sizeof(decoded)));
+    EXPECT_EQ(std::vector<uint8_t>(decoded, decoded + 5),
+              (std::vector<uint8_t>{7, 7, 7, 8, 9}));
+
+    // Too short output
+    EXPECT_FALSE(codec.decode(*tiff, encoded, sizeof(encoded) - 1, decoded,
+                              sizeof(decoded)));
+}
+
+TEST_F(test, lzw_codec)
+{
+    TestImage desc;
+    desc.width = 1;
+    desc.height = 1;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+
+    const libertiff::LZWCodec codec;
+    // Large sizes exercise all code widths and table resets
+    for (size_t size : {1, 2, 3, 1000, 100000, 1000000})
+    {
+        const auto data = makeCompressibleData(size);
+        const auto encoded = encodeLZW(data);
+        std::vector<uint8_t> decoded(size);
+        EXPECT_TRUE(codec.decode(*tiff, encoded.data(), encoded.size(),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(decoded, data);
+    }
+
+    // Repeated byte, exercising codes not yet in the table
+    {
+        const std::vector<uint8_t> data(10000, 42);
+        const auto encoded = encodeLZW(data);
+        std::vector<uint8_t> decoded(data.size());
+        EXPECT_TRUE(codec.decode(*tiff, encoded.data(), encoded.size(),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(decoded, data);
+    }
+
+    const auto data = makeCompressibleData(1000);
+    const auto encoded = encodeLZW(data);
+    std::vector<uint8_t> decoded(data.size());
+
+    // Truncated data
+    EXPECT_FALSE(codec.decode(*tiff, encoded.data(), encoded.size() / 2,
+                              decoded.data(), decoded.size()));
+
+    // Clear code followed by code 300, which is not in the table
+    const uint8_t invalidCode[] = {0x80, 0x4B, 0x00};
+    EXPECT_FALSE(codec.decode(*tiff, invalidCode, sizeof(invalidCode),
+                              decoded.data(), 1));
+
+    // Clear code, literal 'A' and end of information code
+    const uint8_t literal[] = {0x80, 0x10, 0x60, 0x20};
+    EXPECT_TRUE(
+        codec.decode(*tiff, literal, sizeof(literal), decoded.data(), 1));
+    EXPECT_EQ(decoded[0], 'A');
+    EXPECT_FALSE(
+        codec.decode(*tiff, literal, sizeof(literal), decoded.data(), 2));
+}
+
+TEST_F(test, decode_strile_builtin_codecs)
+{
+    for (uint16_t compression :
+         {libertiff::Compression::PackBits, libertiff::Compression::LZW})
+    {
+        SCOPED_TRACE(testing::Message() << "compression=" << compression);
+        TestImage desc;
+        desc.width = 300;
+        desc.height = 200;
+        desc.bitsPerSample = 16;
+        desc.rowsPerStrip = 64;
+        desc.compression = compression;
+        desc.bigEndian = true;
+        fillUncompressedStriles(desc);
+        for (auto &strile : desc.striles)
+        {
+            strile = compression == libertiff::Compression::LZW
+                         ? encodeLZW(strile)
+                         : encodePackBits(strile);
+        }
+        auto tiff = libertiff::open(
+            std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+        ASSERT_NE(tiff, nullptr);
+
+        std::vector<uint16_t> buffer(300 * 200);
+        bool ok = true;
+        tiff->readWindow(0, 0, 300, 200, nullptr, 0, buffer.data(), 2, 600,
+                         ok);
+        ASSERT_TRUE(ok);
+        for (uint32_t y = 0; y < 200; ++y)
+        {
+            for (uint32_t x = 0; x < 300; ++x)
+                ASSERT_EQ(buffer[y * 300 + x], testPixelValue(x, y, 0, 2));
+        }
+    }
+}
+
+TEST_F(test, deflate_codec)
+{
+    TestImage desc;
+    desc.width = 1;
+    desc.height = 1;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    const libertiff::DeflateCodec codec;
+
+    // Stored block
+    {
+        const uint8_t encoded[] = {0x78, 0x01, 0x01, 0x09, 0x00, 0xF6, 0xFF,
+                                   0x6C, 0x69, 0x62, 0x65, 0x72, 0x74, 0x69,
+                                   0x66, 0x66, 0x12, 0xA0, 0x03, 0xB8};
+        std::vector<uint8_t> decoded(9);
+        EXPECT_TRUE(codec.decode(*tiff, encoded, sizeof(encoded),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(std::string(decoded.begin(), decoded.end()), "libertiff");
+        decoded.resize(10);
+        EXPECT_FALSE(codec.decode(*tiff, encoded, sizeof(encoded),
+                                  decoded.data(), decoded.size()));
+    }
+
+    // Block with fixed Huffman codes, and overlapping match
+    {
+        const uint8_t encoded[] = {0x78, 0xDA, 0x4B, 0x4C, 0x4A,
+                                   0x4E, 0x44, 0x45, 0x29, 0x00,
+                                   0x48, 0xC5, 0x07, 0x49};
+        std::vector<uint8_t> decoded(19);
+        EXPECT_TRUE(codec.decode(*tiff, encoded, sizeof(encoded),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(std::string(decoded.begin(), decoded.end()),
+                  "abcabcabcabcabcabcd");
+    }
+
+    // Block with dynamic Huffman codes
+    {
+        const uint8_t encoded[] = {
+            0x78, 0xDA, 0xED, 0xD0, 0xB7, 0x11, 0x80, 0x40, 0x10, 0x04, 0xC1,
+            0x54, 0x36, 0x02, 0x0A, 0x1D, 0xC9, 0x27, 0x80, 0x78, 0x34, 0x1C,
+            0x3C, 0x9A, 0xE8, 0x21, 0x85, 0x75, 0xA9, 0xB3, 0xA7, 0xAD, 0x31,
+            0x8D, 0xC5, 0xB2, 0xB7, 0x45, 0x8F, 0xDC, 0xC9, 0x39, 0xA1, 0x92,
+            0x0B, 0xDD, 0x3E, 0xCE, 0x2B, 0xE4, 0xB0, 0x0E, 0xDB, 0x97, 0x87,
+            0xEC, 0xB9, 0x51, 0x4A, 0x0D, 0xDF, 0x83, 0x21, 0x78, 0xC0, 0xF1,
+            0x90, 0xE3, 0x11, 0xC7, 0x63, 0x8E, 0x27, 0x1C, 0x4F, 0x39, 0xAE,
+            0x23, 0x75, 0xA4, 0x8E, 0xD4, 0x91, 0x3A, 0xF2, 0xB7, 0x23, 0x5F,
+            0x6E, 0xF1, 0x93, 0x2A};
+        std::string expected;
+        for (int i = 0; i < 40; ++i)
+        {
+            expected += "The quick brown fox jumps over the lazy dog ";
+            expected += std::to_string(i % 7);
+            expected += ". ";
+        }
+        std::vector<uint8_t> decoded(expected.size());
+        EXPECT_TRUE(codec.decode(*tiff, encoded, sizeof(encoded),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(std::string(decoded.begin(), decoded.end()), expected);
+
+        // Truncated stream
+        EXPECT_FALSE(codec.decode(*tiff, encoded, sizeof(encoded) / 2,
+                                  decoded.data(), decoded.size()));
+
+        // Invalid zlib header
+        std::vector<uint8_t> corrupted(encoded, encoded + sizeof(encoded));
+        corrupted[1] = 0xDB;
+        EXPECT_FALSE(codec.decode(*tiff, corrupted.data(), corrupted.size(),
+                                  decoded.data(), decoded.size()));
+
+        // Reserved block type
+        corrupted[1] = 0xDA;
+        corrupted[2] = 0x07;
+        EXPECT_FALSE(codec.decode(*tiff, corrupted.data(), corrupted.size(),
+                                  decoded.data(), decoded.size()));
+    }
+
+    EXPECT_NE(libertiff::CodecRegistry::global().codec(
+                  libertiff::Compression::Deflate),
+              nullptr);
+    EXPECT_NE(libertiff::CodecRegistry::global().codec(
+                  libertiff::Compression::LegacyDeflate),
+              nullptr);
+}
+
+#ifdef LIBERTIFF_TESTS_HAVE_ZLIB
+
+static std::vector<uint8_t> compressWithZlib(const std::vector<uint8_t> &data,
+                                             int level, int strategy)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    EXPECT_EQ(deflateInit2(&stream, level, Z_DEFLATED, 15, 8, strategy),
+              Z_OK);
+    std::vector<uint8_t> out(deflateBound(
+        &stream, static_cast<uLong>(std::max<size_t>(data.size(), 1))));
+    stream.next_in = const_cast<Bytef *>(data.data());
+    stream.avail_in = static_cast<uInt>(data.size());
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    EXPECT_EQ(deflate(&stream, Z_FINISH), Z_STREAM_END);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return out;
+}
+
+TEST_F(test, deflate_codec_against_zlib)
+{
+    TestImage desc;
+    desc.width = 1;
+    desc.height = 1;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    const libertiff::DeflateCodec codec;
+
+    for (size_t size : {0, 1, 100, 70000, 1000000})
+    {
+        const auto data = makeCompressibleData(size);
+        for (int level : {0, 1, 6, 9})
+        {
+            for (int strategy :
+                 {Z_DEFAULT_STRATEGY, Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE,
+                  Z_FIXED})
+            {
+                SCOPED_TRACE(testing::Message()
+                             << "size=" << size << " level=" << level
+                             << " strategy=" << strategy);
+                const auto encoded = compressWithZlib(data, level, strategy);
+                std::vector<uint8_t> decoded(size);
+                EXPECT_TRUE(codec.decode(*tiff, encoded.data(),
+                                         encoded.size(), decoded.data(),
+                                         decoded.size()));
+                EXPECT_EQ(decoded, data);
+            }
+        }
+    }
+
+    // Long runs and matches at the maximum distance
+    std::vector<uint8_t> data(200000, 0);
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        if ((i / 32768) % 2)
+            data[i] = static_cast<uint8_t>(i % 251);
+    }
+    const auto encoded = compressWithZlib(data, 9, Z_DEFAULT_STRATEGY);
+    std::vector<uint8_t> decoded(data.size());
+    EXPECT_TRUE(codec.decode(*tiff, encoded.data(), encoded.size(),
+                             decoded.data(), decoded.size()));
+    EXPECT_EQ(decoded, data);
+
+    // Corrupted data must not crash
+    auto corrupted = encoded;
+    for (size_t i = 2; i < corrupted.size(); i += 37)
+        corrupted[i] = static_cast<uint8_t>(corrupted[i] ^ 0x55);
+    codec.decode(*tiff, corrupted.data(), corrupted.size(), decoded.data(),
+                 decoded.size());
+}
+
+// Dynamic Huffman blocks using all 19 code length codes (HCLEN = 15), whose
+// 57 bits of code lengths exceed what a single refill of the bit buffer
+// guarantees
+TEST_F(test, deflate_codec_all_code_length_codes)
+{
+    TestImage desc;
+    desc.width = 1;
+    desc.height = 1;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+    const libertiff::DeflateCodec codec;
+
+    size_t blocksWithAllCodes = 0;
+    for (uint32_t seed = 0; seed < 48; ++seed)
+    {
+        SCOPED_TRACE(testing::Message() << "seed=" << seed);
+        // Shuffled chunks where the frequencies of 19 to 22 byte values
+        // follow the Fibonacci sequence, giving the deepest Huffman trees,
+        // with codes of 1 to 15 bits
+        std::vector<uint8_t> data;
+        uint32_t state = seed + 1;
+        const uint32_t valueCount = 19 + seed % 4;
+        for (uint32_t chunk = 0; chunk < 1 + seed / 4 % 3; ++chunk)
+        {
+            std::vector<uint8_t> values;
+            uint32_t a = 1;
+            uint32_t b = 1;
+            for (uint8_t v = 0; v < valueCount; ++v)
+            {
+                values.insert(values.end(), a, static_cast<uint8_t>(v + seed));
+                const uint32_t next = a + b;
+                a = b;
+                b = next;
+            }
+            for (size_t i = values.size() - 1; i > 0; --i)
+            {
+                state = state * 1103515245 + 12345;
+                std::swap(values[i], values[(state >> 8) % (i + 1)]);
+            }
+            data.insert(data.end(), values.begin(), values.end());
+        }
+        const auto encoded = compressWithZlib(data, 6, Z_HUFFMAN_ONLY);
+        // Count first blocks with HCLEN = 15, after the 2-byte zlib header
+        ASSERT_GT(encoded.size(), 4U);
+        ASSERT_EQ((encoded[2] >> 1) & 3, 2);
+        if (((encoded[3] >> 5) | ((encoded[4] & 1) << 3)) == 15)
+            ++blocksWithAllCodes;
+        std::vector<uint8_t> decoded(data.size());
+        EXPECT_TRUE(codec.decode(*tiff, encoded.data(), encoded.size(),
+                                 decoded.data(), decoded.size()));
+        EXPECT_EQ(decoded, data);
+    }
+    EXPECT_GT(blocksWithAllCodes, 0U);
+}
+
+TEST_F(test, decode_strile_deflate)
+{
+    TestImage desc;
+    desc.width = 100;
+    desc.height = 50;
+    desc.samplesPerPixel = 2;
+    desc.bitsPerSample = 32;
+    desc.tileWidth = 32;
+    desc.tileHeight = 32;
+    desc.predictor = libertiff::Predictor::Horizontal;
+    desc.compression = libertiff::Compression::Deflate;
+    fillUncompressedStriles(desc);
+    encodeTestStriles(desc);
+    for (auto &strile : desc.striles)
+    {
+        // Undo the XOR of encodeTestStriles()
+        for (auto &byte : strile)
+            byte ^= 0x5A;
+        strile = compressWithZlib(strile, 6, Z_DEFAULT_STRATEGY);
+    }
+    desc.compression = libertiff::Compression::Deflate;
+    auto tiff = libertiff::open(
+        std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+    ASSERT_NE(tiff, nullptr);
+
+    std::vector<uint32_t> buffer(100 * 50 * 2);
+    bool ok = true;
+    tiff->readWindow(0, 0, 100, 50, nullptr, 0, buffer.data(), 8, 800, ok);
+    ASSERT_TRUE(ok);
+    for (uint32_t y = 0; y < 50; ++y)
+    {
+        for (uint32_t x = 0; x < 100; ++x)
+        {
+            for (uint32_t b = 0; b < 2; ++b)
+            {
+                ASSERT_EQ(buffer[(y * 100 + x) * 2 + b],
+                          testPixelValue(x, y, b, 4));
+            }
+        }
+    }
+}
+
+#endif
+
+TEST_F(test, undo_horizontal_differencing)
+{
+    std::vector<uint8_t> data(1000 * 8);
+    uint32_t state = 1;
+    for (auto &byte : data)
+    {
+        state = state * 1103515245 + 12345;
+        byte = static_cast<uint8_t>(state >> 24);
+    }
+    for (size_t sampleSize : {1, 2, 4, 8})
+    {
+        for (size_t stride = 1; stride <= 9; ++stride)
+        {
+            for (size_t count : {0, 1, 7, 16, 17, 63, 64, 65, 1000})
+            {
+                SCOPED_TRACE(testing::Message()
+                             << "sampleSize=" << sampleSize
+                             << " stride=" << stride << " count=" << count);
+                auto expected = data;
+                auto row = data;
+                libertiff::detail::undoHorizontalDifferencing(
+                    row.data(), count, stride, sampleSize);
+                if (sampleSize == 1)
+                {
+                    libertiff::detail::undoHorizontalDifferencingScalar<
+                        uint8_t>(expected.data(), 0, count, stride);
+                }
+                else if (sampleSize == 2)
+                {
+                    libertiff::detail::undoHorizontalDifferencingScalar<
+                        uint16_t>(expected.data(), 0, count, stride);
+                }
+                else if (sampleSize == 4)
+                {
+                    libertiff::detail::undoHorizontalDifferencingScalar<
+                        uint32_t>(expected.data(), 0, count, stride);
+                }
+                else
+                {
+                    libertiff::detail::undoHorizontalDifferencingScalar<
+                        uint64_t>(expected.data(), 0, count, stride);
+                }
+                ASSERT_EQ(row, expected);
+            }
+        }
+    }
+}
+
+TEST_F(test, undo_floating_point_predictor)
+{
+    for (size_t sampleSize : {2, 4, 8})
+    {
+        for (size_t stride : {1, 2, 3})
+        {
+            for (size_t count : {1, 15, 16, 17, 48, 100})
+            {
+                SCOPED_TRACE(testing::Message()
+                             << "sampleSize=" << sampleSize
+                             << " stride=" << stride << " count=" << count);
+                std::vector<uint64_t> values(count);
+                for (size_t i = 0; i < count; ++i)
+                    values[i] = 0x0123456789ABCDEFULL * (i + 1) + i;
+
+                // Byte planes, most significant first, then byte
+                // differencing
+                const size_t byteCount = count * sampleSize;
+                std::vector<uint8_t> row(byteCount);
+                for (size_t i = 0; i < count; ++i)
+                {
+                    for (size_t b = 0; b < sampleSize; ++b)
+                    {
+                        row[b * count + i] = static_cast<uint8_t>(
+                            values[i] >> (8 * (sampleSize - 1 - b)));
+                    }
+                }
+                for (size_t i = byteCount; i-- > stride;)
+                    row[i] = static_cast<uint8_t>(row[i] - row[i - stride]);
+
+                std::vector<uint8_t> tmp(byteCount);
+                libertiff::detail::undoFloatingPointPredictor(
+                    row.data(), count, stride, sampleSize, tmp.data());
+                for (size_t i = 0; i < count; ++i)
+                {
+                    const uint64_t mask =
+                        sampleSize == 8
+                            ? ~uint64_t(0)
+                            : (uint64_t(1) << (8 * sampleSize)) - 1;
+                    ASSERT_EQ(readHostSample(row.data() + i * sampleSize,
+                                             sampleSize),
+                              values[i] & mask)
+                        << i;
+                }
+            }
+        }
+    }
+}
+
+// Return sample i of data, packed with bitsPerSample bits per sample, most
+// significant bit first
+static uint32_t readPackedSample(const std::vector<uint8_t> &data, size_t i,
+                                 uint32_t bitsPerSample)
+{
+    uint32_t v = 0;
+    for (size_t bit = i * bitsPerSample; bit < (i + 1) * bitsPerSample; ++bit)
+        v = (v << 1) | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+    return v;
+}
+
+template <class T> static void checkUnpackAndPackSamples(uint32_t bitsPerSample)
+{
+    for (size_t count : {0, 1, 7, 8, 15, 16, 17, 31, 33, 64, 100, 1000})
+    {
+        SCOPED_TRACE(testing::Message() << "sizeof(T)=" << sizeof(T)
+                                        << " count=" << count);
+        const size_t byteCount = (count * bitsPerSample + 7) / 8;
+        std::vector<uint8_t> packed(byteCount);
+        for (size_t i = 0; i < byteCount; ++i)
+            packed[i] = static_cast<uint8_t>((i * 151 + 7) ^ (i >> 3));
+        // Clear the padding bits, which packSamples() sets to zero
+        const size_t paddingBits = byteCount * 8 - count * bitsPerSample;
+        if (paddingBits > 0)
+            packed.back() = static_cast<uint8_t>(
+                packed.back() & (0xFF << paddingBits));
+
+        std::vector<T> values(count);
+        libertiff::unpackSamples(packed.data(), count, bitsPerSample,
+                                 values.data());
+        for (size_t i = 0; i < count; ++i)
+        {
+            ASSERT_EQ(values[i], readPackedSample(packed, i, bitsPerSample))
+                << i;
+        }
+
+        // Bits above bitsPerSample are ignored when packing
+        if (bitsPerSample < 8 * sizeof(T))
+        {
+            for (T &v : values)
+                v = static_cast<T>(v | (~uint32_t(0) << bitsPerSample));
+        }
+        std::vector<uint8_t> repacked(byteCount, 0xFF);
+        libertiff::packSamples(values.data(), count, bitsPerSample,
+                               repacked.data());
+        EXPECT_EQ(repacked, packed);
+    }
+}
+
+TEST_F(test, unpack_pack_samples)
+{
+    for (uint32_t bitsPerSample = 1; bitsPerSample <= 32; ++bitsPerSample)
+    {
+        SCOPED_TRACE(testing::Message() << "bitsPerSample=" << bitsPerSample);
+        if (bitsPerSample <= 8)
+            checkUnpackAndPackSamples<uint8_t>(bitsPerSample);
+        if (bitsPerSample <= 16)
+            checkUnpackAndPackSamples<uint16_t>(bitsPerSample);
+        checkUnpackAndPackSamples<uint32_t>(bitsPerSample);
+    }
+}
+
+TEST_F(test, read_window_packed_bit_depths)
+{
+    for (uint16_t bitsPerSample : {1, 2, 4, 5, 12, 24})
+    {
+        for (uint16_t planarConfiguration :
+             {libertiff::PlanarConfiguration::Contiguous,
+              libertiff::PlanarConfiguration::Separate})
+        {
+            for (bool isTiled : {false, true})
+            {
+                for (bool bigEndian : {false, true})
+                {
+                    SCOPED_TRACE(testing::Message()
+                                 << "bitsPerSample=" << bitsPerSample
+                                 << " planarConfiguration="
+                                 << planarConfiguration
+                                 << " isTiled=" << isTiled
+                                 << " bigEndian=" << bigEndian);
+                    TestImage desc;
+                    desc.width = 21;
+                    desc.height = 7;
+                    desc.samplesPerPixel = 3;
+                    desc.bitsPerSample = bitsPerSample;
+                    desc.planarConfiguration = planarConfiguration;
+                    desc.bigEndian = bigEndian;
+                    if (isTiled)
+                    {
+                        desc.tileWidth = 8;
+                        desc.tileHeight = 4;
+                    }
+                    else
+                    {
+                        desc.rowsPerStrip = 3;
+                    }
+                    fillUncompressedStriles(desc);
+                    auto tiff = libertiff::open(
+                        std::make_shared<MemoryFileReader>(
+                            buildImageFile(desc)));
+                    ASSERT_NE(tiff, nullptr);
+                    const size_t sampleSize = bitsPerSample <= 8    ? 1
+                                              : bitsPerSample <= 16 ? 2
+                                                                    : 4;
+                    const auto expected =
+                        [bitsPerSample](uint32_t x, uint32_t y, uint32_t b)
+                    {
+                        return bitsPerSample == 24
+                                   ? testPixelValue(x, y, b, 3)
+                                   : testPackedPixelValue(x, y, b,
+                                                          bitsPerSample);
+                    };
+
+                    // Whole image, all bands, packed
+                    {
+                        std::vector<uint8_t> buffer(21 * 7 * 3 * sampleSize);
+                        bool ok = true;
+                        tiff->readWindow(0, 0, 21, 7, nullptr, 0,
+                                         buffer.data(), 3 * sampleSize,
+                                         21 * 3 * sampleSize, ok);
+                        ASSERT_TRUE(ok);
+                        for (uint32_t y = 0; y < 7; ++y)
+                        {
+                            for (uint32_t x = 0; x < 21; ++x)
+                            {
+                                for (uint32_t b = 0; b < 3; ++b)
+                                {
+                                    EXPECT_EQ(
+                                        readHostSample(
+                                            buffer.data() +
+                                                ((y * 21 + x) * 3 + b) *
+                                                    sampleSize,
+                                            sampleSize),
+                                        expected(x, y, b));
+                                }
+                            }
+                        }
+                    }
+
+                    // Window starting in the middle of the bytes of
+                    // striles, with bands reordered
+                    {
+                        const uint32_t bands[] = {2, 0};
+                        const size_t pixelStride = 2 * sampleSize;
+                        const size_t lineStride = 15 * pixelStride;
+                        std::vector<uint8_t> buffer(5 * lineStride);
+                        bool ok = true;
+                        tiff->readWindow(3, 2, 15, 5, bands, 2, buffer.data(),
+                                         pixelStride, lineStride, ok);
+                        ASSERT_TRUE(ok);
+                        for (uint32_t j = 0; j < 5; ++j)
+                        {
+                            for (uint32_t i = 0; i < 15; ++i)
+                            {
+                                for (uint32_t k = 0; k < 2; ++k)
+                                {
+                                    EXPECT_EQ(
+                                        readHostSample(
+                                            buffer.data() + j * lineStride +
+                                                i * pixelStride +
+                                                k * sampleSize,
+                                            sampleSize),
+                                        expected(3 + i, 2 + j, bands[k]));
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+TEST_F(test, read_window_packed_truncated_strip)
+{
+    for (uint16_t bitsPerSample : {5, 12, 24})
+    {
+        for (bool bigEndian : {false, true})
+        {
+            SCOPED_TRACE(testing::Message() << "bitsPerSample=" << bitsPerSample
+                                            << " bigEndian=" << bigEndian);
+            TestImage desc;
+            desc.width = 21;
+            desc.height = 7;
+            desc.samplesPerPixel = 3;
+            desc.bitsPerSample = bitsPerSample;
+            desc.bigEndian = bigEndian;
+            desc.rowsPerStrip = 4;
+            fillUncompressedStriles(desc);
+            // Last strip truncated after the samples of its first row needed
+            // below
+            desc.striles[1].resize(
+                (21 * 3 * bitsPerSample + 7) / 8 +
+                (10 * 3 * bitsPerSample + 7) / 8);
+
+            auto tiff = libertiff::open(
+                std::make_shared<MemoryFileReader>(buildImageFile(desc)));
+            ASSERT_NE(tiff, nullptr);
+            const size_t sampleSize = bitsPerSample <= 8    ? 1
+                                      : bitsPerSample <= 16 ? 2
+                                                            : 4;
+            std::vector<uint8_t> buffer(2 * 10 * 3 * sampleSize);
+            bool ok = true;
+            tiff->readWindow(0, 4, 10, 2, nullptr, 0, buffer.data(),
+                             3 * sampleSize, 10 * 3 * sampleSize, ok);
+            ASSERT_TRUE(ok);
+            for (uint32_t y = 4; y < 6; ++y)
+            {
+                for (uint32_t x = 0; x < 10; ++x)
+                {
+                    for (uint32_t b = 0; b < 3; ++b)
+                    {
+                        EXPECT_EQ(readHostSample(
+                                      buffer.data() +
+                                          (((y - 4) * 10 + x) * 3 + b) *
+                                              sampleSize,
+                                      sampleSize),
+                                  bitsPerSample == 24
+                                      ? testPixelValue(x, y, b, 3)
+                                      : testPackedPixelValue(x, y, b,
+                                                             bitsPerSample));
+                    }
+                }
+            }
+
+            // Samples beyond the truncation cannot be read
+            buffer.resize(2 * 11 * 3 * sampleSize);
+            tiff->readWindow(0, 4, 11, 2, nullptr, 0, buffer.data(),
+                             3 * sampleSize, 11 * 3 * sampleSize, ok);
+            EXPECT_FALSE(ok);
+        }
+    }
+}
+
+TEST_F(test, image_open_with_visited_offsets_set)
+{
+    // IFDs at offsets 8, 26 and 44, the last one pointing back to the first
+    auto rc = std::make_shared<libertiff::ReadContext>(
+        std::make_shared<MemoryFileReader>(buildMultiIFDFile(3, 0)),
+        !libertiff::isHostLittleEndian());
+    const std::set<uint64_t> visited = {8};
+    EXPECT_EQ(libertiff::Image::open<false>(rc, 8, visited), nullptr);
+    auto image = libertiff::Image::open<false>(rc, 26, visited);
+    ASSERT_NE(image, nullptr);
+    EXPECT_EQ(image->width(), 1);
+    image = image->next();
+    ASSERT_NE(image, nullptr);
+    EXPECT_EQ(image->width(), 2);
+    EXPECT_EQ(image->next(), nullptr);
+
+    // Calls passing {} start a new chain
+    image = libertiff::Image::open<false>(rc, 8, {});
+    ASSERT_NE(image, nullptr);
+    EXPECT_EQ(image->width(), 0);
+}
+
+TEST_F(test, tiff_document_index_corrupted_tag_count)
+{
+    FILE *f = fopen("data/le_strip_three_band_separate.tif", "rb");
+    ASSERT_NE(f, nullptr);
+    auto file = std::make_shared<libertiff::CFileReader>(f);
+    auto document = libertiff::TiffDocument::open(file);
+    ASSERT_NE(document, nullptr);
+    const auto index = document->writeIndex(0);
+    ASSERT_NE(libertiff::TiffDocument::openFromIndex(file, index.data(),
+                                                     index.size(), 0),
+              nullptr);
+
+    // Locate the StripOffsets entry: tag entries of 32 bytes follow the
+    // 48-byte index header and the 32-byte image header
+    constexpr size_t FIRST_TAG_POS = 48 + 32;
+    constexpr size_t TAG_ENTRY_SIZE = 32;
+    constexpr size_t COUNT_POS_IN_ENTRY = 8;
+    size_t countPos = 0;
+    for (size_t pos = FIRST_TAG_POS; pos + TAG_ENTRY_SIZE <= index.size();
+         pos += TAG_ENTRY_SIZE)
+    {
+        uint16_t tagCode = 0;
+        memcpy(&tagCode, index.data() + pos, sizeof(tagCode));
+        if (tagCode == libertiff::TagCode::StripOffsets)
+        {
+            countPos = pos + COUNT_POS_IN_ENTRY;
+            break;
+        }
+    }
+    ASSERT_NE(countPos, 0U);
+    uint64_t count = 0;
+    memcpy(&count, index.data() + countPos, sizeof(count));
+    EXPECT_EQ(count, document->firstImage()->strileCount());
+
+    // Counts whose values cannot be within the file, or within the index
+    for (const uint64_t corruptedCount :
+         {std::numeric_limits<uint64_t>::max(), uint64_t(1) << 40,
+          count + 1000})
+    {
+        auto corruptedIndex = index;
+        memcpy(corruptedIndex.data() + countPos, &corruptedCount,
+               sizeof(corruptedCount));
+        EXPECT_EQ(libertiff::TiffDocument::openFromIndex(
+                      file, corruptedIndex.data(), corruptedIndex.size(), 0),
+                  nullptr);
+    }
+}
+
+TEST_F(test, strile_array_page_memory_usage)
+{
+    // 10000 32-bit strip offsets: 9 pages of 1024 values, and a last page
+    // of 784 values
+    constexpr uint32_t STRIP_COUNT = 10000;
+    auto document = libertiff::TiffDocument::open(
+        std::make_shared<MemoryFileReader>(
+            buildManyStripsFile(STRIP_COUNT, false)));
+    ASSERT_NE(document, nullptr);
+    const auto *image = document->firstImage();
+    ASSERT_NE(image, nullptr);
+    bool ok = true;
+    size_t memoryUsage = document->memoryUsage();
+    EXPECT_EQ(image->strileOffset(STRIP_COUNT - 1, ok),
+              1000 + STRIP_COUNT - 1);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(document->memoryUsage() - memoryUsage,
+              (STRIP_COUNT - 9 * 1024) * sizeof(uint64_t));
+    memoryUsage = document->memoryUsage();
+    EXPECT_EQ(image->strileOffset(0, ok), 1000);
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(document->memoryUsage() - memoryUsage,
+              1024 * sizeof(uint64_t));
+}
+
 }  // namespace